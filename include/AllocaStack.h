@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_ALLOCASTACK_H_
+#define INCLUDE_ALLOCASTACK_H_
+
+#include <cstddef>
+
+#include <vector>
+
+// The live allocas of a thread of the instrumented program, for the runtime
+//   (StaticLibs) libraries, which must forget each alloca when its frame
+//   returns.
+//
+// All frames share one contiguous array of allocas, and a frame is only the
+//   index its allocas start at.  A call pushes that index, and a ret clears
+//   the allocas past it and pops it.  Neither array shrinks, so once a thread
+//   has been as deep as it goes, calls and rets never allocate.
+//
+// A setjmp saves a Marker (the depth and number of allocas), and the longjmp
+//   rewinds to it, clearing every alloca made since.
+//
+// Usage:
+//   static thread_local AllocaStack<std::pair<void *, int64_t>> stack_allocs;
+//   do_call:   stack_allocs.call();
+//   do_alloca: stack_allocs.push(std::make_pair(addr, size));
+//   do_ret:    stack_allocs.ret([] (const std::pair<void *, int64_t> &alloc) {
+//                clear(alloc);
+//              });
+template <typename alloc_type>
+class AllocaStack {
+  //{{{
+ public:
+  struct Marker {
+    size_t depth;
+    size_t numAllocs;
+  };
+
+  void call() {
+    frames_.push_back(allocs_.size());
+  }
+
+  void push(const alloc_type &alloc) {
+    allocs_.push_back(alloc);
+  }
+
+  // Clears the allocas of the top frame, and pops it.  Allocas made before
+  //   the first call belong to a base frame, which is never popped.
+  template <typename clear_fcn>
+  void ret(clear_fcn clear) {
+    if (frames_.empty()) {
+      popTo(0, clear);
+      return;
+    }
+
+    popTo(frames_.back(), clear);
+    frames_.pop_back();
+  }
+
+  Marker mark() const {
+    return Marker{frames_.size(), allocs_.size()};
+  }
+
+  // Clears the allocas made since marker, and pops the frames called since.
+  //   Returns false (clearing nothing) if marker's frame has returned.
+  template <typename clear_fcn>
+  bool rewind(const Marker &marker, clear_fcn clear) {
+    if (marker.depth > frames_.size() || marker.numAllocs > allocs_.size() ||
+        (marker.depth > 0 && frames_[marker.depth - 1] > marker.numAllocs)) {
+      return false;
+    }
+
+    popTo(marker.numAllocs, clear);
+    frames_.resize(marker.depth);
+    return true;
+  }
+
+ private:
+  template <typename clear_fcn>
+  void popTo(size_t num_allocs, clear_fcn &clear) {
+    for (size_t i = allocs_.size(); i > num_allocs; --i) {
+      clear(allocs_[i - 1]);
+    }
+    allocs_.resize(num_allocs);
+  }
+
+  std::vector<alloc_type> allocs_;
+  // The index of the first alloca of each frame
+  std::vector<size_t> frames_;
+  //}}}
+};
+
+#endif  // INCLUDE_ALLOCASTACK_H_
@@ -6,6 +6,7 @@
 #define INCLUDE_ASSUMPTIONS_H_
 
 #include <algorithm>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <set>
@@ -385,7 +386,8 @@ class SetCheckInst : public InstrumentationSite {  //{{{
 
       auto &ai = cast<SetCheckInst>(is);
 
-      return assignInst_ == ai.assignInst_ && checkSet_ == ai.checkSet_;
+      return assignInst_ == ai.assignInst_ && site_ == ai.site_ &&
+        checkSet_ == ai.checkSet_;
     }
 
     int64_t approxCost() override {
@@ -406,6 +408,38 @@ class SetCheckInst : public InstrumentationSite {  //{{{
       return cast<llvm::Instruction>(assignInst_)->getParent();
     }
 
+    // Accessors, for optimizeChecks {{{
+    llvm::Value *getValue() const {
+      return assignInst_;
+    }
+
+    void setValue(llvm::Value *val) {
+      assignInst_ = val;
+    }
+
+    // The check is inserted before its site, or after its value is defined if
+    //   it has no site
+    llvm::Instruction *getSite() const {
+      return site_;
+    }
+
+    void setSite(llvm::Instruction *site) {
+      site_ = site;
+    }
+
+    const std::set<ValueMap::Id> &getCheckSet() const {
+      return checkSet_;
+    }
+
+    void intersectCheckSet(const std::set<ValueMap::Id> &check_set) {
+      std::set<ValueMap::Id> both;
+      std::set_intersection(std::begin(checkSet_), std::end(checkSet_),
+          std::begin(check_set), std::end(check_set),
+          std::inserter(both, std::end(both)));
+      checkSet_.swap(both);
+    }
+    //}}}
+
  private:
     llvm::Value *assignInst_;
     std::set<ValueMap::Id> checkSet_;
@@ -672,6 +706,16 @@ llvm::Function *getCallFunction(llvm::Module &m);
 llvm::Function *getFreeFunction(llvm::Module &m);
 llvm::Function *getAssignFunction(llvm::Module &m);
 llvm::Function *getVisitFunction(llvm::Module &m);
+
+// Removes the checks made redundant by others, before sites are instrumented
+//   (sites must already be deduplicated):
+//   - SetCheckInsts of loop-invariant values are hoisted to the preheader of
+//     any loop they are guaranteed to run in
+//   - SetCheckInsts of the same address (up to pointer casts) later in the
+//     same block are merged into the first
+//   - SetCheckInsts dominated by a check of the same address against a subset
+//     are removed, as are VisitInsts dominated by another VisitInst
+void optimizeChecks(std::vector<std::unique_ptr<InstrumentationSite>> &sites);
 //}}}
 
 #endif  // INCLUDE_ASSUMPTIONS_H_
@@ -14,6 +14,7 @@
 #include <algorithm>
 #include <array>
 #include <functional>
+#include <vector>
 
 // #include "include/util.h"
 
@@ -33,31 +34,49 @@ constexpr size_t bit_sizeof() {
 
 struct BloomHasher {
   // Changable
-  static const size_t bits = 4096;
   static const size_t num_hashes = 4;
+  // Filters are sized to about this many bits per element, which keeps false
+  //   positives near 0.25% (with 4 hashes)
+  static const size_t bits_per_elm = 16;
 
   // Don't change
-  static_assert(is_power_of_two(bits), "bits should be power of two");
   static const uint64_t  bit_size = bit_sizeof<uint64_t>();
-  static const size_t num_elms = bits / bit_size;
-
-  typedef std::array<uint64_t, num_elms> BloomFilter;
+  static_assert(is_power_of_two(bit_size), "bit_size should be power of two");
 
   static const size_t shift_size = 16;
   static_assert(shift_size * num_hashes <= bit_size, "too many hashes");
 
+  // Each hash is shift_size bits of the element hash, so bigger filters gain
+  //   nothing
+  static const size_t min_bits = bit_size;
+  static const size_t max_bits = 1 << shift_size;
+
+  // A filter of bits bits (a power of two), as an array of bits / bit_size
+  //   words
+  typedef std::vector<uint64_t> BloomFilter;
+
   static uint64_t mix_hash(uint64_t stack_hash, uint64_t elm_hash) {
     return stack_hash ^= elm_hash + 0x9e3779b9 +
         (stack_hash << 6) + (stack_hash >> 2);
   }
 
-  static void bloom_clear(BloomFilter &filt) {
-    std::fill(std::begin(filt), std::end(filt), 0);
+  // The filter size (in bits) for num_elms elements
+  static size_t filter_bits(size_t num_elms) {
+    size_t bits = min_bits;
+    while (bits < max_bits && bits < num_elms * bits_per_elm) {
+      bits <<= 1;
+    }
+    return bits;
+  }
+
+  static void bloom_clear(BloomFilter &filt, size_t bits) {
+    filt.assign(bits / bit_size, 0);
   }
 
   static void bloom_add(BloomFilter &filt, uint64_t hash) {
+    size_t bits = filt.size() * bit_size;
     for (size_t i = 0; i < num_hashes; i++) {
-      auto hash_offs = get_hash_offs(hash, i);
+      auto hash_offs = get_hash_offs(hash, i, bits);
 
       uint64_t shift = 1ULL << data_shift(hash_offs);
       size_t idx = data_idx(hash_offs);
@@ -65,9 +84,9 @@ struct BloomHasher {
     }
   }
 
-  static bool bloom_check(uint64_t data[], uint64_t hash) {
+  static bool bloom_check(const uint64_t data[], size_t bits, uint64_t hash) {
     for (size_t i = 0; i < num_hashes; i++) {
-      auto hash_offs = get_hash_offs(hash, i);
+      auto hash_offs = get_hash_offs(hash, i, bits);
 
       uint64_t elm = data[data_idx(hash_offs)];
       if (((elm >> data_shift(hash_offs)) & 1) == 0) {
@@ -88,8 +107,8 @@ struct BloomHasher {
     return offs % bit_size;
   }
 
-  static inline size_t get_hash_offs(uint64_t hash, size_t num) {
-    return (hash >> (num * shift_size)) % bits;
+  static inline size_t get_hash_offs(uint64_t hash, size_t num, size_t bits) {
+    return (hash >> (num * shift_size)) & (bits - 1);
   }
 
 };
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_CHECKSET_H_
+#define INCLUDE_CHECKSET_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+// Membership tables for the speculative set checks.  The instrumenter encodes
+//   each checked points-to set into one (see getGlobalSet in
+//   src/Assumptions.cpp), and SpecSFSCheckLib tests an object id against it
+//   in O(1), instead of binary searching a sorted array:
+//
+//   Bitmap: { Bitmap, base, num_words, words... }
+//     id is a member if bit (id - base) is set
+//   Hash:   { Hash, shift, mult, slots... }
+//     A linearly probed table of the set, at most half full, id is a member
+//     if it is found probing from slots[(id * mult) >> shift] before an
+//     empty slot (empty slots hold -1).  The multiplier is chosen to keep the
+//     probes short (most sets hash perfectly, with one probe per lookup).
+//
+// Sets whose ids are close together get a bitmap, sparse sets the hash.
+struct CheckSet {
+  enum Kind : int32_t {
+    Bitmap = 0,
+    Hash = 1
+  };
+
+  // Encodes ids (sorted and unique)
+  static std::vector<int32_t> encode(const std::vector<int32_t> &ids) {
+    std::vector<int32_t> ret;
+
+    // Bitmaps no larger than about 4 words per id are denser than the hash
+    int64_t range = ids.empty() ? 0 :
+      static_cast<int64_t>(ids.back()) - ids.front() + 1;
+    int64_t num_words = (range + 31) / 32;
+    if (num_words > 4 * static_cast<int64_t>(ids.size()) + 4) {
+      encodeHash(ids, ret);
+    } else {
+      ret.push_back(Bitmap);
+      ret.push_back(ids.empty() ? 0 : ids.front());
+      ret.push_back(num_words);
+      ret.resize(ret.size() + num_words, 0);
+      for (auto id : ids) {
+        auto bit = static_cast<uint32_t>(id - ids.front());
+        ret[3 + bit / 32] |= static_cast<int32_t>(1u << (bit % 32));
+      }
+    }
+
+    return ret;
+  }
+
+  static bool contains(const int32_t *table, int32_t id) {
+    if (table[0] == Bitmap) {
+      auto bit = static_cast<uint32_t>(id - table[1]);
+      if (bit / 32 >= static_cast<uint32_t>(table[2])) {
+        return false;
+      }
+      return (static_cast<uint32_t>(table[3 + bit / 32]) >> (bit % 32)) & 1;
+    }
+
+    if (id == -1) {
+      return false;
+    }
+
+    uint32_t mask = (static_cast<uint32_t>(1) << (32 - table[1])) - 1;
+    for (uint32_t slot = hash(id, table[1], table[2]); table[3 + slot] != -1;
+        slot = (slot + 1) & mask) {
+      if (table[3 + slot] == id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Calls fn on each member of table (in no particular order)
+  template <typename fn_type>
+  static void forEach(const int32_t *table, fn_type fn) {
+    if (table[0] == Bitmap) {
+      for (int32_t i = 0; i < table[2] * 32; ++i) {
+        if (contains(table, table[1] + i)) {
+          fn(table[1] + i);
+        }
+      }
+    } else {
+      auto num_slots = static_cast<size_t>(1) << (32 - table[1]);
+      for (size_t i = 0; i < num_slots; ++i) {
+        if (table[3 + i] != -1) {
+          fn(table[3 + i]);
+        }
+      }
+    }
+  }
+
+ private:
+  static uint32_t hash(int32_t id, int32_t shift, int32_t mult) {
+    return (static_cast<uint32_t>(id) * static_cast<uint32_t>(mult)) >> shift;
+  }
+
+  // Hashes ids into 2 slots per id, with the multiplier (of MaxTries) which
+  //   needs the fewest probes, stopping at the first perfect one
+  static void encodeHash(const std::vector<int32_t> &ids,
+      std::vector<int32_t> &ret) {
+    static const int MaxTries = 64;
+
+    int32_t bits = 1;
+    while ((static_cast<size_t>(1) << bits) < 2 * ids.size()) {
+      bits++;
+    }
+    int32_t shift = 32 - bits;
+    uint32_t mask = (static_cast<uint32_t>(1) << bits) - 1;
+
+    std::vector<int32_t> slots;
+    std::vector<int32_t> best_slots;
+    uint32_t best_mult = 0;
+    size_t best_probes = SIZE_MAX;
+    // A fixed sequence of odd multipliers, so builds are deterministic
+    uint32_t mult = 0x9E3779B9u;
+    for (int tries = 0; tries < MaxTries && best_probes != 0; ++tries) {
+      mult = mult * 1664525u + 1013904223u;
+      mult |= 1;
+
+      slots.assign(static_cast<size_t>(1) << bits, -1);
+      size_t probes = 0;
+      for (auto id : ids) {
+        auto slot = hash(id, shift, static_cast<int32_t>(mult));
+        while (slots[slot] != -1) {
+          slot = (slot + 1) & mask;
+          probes++;
+        }
+        slots[slot] = id;
+      }
+
+      if (probes < best_probes) {
+        best_probes = probes;
+        best_mult = mult;
+        best_slots.swap(slots);
+      }
+    }
+
+    ret.push_back(Hash);
+    ret.push_back(shift);
+    ret.push_back(static_cast<int32_t>(best_mult));
+    ret.insert(std::end(ret), std::begin(best_slots), std::end(best_slots));
+  }
+};
+
+#endif  // INCLUDE_CHECKSET_H_
@@ -7,9 +7,12 @@
 #define INCLUDE_CONTEXTINFO_H_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 #include <vector>
@@ -136,19 +139,19 @@ class ContextInfo : public llvm::ModulePass {
       return id_;
     }
 
+    // NOTE: The returned sets are BDDs, callers touching them while other
+    //   threads use this ContextInfo must hold lockBdds()
     const BBBddSet &predBBs() const {
-      if (!predsPopulated_) {
+      if (!predsPopulated_.load(std::memory_order_acquire)) {
         populatePreds();
-        predsPopulated_ = true;
       }
 
       return predBBs_;
     }
 
     const StoreBddSet &predStores() const {
-      if (!predsPopulated_) {
+      if (!predsPopulated_.load(std::memory_order_acquire)) {
         populatePreds();
-        predsPopulated_ = true;
       }
 
       return predStores_;
@@ -185,7 +188,9 @@ class ContextInfo : public llvm::ModulePass {
     const ContextInfo &info_;
 
     // Cached data
-    mutable bool predsPopulated_ = false;
+    //   predsPopulated_ is only set once the pred sets are complete, so
+    //   readers may skip the bdd lock once they observe it
+    mutable std::atomic<bool> predsPopulated_{false};
     mutable BBBddSet predBBs_;
     mutable StoreBddSet predStores_;
     mutable bool localPopulated_ = false;
@@ -206,6 +211,16 @@ class ContextInfo : public llvm::ModulePass {
     return "ContextInfo";
   }
 
+  // Threading {{{
+  // BuDDy keeps all of its state global, so any bdd manipulation (including
+  //   copying or destroying a BddSet) done while other threads are using this
+  //   pass must be done while holding this lock.  Everything else in
+  //   ContextInfo is safe to call concurrently.
+  std::unique_lock<std::recursive_mutex> lockBdds() const {
+    return std::unique_lock<std::recursive_mutex>(bddLock_);
+  }
+  //}}}
+
   // Context Creations/acquisition functions {{{
   std::vector<ContextId> getAllContexts(const llvm::Instruction *) const;
 
@@ -267,6 +282,11 @@ class ContextInfo : public llvm::ModulePass {
     }
 
    private:
+    // The lookup table is sharded by key, so concurrent slices rarely contend
+    //   on the same lock.  Ids are handed out from contextSize_, and a context
+    //   is constructed before its id is published in the shard.
+    static const size_t NumShards = 64;
+
     struct ContextKey {
       struct hasher {
         size_t operator()(const ContextKey &k1) const {
@@ -290,10 +310,15 @@ class ContextInfo : public llvm::ModulePass {
       StackId stack;
     };
 
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<ContextKey, size_t, ContextKey::hasher> cache;
+    };
+
     ExternalInfo &info_;
 
-    std::unordered_map<ContextKey, size_t, ContextKey::hasher> cache_;
-    size_t contextSize_ = 0;
+    std::array<Shard, NumShards> shards_;
+    std::atomic<size_t> contextSize_{0};
     std::unique_ptr<int8_t[]> contextMem_;
     Context *contexts_;
 
@@ -306,12 +331,18 @@ class ContextInfo : public llvm::ModulePass {
    public:
     static const size_t MaxStacks = 50000000;
 
-    StackCache() :
+    explicit StackCache(std::recursive_mutex &bdd_lock) :
+      bddLock_(bdd_lock),
       stackMem_(new int8_t[sizeof(StackInfo) * MaxStacks]),
       stacks_(reinterpret_cast<StackInfo *>(stackMem_.get())) { }
 
+    // Takes the bdd lock (stacks are keyed by their frame set bdd)
     StackId find(const std::vector<CsCFG::Id> &stack);
 
+    std::recursive_mutex &bddLock() {
+      return bddLock_;
+    }
+
     const StackInfo &getStack(StackId id) const {
       assert(static_cast<size_t>(id) < stackSize_);
       return stacks_[static_cast<size_t>(id)];
@@ -333,9 +364,11 @@ class ContextInfo : public llvm::ModulePass {
       }
     };
 
+    std::recursive_mutex &bddLock_;
+
     std::unordered_map<int, size_t> cache_;  // NOLINT
     // std::vector<StackInfo> stacks_;
-    size_t stackSize_ = 1;
+    std::atomic<size_t> stackSize_{1};
     std::unique_ptr<int8_t[]> stackMem_;
     StackInfo *stacks_;
     //}}}
@@ -348,6 +381,9 @@ class ContextInfo : public llvm::ModulePass {
   mutable CallDests *callDests_;
   mutable CsCFG *csCFG_;
 
+  // Guards all bdd operations, see lockBdds()
+  mutable std::recursive_mutex bddLock_;
+
   // Made mutable, because its actually a cache, all we really do is read the
   //   file.  The cache just makes our reading not stupid slow
   mutable ContextCache cache_;
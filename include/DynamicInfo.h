@@ -22,17 +22,27 @@
 #include "include/lib/IndirFcnTarget.h"
 #include "include/lib/UnusedFunctions.h"
 #include "include/lib/CallContextPass.h"
+#include "include/lib/SpecCheckBudget.h"
 
 class DynamicInfo {
  public:
   DynamicInfo(const UnusedFunctions &unused, const IndirFunctionInfo &indir,
-      const CallContextLoader &call) :
+      const CallContextLoader &call, const SpecCheckBudget *budget) :
     used_info(unused),
     indir_info(indir),
-    call_info(call) { }
+    call_info(call),
+    check_budget(budget) { }
+
+  // True if the analysis may speculate on the targets of the indirect call ci
+  bool keepIndirCall(const llvm::Instruction *ci) const {
+    return check_budget == nullptr || check_budget->keepIndirCall(ci);
+  }
+
   const UnusedFunctions &used_info;
   const IndirFunctionInfo &indir_info;
   const CallContextLoader &call_info;
+  // nullptr unless SpecCheckBudget::enabled()
+  const SpecCheckBudget *check_budget;
 };
 
 #endif // INCLUDE_DYNAMICINFO_H_
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_GRANULESHADOW_H_
+#define INCLUDE_GRANULESHADOW_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <vector>
+
+// Shadow memory for the runtime (StaticLibs) libraries, mapping each address to
+//   an int32_t value.
+//
+// There is one value per granule (a power of two, from 8 to 64 bytes), in a
+//   single mmap(MAP_NORESERVE) reservation indexed by address, so only the
+//   shadow of memory actually set is ever backed.  A store covering part of a
+//   granule which holds a different value splits the granule: its entry then
+//   names a slot holding one value per byte.  Untouched memory reads as 0.
+//
+// Lookups and stores never take a lock.  Racing stores to one address leave
+//   one of their values.
+//
+// Usage:
+//   static GranuleShadow shadow;
+//   if (!shadow.init(8)) { use something else }
+//   shadow.set(val, addr, size);
+//   shadow.get(addr);
+//   shadow.clear(addr, size);
+class GranuleShadow {
+  //{{{
+ public:
+  typedef int32_t value_type;
+
+  static const value_type InvalidValue = -1;
+
+  // User space addresses (x86-64, 4-level page tables)
+  static const size_t AddressBits = 47;
+
+  // Frees of at least this many bytes return their shadow pages
+  static const size_t LargeFree = 1 << 20;
+
+  // Reserves the shadow, returns false if it cannot be reserved
+  bool init(size_t granule) {
+    if (granule == 0 || (granule & (granule - 1)) != 0 ||
+        granule > MaxGranule) {
+      return false;
+    }
+
+    granuleBits_ = __builtin_ctzll(granule);
+    granule_ = granule;
+    numEntries_ = (static_cast<size_t>(1) << AddressBits) >> granuleBits_;
+    auto map = mmap(nullptr, numEntries_ * sizeof(Entry),
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+
+    shadow_ = static_cast<Entry *>(map);
+    return true;
+  }
+
+  value_type get(uintptr_t addr) const {
+    auto idx = addr >> granuleBits_;
+    if (idx >= numEntries_) {
+      return InvalidValue;
+    }
+
+    auto val = shadow_[idx].load(std::memory_order_acquire);
+    if (isSplit(val)) {
+      return slot(val)[addr & (granule_ - 1)].load(std::memory_order_relaxed);
+    }
+
+    return val;
+  }
+
+  // Values stored must be >= InvalidValue, lower values mark split granules
+  void set(value_type val, uintptr_t addr, size_t size) {
+    auto end = addr + size;
+    while (addr < end) {
+      auto idx = addr >> granuleBits_;
+      if (idx >= numEntries_) {
+        return;
+      }
+
+      auto granule_start = idx << granuleBits_;
+      if (addr == granule_start && end - addr >= granule_) {
+        // Every whole granule in the range
+        size_t num_granules = (end - addr) >> granuleBits_;
+        for (size_t i = idx; i < idx + num_granules; ++i) {
+          setWhole(i, val);
+        }
+        addr += num_granules << granuleBits_;
+      } else {
+        auto part_end = std::min<uintptr_t>(end, granule_start + granule_);
+        setPart(idx, addr - granule_start, part_end - addr, val);
+        addr = part_end;
+      }
+    }
+  }
+
+  // Replaces the value of each byte in [addr, addr+size) with fn(old value).
+  //   Slower than set, for the rare updates which depend on the old value.
+  template <typename fn_type>
+  void update(uintptr_t addr, size_t size, fn_type fn) {
+    auto end = addr + size;
+    while (addr < end) {
+      auto idx = addr >> granuleBits_;
+      if (idx >= numEntries_) {
+        return;
+      }
+
+      auto granule_start = idx << granuleBits_;
+      auto old_val = shadow_[idx].load(std::memory_order_acquire);
+      if (!isSplit(old_val) && addr == granule_start &&
+          end - addr >= granule_) {
+        setWhole(idx, fn(old_val));
+        addr += granule_;
+        continue;
+      }
+
+      auto part_end = std::min<uintptr_t>(end, granule_start + granule_);
+      for (; addr < part_end; ++addr) {
+        setPart(idx, addr - granule_start, 1, fn(get(addr)));
+      }
+    }
+  }
+
+  // Marks [addr, addr+size) as freed, returning the shadow of large frees (it
+  //   then reads as 0)
+  void clear(uintptr_t addr, size_t size) {
+    auto first = (addr + granule_ - 1) >> granuleBits_;
+    auto last = std::min((addr + size) >> granuleBits_, numEntries_);
+    if (size < LargeFree || first >= last) {
+      set(InvalidValue, addr, size);
+      return;
+    }
+
+    // The partial shadow pages (and granules) on either side are cleared, the
+    //   whole pages between are returned
+    auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto shadow_start = reinterpret_cast<uintptr_t>(&shadow_[first]);
+    auto shadow_end = reinterpret_cast<uintptr_t>(&shadow_[last]);
+    auto page_start = (shadow_start + page_size - 1) & ~(page_size - 1);
+    auto page_end = shadow_end & ~(page_size - 1);
+    if (page_start >= page_end) {
+      set(InvalidValue, addr, size);
+      return;
+    }
+
+    // The first and last granules whose shadow is returned
+    auto first_ret = (page_start - reinterpret_cast<uintptr_t>(shadow_)) /
+      sizeof(Entry);
+    auto last_ret = (page_end - reinterpret_cast<uintptr_t>(shadow_)) /
+      sizeof(Entry);
+
+    for (size_t i = first_ret; i < last_ret; ++i) {
+      auto old_val = shadow_[i].load(std::memory_order_relaxed);
+      if (isSplit(old_val)) {
+        freeSlot(old_val);
+      }
+    }
+    madvise(reinterpret_cast<void *>(page_start), page_end - page_start,
+        MADV_DONTNEED);
+
+    set(InvalidValue, addr, (first_ret << granuleBits_) - addr);
+    set(InvalidValue, last_ret << granuleBits_,
+        addr + size - (last_ret << granuleBits_));
+  }
+
+  size_t granule() const {
+    return granule_;
+  }
+
+  // Resident bytes of the reservation, and of the split slots
+  size_t rss() const {
+    return mappingRss(shadow_);
+  }
+
+  size_t splitRss() const {
+    return numChunks_.load(std::memory_order_relaxed) * ChunkSlots *
+      granule_ * sizeof(Entry);
+  }
+
+  size_t numSplits() const {
+    return numSplits_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  typedef std::atomic<value_type> Entry;
+
+  static const size_t MaxGranule = 64;
+  static const size_t ChunkBits = 12;
+  static const size_t ChunkSlots = 1 << ChunkBits;
+  static const size_t NumChunks = 1 << 19;
+
+  // Split entries hold -(slot + 2), below InvalidValue
+  static bool isSplit(value_type val) {
+    return val < InvalidValue;
+  }
+
+  Entry *slot(value_type val) const {
+    size_t id = -(static_cast<int64_t>(val) + 2);
+    auto chunk = chunks_[id >> ChunkBits].load(std::memory_order_acquire);
+    return chunk + (id & (ChunkSlots - 1)) * granule_;
+  }
+
+  void setWhole(size_t idx, value_type val) {
+    auto &entry = shadow_[idx];
+    if (isSplit(entry.load(std::memory_order_relaxed))) {
+      auto old_val = entry.exchange(val, std::memory_order_relaxed);
+      if (isSplit(old_val)) {
+        freeSlot(old_val);
+      }
+    } else {
+      entry.store(val, std::memory_order_relaxed);
+    }
+  }
+
+  void setPart(size_t idx, size_t offs, size_t len, value_type val) {
+    auto &entry = shadow_[idx];
+    auto old_val = entry.load(std::memory_order_acquire);
+    while (true) {
+      if (isSplit(old_val)) {
+        auto bytes = slot(old_val);
+        for (size_t i = offs; i < offs + len; ++i) {
+          bytes[i].store(val, std::memory_order_relaxed);
+        }
+        return;
+      }
+
+      if (old_val == val) {
+        return;
+      }
+
+      // Split the granule, unless another thread changes it first
+      auto new_val = allocSlot();
+      auto bytes = slot(new_val);
+      for (size_t i = 0; i < granule_; ++i) {
+        bytes[i].store((i >= offs && i < offs + len) ? val : old_val,
+            std::memory_order_relaxed);
+      }
+      if (entry.compare_exchange_strong(old_val, new_val,
+            std::memory_order_release, std::memory_order_acquire)) {
+        return;
+      }
+      freeSlot(new_val);
+    }
+  }
+
+  // Freed slots are reused by the thread freeing them, so splitting never
+  //   takes a lock.  Only racing (unsynchronized) stores to one granule can
+  //   write to a slot after it is freed.
+  static std::vector<value_type> &freeSlots() {
+    static thread_local std::vector<value_type> free_slots;
+    return free_slots;
+  }
+
+  value_type allocSlot() {
+    numSplits_.fetch_add(1, std::memory_order_relaxed);
+
+    auto &free_slots = freeSlots();
+    if (!free_slots.empty()) {
+      auto ret = free_slots.back();
+      free_slots.pop_back();
+      return ret;
+    }
+
+    auto id = nextSlot_.fetch_add(1, std::memory_order_relaxed);
+    if (id >= ChunkSlots * NumChunks) {
+      fprintf(stderr, "ERROR: Out of GranuleShadow split granules\n");
+      abort();
+    }
+
+    auto &chunk = chunks_[id >> ChunkBits];
+    if (chunk.load(std::memory_order_acquire) == nullptr) {
+      auto new_chunk = new Entry[ChunkSlots * granule_]();
+      Entry *expected = nullptr;
+      if (chunk.compare_exchange_strong(expected, new_chunk,
+            std::memory_order_acq_rel)) {
+        numChunks_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        delete[] new_chunk;
+      }
+    }
+
+    return -static_cast<value_type>(id) - 2;
+  }
+
+  void freeSlot(value_type val) {
+    numSplits_.fetch_sub(1, std::memory_order_relaxed);
+    freeSlots().push_back(val);
+  }
+
+  // The Rss of the mapping starting at start, from /proc/self/smaps
+  static size_t mappingRss(const void *start) {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == nullptr) {
+      return 0;
+    }
+
+    auto want = reinterpret_cast<uintptr_t>(start);
+    bool found = false;
+    size_t ret = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), smaps) != nullptr) {
+      unsigned long long map_start;  // NOLINT
+      unsigned long long map_end;  // NOLINT
+      unsigned long long rss_kb;  // NOLINT
+      if (sscanf(line, "%llx-%llx ", &map_start, &map_end) == 2) {
+        found = (map_start == want);
+      } else if (found && sscanf(line, "Rss: %llu kB", &rss_kb) == 1) {
+        ret = rss_kb * 1024;
+        break;
+      }
+    }
+    fclose(smaps);
+
+    return ret;
+  }
+
+  size_t granule_ = 0;
+  size_t granuleBits_ = 0;
+  size_t numEntries_ = 0;
+  Entry *shadow_ = nullptr;
+
+  std::atomic<size_t> nextSlot_{0};
+  std::atomic<size_t> numSplits_{0};
+  std::atomic<size_t> numChunks_{0};
+  std::array<std::atomic<Entry *>, NumChunks> chunks_{};
+  //}}}
+};
+
+#endif  // INCLUDE_GRANULESHADOW_H_
@@ -5,9 +5,15 @@
 #ifndef INCLUDE_INSTLABELER_H_
 #define INCLUDE_INSTLABELER_H_
 
+#include <cstring>
+
+#include <istream>
 #include <map>
+#include <ostream>
 #include <set>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 
@@ -15,6 +21,7 @@
 
 #include "include/lib/UnusedFunctions.h"
 
+#include "llvm/ADT/SparseBitVector.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/InstIterator.h"
@@ -22,6 +29,9 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
 
+// A set of instructions, by InstLabeler id
+typedef llvm::SparseBitVector<> InstIdSet;
+
 class InstLabeler {
  //{{{
  public:
@@ -54,7 +64,7 @@ class InstLabeler {
 
       for (auto &bb : fcn) {
         for (auto &inst : bb) {
-          idToInst_[inst_id] = &inst;
+          idToInst_.push_back(&inst);
           instToID_[&inst] = inst_id;
           inst_id++;
         }
@@ -87,6 +97,10 @@ class InstLabeler {
     return idToInst_.at(inst_id);
   }
 
+  int64_t numIDs() const {
+    return idToInst_.size();
+  }
+
   bool hasID(const llvm::Instruction *inst) const {
     return instToID_.find(inst) != std::end(instToID_);
   }
@@ -104,32 +118,69 @@ class InstLabeler {
 
   std::map<const llvm::Function *, int64_t> fcnToID_;
 
-  std::map<const llvm::Instruction *, int64_t> instToID_;
-  std::map<int64_t, const llvm::Instruction *> idToInst_;
+  // Ids are handed out densely, in module order
+  std::unordered_map<const llvm::Instruction *, int64_t> instToID_;
+  std::vector<const llvm::Instruction *> idToInst_;
 
   std::vector<std::vector<const llvm::Instruction *>> reallyUsedInsts_;
   std::vector<const llvm::Function *> reallyUsedFcns_;
   //}}}
 };
 
+// Slice files {{{
+// Binary slice files start with SliceFileMagic and a varint version, followed
+//   by one record per slice:
+//     varint header_id, varint num_ids, num_ids varint deltas
+//   Each id is stored as the difference from the previous (sorted) id of the
+//   record, so dense slices cost about one byte per instruction.
+// The original text format ("header_id: id id id...\n") is still the default
+//   (StaticSlice writes binary with -slice-binary-output), both are readable.
+static const char SliceFileMagic[8] = { 'O', 'H', 'A', 'S', 'L', 'I', 'C',
+  'E' };
+static const uint64_t SliceFileVersion = 1;
+
 class InstWriter {
   //{{{
  public:
-  template<typename iter_type>
-  static void Write(std::ostream &os, int64_t header_id,
-      iter_type cur, iter_type end,
-      const InstLabeler &l) {
-    // Okay, write out a label for each instruction
+  // Text format, useful for debugging
+  static void WriteText(std::ostream &os, int64_t header_id,
+      const InstIdSet &insts) {
     os << header_id << ":";
-    for (; cur != end; ++cur) {
-      auto inst = dyn_cast<llvm::Instruction>(*cur);
-      if (inst != nullptr && l.hasID(inst)) {
-        auto id = l.getID(inst);
-        // llvm::dbgs() << "Writing inst(" << id << "): " << *inst << "\n";
-        os << " " << id;
-      }
+    for (auto id : insts) {
+      os << " " << id;
+    }
+    os << "\n";
+  }
+
+  // Binary format, must be preceded by one WriteHeader() per file
+  static void WriteHeader(std::ostream &os) {
+    os.write(SliceFileMagic, sizeof(SliceFileMagic));
+    writeVarint(os, SliceFileVersion);
+  }
+
+  static void WriteBinary(std::ostream &os, int64_t header_id,
+      const InstIdSet &insts) {
+    assert(header_id >= 0);
+    writeVarint(os, header_id);
+    writeVarint(os, insts.count());
+
+    uint64_t prev = 0;
+    for (auto id : insts) {
+      writeVarint(os, id - prev);
+      prev = id;
+    }
+  }
+
+ private:
+  static void writeVarint(std::ostream &os, uint64_t val) {
+    char buf[10];
+    size_t len = 0;
+    while (val >= 0x80) {
+      buf[len++] = static_cast<char>((val & 0x7F) | 0x80);
+      val >>= 7;
     }
-    os << std::endl;
+    buf[len++] = static_cast<char>(val);
+    os.write(buf, len);
   }
   //}}}
 };
@@ -137,21 +188,93 @@ class InstWriter {
 class InstReader {
   //{{{
  public:
-  static std::pair<int64_t, std::vector<const llvm::Instruction *>>
-  Read(std::istream &is, const InstLabeler &l) {
+  // Detects the format of is from its first byte, which is never the start
+  //   of the magic in a text file (they start with a header id), so is is
+  //   never rewound and may be a pipe
+  InstReader(std::istream &is, const InstLabeler &l) : is_(is), l_(l) {
+    if (is_.peek() != SliceFileMagic[0]) {
+      is_.clear();
+      return;
+    }
+
+    binary_ = true;
+    char magic[sizeof(SliceFileMagic)];
+    is_.read(magic, sizeof(magic));
+    uint64_t version;
+    if (is_.gcount() != sizeof(magic) ||
+        std::memcmp(magic, SliceFileMagic, sizeof(magic)) != 0) {
+      llvm::dbgs() << "WARNING: Malformed slice file\n";
+      good_ = false;
+    } else if (!readVarint(version) || version != SliceFileVersion) {
+      llvm::dbgs() << "WARNING: Unsupported slice file version\n";
+      good_ = false;
+    }
+  }
+
+  // Reads the next slice, returns false once the file is exhausted
+  bool next(int64_t &header_id, InstIdSet &insts) {
+    insts.clear();
+    if (!good_) {
+      return false;
+    }
+
+    good_ = binary_ ? nextBinary(header_id, insts) :
+      nextText(header_id, insts);
+    return good_;
+  }
+
+  // Old interface, returns a header of -1 at the end of the file
+  std::pair<int64_t, std::vector<const llvm::Instruction *>> Read() {
     std::vector<const llvm::Instruction *> ret_vec;
+    int64_t header_id;
+    InstIdSet insts;
 
+    if (!next(header_id, insts)) {
+      return std::make_pair(-1, std::move(ret_vec));
+    }
+
+    for (auto id : insts) {
+      ret_vec.push_back(l_.getInst(id));
+    }
+
+    return std::make_pair(header_id, std::move(ret_vec));
+  }
+
+ private:
+  bool nextBinary(int64_t &header_id, InstIdSet &insts) {
+    uint64_t header;
+    uint64_t num_ids;
+    if (!readVarint(header) || !readVarint(num_ids)) {
+      return false;
+    }
+    header_id = header;
+
+    uint64_t id = 0;
+    for (uint64_t i = 0; i < num_ids; ++i) {
+      uint64_t delta;
+      if (!readVarint(delta)) {
+        llvm::dbgs() << "WARNING: Truncated slice file\n";
+        return false;
+      }
+      id += delta;
+      assert(static_cast<int64_t>(id) < l_.numIDs());
+      insts.set(id);
+    }
+
+    return true;
+  }
+
+  bool nextText(int64_t &header_id, InstIdSet &insts) {
     std::string line;
 
-    if (!std::getline(is, line, ':')) {
-      return std::make_pair(-1, std::move(ret_vec));
+    if (!std::getline(is_, line, ':')) {
+      return false;
     }
 
     std::stringstream strm(line);
-    int64_t header_id;
     strm >> header_id;
 
-    std::getline(is, line);
+    std::getline(is_, line);
 
     std::stringstream converter(line);
 
@@ -159,16 +282,38 @@ class InstReader {
     converter >> inst_id;
     while (!converter.fail()) {
       // llvm::dbgs() << "Reading id: " << inst_id << "\n";
-      auto inst = l.getInst(inst_id);
-      ret_vec.push_back(inst);
-      // llvm::dbgs() << "got inst: " << *inst << "\n";
+      assert(inst_id < l_.numIDs());
+      insts.set(inst_id);
 
       converter >> inst_id;
     }
 
-    return std::make_pair(header_id, std::move(ret_vec));
+    return true;
   }
+
+  bool readVarint(uint64_t &val) {
+    val = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto c = is_.get();
+      if (c == std::istream::traits_type::eof()) {
+        return false;
+      }
+
+      val |= static_cast<uint64_t>(c & 0x7F) << shift;
+      if ((c & 0x80) == 0) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  std::istream &is_;
+  const InstLabeler &l_;
+  bool binary_ = false;
+  bool good_ = true;
   //}}}
 };
+//}}}
 
 #endif  // INCLUDE_INSTLABELER_H_
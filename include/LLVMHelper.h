@@ -26,6 +26,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 class LLVMHelper {
  public:
@@ -325,6 +326,44 @@ class LLVMHelper {
 
     return fcn;
   }
+
+  // Declares a runtime's thread-local sample skip counter (see
+  //   include/SampleWindow.h)
+  static llvm::GlobalVariable *getSampleSkip(llvm::Module &m,
+      const std::string &name) {
+    auto skip = m.getGlobalVariable(name);
+    if (skip == nullptr) {
+      skip = new llvm::GlobalVariable(m,
+          llvm::IntegerType::get(m.getContext(), 32),
+          false,
+          llvm::GlobalValue::ExternalLinkage,
+          nullptr,
+          name,
+          nullptr,
+          llvm::GlobalVariable::InitialExecTLSModel);
+    }
+
+    return skip;
+  }
+
+  // Guards the runtime call ci with skip, so it is only made when skip is 0:
+  //   if (skip != 0) { skip--; } else { ci }
+  static void sampleCall(llvm::CallInst *ci, llvm::GlobalVariable *skip) {
+    auto skip_val = new llvm::LoadInst(skip, "", ci);
+    auto zero = llvm::ConstantInt::get(skip_val->getType(), 0);
+    auto skipping = new llvm::ICmpInst(ci, llvm::CmpInst::ICMP_NE, skip_val,
+        zero);
+
+    llvm::TerminatorInst *skip_term;
+    llvm::TerminatorInst *call_term;
+    llvm::SplitBlockAndInsertIfThenElse(skipping, ci, &skip_term, &call_term);
+
+    auto dec = llvm::BinaryOperator::Create(llvm::Instruction::Sub, skip_val,
+        llvm::ConstantInt::get(skip_val->getType(), 1), "", skip_term);
+    new llvm::StoreInst(dec, skip, skip_term);
+
+    ci->moveBefore(call_term);
+  }
       
 
   /*
@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_PROFILEFILE_H_
+#define INCLUDE_PROFILEFILE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Profile files, shared by the runtime (StaticLibs) libraries which write them
+//   and the passes which load them.  Only depends on the standard library.
+//
+// Binary profiles start with ProfileFileMagic, a varint version and a varint
+//   ProfileKind, followed by one record per key:
+//     zigzag varint key, varint num_vals, num_vals values
+//   Values are coded by kind:
+//     Ptsto, Alias, Indir: sorted ids, the first zigzag, then varint deltas
+//     CallStack:           zigzag ids, in stack order (keys are unused)
+//     Edge:                a single varint count
+//
+// The old text formats are still written when SFS_LOG_FORMAT=text (as a debug
+//   export), and still read:
+//     Ptsto, Alias, Indir: "key: id id id\n"
+//     CallStack:           "id id id\n" (empty stacks are blank, and skipped)
+//     Edge:                "key count\n"
+//
+// Sampled Ptsto and Alias profiles (see include/SampleWindow.h) start with a
+//   record keyed by ProfileCoverageKey, holding the number of events recorded
+//   and the number seen.  Merges sum it.
+static const char ProfileFileMagic[8] = { 'O', 'H', 'A', 'P', 'R', 'O', 'F',
+  '\0' };
+static const uint64_t ProfileFileVersion = 1;
+static const int64_t ProfileCoverageKey = -1;
+
+enum class ProfileKind : uint64_t {
+  Ptsto = 1,
+  Alias = 2,
+  Indir = 3,
+  CallStack = 4,
+  Edge = 5
+};
+
+class ProfileWriter {
+  //{{{
+ public:
+  // Writes text instead of binary when SFS_LOG_FORMAT=text
+  ProfileWriter(const std::string &filename, ProfileKind kind) :
+      ProfileWriter(filename, kind, textFromEnv()) { }
+
+  // A filename of "-" writes to stdout
+  ProfileWriter(const std::string &filename, ProfileKind kind, bool text) :
+      kind_(kind), text_(text) {
+    if (filename == "-") {
+      out_ = stdout;
+    } else {
+      out_ = fopen(filename.c_str(), text_ ? "w" : "wb");
+    }
+
+    if (out_ != nullptr && !text_) {
+      buf_.append(ProfileFileMagic, sizeof(ProfileFileMagic));
+      putVarint(ProfileFileVersion);
+      putVarint(static_cast<uint64_t>(kind_));
+    }
+  }
+
+  ~ProfileWriter() {
+    if (out_ != nullptr) {
+      flush();
+      if (out_ == stdout) {
+        fflush(out_);
+      } else {
+        fclose(out_);
+      }
+    }
+  }
+
+  ProfileWriter(const ProfileWriter &) = delete;
+  ProfileWriter &operator=(const ProfileWriter &) = delete;
+
+  bool good() const {
+    return out_ != nullptr;
+  }
+
+  // The ids in [it, en) must be sorted and unique
+  template <typename iter>
+  void writeSet(int64_t key, iter it, iter en) {
+    if (text_) {
+      putText(key);
+      buf_.push_back(':');
+      for (; it != en; ++it) {
+        buf_.push_back(' ');
+        putText(*it);
+      }
+      buf_.push_back('\n');
+    } else {
+      putVarint(zigzag(key));
+      putVarint(std::distance(it, en));
+
+      bool first = true;
+      int64_t prev = 0;
+      for (; it != en; ++it) {
+        int64_t id = *it;
+        if (first) {
+          putVarint(zigzag(id));
+          first = false;
+        } else {
+          putVarint(id - prev);
+        }
+        prev = id;
+      }
+    }
+    maybeFlush();
+  }
+
+  template <typename iter>
+  void writeList(iter it, iter en) {
+    if (text_) {
+      for (; it != en; ++it) {
+        putText(*it);
+        buf_.push_back(' ');
+      }
+      buf_.push_back('\n');
+    } else {
+      putVarint(zigzag(0));
+      putVarint(std::distance(it, en));
+      for (; it != en; ++it) {
+        putVarint(zigzag(*it));
+      }
+    }
+    maybeFlush();
+  }
+
+  // Must be written first, so the keys stay sorted
+  void writeCoverage(uint64_t sampled, uint64_t total) {
+    uint64_t vals[] = { sampled, std::max(sampled, total) };
+    writeSet(ProfileCoverageKey, std::begin(vals), std::end(vals));
+  }
+
+  void writeCount(int64_t key, uint64_t count) {
+    if (text_) {
+      putText(key);
+      buf_.push_back(' ');
+      putText(count);
+      buf_.push_back('\n');
+    } else {
+      putVarint(zigzag(key));
+      putVarint(1);
+      putVarint(count);
+    }
+    maybeFlush();
+  }
+
+ private:
+  static const size_t FlushSize = 1 << 20;
+
+  static bool textFromEnv() {
+    const char *format = getenv("SFS_LOG_FORMAT");
+    return format != nullptr && strcmp(format, "text") == 0;
+  }
+
+  static uint64_t zigzag(int64_t val) {
+    return (static_cast<uint64_t>(val) << 1) ^ (val >> 63);
+  }
+
+  void putVarint(uint64_t val) {
+    while (val >= 0x80) {
+      buf_.push_back(static_cast<char>((val & 0x7F) | 0x80));
+      val >>= 7;
+    }
+    buf_.push_back(static_cast<char>(val));
+  }
+
+  template <typename int_type>
+  void putText(int_type val) {
+    char num[24];
+    int len = snprintf(num, sizeof(num), "%lld",
+        static_cast<long long>(val));  // NOLINT
+    buf_.append(num, len);
+  }
+
+  void maybeFlush() {
+    if (buf_.size() >= FlushSize) {
+      flush();
+    }
+  }
+
+  void flush() {
+    if (out_ != nullptr && !buf_.empty()) {
+      fwrite(buf_.data(), 1, buf_.size(), out_);
+    }
+    buf_.clear();
+  }
+
+  ProfileKind kind_;
+  bool text_;
+  FILE *out_;
+  std::string buf_;
+  //}}}
+};
+
+class ProfileReader {
+  //{{{
+ public:
+  // Maps filename, detecting whether it is binary or text.  Text files are
+  //   parsed as the text format of kind
+  ProfileReader(const std::string &filename, ProfileKind kind) :
+      kind_(kind) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    open_ = true;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_ = st.st_size;
+      auto map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        data_ = static_cast<const char *>(map);
+        madvise(map, size_, MADV_SEQUENTIAL);
+      } else {
+        size_ = 0;
+      }
+    }
+    close(fd);
+
+    pos_ = data_;
+    end_ = data_ + size_;
+
+    if (size_ >= sizeof(ProfileFileMagic) &&
+        memcmp(data_, ProfileFileMagic, sizeof(ProfileFileMagic)) == 0) {
+      binary_ = true;
+      pos_ += sizeof(ProfileFileMagic);
+
+      uint64_t version;
+      uint64_t file_kind;
+      if (!getVarint(version) || version != ProfileFileVersion ||
+          !getVarint(file_kind) ||
+          file_kind != static_cast<uint64_t>(kind_)) {
+        fprintf(stderr, "WARNING: Unsupported profile file: %s\n",
+            filename.c_str());
+        pos_ = end_;
+      }
+    }
+  }
+
+  ~ProfileReader() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  ProfileReader(const ProfileReader &) = delete;
+  ProfileReader &operator=(const ProfileReader &) = delete;
+
+  // Sets kind to the kind in filename's header.  False if filename isn't a
+  //   binary profile of this version (e.g. it is text, which has no header).
+  static bool fileKind(const std::string &filename, ProfileKind &kind) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+
+    // The magic, and two varints of at most 10 bytes
+    char header[sizeof(ProfileFileMagic) + 20];
+    auto size = read(fd, header, sizeof(header));
+    close(fd);
+    if (size < static_cast<ssize_t>(sizeof(ProfileFileMagic)) ||
+        memcmp(header, ProfileFileMagic, sizeof(ProfileFileMagic)) != 0) {
+      return false;
+    }
+
+    ProfileReader reader(kind);
+    reader.pos_ = header + sizeof(ProfileFileMagic);
+    reader.end_ = header + size;
+    uint64_t version;
+    uint64_t file_kind;
+    if (!reader.getVarint(version) || version != ProfileFileVersion ||
+        !reader.getVarint(file_kind) ||
+        file_kind < static_cast<uint64_t>(ProfileKind::Ptsto) ||
+        file_kind > static_cast<uint64_t>(ProfileKind::Edge)) {
+      return false;
+    }
+
+    kind = static_cast<ProfileKind>(file_kind);
+    return true;
+  }
+
+  // True if the file exists (even if it is empty)
+  bool isOpen() const {
+    return open_;
+  }
+
+  bool isBinary() const {
+    return binary_;
+  }
+
+  // Reads the next record.  Edge records have one value, the count.
+  bool next(int64_t &key, std::vector<int64_t> &vals) {
+    vals.clear();
+    return binary_ ? nextBinary(key, vals) : nextText(key, vals);
+  }
+
+ private:
+  // Reads nothing, for fileKind()
+  explicit ProfileReader(ProfileKind kind) : kind_(kind) { }
+
+  static int64_t unzigzag(uint64_t val) {
+    return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+  }
+
+  bool getVarint(uint64_t &val) {
+    val = 0;
+    for (int shift = 0; shift < 64 && pos_ != end_; shift += 7) {
+      auto c = static_cast<uint8_t>(*pos_++);
+      val |= static_cast<uint64_t>(c & 0x7F) << shift;
+      if ((c & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool nextBinary(int64_t &key, std::vector<int64_t> &vals) {
+    uint64_t raw_key;
+    uint64_t num_vals;
+    if (!getVarint(raw_key) || !getVarint(num_vals)) {
+      return false;
+    }
+    key = unzigzag(raw_key);
+
+    // Each value takes at least a byte, so a larger count can't be read (and
+    //   mustn't size the reserve)
+    if (num_vals > static_cast<uint64_t>(end_ - pos_)) {
+      fprintf(stderr, "WARNING: Truncated profile file\n");
+      pos_ = end_;
+      return false;
+    }
+
+    vals.reserve(num_vals);
+    int64_t prev = 0;
+    for (uint64_t i = 0; i < num_vals; ++i) {
+      uint64_t raw;
+      if (!getVarint(raw)) {
+        fprintf(stderr, "WARNING: Truncated profile file\n");
+        pos_ = end_;
+        return false;
+      }
+
+      switch (kind_) {
+        case ProfileKind::Ptsto:
+        case ProfileKind::Alias:
+        case ProfileKind::Indir:
+          prev = (i == 0) ? unzigzag(raw) : prev + static_cast<int64_t>(raw);
+          vals.push_back(prev);
+          break;
+        case ProfileKind::CallStack:
+          vals.push_back(unzigzag(raw));
+          break;
+        case ProfileKind::Edge:
+          vals.push_back(static_cast<int64_t>(raw));
+          break;
+      }
+    }
+
+    return true;
+  }
+
+  // Parses an integer on the current line, skipping blanks
+  bool getInt(int64_t &val) {
+    while (pos_ != end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\r')) {
+      ++pos_;
+    }
+
+    bool neg = false;
+    if (pos_ != end_ && *pos_ == '-') {
+      neg = true;
+      ++pos_;
+    }
+
+    if (pos_ == end_ || *pos_ < '0' || *pos_ > '9') {
+      return false;
+    }
+
+    val = 0;
+    while (pos_ != end_ && *pos_ >= '0' && *pos_ <= '9') {
+      val = val * 10 + (*pos_ - '0');
+      ++pos_;
+    }
+
+    if (neg) {
+      val = -val;
+    }
+    return true;
+  }
+
+  bool nextText(int64_t &key, std::vector<int64_t> &vals) {
+    // Skip blank lines
+    while (pos_ != end_ && (*pos_ == '\n' || *pos_ == ' ')) {
+      ++pos_;
+    }
+    if (pos_ == end_) {
+      return false;
+    }
+
+    key = 0;
+    if (kind_ == ProfileKind::CallStack) {
+      key = line_;
+    } else {
+      if (!getInt(key)) {
+        fprintf(stderr, "WARNING: Malformed profile file\n");
+        return false;
+      }
+      if (kind_ != ProfileKind::Edge) {
+        if (pos_ == end_ || *pos_ != ':') {
+          fprintf(stderr, "WARNING: Malformed profile file\n");
+          return false;
+        }
+        ++pos_;
+      }
+    }
+
+    int64_t val;
+    while (getInt(val)) {
+      vals.push_back(val);
+    }
+
+    // Anything else on the line (e.g. the start of a truncated binary file)
+    if (pos_ != end_ && *pos_ != '\n') {
+      fprintf(stderr, "WARNING: Malformed profile file\n");
+      pos_ = end_;
+      return false;
+    }
+    line_++;
+
+    return true;
+  }
+
+  ProfileKind kind_;
+  bool open_ = false;
+  bool binary_ = false;
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const char *pos_ = nullptr;
+  const char *end_ = nullptr;
+
+  int64_t line_ = 0;
+  //}}}
+};
+
+#endif  // INCLUDE_PROFILEFILE_H_
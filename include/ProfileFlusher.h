@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_PROFILEFLUSHER_H_
+#define INCLUDE_PROFILEFLUSHER_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Periodic and on-demand profile flushing for the runtime (StaticLibs)
+//   libraries, so long running processes can be profiled without stopping
+//   them.  Enabled from the environment:
+//     SFS_FLUSH_INTERVAL=<seconds>  Flushes every <seconds>
+//     SFS_FLUSH_SIGNAL=<signo>      Flushes when the process gets signo (e.g.
+//                                   12, SIGUSR2).  The signal is reserved, the
+//                                   SignalHandler shims drop the program's own
+//                                   handlers for it.
+//
+// Flushes run on one background thread, never in the signal handler (which
+//   only posts a semaphore).  Each library writes the records made since its
+//   last flush (see ThreadRecords::drain) as a delta file, an ordinary profile
+//   named by deltaName().  The deltas of a run add up to its final profile, so
+//   merge_logfiles either the deltas or the final profile, not both.
+//
+// A forked child numbers its deltas (named by its own pid) from 0.  It gets
+//   its own flusher thread, but a thread can't be started from the fork
+//   handler, so it is started by the child's next poll(), which the libraries
+//   call as they record.  (The edge counter has no record path, so its forked
+//   children only write their final profile.)
+//
+// Usage:
+//   do_init:   ProfileFlusher::start(flush_delta);
+//   record:    ProfileFlusher::poll();
+//   do_finish: ProfileFlusher::stop(flush_delta);
+class ProfileFlusher {
+  //{{{
+ public:
+  // Writes the delta numbered seq
+  typedef void (*flush_fn)(uint64_t seq);
+
+  // Adds flush to the flushes, starting the flusher if it is enabled
+  static void start(flush_fn flush) {
+    if (!enabled()) {
+      return;
+    }
+
+    auto &flusher = get();
+    std::unique_lock<std::mutex> lk(flusher.lock_);
+    flusher.fcns_.push_back(flush);
+
+    if (!flusher.started_) {
+      flusher.started_ = true;
+      restartPending().store(false, std::memory_order_relaxed);
+      flusher.run();
+    }
+  }
+
+  // Waits for a flush in progress, and removes flush from the flushes (the
+  //   flusher exits once none are left).  Called before a do_finish writes its
+  //   final profile.
+  //
+  // A do_finish may run from a signal handler, which may have interrupted the
+  //   holder of lock_ (this thread, or a flush waiting on it), so the wait is
+  //   bounded.  If it times out every flush is stopped, and the final profile
+  //   is written alongside the flush in progress.
+  static void stop(flush_fn flush) {
+    if (!enabled()) {
+      return;
+    }
+
+    auto &flusher = get();
+    std::unique_lock<std::mutex> lk(flusher.lock_, std::defer_lock);
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!lk.try_lock()) {
+      if (std::chrono::steady_clock::now() > until) {
+        flusher.stopped_.store(true, std::memory_order_relaxed);
+        fprintf(stderr, "WARNING: Profile flush didn't finish, stopping "
+            "all flushes\n");
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto &fcns = flusher.fcns_;
+    fcns.erase(std::remove(std::begin(fcns), std::end(fcns), flush),
+        std::end(fcns));
+  }
+
+  // True if flushing is enabled from the environment
+  static bool enabled() {
+    return intervalFromEnv() != 0 || signalFromEnv() != 0;
+  }
+
+  // Starts the flusher of a forked child (see afterForkChild()), cheap
+  //   otherwise
+  static void poll() {
+    if (restartPending().load(std::memory_order_relaxed)) {
+      get().restart();
+    }
+  }
+
+  // The reserved flush signal, or 0 if there is none
+  static int signalFromEnv() {
+    const char *signo = getenv("SFS_FLUSH_SIGNAL");
+    if (signo == nullptr) {
+      return 0;
+    }
+
+    int ret = atoi(signo);
+    return (ret > 0 && ret < NSIG) ? ret : 0;
+  }
+
+  // "<logname>.<pid>.delta.<seq>"
+  static std::string deltaName(const std::string &logname, uint64_t seq) {
+    return logname + "." + std::to_string(getpid()) + ".delta." +
+      std::to_string(seq);
+  }
+
+ private:
+  ProfileFlusher() {
+    sem_init(&wake_, 0, 0);
+    pthread_atfork(beforeFork, afterForkParent, afterForkChild);
+  }
+
+  // Never destroyed, so the flusher can outlive static destruction
+  static ProfileFlusher &get() {
+    static ProfileFlusher *flusher = new ProfileFlusher();
+    return *flusher;
+  }
+
+  // Set in a forked child until its flusher is started
+  static std::atomic<bool> &restartPending() {
+    static std::atomic<bool> pending(false);
+    return pending;
+  }
+
+  void restart() {
+    std::unique_lock<std::mutex> lk(lock_);
+    if (restartPending().exchange(false, std::memory_order_relaxed) &&
+        !started_ && !fcns_.empty() &&
+        !stopped_.load(std::memory_order_relaxed)) {
+      started_ = true;
+      run();
+    }
+  }
+
+  // Seconds between flushes, or 0 to only flush on the signal
+  static uint64_t intervalFromEnv() {
+    const char *interval = getenv("SFS_FLUSH_INTERVAL");
+    if (interval == nullptr) {
+      return 0;
+    }
+
+    return strtoull(interval, nullptr, 10);
+  }
+
+  static void onSignal(int) {
+    int saved_errno = errno;
+    sem_post(&get().wake_);
+    errno = saved_errno;
+  }
+
+  void run() {
+    int signo = signalFromEnv();
+    if (signo != 0) {
+      struct sigaction act;
+      sigemptyset(&act.sa_mask);
+      act.sa_flags = SA_RESTART;
+      act.sa_handler = onSignal;
+      sigaction(signo, &act, nullptr);
+    }
+
+    // The flusher blocks every signal, so a terminating signal's do_finish
+    //   never runs on it (while it holds lock_)
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    std::thread(&ProfileFlusher::loop, this, intervalFromEnv()).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  }
+
+  void loop(uint64_t interval) {
+    while (true) {
+      wait(interval);
+
+      std::unique_lock<std::mutex> lk(lock_);
+      if (fcns_.empty()) {
+        started_ = false;
+        return;
+      }
+
+      for (auto flush : fcns_) {
+        if (stopped_.load(std::memory_order_relaxed)) {
+          return;
+        }
+        flush(seq_);
+      }
+      seq_++;
+    }
+  }
+
+  // No flush is in progress across a fork.  The child has no flusher thread,
+  //   and may only make async-signal-safe calls here (if the parent had other
+  //   threads), so its poll() starts one later.
+  static void beforeFork() {
+    get().lock_.lock();
+  }
+
+  static void afterForkParent() {
+    get().lock_.unlock();
+  }
+
+  static void afterForkChild() {
+    auto &flusher = get();
+    flusher.seq_ = 0;
+    flusher.started_ = false;
+    restartPending().store(!flusher.fcns_.empty(),
+        std::memory_order_relaxed);
+    flusher.lock_.unlock();
+  }
+
+  // Waits for the signal, or interval seconds (if it isn't 0)
+  void wait(uint64_t interval) {
+    if (interval == 0) {
+      while (sem_wait(&wake_) != 0 && errno == EINTR) { }
+      return;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += interval;
+    while (sem_timedwait(&wake_, &until) != 0 && errno == EINTR) { }
+  }
+
+  sem_t wake_;
+
+  std::mutex lock_;
+  bool started_ = false;
+  uint64_t seq_ = 0;
+  std::vector<flush_fn> fcns_;
+
+  // Set if a stop() times out
+  std::atomic<bool> stopped_{false};
+  //}}}
+};
+
+#endif  // INCLUDE_PROFILEFLUSHER_H_
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_SAMPLEWINDOW_H_
+#define INCLUDE_SAMPLEWINDOW_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+// Bursty sampling for the runtime (StaticLibs) libraries.
+//
+// The instrumentation guards each sampled event with a thread-local skip
+//   counter owned by the runtime (see LLVMHelper::sampleCall):
+//     if (skip != 0) { skip--; } else { call the runtime }
+//   The runtime records on_ events in a row, then sets skip to off_, so the
+//   next off_ events are skipped without leaving the instrumented code.
+//
+// The windows are read from an environment variable as "<on>:<off>", e.g.
+//   SFS_SAMPLE=1000:9000 records 10% of events, in bursts of 1000.  If it is
+//   unset (or off is 0) every event is recorded.
+//
+// Usage:
+//   static SampleWindow sampler("SFS_SAMPLE");
+//   static thread_local SampleWindow::Local sample_local;
+//   ...
+//   if (sampler.enabled()) {
+//     sampler.record(sample_local, skip);
+//   }
+class SampleWindow {
+  //{{{
+ public:
+  // A thread's window, flushed into the totals when the thread exits
+  class Local {
+    //{{{
+   public:
+    Local() = default;
+
+    ~Local() {
+      if (window_ != nullptr) {
+        window_->flush(*this);
+      }
+    }
+
+    Local(const Local &) = delete;
+    Local &operator=(const Local &) = delete;
+
+   private:
+    friend class SampleWindow;
+
+    SampleWindow *window_ = nullptr;
+    int32_t *skip_ = nullptr;
+    // Events left in the current on window
+    uint64_t left_ = 0;
+    // Events recorded, and not yet added to the totals
+    uint64_t sampled_ = 0;
+    // Set while an off window is pending
+    bool skipping_ = false;
+    //}}}
+  };
+
+  explicit SampleWindow(const char *env_name) {
+    const char *window = getenv(env_name);
+    unsigned long long on = 0;  // NOLINT
+    unsigned long long off = 0;  // NOLINT
+    if (window != nullptr) {
+      if (sscanf(window, "%llu:%llu", &on, &off) != 2 || on == 0) {
+        fprintf(stderr, "WARNING: %s should be <on>:<off>, not sampling\n",
+            env_name);
+        off = 0;
+      }
+    }
+    on_ = on;
+    // skip is an int32_t
+    off_ = std::min<uint64_t>(off, std::numeric_limits<int32_t>::max());
+  }
+
+  SampleWindow(const SampleWindow &) = delete;
+  SampleWindow &operator=(const SampleWindow &) = delete;
+
+  bool enabled() const {
+    return off_ != 0 && !unguarded_.load(std::memory_order_relaxed);
+  }
+
+  // Called for each event reaching the runtime, sets skip at the end of each
+  //   on window
+  void record(Local &local, int32_t &skip) {
+    // The instrumentation didn't decrement skip, so it wasn't built to sample
+    //   and every event is being recorded anyway
+    if (skip != 0) {
+      unguarded_.store(true, std::memory_order_relaxed);
+      return;
+    }
+
+    if (local.window_ == nullptr) {
+      local.window_ = this;
+      local.skip_ = &skip;
+    }
+
+    // The last off window has passed
+    if (local.skipping_) {
+      local.skipping_ = false;
+      skipped_.fetch_add(off_, std::memory_order_relaxed);
+    }
+
+    if (local.left_ == 0) {
+      local.left_ = on_;
+    }
+
+    local.sampled_++;
+    local.left_--;
+    if (local.left_ == 0) {
+      skip = static_cast<int32_t>(off_);
+      local.skipping_ = true;
+      sampled_.fetch_add(local.sampled_, std::memory_order_relaxed);
+      local.sampled_ = 0;
+    }
+  }
+
+  // Adds local's partial windows to the totals (as it exits, or from a
+  //   do_finish)
+  void flush(Local &local) {
+    sampled_.fetch_add(local.sampled_, std::memory_order_relaxed);
+    local.sampled_ = 0;
+
+    if (local.skipping_) {
+      local.skipping_ = false;
+      skipped_.fetch_add(off_ - *local.skip_, std::memory_order_relaxed);
+    }
+  }
+
+  // Drops the totals and local's partial window, in a forked child (see
+  //   include/SharedProfile.h), so it only counts its own events
+  void reset(Local &local) {
+    sampled_.store(0, std::memory_order_relaxed);
+    skipped_.store(0, std::memory_order_relaxed);
+    local.sampled_ = 0;
+  }
+
+  // Events recorded, and seen (recorded or skipped).  Partial windows of
+  //   threads still running (other than the caller) are not counted.
+  uint64_t sampled() const {
+    return sampled_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t total() const {
+    return sampled() + skipped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  uint64_t on_ = 0;
+  uint64_t off_ = 0;
+
+  std::atomic<bool> unguarded_{false};
+  std::atomic<uint64_t> sampled_{0};
+  std::atomic<uint64_t> skipped_{0};
+  //}}}
+};
+
+#endif  // INCLUDE_SAMPLEWINDOW_H_
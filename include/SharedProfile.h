@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_SHAREDPROFILE_H_
+#define INCLUDE_SHAREDPROFILE_H_
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "include/ProfileFlusher.h"
+
+// Profiles shared by a process and the workers it forks, for the runtime
+//   (StaticLibs) libraries.  Enabled with SFS_SHARED_PROFILE=<pairs> (the
+//   capacity of the pair table, 0 for DefaultSlots).
+//
+// Without it, each worker keeps its own copy of the records and writes its
+//   own profile.  With it, the library maps one segment in its do_init (so it
+//   is inherited by every fork), and all the processes record into it:
+//     pairs     An open addressed set of (key, val) pairs (e.g. value id,
+//               object id), inserted with a CAS and probed linearly
+//     counters  num_counters counters, updated with atomic adds
+//   Each process leave()s from its do_finish, and the last to leave writes the
+//   profile, so it is written once, with no file race.
+//
+// Each process is a member while it holds a shared flock() on its own open of
+//   one (unlinked) lock file.  A child's is opened before the fork, close on
+//   exec, so a process which never runs its do_finish (it execs, or is
+//   killed) stops being a member anyway, as does the child of a failed fork.
+//   A leaving process is the last if it can then take the lock exclusively.
+//
+// The pairs are in the segment as soon as they are recorded, but the counters
+//   (e.g. the edge counts, and the sampler's totals) are kept by each process
+//   and only added from its do_finish.  So the counts of a worker which never
+//   runs it (it is killed, or execs) are lost, and the profile is written
+//   without them.
+//
+// Flushing (see include/ProfileFlusher.h) only drains each process's own
+//   records, so it is refused: with SFS_FLUSH_INTERVAL or SFS_FLUSH_SIGNAL set
+//   create() warns and returns nullptr, and each process writes its own
+//   profile (and deltas).
+//
+// The pair table never grows.  Once it is 3/4 full, or a probe runs past
+//   MaxProbes slots, insert() fails, and the library falls back to the
+//   process's own records, written by each process as before.
+//
+// Usage:
+//   do_init:   shared = SharedProfile::create(NumCounters, reset_after_fork);
+//   record:    if (shared == nullptr || !shared->insert(key, val)) { local }
+//   do_finish: shared->add(...); if (shared->leave()) { write forEach(...) }
+class SharedProfile {
+  //{{{
+ public:
+  static const size_t DefaultSlots = 1 << 22;
+  static const size_t MaxProbes = 64;
+
+  // Called in a forked child, to drop the counts it copied from its parent
+  typedef void (*fork_fn)();
+
+  // Returns nullptr unless SFS_SHARED_PROFILE is set (and the segment maps,
+  //   and flushing is off)
+  static SharedProfile *create(size_t num_counters, fork_fn on_fork) {
+    const char *slots_env = getenv("SFS_SHARED_PROFILE");
+    if (slots_env == nullptr) {
+      return nullptr;
+    }
+
+    if (ProfileFlusher::enabled()) {
+      fprintf(stderr, "WARNING: SFS_SHARED_PROFILE can't be used with "
+          "profile flushing, each process will write its own\n");
+      return nullptr;
+    }
+
+    size_t num_slots = 1;
+    size_t min_slots = strtoull(slots_env, nullptr, 10);
+    if (min_slots == 0) {
+      min_slots = DefaultSlots;
+    }
+    while (num_slots < min_slots) {
+      num_slots <<= 1;
+    }
+
+    size_t size = sizeof(Header) + (num_counters + num_slots) *
+      sizeof(std::atomic<uint64_t>);
+    auto map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "WARNING: Couldn't map a %zu byte shared profile, "
+          "each process will write its own\n", size);
+      return nullptr;
+    }
+
+    int member = createMember();
+    if (member < 0) {
+      fprintf(stderr, "WARNING: Couldn't create a shared profile lock file, "
+          "each process will write its own\n");
+      munmap(map, size);
+      return nullptr;
+    }
+
+    auto shared = new SharedProfile(map, num_counters, num_slots, member,
+        on_fork);
+
+    std::unique_lock<std::mutex> lk(forkLock());
+    if (profiles().empty()) {
+      pthread_atfork(beforeFork, afterForkParent, afterForkChild);
+    }
+    profiles().push_back(shared);
+
+    return shared;
+  }
+
+  // Adds (key, val) to the set, false if the table is full
+  bool insert(int32_t key, int32_t val) {
+    // Slots hold the pair + 1, so empty slots are 0 (and (-1, -1) can't be
+    //   held)
+    uint64_t pair = ((static_cast<uint64_t>(static_cast<uint32_t>(key)) << 32) |
+        static_cast<uint32_t>(val)) + 1;
+    if (pair == 0 || header_->full.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    size_t mask = numSlots_ - 1;
+    size_t slot = hash(pair) & mask;
+    size_t max_probes = MaxProbes;
+    if (max_probes > numSlots_) {
+      max_probes = numSlots_;
+    }
+    for (size_t i = 0; i < max_probes; ++i) {
+      auto &cur = slots_[slot];
+      uint64_t held = cur.load(std::memory_order_relaxed);
+      if (held == 0 &&
+          cur.compare_exchange_strong(held, pair, std::memory_order_relaxed)) {
+        if (header_->used.fetch_add(1, std::memory_order_relaxed) + 1 >=
+            numSlots_ / 4 * 3) {
+          header_->full.store(true, std::memory_order_relaxed);
+        }
+        return true;
+      }
+
+      if (held == pair) {
+        return true;
+      }
+
+      slot = (slot + 1) & mask;
+    }
+
+    // The table is too crowded for more probes to pay off
+    header_->full.store(true, std::memory_order_relaxed);
+    return false;
+  }
+
+  void add(size_t counter, uint64_t count) {
+    counters_[counter].fetch_add(count, std::memory_order_relaxed);
+  }
+
+  uint64_t count(size_t counter) const {
+    return counters_[counter].load(std::memory_order_relaxed);
+  }
+
+  // Calls fcn(key, val) for each pair in the set
+  template <typename fcn_type>
+  void forEach(fcn_type fcn) const {
+    for (size_t i = 0; i < numSlots_; ++i) {
+      uint64_t pair = slots_[i].load(std::memory_order_relaxed);
+      if (pair != 0) {
+        pair--;
+        fcn(static_cast<int32_t>(pair >> 32), static_cast<int32_t>(pair));
+      }
+    }
+  }
+
+  // True once insert() fails
+  bool full() const {
+    return header_->full.load(std::memory_order_relaxed);
+  }
+
+  // Detaches this process, true if it was the last, and should write the
+  //   profile.  Only one process is ever the last.
+  bool leave() {
+    if (member_ < 0) {
+      return false;
+    }
+
+    // A new open, so it doesn't share our membership's lock
+    int probe = reopen(member_);
+    close(member_);
+    member_ = -1;
+    if (probe < 0) {
+      fprintf(stderr, "WARNING: Couldn't check for other shared profile "
+          "members, writing it anyway\n");
+      return true;
+    }
+
+    // The winner holds the lock until it exits, so no later leaver wins too
+    if (flock(probe, LOCK_EX | LOCK_NB) == 0) {
+      return true;
+    }
+
+    close(probe);
+    return false;
+  }
+
+ private:
+  struct Header {
+    std::atomic<uint64_t> used;
+    std::atomic<bool> full;
+  };
+
+  SharedProfile(void *map, size_t num_counters, size_t num_slots, int member,
+      fork_fn on_fork) :
+      header_(new (map) Header()),
+      counters_(reinterpret_cast<std::atomic<uint64_t> *>(header_ + 1)),
+      slots_(counters_ + num_counters), numSlots_(num_slots),
+      member_(member), onFork_(on_fork) {
+    // The mapping is zeroed, which is what the atomics start as
+  }
+
+  // Returns the creator's membership, an unlinked lock file it holds shared
+  static int createMember() {
+    const char *dir = getenv("TMPDIR");
+    std::string name = std::string(dir != nullptr ? dir : "/tmp") +
+      "/ohashared.XXXXXX";
+    int fd = mkostemp(&name[0], O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    unlink(name.c_str());
+
+    if (flock(fd, LOCK_SH) != 0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Opens fd's file again, unlocked, or returns -1
+  static int reopen(int fd) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_CLOEXEC);
+  }
+
+  static uint64_t hash(uint64_t pair) {
+    pair ^= pair >> 31;
+    pair *= 0x9e3779b97f4a7c15ULL;
+    pair ^= pair >> 32;
+    return pair;
+  }
+
+  static std::mutex &forkLock() {
+    static std::mutex *lock = new std::mutex();
+    return *lock;
+  }
+
+  static std::vector<SharedProfile *> &profiles() {
+    static std::vector<SharedProfile *> *profiles =
+      new std::vector<SharedProfile *>();
+    return *profiles;
+  }
+
+  // The memberships opened for the child of this thread's fork, by profile
+  static std::vector<int> &forkMembers() {
+    static thread_local std::vector<int> members;
+    return members;
+  }
+
+  // Joins the child before the fork, so the parent can't be the last to leave
+  //   while the child is starting.  The parent closes its copy afterwards, so
+  //   if the fork fails the membership goes with it.
+  static void beforeFork() {
+    auto &members = forkMembers();
+    members.clear();
+    for (auto shared : profiles()) {
+      int member = -1;
+      if (shared->member_ >= 0) {
+        member = reopen(shared->member_);
+        if (member >= 0 && flock(member, LOCK_SH) != 0) {
+          close(member);
+          member = -1;
+        }
+      }
+      members.push_back(member);
+    }
+  }
+
+  static void afterForkParent() {
+    for (auto member : forkMembers()) {
+      if (member >= 0) {
+        close(member);
+      }
+    }
+    forkMembers().clear();
+  }
+
+  static void afterForkChild() {
+    auto &members = forkMembers();
+    for (size_t i = 0; i < profiles().size(); ++i) {
+      auto shared = profiles()[i];
+      // Drop the parent's membership for our own
+      if (shared->member_ >= 0) {
+        close(shared->member_);
+      }
+      shared->member_ = (i < members.size()) ? members[i] : -1;
+
+      if (shared->onFork_ != nullptr) {
+        shared->onFork_();
+      }
+    }
+    members.clear();
+  }
+
+  Header *header_;
+  std::atomic<uint64_t> *counters_;
+  std::atomic<uint64_t> *slots_;
+  size_t numSlots_;
+  // This process's membership (see leave()), or -1 once it has left
+  int member_;
+  fork_fn onFork_;
+  //}}}
+};
+
+#endif  // INCLUDE_SHAREDPROFILE_H_
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_SITECACHE_H_
+#define INCLUDE_SITECACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "include/ThreadRecords.h"
+
+// Per-site dedup for the runtime (StaticLibs) libraries.
+//
+// Most executions of an instrumentation site see the same value as the last
+//   one (the same object for a visit, the same store for a load), and
+//   recording it again is a lock and a std::set insert for nothing.  Each
+//   thread keeps a direct-mapped cache of the last value each site saw, and
+//   only records a value when it misses.
+//
+// The cached value must identify what is recorded (e.g. an interned shadow
+//   value, not an address), so a hit never hides a new record.  Records
+//   harvested by a do_finish keep everything a hit skipped.
+//
+// Usage:
+//   static thread_local SiteCache cache;
+//   ...
+//   if (cache.seen(site, val)) {
+//     return;
+//   }
+class SiteCache {
+  //{{{
+ public:
+  static const size_t Bits = 12;
+  static const size_t Size = 1 << Bits;
+
+  // True if site's last value was val, else caches val for site
+  bool seen(int32_t site, int64_t val) {
+    // Tags are never 0, so the zeroed (thread_local) entries never hit
+    uint64_t tag = (static_cast<uint64_t>(static_cast<uint32_t>(site)) << 1) |
+      1;
+    auto &entry = entries_[index(site)];
+    if (entry.tag == tag && entry.val == val) {
+      return true;
+    }
+
+    entry.tag = tag;
+    entry.val = val;
+    return false;
+  }
+
+ private:
+  struct Entry {
+    uint64_t tag;
+    int64_t val;
+  };
+
+  static size_t index(int32_t site) {
+    // Fibonacci hash, as neighbouring sites are often executed together
+    return (static_cast<uint32_t>(site) * 2654435769u) >> (32 - Bits);
+  }
+
+  // No initializers, so a thread_local SiteCache is zero-initialized and
+  //   needs no constructor call
+  std::array<Entry, Size> entries_;
+  //}}}
+};
+
+// Per-site hit and miss counts of a SiteCache, collected only when
+//   SFS_PROFILE_STATS is set, and printed by the do_finish
+class SiteCacheStats {
+  //{{{
+ public:
+  // site -> (hits, misses)
+  typedef std::unordered_map<int32_t, std::pair<uint64_t, uint64_t>> Counts;
+
+  SiteCacheStats() :
+      enabled_(getenv("SFS_PROFILE_STATS") != nullptr),
+      records_(ThreadRecords<Counts>::create(merge)) { }
+
+  SiteCacheStats(const SiteCacheStats &) = delete;
+  SiteCacheStats &operator=(const SiteCacheStats &) = delete;
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  void record(int32_t site, bool hit) {
+    records_.record([site, hit] (Counts &all_counts) {
+      auto &counts = all_counts[site];
+      if (hit) {
+        counts.first++;
+      } else {
+        counts.second++;
+      }
+    });
+  }
+
+  // Prints the overall hit rate, and the num_sites sites executed most
+  void print(const char *name, size_t num_sites) {
+    auto counts = records_.harvest();
+
+    std::vector<std::pair<uint64_t, int32_t>> by_execs;
+    uint64_t hits = 0;
+    uint64_t execs = 0;
+    for (auto &pr : counts) {
+      auto site_execs = pr.second.first + pr.second.second;
+      hits += pr.second.first;
+      execs += site_execs;
+      by_execs.emplace_back(site_execs, pr.first);
+    }
+
+    fprintf(stderr, "%s: cache hits %llu of %llu (%.1f%%) over %zu sites\n",
+        name, static_cast<unsigned long long>(hits),  // NOLINT
+        static_cast<unsigned long long>(execs),  // NOLINT
+        percent(hits, execs), counts.size());
+
+    num_sites = std::min(num_sites, by_execs.size());
+    std::partial_sort(std::begin(by_execs), std::begin(by_execs) + num_sites,
+        std::end(by_execs), std::greater<std::pair<uint64_t, int32_t>>());
+    for (size_t i = 0; i < num_sites; ++i) {
+      auto &site_counts = counts[by_execs[i].second];
+      fprintf(stderr, "  site %d: %llu hits, %llu misses (%.1f%%)\n",
+          by_execs[i].second,
+          static_cast<unsigned long long>(site_counts.first),  // NOLINT
+          static_cast<unsigned long long>(site_counts.second),  // NOLINT
+          percent(site_counts.first, by_execs[i].first));
+    }
+  }
+
+ private:
+  static void merge(Counts &into, Counts &from) {
+    for (auto &pr : from) {
+      auto &counts = into[pr.first];
+      counts.first += pr.second.first;
+      counts.second += pr.second.second;
+    }
+    from.clear();
+  }
+
+  static double percent(uint64_t part, uint64_t whole) {
+    return (whole == 0) ? 0.0 : 100.0 * part / whole;
+  }
+
+  const bool enabled_;
+  ThreadRecords<Counts> &records_;
+  //}}}
+};
+
+#endif  // INCLUDE_SITECACHE_H_
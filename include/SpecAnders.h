@@ -51,7 +51,8 @@ class SpecAndersAnalysis {
       ConstraintPass &cp,
       UnusedFunctions &uf,
       IndirFunctionInfo &indir_info,
-      CallContextLoader &call_info);
+      CallContextLoader &call_info,
+      const SpecCheckBudget *check_budget);
 
   const AssumptionSet &getSpecAssumptions() const {
     return cp_->getSpecAssumptions();
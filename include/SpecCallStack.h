@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_SPECCALLSTACK_H_
+#define INCLUDE_SPECCALLSTACK_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "include/BloomHash.h"
+
+// The call stack checked by the SpecSFS call-stack assumptions, shared by the
+//   instrumenter (SpecSFSInstrumenter, in src/InsertSpecAssumptions.cpp) and
+//   SpecSFSCheckLib.
+//
+// The stack lives in thread-local arrays owned by the runtime, so the
+//   instrumenter can push, pop and probe the bloom filter with inline IR, and
+//   only call the runtime on a bloom hit:
+//     ids[d], hashes[d]  The callsite id and stack hash of frame d
+//     depth              The index of the top frame
+//
+//   Frame 0 is the "main" frame (id 0, hash 0), so the zero-initialized
+//   arrays need no constructor.  A push of the callsite already on top is
+//   skipped (as is a pop of any other callsite).
+//
+//   Frames deeper than MaxDepth are only counted (depth keeps growing, and
+//   every push and pop past it is taken), as no checked stack is that deep.
+//   The instrumenter bounds the inline stack by its longest checked stack
+//   instead, where that is shorter.
+//
+// Each check site has the set of stacks it must not be reached from:
+//   filter   { bits, words[bits / 64] }, a bloom filter of the stack hashes,
+//            sized for the site (see BloomHasher::filter_bits)
+//   hashes   An open addressed table of num_slots (a power of two) stack
+//            hashes, probed linearly from slot(hash)
+//   stacks   For each slot, the stack as { size, ids[size] }, or null if
+//            the slot is empty
+//   The hash of a stack is the rolling hash push() keeps, frame 0 is not
+//   mixed in.  Stacks are only compared on a matching hash.
+//
+// push(), pop() and find() are the reference versions of the stack
+//   operations, which the runtime calls out of line, and the instrumenter
+//   emits inline.
+struct SpecCallStack {
+  static const int32_t MaxDepth = 4096;
+
+  static constexpr const char *DepthName = "__specsfs_callstack_depth";
+  static constexpr const char *IdsName = "__specsfs_callstack_ids";
+  static constexpr const char *HashesName = "__specsfs_callstack_hashes";
+
+  // Counts of the inline pushes and pops executed, only emitted with
+  //   -specsfs-count-callstack
+  static constexpr const char *PushesName = "__specsfs_callstack_pushes";
+  static constexpr const char *PopsName = "__specsfs_callstack_pops";
+
+  // The hash of frame 0, the seed of every stack hash
+  static const uint64_t BaseHash = 0;
+
+  // Pushes the callsite id (whose hash is id_hash), unless it is on top.
+  //   Frames at or past limit (MaxDepth, or the instrumenter's bound) are only
+  //   counted.
+  static void push(int32_t &depth, int32_t ids[], uint64_t hashes[],
+      int32_t id, uint64_t id_hash, int32_t limit = MaxDepth) {
+    if (depth >= limit - 1) {
+      depth++;
+    } else if (ids[depth] != id) {
+      ids[depth + 1] = id;
+      hashes[depth + 1] = BloomHasher::mix_hash(hashes[depth], id_hash);
+      depth++;
+    }
+  }
+
+  // Pops the callsite id, if it is on top
+  static void pop(int32_t &depth, const int32_t ids[], int32_t id,
+      int32_t limit = MaxDepth) {
+    if (depth >= limit || (depth > 0 && ids[depth] == id)) {
+      depth--;
+    }
+  }
+
+  // Returns the stack of a check site's table equal to ids[0..depth] (whose
+  //   hash is hash), or nullptr.  Frame 0 is always main, so it isn't
+  //   compared.
+  static const int32_t *find(size_t num_slots, int32_t *const stacks[],
+      const uint64_t hashes[], const int32_t ids[], int32_t depth,
+      uint64_t hash) {
+    // Only the stacks with our hash can match, and they're in the run of
+    //   full slots starting at slot(hash)
+    size_t mask = num_slots - 1;
+    for (size_t i = slot(hash, num_slots); stacks[i] != nullptr;
+        i = (i + 1) & mask) {
+      const int32_t *stack = stacks[i];
+      if (hashes[i] != hash || stack[0] != depth + 1) {
+        continue;
+      }
+
+      int32_t j = depth;
+      while (j > 0 && ids[j] == stack[1 + j]) {
+        --j;
+      }
+      if (j == 0) {
+        return stack;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // Tables are kept at most half full
+  static size_t numSlots(size_t num_stacks) {
+    size_t num_slots = 1;
+    while (num_slots < 2 * num_stacks) {
+      num_slots <<= 1;
+    }
+    return num_slots;
+  }
+
+  // The first slot probed for hash (stack hashes are weak in the low bits)
+  static size_t slot(uint64_t hash, size_t num_slots) {
+    hash ^= hash >> 31;
+    hash *= 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+    return hash & (num_slots - 1);
+  }
+};
+
+#endif  // INCLUDE_SPECCALLSTACK_H_
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_THREADRECORDS_H_
+#define INCLUDE_THREADRECORDS_H_
+
+#include <cstdint>
+#include <cstdio>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Per-thread profile records for the runtime (StaticLibs) libraries.
+//
+// Each thread records into its own record_type, and the records are merged
+//   into one when the thread exits, or when harvest() is called (from a
+//   do_finish).  Recording takes no lock: the thread marks itself as
+//   recording (an odd seq), and a harvest swaps each thread's record_type out
+//   for an empty one, then waits for any record in progress to finish before
+//   merging what it took.
+//
+// A do_finish may harvest from a terminating signal's handler, which can
+//   interrupt its own thread mid-record.  That thread's records are torn, so
+//   the harvest skips them, and it only waits a bounded time for any other
+//   thread, so it never deadlocks.
+//
+// drain() (from a ProfileFlusher flush) instead returns only the records made
+//   since the last drain, taken the same way.
+//
+// Usage:
+//   static ThreadRecords<Recs> &records = ThreadRecords<Recs>::create(merge);
+//   ...
+//   records.record([&] (Recs &recs) {
+//     recs...
+//   });
+template <typename record_type>
+class ThreadRecords {
+  //{{{
+ public:
+  // Merges from into into, from is cleared afterwards
+  typedef void (*merge_fn)(record_type &into, record_type &from);
+
+  class Local {
+    //{{{
+   public:
+    explicit Local(ThreadRecords &parent) : parent_(parent),
+        records_(new record_type()) {
+      parent_.attach(this);
+    }
+
+    ~Local() {
+      parent_.detach(this);
+      delete records_.load(std::memory_order_relaxed);
+    }
+
+    Local(const Local &) = delete;
+    Local &operator=(const Local &) = delete;
+
+   private:
+    friend class ThreadRecords;
+
+    ThreadRecords &parent_;
+    // Odd while the thread is recording
+    std::atomic<uint64_t> seq_{0};
+    std::atomic<record_type *> records_;
+    //}}}
+  };
+
+  // The records live until process exit (they are never destroyed), so
+  //   threads outliving static destruction can still merge into them
+  static ThreadRecords &create(merge_fn merge) {
+    return *(new ThreadRecords(merge));
+  }
+
+  // Calls fcn with the calling thread's records.  fcn must not record.
+  template <typename fcn_type>
+  void record(fcn_type fcn) {
+    auto &local = this->local();
+    // Announce the record before loading the records, so a harvest which
+    //   swaps them out sees it (see take())
+    local.seq_.fetch_add(1, std::memory_order_seq_cst);
+    fcn(*local.records_.load(std::memory_order_seq_cst));
+    local.seq_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Returns every thread's records (live and exited) merged into one.
+  //   Threads keep recording after a harvest, and their new records show up
+  //   in the next one.
+  record_type harvest() {
+    std::unique_lock<std::mutex> lk(lock_);
+    for (auto local : live_) {
+      auto taken = take(local);
+      if (taken != nullptr) {
+        keep(*taken);
+        delete taken;
+      }
+    }
+
+    return merged_;
+  }
+
+  // Moves the records made since the last drain (by live and exited threads)
+  //   into delta.  They stay in the records harvest() returns.
+  void drain(record_type &delta) {
+    std::unique_lock<std::mutex> lk(lock_);
+    if (!draining_) {
+      // The first delta has everything merged before it
+      draining_ = true;
+      record_type merged(merged_);
+      merge_(delta, merged);
+    } else {
+      merge_(delta, undrained_);
+    }
+
+    for (auto local : live_) {
+      auto taken = take(local);
+      if (taken != nullptr) {
+        record_type copy(*taken);
+        merge_(merged_, copy);
+        merge_(delta, *taken);
+        delete taken;
+      }
+    }
+  }
+
+ private:
+  typedef std::vector<std::pair<ThreadRecords *, Local *>> LocalList;
+
+  // How long a take() waits for a record in progress
+  static const int MaxYields = 1 << 16;
+
+  explicit ThreadRecords(merge_fn merge) : merge_(merge) { }
+
+  // One Local per thread, per ThreadRecords instance
+  static LocalList &locals() {
+    thread_local LocalList locals;
+    return locals;
+  }
+
+  // Returns the calling thread's records
+  Local &local() {
+    for (auto &pr : locals()) {
+      if (pr.first == this) {
+        return *pr.second;
+      }
+    }
+
+    return *newLocal();
+  }
+
+  bool isCallers(const Local *local) {
+    for (auto &pr : locals()) {
+      if (pr.second == local) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Swaps local's records out for empty ones, and returns them once no record
+  //   can still be writing them.  Returns nullptr (leaking them) if a record
+  //   doesn't finish, as they may still be written.
+  record_type *take(Local *local) {
+    auto taken = local->records_.exchange(new record_type(),
+        std::memory_order_seq_cst);
+
+    // A record which loaded taken began before the exchange, so it is the one
+    //   in progress now (if any)
+    uint64_t seq = local->seq_.load(std::memory_order_seq_cst);
+    if ((seq & 1) == 0) {
+      return taken;
+    }
+
+    // The caller's own record, interrupted by the signal we are handling,
+    //   never finishes
+    if (!isCallers(local)) {
+      for (int i = 0; i < MaxYields; ++i) {
+        if (local->seq_.load(std::memory_order_acquire) != seq) {
+          return taken;
+        }
+        std::this_thread::yield();
+      }
+    }
+
+    fprintf(stderr, "WARNING: Dropping the records of a thread interrupted "
+        "while recording\n");
+    return nullptr;
+  }
+
+  // The Local is owned by a thread_local holder, so it is destroyed (and
+  //   merged) when the thread exits
+  Local *newLocal() {
+    struct Holder {
+      ~Holder() {
+        for (auto local : owned) {
+          delete local;
+        }
+      }
+
+      std::vector<Local *> owned;
+    };
+    thread_local Holder holder;
+
+    auto local = new Local(*this);
+    holder.owned.push_back(local);
+    locals().emplace_back(this, local);
+    return local;
+  }
+
+  void attach(Local *local) {
+    std::unique_lock<std::mutex> lk(lock_);
+    live_.push_back(local);
+  }
+
+  // Called by the exiting thread, which is no longer recording
+  void detach(Local *local) {
+    std::unique_lock<std::mutex> lk(lock_);
+    keep(*local->records_.load(std::memory_order_relaxed));
+    live_.erase(std::find(std::begin(live_), std::end(live_), local));
+  }
+
+  // Merges records taken outside of a drain, which the next drain returns.
+  //   Called with lock_ held.
+  void keep(record_type &records) {
+    if (draining_) {
+      record_type copy(records);
+      merge_(undrained_, copy);
+    }
+    merge_(merged_, records);
+  }
+
+  merge_fn merge_;
+
+  std::mutex lock_;
+  std::vector<Local *> live_;
+  record_type merged_;
+
+  // The records harvested, or of threads which exited, since the last drain
+  bool draining_ = false;
+  record_type undrained_;
+  //}}}
+};
+
+#endif  // INCLUDE_THREADRECORDS_H_
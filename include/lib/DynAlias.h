@@ -44,6 +44,11 @@ class DynAliasLoader : public llvm::ModulePass {
     return hasInfo_;
   }
 
+  // The fraction of events a sampled profile recorded, 1 if it wasn't sampled
+  double sampleCoverage() const {
+    return sampleCoverage_;
+  }
+
   /*
   bool hasPtsto(ValueMap::Id &val_id) const {
     assert(hasInfo_);
@@ -155,6 +160,7 @@ class DynAliasLoader : public llvm::ModulePass {
   ValueMap map_;
   std::map<ValueMap::Id, std::set<ValueMap::Id>> valToObjs_;
   bool hasInfo_ = false;
+  double sampleCoverage_ = 1.0;
 };
 
 class DynAliasTester : public llvm::ModulePass {
@@ -7,6 +7,7 @@
 
 #include <map>
 #include <set>
+#include <unordered_set>
 
 #include "llvm/Pass.h"
 #include "llvm/IR/BasicBlock.h"
@@ -42,6 +43,11 @@ class DynPtstoLoader : public llvm::ModulePass {
     return hasInfo_;
   }
 
+  // The fraction of events a sampled profile recorded, 1 if it wasn't sampled
+  double sampleCoverage() const {
+    return sampleCoverage_;
+  }
+
   /*
   bool hasPtsto(ObjectMap::ObjID &val_id) const {
     assert(hasInfo_);
@@ -108,10 +114,13 @@ class DynPtstoLoader : public llvm::ModulePass {
 
  private:
   void setupSpecSFSids(llvm::Module &);
+  void rebuildElided(llvm::Module &m,
+      std::unordered_set<ValueMap::Id, ValueMap::Id::hasher> &universal);
 
   ValueMap map_;
   std::map<ValueMap::Id, PtstoSet> valToObjs_;
   bool hasInfo_ = false;
+  double sampleCoverage_ = 1.0;
 };
 
 class DynPtstoAA : public llvm::ModulePass,
@@ -37,11 +37,11 @@ class DynEdgeLoader : public llvm::ModulePass {
     return loaded_;
   }
 
-  bool getExecutionCount(const llvm::Function *fcn) const {
+  size_t getExecutionCount(const llvm::Function *fcn) const {
     return getExecutionCount(&fcn->getEntryBlock());
   }
 
-  bool getExecutionCount(const llvm::BasicBlock *bb) const {
+  size_t getExecutionCount(const llvm::BasicBlock *bb) const {
     return executionCounts_.at(bb);
   }
 
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef INCLUDE_LIB_SPECCHECKBUDGET_H_
+#define INCLUDE_LIB_SPECCHECKBUDGET_H_
+
+#include <cstdint>
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/Pass.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "include/lib/EdgeCountPass.h"
+
+class InstrumentationSite;
+
+// Approximates the runtime cost of instrumentation from the edge profile, as
+//   a fraction of the instructions the profiled runs executed.  Each site
+//   costs its approxCost() per execution of its block.
+class CostApprox {
+ public:
+  CostApprox(const llvm::Module &m, const DynEdgeLoader &edges);
+
+  bool hasInfo() const {
+    return totalDynInsts_ > 0.0;
+  }
+
+  // The cost of bb's instructions
+  double blockCost(const llvm::BasicBlock &bb) const;
+
+  // The cost of a check of approx_cost, run on each execution of bb
+  double checkCost(const llvm::BasicBlock &bb, int64_t approx_cost) const;
+
+  double siteCost(InstrumentationSite &site) const;
+
+  double siteCost(
+      const std::vector<std::unique_ptr<InstrumentationSite>> &sites) const;
+
+ private:
+  const DynEdgeLoader &edges_;
+  double totalDynInsts_ = 0.0;
+};
+
+// Chooses which speculative assumptions are worth their checks.
+//
+// With -spec-check-budget (e.g. -spec-check-budget=2%) and an edge profile,
+//   each candidate assumption is weighed by the precision it buys the
+//   analysis against the cost of its checks (from CostApprox).  Candidates
+//   are kept best ratio first, until their checks would exceed the budget.
+//   Those rejected are analyzed as if there were no dynamic info for them.
+//
+// Without a budget, or a profile, every assumption is kept.  The analyses only
+//   require this pass (and the edge profile) when -spec-check-budget is given,
+//   see enabled().
+//
+// Only the indirect call target assumptions are weighed.  A dead code
+//   assumption's visit check is in a block the profile never ran, so it costs
+//   nothing under the model and is always kept.  Call context assumptions
+//   are always kept too: their checks share one call-stack instrumentation
+//   (pushes and pops at the callsites of every checked stack), whose cost
+//   depends on all of the checked stacks together, so no one assumption has
+//   a cost of its own to weigh.
+class SpecCheckBudget : public llvm::ModulePass {
+ public:
+  static char ID;
+
+  SpecCheckBudget();
+
+  bool runOnModule(llvm::Module &m) override;
+
+  void getAnalysisUsage(llvm::AnalysisUsage &usage) const override;
+
+  llvm::StringRef getPassName() const override {
+    return "SpecCheckBudget";
+  }
+
+  // True if -spec-check-budget is given.  Otherwise every assumption is kept,
+  //   and the analyses don't require this pass.
+  static bool enabled();
+
+  // The cost model, or nullptr if there is no edge profile
+  const CostApprox *costs() const {
+    return costs_.get();
+  }
+
+  // True if the analysis may speculate on the targets of the indirect call (or
+  //   invoke) ci
+  bool keepIndirCall(const llvm::Instruction *ci) const {
+    return !limited_ || keptCalls_.count(ci) != 0;
+  }
+
+ private:
+  std::unique_ptr<CostApprox> costs_;
+
+  bool limited_ = false;
+  std::unordered_set<const llvm::Instruction *> keptCalls_;
+};
+
+#endif  // INCLUDE_LIB_SPECCHECKBUDGET_H_
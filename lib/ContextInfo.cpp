@@ -4,6 +4,7 @@
 
 #include "include/ContextInfo.h"
 
+#include <mutex>
 #include <set>
 #include <unordered_set>
 #include <vector>
@@ -23,7 +24,8 @@ typedef ContextInfo::StackId StackId;
 typedef ContextInfo::ContextId ContextId;
 
 char ContextInfo::ID = 0;
-ContextInfo::ContextInfo() : llvm::ModulePass(ID), cache_(info_) { }
+ContextInfo::ContextInfo() : llvm::ModulePass(ID), cache_(info_),
+    stackCache_(bddLock_) { }
 
 /*
  *    How do we determine which stores may provide a load l?
@@ -113,11 +115,17 @@ void ContextInfo::Context::populatePreds() const {
   // Iterate through the entire thing, and follow the magical algorithm of
   //   greatness and prosperity
   // llvm::dbgs() << "populatePreds(): " << id() << "\n";
+  auto lock = info_.lockBdds();
 
+  // Another thread may have finished this while we waited on the lock
+  if (predsPopulated_.load(std::memory_order_relaxed)) {
+    return;
+  }
 
   if (stack() == StackInfo::NonCons()) {
     predBBs_ = BBBddSet::tautology();
     predStores_ = StoreBddSet::tautology();
+    predsPopulated_.store(true, std::memory_order_release);
     return;
   }
 
@@ -139,8 +147,11 @@ void ContextInfo::Context::populatePreds() const {
     auto &caller_stores = caller_ctx.predStores();
     predStores_ |= caller_stores;
   }
+
+  predsPopulated_.store(true, std::memory_order_release);
 }
 
+// NOTE: Only called from populatePreds(), so the bdd lock is held
 void ContextInfo::Context::populateLocal() const {
   localPopulated_ = true;
 
@@ -259,25 +270,27 @@ ContextId ContextInfo::ContextCache::find(
     const llvm::Value *val,
     StackId stack,
     const ContextInfo &info) {
-  auto id_num = contextSize_;
-  auto rc = cache_.emplace(std::piecewise_construct,
-      std::make_tuple(val, stack), std::make_tuple(id_num));
-
-  if (rc.second) {
+  ContextKey key(val, stack);
+  auto &shard = shards_[ContextKey::hasher()(key) % NumShards];
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  auto it = shard.cache.find(key);
+  if (it == std::end(shard.cache)) {
+    auto id_num = contextSize_.fetch_add(1);
+    assert(id_num + 1 < MaxContexts);
     // contexts_.emplace_back(val, stack, ContextId(id_num), info);
     // This line constructs the context in the array... yeah...
-    new (&contexts_[contextSize_]) Context(val, stack, ContextId(id_num), info);
-    contextSize_++;
-    assert(contextSize_ < MaxContexts);
-    assert(contextSize_ == id_num+1);
+    new (&contexts_[id_num]) Context(val, stack, ContextId(id_num), info);
+
+    it = shard.cache.emplace(key, id_num).first;
   }
 
-  auto it = rc.first;
   return ContextId(it->second);
 }
 
 StackId ContextInfo::StackCache::find(
     const std::vector<CsCFG::Id> &stack) {
+  std::lock_guard<std::recursive_mutex> lock(bddLock_);
   // Construct a bdd out of it?
   StackSet s;
   // llvm::dbgs() << "Making set\n";
@@ -286,7 +299,7 @@ StackId ContextInfo::StackCache::find(
   }
   // llvm::dbgs() << "Done making set\n";
 
-  auto val = stackSize_;
+  size_t val = stackSize_;
   auto rc = cache_.emplace(s.id(), val);
   if (rc.second) {
     // Make entry in stacks_
@@ -294,7 +307,7 @@ StackId ContextInfo::StackCache::find(
     stacks_.emplace_back(stack, StackId(val));
     assert(stacks_.size() == val+1);
     */
-    new (&stacks_[stackSize_]) StackInfo(stack, s, StackId(val));
+    new (&stacks_[val]) StackInfo(stack, s, StackId(val));
     stackSize_++;
     assert(stackSize_ < MaxStacks);
     assert(stackSize_ == val+1);
@@ -306,6 +319,7 @@ StackId ContextInfo::StackCache::find(
 
 StackId ContextInfo::StackInfo::parentId(
     StackCache &cache) const {
+  std::lock_guard<std::recursive_mutex> lock(cache.bddLock());
   if (parentId_ == StackId::invalid()) {
     // Populate parentId
     auto parent_stack = stack();
@@ -409,6 +423,10 @@ ContextInfo::getAllContexts(const llvm::Instruction *inst) const {
   static std::unordered_map<const llvm::Instruction *, std::vector<ContextId>>
     inst_to_context;
 
+  // Guards the above tables (and the CsCFG path cache behind them)
+  static std::mutex all_contexts_lock;
+  std::lock_guard<std::mutex> lock(all_contexts_lock);
+
   auto con_it = inst_to_context.find(inst);
 
   if (con_it == std::end(inst_to_context)) {
@@ -495,7 +513,6 @@ ContextInfo::getPriorContexts(const llvm::Instruction *inst,
   std::vector<ContextId> ret;
 
   auto &cur_context = getContext(cur_context_id);
-  auto predBBs = cur_context.predBBs();
 
   if (cur_context.stack() == StackInfo::NonCons()) {
     ret.push_back(getContext(inst, cur_context.stack()));
@@ -507,6 +524,7 @@ ContextInfo::getPriorContexts(const llvm::Instruction *inst,
     for (auto context_id : possible_contexts) {
       // auto &context = getContext(context_id);
 
+      // auto predBBs = cur_context.predBBs();
       // if ((context.predBBs() - (predBBs)).empty()) {
         ret.push_back(context_id);
       // }
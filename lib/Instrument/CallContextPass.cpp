@@ -13,6 +13,7 @@
 
 #include "include/util.h"
 #include "include/LLVMHelper.h"
+#include "include/ProfileFile.h"
 #include "include/lib/CsCFG.h"
 #include "include/lib/UnusedFunctions.h"
 #include "include/lib/IndirFcnTarget.h"
@@ -255,25 +256,24 @@ void CallContextLoader::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
 // Here is where the magic happens
 bool CallContextLoader::runOnModule(llvm::Module &) {
   // Open the loader-file
-  std::ifstream logfile(DynCallGraphFilename, std::ifstream::in);
+  ProfileReader logfile(DynCallGraphFilename, ProfileKind::CallStack);
 
   // If we actually managed to get data...
-  if (logfile.good()) {
+  if (logfile.isOpen()) {
     llvm::dbgs() << "CallContextLoader: Successfully Loaded!\n";
 
     auto &cfg = getAnalysis<CsCFG>();
 
-    // Then, load the lines of callstacks
-    for (std::string line; std::getline(logfile, line); ) {
-      std::stringstream converter(line);
-
-
+    // Then, load the callstacks
+    int64_t stack_num;
+    std::vector<int64_t> stack;
+    while (logfile.next(stack_num, stack)) {
       // All vectors start with 0 id...
       std::vector<CsCFG::Id> vec(1, CsCFG::Id(0));
 
-      vec.insert(std::end(vec),
-          std::istream_iterator<CsCFG::Id>(converter),
-          std::istream_iterator<CsCFG::Id>());
+      for (auto id : stack) {
+        vec.emplace_back(id);
+      }
 
       callsites_.emplace_back(std::move(vec));
 
@@ -34,6 +34,7 @@
 #include "include/LLVMHelper.h"
 #include "include/ExtInfo.h"
 #include "include/ModuleAAResults.h"
+#include "include/ProfileFile.h"
 #include "include/lib/UnusedFunctions.h"
 #include "include/lib/PtsNumberPass.h"
 
@@ -42,6 +43,12 @@ static llvm::cl::opt<std::string>
       llvm::cl::value_desc("filename"),
       llvm::cl::desc("Ptsto file saved/loaded by DynPtsto analysis"));
 
+static llvm::cl::opt<bool>
+  dyn_alias_sample("dyn-alias-sample", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("If set loads are guarded by the runtime's sample "
+        "counter, so runs can record bursts of them (set with SFS_SAMPLE)"));
+
 // First and last functions called
 static const std::string InitInstName = "__DynAlias_do_init";
 static const std::string FinishInstName = "__DynAlias_do_finish";
@@ -61,6 +68,13 @@ static const std::string FreeInstName = "__DynAlias_do_free";
 static const std::string LoadInstName = "__DynAlias_do_load";
 static const std::string StoreInstName = "__DynAlias_do_store";
 
+// The value id of each load, indexed by the load index passed to do_load
+static const std::string LoadIdsName = "__DynAlias_load_ids";
+static const std::string NumLoadsName = "__DynAlias_num_loads";
+
+// Thread-local count of loads to skip, when sampling
+static const std::string SampleSkipName = "__DynAlias_sample_skip";
+
 // setjump/longjmp *sigh*
 static const std::string SetjmpInstName = "__DynAlias_do_setjmp";
 static const std::string LongjmpInstName = "__DynAlias_do_longjmp";
@@ -83,6 +97,7 @@ class InstrDynAlias : public llvm::ModulePass {
     void setupSpecSFSids(llvm::Module &);
     void addExternalFunctions(llvm::Module &);
     void addInitializationCalls(llvm::Module &);
+    void addLoadIds(llvm::Module &, const std::vector<int32_t> &load_ids);
     llvm::Instruction *addMallocCall(llvm::Module &m, ValueMap::Id obj_id,
         llvm::Value *val, llvm::Value *size_val,
         llvm::Instruction *insert_before);
@@ -128,6 +143,9 @@ bool InstrDynAlias::runOnModule(llvm::Module &m) {
 
   // int32_t gep_id = 0;
 
+  // Loads are numbered densely, so the runtime can index its records by load
+  std::vector<int32_t> load_ids;
+
   // Iterate each instruction, keeping lists
   for (auto &fcn : m) {
     // Ignore functions without bodies
@@ -436,9 +454,10 @@ bool InstrDynAlias::runOnModule(llvm::Module &m) {
         }
 
 
-        args.push_back(llvm::ConstantInt::get(i32_type, val_id.val()));
+        args.push_back(llvm::ConstantInt::get(i32_type, load_ids.size()));
         args.push_back(ptr);
         args.push_back(size);
+        load_ids.push_back(val_id.val());
 
         // Call our do_load function
         llvm::CallInst::Create(load_fcn,
@@ -673,6 +692,26 @@ bool InstrDynAlias::runOnModule(llvm::Module &m) {
 
   // Add initialization calls:
   addInitializationCalls(m);
+  addLoadIds(m, load_ids);
+
+  // Only the loads are sampled, every store must update the shadow map or
+  //   sampled loads would see stale stores
+  if (dyn_alias_sample) {
+    auto skip = LLVMHelper::getSampleSkip(m, SampleSkipName);
+
+    std::vector<llvm::CallInst *> loads;
+    for (auto user : m.getFunction(LoadInstName)->users()) {
+      if (auto ci = dyn_cast<llvm::CallInst>(user)) {
+        loads.push_back(ci);
+      }
+    }
+
+    for (auto ci : loads) {
+      LLVMHelper::sampleCall(ci, skip);
+    }
+
+    llvm::dbgs() << "InstrDynAlias: sampling " << loads.size() << " loads\n";
+  }
 
   // We modify all the stuff
   return true;
@@ -1006,6 +1045,29 @@ void InstrDynAlias::addInitializationCalls(llvm::Module &m) {
   llvm::CallInst::Create(at_exit, atexit_call_args, "", first_inst);
 }
 
+void InstrDynAlias::addLoadIds(llvm::Module &m,
+    const std::vector<int32_t> &load_ids) {
+  auto i32_type = llvm::IntegerType::get(m.getContext(), 32);
+
+  std::vector<uint32_t> raw_ids(std::begin(load_ids), std::end(load_ids));
+  auto ids_init = llvm::ConstantDataArray::get(m.getContext(), raw_ids);
+  new llvm::GlobalVariable(m,
+      ids_init->getType(),
+      true,
+      llvm::GlobalValue::ExternalLinkage,
+      ids_init,
+      LoadIdsName);
+
+  new llvm::GlobalVariable(m,
+      i32_type,
+      true,
+      llvm::GlobalValue::ExternalLinkage,
+      llvm::ConstantInt::get(i32_type, load_ids.size()),
+      NumLoadsName);
+
+  llvm::dbgs() << "InstrDynAlias: " << load_ids.size() << " loads\n";
+}
+
 llvm::Instruction *InstrDynAlias::addMallocCall(llvm::Module &m,
     ValueMap::Id obj_id, llvm::Value *val, llvm::Value *size_val,
     llvm::Instruction *insert_before) {
@@ -1051,27 +1113,32 @@ bool DynAliasLoader::runOnModule(llvm::Module &) {
 
   // Now optimize so its related to spec's
 
-  std::ifstream logfile(DynAliasFilename);
+  ProfileReader logfile(DynAliasFilename, ProfileKind::Alias);
   llvm::dbgs() << "Loading DynAliasFile: " << DynAliasFilename << "\n";
-  if (!logfile.is_open()) {
+  if (!logfile.isOpen()) {
     llvm::dbgs() << "DynAliasLoader: no logfile loaded!\n";
     hasInfo_ = false;
   } else {
     llvm::dbgs() << "DynAliasLoader: Successfully Loaded\n";
     hasInfo_ = true;
 
-    for (std::string line; std::getline(logfile, line, ':'); ) {
-      auto call_id = ValueMap::Id(stoi(line));
-
-      auto &obj_set = valToObjs_[call_id];
+    int64_t line_id;
+    std::vector<int64_t> obj_ids;
+    while (logfile.next(line_id, obj_ids)) {
+      if (line_id == ProfileCoverageKey) {
+        if (obj_ids.size() == 2 && obj_ids[1] > 0) {
+          sampleCoverage_ = static_cast<double>(obj_ids[0]) / obj_ids[1];
+        }
+        llvm::dbgs() << "DynAliasLoader: sampled profile, coverage: " <<
+          sampleCoverage_ * 100 << "%\n";
+        continue;
+      }
 
-      std::getline(logfile, line);
+      auto call_id = ValueMap::Id(line_id);
 
-      std::stringstream converter(line);
+      auto &obj_set = valToObjs_[call_id];
 
-      int32_t obj_int_val;
-      converter >> obj_int_val;
-      while (!converter.fail()) {
+      for (auto obj_int_val : obj_ids) {
         auto obj_id = ValueMap::Id(obj_int_val);
 
         // If we have a universal value, we don't maintain dyn ptsto constraints
@@ -1084,9 +1151,6 @@ bool DynAliasLoader::runOnModule(llvm::Module &) {
         if (obj_id != ValueMap::NullValue) {
           obj_set.insert(obj_id);
         }
-
-
-        converter >> obj_int_val;
       }
     }
 
@@ -12,6 +12,8 @@
 #include <string>
 #include <sstream>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "llvm/Pass.h"
@@ -19,23 +21,27 @@
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Analysis/LoopInfo.h"
 
 #include "include/AllocInfo.h"
 #include "include/Cg.h"
 #include "include/ConstraintPass.h"
 #include "include/ExtInfo.h"
 #include "include/LLVMHelper.h"
+#include "include/ProfileFile.h"
 #include "include/lib/UnusedFunctions.h"
 
 static llvm::cl::opt<bool>
@@ -55,6 +61,18 @@ static llvm::cl::opt<bool>
       llvm::cl::desc("If set the dynamic information will be gathered without "
         "structure field information"));
 
+static llvm::cl::opt<bool>
+  dyn_ptsto_no_elide("dyn-ptsto-no-elide", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("If set every pointer is visited, instead of rebuilding "
+        "the ptstos of casts and phis from the values they come from"));
+
+static llvm::cl::opt<bool>
+  dyn_ptsto_sample("dyn-ptsto-sample", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("If set visits are guarded by the runtime's sample "
+        "counter, so runs can record bursts of them (set with SFS_SAMPLE)"));
+
 // First and last functions called
 static const std::string InitInstName = "__DynPtsto_do_init";
 static const std::string FinishInstName = "__DynPtsto_do_finish";
@@ -80,6 +98,186 @@ static const std::string GEPInstName = "__DynPtsto_do_gep";
 // Called on ptr returnin fcn
 static const std::string VisitInstName = "__DynPtsto_do_visit";
 
+// Thread-local count of visits to skip, when sampling
+static const std::string SampleSkipName = "__DynPtsto_sample_skip";
+
+// Visit elision {{{
+// Visits implied by other visits.  The instrumentation leaves them out, and
+//   DynPtstoLoader rebuilds their ptstos from the values they come from.  Both
+//   compute this from the uninstrumented module, so they agree.
+//   - Casts (and all zero index geps) see the same address as their operand
+//   - Phis see one of their incoming addresses, so their ptsto is within the
+//     union of their incoming values' (a superset of what a visit would have
+//     seen, so still safe to speculate on)
+typedef std::unordered_map<const llvm::Value *,
+        std::vector<const llvm::Value *>> ElidedVisits;
+
+static const llvm::Value *castSource(const llvm::Value *val) {
+  if (llvm::isa<llvm::BitCastInst>(val) ||
+      llvm::isa<llvm::AddrSpaceCastInst>(val)) {
+    auto src = llvm::cast<llvm::Instruction>(val)->getOperand(0);
+    if (llvm::isa<llvm::PointerType>(src->getType())) {
+      return src;
+    }
+  } else if (auto gep = dyn_cast<llvm::GetElementPtrInst>(val)) {
+    if (gep->hasAllZeroIndices()) {
+      return gep->getPointerOperand();
+    }
+  }
+
+  return nullptr;
+}
+
+static const llvm::Value *castRoot(const llvm::Value *val) {
+  while (auto src = castSource(val)) {
+    val = src;
+  }
+  return val;
+}
+
+// Values always visited where they are defined
+static bool isVisitRoot(const llvm::Value *val) {
+  if (auto arg = dyn_cast<llvm::Argument>(val)) {
+    // main's arguments are set up by main_init, not visited
+    return arg->getParent()->getName() != "main";
+  }
+
+  return llvm::isa<llvm::Instruction>(val) &&
+    llvm::isa<llvm::PointerType>(val->getType());
+}
+
+static void findElidedVisits(llvm::Module &m, ElidedVisits &elided) {
+  if (dyn_ptsto_no_elide) {
+    return;
+  }
+
+  for (auto &fcn : m) {
+    for (auto &inst : llvm::instructions(fcn)) {
+      if (!llvm::isa<llvm::PointerType>(inst.getType())) {
+        continue;
+      }
+
+      if (castSource(&inst) != nullptr) {
+        auto root = castRoot(&inst);
+        if (isVisitRoot(root)) {
+          elided[&inst].push_back(root);
+        }
+      } else if (auto phi = dyn_cast<llvm::PHINode>(&inst)) {
+        // Only from roots (never another elided phi), so the rebuild is one
+        //   step
+        std::vector<const llvm::Value *> srcs;
+        bool ok = true;
+        for (auto &in : phi->incoming_values()) {
+          if (llvm::isa<llvm::ConstantPointerNull>(in) ||
+              llvm::isa<llvm::UndefValue>(in)) {
+            continue;
+          }
+
+          auto root = castRoot(in);
+          if (!isVisitRoot(root) || llvm::isa<llvm::PHINode>(root)) {
+            ok = false;
+            break;
+          }
+          srcs.push_back(root);
+        }
+
+        if (ok) {
+          elided.emplace(phi, std::move(srcs));
+        }
+      }
+    }
+  }
+}
+
+// A loop which doesn't call, alloca, or split objects with a gep can't change
+//   the object at any address
+static bool loopChangesObjects(ModInfo &mod_info, const llvm::Loop *loop) {
+  for (auto bb : loop->blocks()) {
+    for (auto &inst : *bb) {
+      if (llvm::isa<llvm::AllocaInst>(inst)) {
+        return true;
+      }
+
+      if ((llvm::isa<llvm::CallInst>(inst) ||
+            llvm::isa<llvm::InvokeInst>(inst)) &&
+          !llvm::isa<llvm::IntrinsicInst>(inst)) {
+        return true;
+      }
+
+      if (auto gep = dyn_cast<llvm::GetElementPtrInst>(&inst)) {
+        if (!dyn_ptsto_no_gep && LLVMHelper::getGEPOffs(mod_info, *gep) > 0 &&
+            !LLVMHelper::gepIsArrayAccess(*gep)) {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+// Geps of loop invariant pointers, run on every trip through loops which
+//   can't change objects, see the same object on every iteration.  Their
+//   visits move to the outermost such loop's preheader (on a copy of the gep).
+static void findHoistedVisits(ModInfo &mod_info, llvm::Function &fcn,
+    const ElidedVisits &elided,
+    std::unordered_map<const llvm::Instruction *, llvm::BasicBlock *> &hoisted) {
+  if (dyn_ptsto_no_elide) {
+    return;
+  }
+
+  llvm::DominatorTree dom(fcn);
+  llvm::LoopInfo loops(dom);
+  if (loops.empty()) {
+    return;
+  }
+
+  std::unordered_map<const llvm::Loop *, bool> changes_objects;
+  auto can_hoist = [&] (const llvm::Loop *loop, llvm::Instruction *inst) {
+    if (loop->getLoopPreheader() == nullptr ||
+        !loop->hasLoopInvariantOperands(inst)) {
+      return false;
+    }
+
+    llvm::SmallVector<llvm::BasicBlock *, 4> exiting;
+    loop->getExitingBlocks(exiting);
+    if (exiting.empty()) {
+      return false;
+    }
+    for (auto bb : exiting) {
+      if (!dom.dominates(inst->getParent(), bb)) {
+        return false;
+      }
+    }
+
+    auto it = changes_objects.find(loop);
+    if (it == std::end(changes_objects)) {
+      it = changes_objects.emplace(loop,
+          loopChangesObjects(mod_info, loop)).first;
+    }
+    return !it->second;
+  };
+
+  for (auto &inst : llvm::instructions(fcn)) {
+    if (!llvm::isa<llvm::GetElementPtrInst>(inst) ||
+        elided.find(&inst) != std::end(elided)) {
+      continue;
+    }
+
+    llvm::Loop *target = nullptr;
+    for (auto loop = loops.getLoopFor(inst.getParent());
+        loop != nullptr && can_hoist(loop, &inst);
+        loop = loop->getParentLoop()) {
+      target = loop;
+    }
+
+    if (target != nullptr) {
+      hoisted[&inst] = target->getLoopPreheader();
+    }
+  }
+}
+//}}}
+
 // Instrument dyn ptsto info {{{
 class InstrDynPtsto : public llvm::ModulePass {
  public:
@@ -145,6 +343,13 @@ bool InstrDynPtsto::runOnModule(llvm::Module &m) {
 
   int32_t gep_id = 0;
 
+  ElidedVisits elided;
+  findElidedVisits(m, elided);
+
+  int32_t num_visits = 0;
+  int32_t num_elided = 0;
+  int32_t num_hoisted = 0;
+
   // Iterate each instruction, keeping lists
   for (auto &fcn : m) {
     // Ignore functions without bodies
@@ -152,6 +357,9 @@ bool InstrDynPtsto::runOnModule(llvm::Module &m) {
       continue;
     }
 
+    // Before we add any instrumentation to the loops
+    std::unordered_map<const llvm::Instruction *, llvm::BasicBlock *> hoisted;
+    findHoistedVisits(mod_info, fcn, elided, hoisted);
 
     int32_t fcn_num_allocas = 0;
     std::vector<llvm::Instruction *> ret_list;
@@ -265,6 +473,12 @@ bool InstrDynPtsto::runOnModule(llvm::Module &m) {
         // we now have first inst which isn't a phi
         // We add all of our phi inst calls here:
         for (auto &phi_inst : phi_list) {
+          if (elided.find(phi_inst) != std::end(elided)) {
+            num_elided++;
+            continue;
+          }
+          num_visits++;
+
           auto val_id = map.getDef(phi_inst);
           auto i8_ptr_val = new llvm::BitCastInst(phi_inst, i8_ptr_type);
           i8_ptr_val->insertBefore(inst);
@@ -280,9 +494,24 @@ bool InstrDynPtsto::runOnModule(llvm::Module &m) {
 
       // for Pointer returning instructions
       for (auto val : pointer_list) {
+        if (elided.find(val) != std::end(elided)) {
+          num_elided++;
+          continue;
+        }
+        num_visits++;
+
         // The return value is the val
         auto val_id = map.getDef(val);
 
+        // Visit a copy in the preheader instead
+        auto hoist_it = hoisted.find(val);
+        if (hoist_it != std::end(hoisted)) {
+          auto copy = val->clone();
+          copy->insertBefore(hoist_it->second->getTerminator());
+          val = copy;
+          num_hoisted++;
+        }
+
         // Make the call
         auto i8_ptr_val = val;
         if (val->getType() != i8_ptr_type) {
@@ -666,6 +895,28 @@ bool InstrDynPtsto::runOnModule(llvm::Module &m) {
   // Add initialization calls:
   addInitializationCalls(m);
 
+  llvm::dbgs() << "InstrDynPtsto: " << num_visits << " visits (" <<
+    num_hoisted << " hoisted from loops), " << num_elided << " elided\n";
+
+  // Only the visits are sampled, the allocations must all be tracked
+  if (dyn_ptsto_sample) {
+    auto skip = LLVMHelper::getSampleSkip(m, SampleSkipName);
+
+    std::vector<llvm::CallInst *> visits;
+    for (auto user : m.getFunction(VisitInstName)->users()) {
+      if (auto ci = dyn_cast<llvm::CallInst>(user)) {
+        visits.push_back(ci);
+      }
+    }
+
+    for (auto ci : visits) {
+      LLVMHelper::sampleCall(ci, skip);
+    }
+
+    llvm::dbgs() << "InstrDynPtsto: sampling " << visits.size() <<
+      " visits\n";
+  }
+
   // We modify all the stuff
   return true;
 }
@@ -1015,15 +1266,15 @@ void DynPtstoLoader::getAnalysisUsage(llvm::AnalysisUsage &au) const {
   au.setPreservesAll();
 }
 
-bool DynPtstoLoader::runOnModule(llvm::Module &) {
+bool DynPtstoLoader::runOnModule(llvm::Module &m) {
   // Setup map:
   const auto &cp = getAnalysis<ConstraintPass>();
   map_ = cp.getCG().vals();
 
   // Now optimize so its related to spec's
-  std::ifstream logfile(DynPtstoFilename);
+  ProfileReader logfile(DynPtstoFilename, ProfileKind::Ptsto);
   llvm::dbgs() << "Loading DynPtstoFile: " << DynPtstoFilename << "\n";
-  if (!logfile.is_open()) {
+  if (!logfile.isOpen()) {
     llvm::dbgs() << "DynPtstoLoader: no logfile loaded!\n";
     hasInfo_ = false;
   } else {
@@ -1034,20 +1285,27 @@ bool DynPtstoLoader::runOnModule(llvm::Module &) {
     // setupSpecSFSids(m);
 
 
-    for (std::string line; std::getline(logfile, line, ':'); ) {
-      int line_id = stoi(line);
-      auto call_id = ValueMap::Id(line_id);
+    // Values we don't maintain dyn ptsto constraints for
+    std::unordered_set<ValueMap::Id, ValueMap::Id::hasher> universal;
 
-      auto &obj_set = valToObjs_[call_id];
+    int64_t line_id;
+    std::vector<int64_t> obj_ids;
+    while (logfile.next(line_id, obj_ids)) {
+      if (line_id == ProfileCoverageKey) {
+        if (obj_ids.size() == 2 && obj_ids[1] > 0) {
+          sampleCoverage_ = static_cast<double>(obj_ids[0]) / obj_ids[1];
+        }
+        llvm::dbgs() << "DynPtstoLoader: sampled profile, coverage: " <<
+          sampleCoverage_ * 100 << "%\n";
+        continue;
+      }
 
-      std::getline(logfile, line);
+      auto call_id = ValueMap::Id(line_id);
 
-      std::stringstream converter(line);
+      auto &obj_set = valToObjs_[call_id];
 
-      int32_t obj_int_val;
-      converter >> obj_int_val;
       bool do_del = false;
-      while (!converter.fail()) {
+      for (auto obj_int_val : obj_ids) {
         if (obj_int_val == -1) {
           llvm::dbgs() << "WARNING: " << line_id <<
             " has val -1, ignoring!!!\n";
@@ -1066,16 +1324,18 @@ bool DynPtstoLoader::runOnModule(llvm::Module &) {
             break;
           }
         }
-        converter >> obj_int_val;
       }
 
       // If we have a universal value, we don't maintain dyn ptsto constraints
       //   for this variable
       if (do_del) {
         valToObjs_.erase(call_id);
+        universal.insert(call_id);
       }
     }
 
+    rebuildElided(m, universal);
+
     llvm::dbgs() << "printing!\n";
     if (print_dyn_ptsto) {
       int64_t total_variables = 0;
@@ -1122,6 +1382,47 @@ bool DynPtstoLoader::runOnModule(llvm::Module &) {
   return false;
 }
 
+// Fills in the ptstos of the visits the instrumentation elided
+void DynPtstoLoader::rebuildElided(llvm::Module &m,
+    std::unordered_set<ValueMap::Id, ValueMap::Id::hasher> &universal) {
+  ElidedVisits elided;
+  findElidedVisits(m, elided);
+
+  auto rebuild = [this, &universal] (const llvm::Value *val,
+      const std::vector<const llvm::Value *> &srcs) {
+    auto val_id = map_.getDef(val);
+    if (universal.find(val_id) != std::end(universal)) {
+      return;
+    }
+
+    for (auto src : srcs) {
+      auto src_id = map_.getDef(src);
+      if (universal.find(src_id) != std::end(universal)) {
+        valToObjs_.erase(val_id);
+        universal.insert(val_id);
+        return;
+      }
+
+      auto it = valToObjs_.find(src_id);
+      if (it != std::end(valToObjs_)) {
+        valToObjs_[val_id] |= it->second;
+      }
+    }
+  };
+
+  // Phis come from roots, and casts may come from phis, so phis go first
+  for (auto &pr : elided) {
+    if (llvm::isa<llvm::PHINode>(pr.first)) {
+      rebuild(pr.first, pr.second);
+    }
+  }
+  for (auto &pr : elided) {
+    if (!llvm::isa<llvm::PHINode>(pr.first)) {
+      rebuild(pr.first, pr.second);
+    }
+  }
+}
+
 char DynPtstoLoader::ID = 0;
 char DynPtstoAA::ID = 0;
 
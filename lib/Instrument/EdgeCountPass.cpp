@@ -14,6 +14,7 @@
 
 #include "include/util.h"
 #include "include/LLVMHelper.h"
+#include "include/ProfileFile.h"
 #include "include/lib/CallDests.h"
 #include "include/lib/CsCFG.h"
 #include "include/lib/ExitInst.h"
@@ -21,8 +22,12 @@
 #include "include/lib/IndirFcnTarget.h"
 
 #include "llvm/Pass.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
@@ -32,10 +37,329 @@ static llvm::cl::opt<std::string>
       llvm::cl::value_desc("filename"),
       llvm::cl::desc("Edge file saved/loaded by EdgeCountPass analysis"));
 
+static llvm::cl::opt<int32_t> //  NOLINT
+  edge_count_shards("edge-count-shards", llvm::cl::init(1),
+      llvm::cl::value_desc("int"),
+      llvm::cl::desc("Number of copies (a power of 2) of the edge counters, "
+        "threads are hashed across copies to reduce contention on hot "
+        "blocks"));
+
+static llvm::cl::opt<bool>
+  edge_span_tree("edge-span-tree", llvm::cl::init(false),
+      llvm::cl::desc("Count only the edges off of a maximum spanning tree of "
+        "each CFG, and recover the block counts by flow conservation (must "
+        "match between spec-edge-profiling and spec-edge-loader)"));
+
 static const std::string InitInstName = "__DynEdge_do_init";
 static const std::string FinishInstName = "__DynEdge_do_finish";
 
-static const std::string VisitInstName = "__DynEdge_do_visit";
+// The counters are emitted as globals, and read by the runtime at finish
+static const std::string CountsName = "__DynEdge_counts";
+static const std::string NumCountsName = "__DynEdge_num_counts";
+static const std::string NumShardsName = "__DynEdge_num_shards";
+static const std::string ShardMarkerName = "__DynEdge_shard_marker";
+
+// Spanning tree counter placement {{{
+// Knuth's optimal counter placement: each function's CFG gets a virtual exit
+//   node, an edge from every returning block to it, and an edge from it back to
+//   the entry, so the edge counts form a circulation.  Given the counts of the
+//   edges off of any spanning tree, flow conservation determines the rest, so
+//   only those edges are counted.  The tree is a maximum spanning tree over
+//   static (loop depth) weights, which keeps the hot edges uncounted.
+//
+// Both DynEdgeInst and DynEdgeLoader build the plan from the uninstrumented
+//   module, so they agree on the tree and on the counter ids.
+struct SpanEdge {
+  enum class Kind {
+    // The virtual exit -> entry edge, always on the tree
+    Entry,
+    // A CFG edge (dst == nullptr for an edge to the exit)
+    Real,
+    // Leaves a block with a call, for frames still live when exit() is called,
+    //   or ends in an unreachable.  Never counted, if off of the tree its
+    //   count is assumed to be 0
+    Fake
+  };
+
+  Kind kind;
+  llvm::BasicBlock *src;
+  llvm::BasicBlock *dst;
+  unsigned succ;
+  uint64_t weight;
+  bool tree = false;
+  int32_t id = -1;
+};
+
+struct SpanPlan {
+  // Set if an uncountable edge ended up off of the tree, the function then
+  //   counts its blocks instead
+  bool byBlock = false;
+  std::vector<SpanEdge> edges;
+  std::unordered_map<const llvm::BasicBlock *, int32_t> blockIds;
+};
+
+// Returns the instruction to insert a counter for edge before, or nullptr if
+//   the edge must be split first
+static llvm::Instruction *edgeInsertPos(const SpanEdge &edge) {
+  auto term = edge.src->getTerminator();
+  if (edge.dst == nullptr || term->getNumSuccessors() == 1) {
+    return term;
+  }
+
+  if (edge.dst->getSinglePredecessor() != nullptr) {
+    return &*edge.dst->getFirstInsertionPt();
+  }
+
+  return nullptr;
+}
+
+static bool canCountEdge(const SpanEdge &edge) {
+  if (edge.kind != SpanEdge::Kind::Real) {
+    return false;
+  }
+
+  auto term = edge.src->getTerminator();
+  if (llvm::isa<llvm::CatchSwitchInst>(term)) {
+    return false;
+  }
+
+  if (edge.dst == nullptr || term->getNumSuccessors() == 1) {
+    return true;
+  }
+
+  // Can't put a counter at the start of a funclet pad, or split an edge into
+  //   any pad
+  if (edge.dst->isEHPad()) {
+    return edge.dst->getSinglePredecessor() != nullptr &&
+      llvm::isa<llvm::LandingPadInst>(edge.dst->getFirstNonPHI());
+  }
+
+  return edge.dst->getSinglePredecessor() != nullptr ||
+    !llvm::isa<llvm::IndirectBrInst>(term);
+}
+
+static bool hasCall(const llvm::BasicBlock &bb) {
+  for (auto &inst : bb) {
+    llvm::ImmutableCallSite cs(&inst);
+    if (cs && !cs.isInlineAsm() && !llvm::isa<llvm::IntrinsicInst>(inst)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void buildSpanPlan(llvm::Function &fcn, SpanPlan &plan) {
+  static const uint64_t MaxWeight = std::numeric_limits<uint64_t>::max();
+
+  llvm::DominatorTree dom(fcn);
+  llvm::LoopInfo loops(dom);
+
+  // Node 0 is the exit, blocks are numbered from 1
+  std::unordered_map<const llvm::BasicBlock *, size_t> node_ids;
+  for (auto &bb : fcn) {
+    node_ids.emplace(&bb, node_ids.size() + 1);
+  }
+  auto node = [&node_ids] (const llvm::BasicBlock *bb) -> size_t {
+    return (bb == nullptr) ? 0 : node_ids.at(bb);
+  };
+
+  auto &edges = plan.edges;
+  edges.push_back({SpanEdge::Kind::Entry, nullptr, &fcn.getEntryBlock(), 0,
+      MaxWeight});
+
+  for (auto &bb : fcn) {
+    auto term = bb.getTerminator();
+    auto num_succs = term->getNumSuccessors();
+    for (unsigned i = 0; i < num_succs; ++i) {
+      auto succ = term->getSuccessor(i);
+      auto depth = std::min(loops.getLoopDepth(&bb),
+          loops.getLoopDepth(succ));
+      // Each loop level ~8x as hot
+      uint64_t weight = uint64_t(1) << (3 * std::min(depth, 20u));
+      edges.push_back({SpanEdge::Kind::Real, &bb, succ, i, weight});
+    }
+
+    // Nothing flows out of an unreachable, so there is nothing to count
+    if (llvm::isa<llvm::UnreachableInst>(term)) {
+      edges.push_back({SpanEdge::Kind::Fake, &bb, nullptr, 0, 0});
+    } else if (num_succs == 0) {
+      edges.push_back({SpanEdge::Kind::Real, &bb, nullptr, 0, 1});
+    }
+
+    if (hasCall(bb)) {
+      edges.push_back({SpanEdge::Kind::Fake, &bb, nullptr, 0,
+          MaxWeight - 2});
+    }
+  }
+
+  // Uncountable edges must go on the tree
+  for (auto &edge : edges) {
+    if (edge.kind == SpanEdge::Kind::Real && !canCountEdge(edge)) {
+      edge.weight = MaxWeight - 1;
+    }
+  }
+
+  // Kruskal's, stable so the tree only depends on the CFG
+  std::vector<size_t> order(edges.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(std::begin(order), std::end(order),
+      [&edges] (size_t lhs, size_t rhs) {
+    return edges[lhs].weight > edges[rhs].weight;
+  });
+
+  std::vector<size_t> parent(node_ids.size() + 1);
+  for (size_t i = 0; i < parent.size(); ++i) {
+    parent[i] = i;
+  }
+  auto find_rep = [&parent] (size_t id) {
+    while (parent[id] != id) {
+      parent[id] = parent[parent[id]];
+      id = parent[id];
+    }
+    return id;
+  };
+
+  for (auto idx : order) {
+    auto &edge = edges[idx];
+    auto src_rep = find_rep(node(edge.src));
+    auto dst_rep = find_rep(node(edge.dst));
+    if (src_rep != dst_rep) {
+      parent[src_rep] = dst_rep;
+      edge.tree = true;
+    } else if (edge.kind == SpanEdge::Kind::Real && !canCountEdge(edge)) {
+      plan.byBlock = true;
+    }
+  }
+}
+
+// Builds the plan for every function, and assigns the counter ids.  Returns
+//   the number of counters
+static size_t populateSpanPlans(llvm::Module &m,
+    std::unordered_map<const llvm::Function *, SpanPlan> &plans) {
+  int32_t id = 0;
+  for (auto &fcn : m) {
+    if (fcn.isDeclaration()) {
+      continue;
+    }
+
+    auto &plan = plans[&fcn];
+    buildSpanPlan(fcn, plan);
+
+    if (plan.byBlock) {
+      for (auto &bb : fcn) {
+        plan.blockIds[&bb] = id;
+        assert(id != std::numeric_limits<int32_t>::max());
+        id++;
+      }
+    } else {
+      for (auto &edge : plan.edges) {
+        if (!edge.tree && edge.kind == SpanEdge::Kind::Real) {
+          edge.id = id;
+          assert(id != std::numeric_limits<int32_t>::max());
+          id++;
+        }
+      }
+    }
+  }
+
+  return id;
+}
+
+// Recovers the block counts of fcn from the counts of its off-tree edges
+static void solveSpanPlan(llvm::Function &fcn, const SpanPlan &plan,
+    const std::vector<size_t> &raw_data,
+    std::unordered_map<const llvm::BasicBlock *, size_t> &counts) {
+  if (plan.byBlock) {
+    for (auto &pr : plan.blockIds) {
+      counts[pr.first] = raw_data[pr.second];
+    }
+    return;
+  }
+
+  std::unordered_map<const llvm::BasicBlock *, size_t> node_ids;
+  for (auto &bb : fcn) {
+    node_ids.emplace(&bb, node_ids.size() + 1);
+  }
+  auto node = [&node_ids] (const llvm::BasicBlock *bb) -> size_t {
+    return (bb == nullptr) ? 0 : node_ids.at(bb);
+  };
+
+  // Net known flow into each node, and its unknown (tree) edges
+  auto &edges = plan.edges;
+  std::vector<int64_t> edge_counts(edges.size(), 0);
+  std::vector<int64_t> net_in(node_ids.size() + 1, 0);
+  std::vector<std::vector<size_t>> unknown(node_ids.size() + 1);
+  for (size_t i = 0; i < edges.size(); ++i) {
+    auto &edge = edges[i];
+    if (edge.tree) {
+      unknown[node(edge.src)].push_back(i);
+      unknown[node(edge.dst)].push_back(i);
+    } else {
+      // Off-tree Fake edges have no counter, and are taken as 0.  An
+      //   unreachable is never left, but a call edge is only 0 if no frame of
+      //   fcn is still live when exit() is called (or longjmp()s out of it).
+      //   Otherwise the missing flow lands on the tree edges around the call.
+      if (edge.kind == SpanEdge::Kind::Real) {
+        edge_counts[i] = raw_data[edge.id];
+      }
+      net_in[node(edge.dst)] += edge_counts[i];
+      net_in[node(edge.src)] -= edge_counts[i];
+    }
+  }
+
+  // Peel the tree's leaves: a node with one unknown edge determines it
+  std::vector<bool> solved(edges.size(), false);
+  std::vector<size_t> work;
+  for (size_t i = 0; i < unknown.size(); ++i) {
+    if (unknown[i].size() == 1) {
+      work.push_back(i);
+    }
+  }
+
+  while (!work.empty()) {
+    auto cur = work.back();
+    work.pop_back();
+
+    auto it = std::find_if(std::begin(unknown[cur]), std::end(unknown[cur]),
+        [&solved] (size_t idx) { return !solved[idx]; });
+    if (it == std::end(unknown[cur])) {
+      continue;
+    }
+    auto idx = *it;
+    solved[idx] = true;
+
+    auto &edge = edges[idx];
+    auto src = node(edge.src);
+    auto dst = node(edge.dst);
+    auto other = (cur == dst) ? src : dst;
+    // Flow in == flow out at cur
+    edge_counts[idx] = (cur == dst) ? -net_in[cur] : net_in[cur];
+    net_in[dst] += edge_counts[idx];
+    net_in[src] -= edge_counts[idx];
+
+    auto remaining = std::count_if(std::begin(unknown[other]),
+        std::end(unknown[other]),
+        [&solved] (size_t id) { return !solved[id]; });
+    if (remaining == 1) {
+      work.push_back(other);
+    }
+  }
+
+  // A block runs once per entering edge
+  for (auto &bb : fcn) {
+    counts[&bb] = 0;
+  }
+  for (size_t i = 0; i < edges.size(); ++i) {
+    auto dst = edges[i].dst;
+    // Negative counts can only come from inconsistent profiles
+    if (dst != nullptr && edge_counts[i] > 0) {
+      counts[dst] += edge_counts[i];
+    }
+  }
+}
+//}}}
 
 class DynEdgeInst : public llvm::ModulePass {
  public:
@@ -53,20 +377,33 @@ class DynEdgeInst : public llvm::ModulePass {
  private:
   llvm::Function *getInitFcn(llvm::Module &m);
   llvm::Function *getFinishFcn(llvm::Module &m);
-  llvm::Function *getVisitFcn(llvm::Module &m);
 
   void setupTypes(llvm::Module &m);
   void addInitFunctions(llvm::Module &m);
-  void callVisit(llvm::Module &m, llvm::BasicBlock *bb);
+  void addCounters(llvm::Module &m);
+  llvm::Value *getShardBase(llvm::Instruction *insert_pos);
+  void addIncrement(int32_t id, llvm::Value *shard_base,
+      llvm::Instruction *insert_pos);
+  void countBlocks(llvm::Function &fcn,
+      const std::unordered_map<const llvm::BasicBlock *, int32_t> &bb_to_id);
+  void countEdges(llvm::Function &fcn, const SpanPlan &plan);
 
   std::unordered_map<const llvm::BasicBlock *, int32_t> bbToId_;
+  std::unordered_map<const llvm::Function *, SpanPlan> spanPlans_;
+  size_t numCounts_ = 0;
 
   llvm::Type *voidType_;
   llvm::Type *int32Type_;
+  llvm::Type *int64Type_;
+
+  uint32_t numShards_ = 1;
+  uint32_t shardBits_ = 0;
+
+  llvm::GlobalVariable *counts_ = nullptr;
+  llvm::GlobalVariable *shardMarker_ = nullptr;
 
   llvm::Function *initFcn_ = nullptr;
   llvm::Function *finishFcn_ = nullptr;
-  llvm::Function *visitFcn_ = nullptr;
 };
 
 static void populateBBMap(llvm::Module &m,
@@ -96,6 +433,7 @@ void DynEdgeInst::getAnalysisUsage(llvm::AnalysisUsage &) const {
 
 void DynEdgeInst::setupTypes(llvm::Module &m) {
   int32Type_ = llvm::IntegerType::get(m.getContext(), 32);
+  int64Type_ = llvm::IntegerType::get(m.getContext(), 64);
   voidType_ = llvm::Type::getVoidTy(m.getContext());
 }
 
@@ -127,52 +465,182 @@ llvm::Function *DynEdgeInst::getFinishFcn(llvm::Module &m) {
   return finishFcn_;
 }
 
-llvm::Function *DynEdgeInst::getVisitFcn(llvm::Module &m) {
-  if (visitFcn_ == nullptr) {
-    std::vector<llvm::Type *> visit_args = { int32Type_ };
-    auto fcn_type = llvm::FunctionType::get(
-        voidType_,
-        visit_args,
-        false);
-    visitFcn_ = llvm::Function::Create(fcn_type,
-        llvm::GlobalValue::ExternalLinkage,
-        VisitInstName, &m);
-  }
-  return visitFcn_;
-}
-
 void DynEdgeInst::addInitFunctions(llvm::Module &m) {
   LLVMHelper::callAtEntry(m, getInitFcn(m), { });
   // LLVMHelper::callAtExit(m, getFinishFcn(m));
 }
 
-void DynEdgeInst::callVisit(llvm::Module &m, llvm::BasicBlock *bb) {
-  std::vector<llvm::Value *> args =
-      { llvm::ConstantInt::get(int32Type_, bbToId_.at(bb)) };
+// Emits the (zeroed) counter array, numShards_ copies of one counter per bb,
+//   and its sizes for the runtime
+void DynEdgeInst::addCounters(llvm::Module &m) {
+  int32_t requested = edge_count_shards;
+  while (numShards_ < static_cast<uint32_t>(std::max(requested, 1))) {
+    numShards_ <<= 1;
+    shardBits_++;
+  }
+  if (numShards_ != static_cast<uint32_t>(requested)) {
+    llvm::dbgs() << "WARNING: edge-count-shards must be a power of 2, using: "
+      << numShards_ << "\n";
+  }
+
+  auto num_counts = numCounts_;
+  auto array_type = llvm::ArrayType::get(int64Type_, num_counts * numShards_);
+  counts_ = new llvm::GlobalVariable(m,
+      array_type,
+      false,
+      llvm::GlobalValue::ExternalLinkage,
+      llvm::Constant::getNullValue(array_type),
+      CountsName);
+
+  new llvm::GlobalVariable(m,
+      int32Type_,
+      true,
+      llvm::GlobalValue::ExternalLinkage,
+      llvm::ConstantInt::get(int32Type_, num_counts),
+      NumCountsName);
+
+  new llvm::GlobalVariable(m,
+      int32Type_,
+      true,
+      llvm::GlobalValue::ExternalLinkage,
+      llvm::ConstantInt::get(int32Type_, numShards_),
+      NumShardsName);
+
+  // Each thread has its own copy of the marker, so its address identifies the
+  //   thread without any runtime registration
+  if (numShards_ > 1) {
+    shardMarker_ = new llvm::GlobalVariable(m,
+        llvm::IntegerType::get(m.getContext(), 8),
+        false,
+        llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantInt::get(llvm::IntegerType::get(m.getContext(), 8), 0),
+        ShardMarkerName,
+        nullptr,
+        llvm::GlobalVariable::InitialExecTLSModel);
+  }
+}
+
+// Computes this thread's first counter index, once per function call
+llvm::Value *DynEdgeInst::getShardBase(llvm::Instruction *insert_pos) {
+  if (numShards_ == 1) {
+    return llvm::ConstantInt::get(int64Type_, 0);
+  }
 
-  auto insert_pos = bb->getFirstNonPHIOrDbg();
+  // Fibonacci hash of the thread's marker address
+  auto addr = new llvm::PtrToIntInst(shardMarker_, int64Type_, "", insert_pos);
+  auto hash = llvm::BinaryOperator::Create(llvm::Instruction::Mul, addr,
+      llvm::ConstantInt::get(int64Type_, 0x9E3779B97F4A7C15ULL), "",
+      insert_pos);
+  auto shard = llvm::BinaryOperator::Create(llvm::Instruction::LShr, hash,
+      llvm::ConstantInt::get(int64Type_, 64 - shardBits_), "", insert_pos);
+  return llvm::BinaryOperator::Create(llvm::Instruction::Mul, shard,
+      llvm::ConstantInt::get(int64Type_, numCounts_), "", insert_pos);
+}
 
-  // Insert here...
-  auto visit_fcn = getVisitFcn(m);
+void DynEdgeInst::addIncrement(int32_t id,
+    llvm::Value *shard_base, llvm::Instruction *insert_pos) {
+  llvm::Value *idx = llvm::ConstantInt::get(int64Type_, id);
+  if (!llvm::isa<llvm::Constant>(shard_base) ||
+      !llvm::cast<llvm::Constant>(shard_base)->isNullValue()) {
+    idx = llvm::BinaryOperator::Create(llvm::Instruction::Add, shard_base, idx,
+        "", insert_pos);
+  }
 
-  llvm::CallInst::Create(visit_fcn, args, "", insert_pos);
+  llvm::Value *gep_indicies[] = {
+    llvm::ConstantInt::get(int32Type_, 0),
+    idx
+  };
+  auto counter = llvm::GetElementPtrInst::CreateInBounds(
+      counts_->getValueType(), counts_,
+      gep_indicies, "", insert_pos);
+
+  // Relaxed, we only need the counts to be exact once the threads finish
+  new llvm::AtomicRMWInst(llvm::AtomicRMWInst::Add, counter,
+      llvm::ConstantInt::get(int64Type_, 1),
+      llvm::AtomicOrdering::Monotonic, llvm::SyncScope::System,
+      insert_pos);
 }
 
+void DynEdgeInst::countBlocks(llvm::Function &fcn,
+    const std::unordered_map<const llvm::BasicBlock *, int32_t> &bb_to_id) {
+  // Grab the insert points first, so the entry's increment lands after the
+  //   shard computation
+  std::vector<std::pair<llvm::BasicBlock *, llvm::Instruction *>> positions;
+  for (auto &bb : fcn) {
+    positions.emplace_back(&bb, bb.getFirstNonPHIOrDbg());
+  }
+
+  auto shard_base = getShardBase(positions.front().second);
+  for (auto &pr : positions) {
+    addIncrement(bb_to_id.at(pr.first), shard_base, pr.second);
+  }
+}
+
+void DynEdgeInst::countEdges(llvm::Function &fcn, const SpanPlan &plan) {
+  auto shard_base = getShardBase(fcn.getEntryBlock().getFirstNonPHIOrDbg());
+
+  for (auto &edge : plan.edges) {
+    if (edge.id < 0) {
+      continue;
+    }
+
+    auto insert_pos = edgeInsertPos(edge);
+    if (insert_pos == nullptr) {
+      // canCountEdge() keeps the edges LLVM won't split on the tree, so this
+      //   shouldn't fail.  If it does the edge goes uncounted, and the loader
+      //   reads it as 0 (skewing this function's counts, not breaking it)
+      auto split = llvm::SplitCriticalEdge(edge.src->getTerminator(),
+          edge.succ);
+      if (split == nullptr) {
+        llvm::dbgs() << "WARNING: Couldn't split edge " <<
+          edge.src->getName() << " -> " << edge.dst->getName() << " in " <<
+          fcn.getName() << ", not counting it\n";
+        continue;
+      }
+      insert_pos = split->getTerminator();
+    }
+
+    addIncrement(edge.id, shard_base, insert_pos);
+  }
+}
 
 bool DynEdgeInst::runOnModule(llvm::Module &m) {
   setupTypes(m);
 
-  populateBBMap(m, bbToId_);
+  // Plan on the uninstrumented module, the loader will see the same one
+  if (edge_span_tree) {
+    numCounts_ = populateSpanPlans(m, spanPlans_);
+  } else {
+    populateBBMap(m, bbToId_);
+    numCounts_ = bbToId_.size();
+  }
 
   addInitFunctions(m);
 
-  // Now, iterate all bbs:
+  addCounters(m);
+
+  size_t num_blocks = 0;
   for (auto &fcn : m) {
-    for (auto &bb : fcn) {
-      callVisit(m, &bb);
+    if (fcn.isDeclaration()) {
+      continue;
+    }
+    num_blocks += fcn.size();
+
+    if (edge_span_tree) {
+      auto &plan = spanPlans_.at(&fcn);
+      if (plan.byBlock) {
+        countBlocks(fcn, plan.blockIds);
+      } else {
+        countEdges(fcn, plan);
+      }
+    } else {
+      countBlocks(fcn, bbToId_);
     }
   }
 
+  llvm::dbgs() << "DynEdgeInst: " << numCounts_ << " counters for " <<
+    num_blocks << " blocks\n";
+
   // Make sure to detect all exit conditions
   ExitInst ei(m, getFinishFcn(m));
   ei.addShims();
@@ -196,35 +664,48 @@ void DynEdgeLoader::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
 
 bool DynEdgeLoader::runOnModule(llvm::Module &m) {
   std::unordered_map<const llvm::BasicBlock *, int32_t> bb_map;
-  populateBBMap(m, bb_map);
+  std::unordered_map<const llvm::Function *, SpanPlan> span_plans;
+  size_t num_counts;
+  if (edge_span_tree) {
+    num_counts = populateSpanPlans(m, span_plans);
+  } else {
+    populateBBMap(m, bb_map);
+    num_counts = bb_map.size();
+  }
 
   // id to count
-  std::vector<size_t> raw_data(bb_map.size(), 0);
+  std::vector<size_t> raw_data(num_counts, 0);
 
   // Load the datafile
-  std::ifstream logfile(DynEdgeFilename, std::ifstream::in);
+  ProfileReader logfile(DynEdgeFilename, ProfileKind::Edge);
   // If we actually managed to get data...
-  if (logfile.good()) {
+  if (logfile.isOpen()) {
     llvm::dbgs() << "DynEdgeLoader: Successfully Loaded!\n";
 
-    // Then, load the lines of callstacks
-    for (std::string line; std::getline(logfile, line); ) {
-      std::stringstream converter(line);
-
-      int32_t id;
-      int32_t count;
-
-      // Pump converter into id and count
-      converter >> id;
-      converter >> count;
+    // Then, load the counts
+    int64_t id;
+    std::vector<int64_t> count;
+    while (logfile.next(id, count)) {
+      if (count.size() != 1 || id < 0 ||
+          static_cast<size_t>(id) >= raw_data.size()) {
+        llvm::dbgs() << "WARNING: Bad edge count record for: " << id << "\n";
+        continue;
+      }
 
       // += so we can handle files merged w/ cats
-      raw_data[id] += count;
+      raw_data[id] += count[0];
 
       loaded_ = true;
     }
 
     // Now, index the data
+    for (auto &fcn : m) {
+      auto it = span_plans.find(&fcn);
+      if (it != std::end(span_plans)) {
+        solveSpanPlan(fcn, it->second, raw_data, executionCounts_);
+      }
+    }
+
     for (auto &pr : bb_map) {
       auto bb = pr.first;
       auto id = pr.second;
@@ -30,6 +30,7 @@
 #include "llvm/Support/MathExtras.h"
 
 #include "include/LLVMHelper.h"
+#include "include/ProfileFile.h"
 
 static llvm::cl::opt<std::string>
   IndirFcnFilename("indir-info-file", llvm::cl::init("dyn_indir.log"),
@@ -334,16 +335,16 @@ bool IndirFunctionInfo::runOnModule(llvm::Module &m) {
   }
 
   // Now that we know the id mappings, lets parse our input file
-  std::ifstream logfile(logfilename);
-  if (!logfile.is_open()) {
+  ProfileReader logfile(logfilename, ProfileKind::Indir);
+  if (!logfile.isOpen()) {
     llvm::dbgs() << "IndirFcnInfo: no logfile found!\n";
     hasInfo_ = false;
   } else {
     llvm::dbgs() << "IndirFcnInfo: Successfully Loaded\n";
     hasInfo_ = true;
-    for (std::string line; std::getline(logfile, line, ':'); ) {
-      // First parse the first int till the :
-      int32_t call_id = stoi(line);
+    int64_t call_id;
+    std::vector<int64_t> fcn_ids;
+    while (logfile.next(call_id, fcn_ids)) {
       auto call = id_to_call[call_id];
       /*
       llvm::dbgs() << "Parsing indir id: " << call_id << ": " <<
@@ -366,14 +367,7 @@ bool IndirFunctionInfo::runOnModule(llvm::Module &m) {
       auto it = rc.first;
       auto &fcn_vec = it->second;
 
-      std::getline(logfile, line);
-      // Now split the line...
-      std::stringstream converter(line);
-      for (auto it = std::istream_iterator<uint32_t>(converter),
-                en = std::istream_iterator<uint32_t>();
-                it != en;
-                ++it) {
-        auto fcn_id = *it;
+      for (auto fcn_id : fcn_ids) {
         auto fcn = cast<llvm::Function>(id_to_fcn[fcn_id]);
 
         fcn_vec.push_back(fcn);
@@ -2,6 +2,7 @@
  * Copyright (C) 2015 David Devecsery
  */
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -12,8 +13,11 @@
 #include <cstring>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <map>
 #include <memory>
@@ -26,6 +30,15 @@
 #include <utility>
 #include <vector>
 
+#include "include/AllocaStack.h"
+#include "include/GranuleShadow.h"
+#include "include/ProfileFile.h"
+#include "include/ProfileFlusher.h"
+#include "include/SampleWindow.h"
+#include "include/SharedProfile.h"
+#include "include/SiteCache.h"
+#include "include/ThreadRecords.h"
+
 #ifndef NDEBUG
 #  define if_debug_enabled(...) __VA_ARGS__
 #else
@@ -58,7 +71,9 @@ class AddressMap {
 
   static const size_t NumPages = (1 << Level0Bits);
 
-  // An internal page class
+  // An internal page class.  Pages are installed with a CAS, so threads
+  //   storing to (and loading from) the map never take a lock.  Pages are
+  //   never freed, as threads may still be using them at exit.
   template <typename next_page, size_t bits>
   class ShadowPageInternal {
     //{{{
@@ -69,36 +84,24 @@ class AddressMap {
     static const size_t ShiftSize = next_page::ShiftSize + bits;
 
     value_type get(uintptr_t addr) const {
-      auto mask_addr = addrMask(addr);
+      auto page = map_[addrMask(addr)].load(std::memory_order_acquire);
 
-      if (map_[mask_addr] == nullptr) {
+      if (page == nullptr) {
         return InvalidValue;
       }
 
-      return map_[mask_addr]->get(addr);
+      return page->get(addr);
     }
 
     void set(value_type val, uintptr_t addr) {
-      auto mask_addr = addrMask(addr);
-
-      if (map_[mask_addr] == nullptr) {
-        map_[mask_addr] = std::unique_ptr<next_page>(new next_page());
-      }
-
-      map_[mask_addr]->set(val, addr);
+      getPage(addr)->set(val, addr);
     }
 
     size_t set(value_type val, uintptr_t addr, size_t size) {
       size_t orig_size = size;
 
       while (size) {
-        auto mask_addr = addrMask(addr);
-
-        if (map_[mask_addr] == nullptr) {
-          map_[mask_addr] = std::unique_ptr<next_page>(new next_page());
-        }
-
-        size_t set_size = map_[mask_addr]->set(val, addr, size);
+        size_t set_size = getPage(addr)->set(val, addr, size);
 
         addr += set_size;
         size -= set_size;
@@ -112,11 +115,28 @@ class AddressMap {
       return (addr >> next_page::ShiftSize) & Mask;
     }
 
-    std::array<std::unique_ptr<next_page>, PageSize> map_;
+    next_page *getPage(uintptr_t addr) {
+      auto &slot = map_[addrMask(addr)];
+      auto page = slot.load(std::memory_order_acquire);
+      if (page == nullptr) {
+        auto new_page = new next_page();
+        if (slot.compare_exchange_strong(page, new_page,
+              std::memory_order_acq_rel)) {
+          page = new_page;
+        } else {
+          delete new_page;
+        }
+      }
+
+      return page;
+    }
+
+    std::array<std::atomic<next_page *>, PageSize> map_{};
     //}}}
   };
 
-  // A specialization for our bottom-level page
+  // A specialization for our bottom-level page.  Entries are relaxed atomics,
+  //   racing stores from different threads leave one of their ids.
   template<size_t bits>
   class ShadowPageInternal<value_type, bits> {
     //{{{
@@ -129,13 +149,13 @@ class AddressMap {
     value_type get(uintptr_t addr) const {
       auto mask_addr = addr & Mask;
 
-      return map_[mask_addr];
+      return map_[mask_addr].load(std::memory_order_relaxed);
     }
 
     void set(value_type val, uintptr_t addr) {
       auto mask_addr = addr & Mask;
 
-      map_[mask_addr] = val;
+      map_[mask_addr].store(val, std::memory_order_relaxed);
     }
 
     size_t set(value_type val, uintptr_t addr, size_t size) {
@@ -144,17 +164,14 @@ class AddressMap {
       size = std::min(size, PageSize - mask_size);
       assert(size <= PageSize);
 
-      auto it = std::begin(map_);
-      std::advance(it, mask_size);
-      auto en = it;
-      std::advance(en, size);
-
-      std::fill(it, en, val);
+      for (size_t i = mask_size; i < mask_size + size; ++i) {
+        map_[i].store(val, std::memory_order_relaxed);
+      }
       return size;
     }
 
    private:
-    std::array<value_type, PageSize> map_;
+    std::array<std::atomic<value_type>, PageSize> map_;
     //}}}
   };
 
@@ -199,24 +216,168 @@ class AddressMap {
 
 // std::mutex inst_lock;
 
-static AddressMap<int32_t> map;
+// Granule shadow {{{
+// The default shadow is a GranuleShadow (see include/GranuleShadow.h) of 8
+//   byte granules, or DYNALIAS_GRANULE.  Large frees give their shadow back,
+//   so it reads as 0 afterwards instead of InvalidValue (the loader ignores
+//   both).
+//
+// The page-table AddressMap is kept as a fallback, select it with
+//   DYNALIAS_BACKEND=pages (it is also used if the reservation fails).
+static AddressMap<int32_t> page_map;
+static GranuleShadow granule_map;
+
+static bool use_granules() {
+  static const bool granules = [] {
+    const char *backend = getenv("DYNALIAS_BACKEND");
+    if (backend != nullptr && strcmp(backend, "pages") == 0) {
+      return false;
+    }
 
-std::unordered_map<int32_t, std::set<int32_t>> load_to_store_alias;
+    size_t granule = 8;
+    const char *granule_env = getenv("DYNALIAS_GRANULE");
+    if (granule_env != nullptr) {
+      granule = strtoull(granule_env, nullptr, 10);
+    }
 
-std::unordered_map<void *, size_t> allocs;
+    if (!granule_map.init(granule)) {
+      std::cerr << "WARNING: Couldn't reserve a DynAlias shadow of " <<
+        granule << " byte granules, using pages\n";
+      return false;
+    }
+    return true;
+  }();
 
-thread_local std::vector<std::vector<void *>> stack_allocs;
-// Used to pop jmp_env's from the stack on pop
-thread_local std::vector<std::vector<std::map<void *, std::pair<size_t, size_t>>::iterator>> stack_longjmps;  // NOLINT
-// Used to lookup the stack location jumped to
-thread_local std::map<void *, std::pair<size_t, size_t>> longjmps;  // NOLINT
+  return granules;
+}
+
+static int32_t shadow_get(void *addr) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  return use_granules() ? granule_map.get(start) : page_map.get(start);
+}
+
+static void shadow_set(int32_t val, void *addr, size_t size) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  if (use_granules()) {
+    granule_map.set(val, start, size);
+  } else {
+    page_map.set(val, start, size);
+  }
+}
 
+static void shadow_clear(void *addr, size_t size) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  if (use_granules()) {
+    granule_map.clear(start, size);
+  } else {
+    page_map.set(AddressMap<int32_t>::InvalidValue, start, size);
+  }
+}
+//}}}
 
 extern "C" {
+// Emitted by InstrDynAlias: loads are passed by their index, and
+//   __DynAlias_load_ids maps each index to the load's value id
+extern const int32_t __DynAlias_load_ids[];
+extern const int32_t __DynAlias_num_loads;
+}
 
-void __DynAlias_do_init() { }
+// The stores each load was seen reading from, recorded per thread.  Indexed by
+//   load index, each load holds its sorted store ids (loads read from few
+//   stores, so a small array beats a std::set)
+typedef std::vector<std::vector<int32_t>> AliasRecords;
 
-void __DynAlias_do_finish() {
+static void insert_store(std::vector<int32_t> &stores, int32_t store_id) {
+  auto it = std::lower_bound(std::begin(stores), std::end(stores), store_id);
+  if (it == std::end(stores) || *it != store_id) {
+    stores.insert(it, store_id);
+  }
+}
+
+static void merge_alias(AliasRecords &into, AliasRecords &from) {
+  into.resize(std::max(into.size(), from.size()));
+  std::vector<int32_t> merged;
+  for (size_t i = 0; i < from.size(); ++i) {
+    auto &from_stores = from[i];
+    if (from_stores.empty()) {
+      continue;
+    }
+
+    auto &into_stores = into[i];
+    merged.clear();
+    std::set_union(std::begin(into_stores), std::end(into_stores),
+        std::begin(from_stores), std::end(from_stores),
+        std::back_inserter(merged));
+    into_stores.swap(merged);
+    from_stores.clear();
+  }
+}
+
+static ThreadRecords<AliasRecords> &alias_records() {
+  static auto &records = ThreadRecords<AliasRecords>::create(merge_alias);
+  return records;
+}
+
+extern "C" {
+// The loads left to skip, decremented by the instrumentation when it is built
+//   with -dyn-alias-sample
+thread_local int32_t __DynAlias_sample_skip = 0;
+}
+
+static SampleWindow &sampler() {
+  static SampleWindow window("SFS_SAMPLE");
+  return window;
+}
+
+static thread_local SampleWindow::Local sample_local;
+
+// The records of this process and its forks, with SFS_SHARED_PROFILE
+static SharedProfile *shared = nullptr;
+// The sampler's totals, added by each process as it exits
+static const size_t SharedSampled = 0;
+static const size_t SharedLoads = 1;
+static const size_t NumSharedCounters = 2;
+
+// The sampler's totals as of the last flush (see flush_delta)
+static uint64_t last_sampled = 0;
+static uint64_t last_loads = 0;
+
+static void reset_after_fork() {
+  sampler().reset(sample_local);
+  last_sampled = 0;
+  last_loads = 0;
+}
+
+// The store each load last read from, so repeated loads skip the records
+static thread_local SiteCache load_cache;
+
+static SiteCacheStats &cache_stats() {
+  static SiteCacheStats stats;
+  return stats;
+}
+
+// Heap objects may be freed by a different thread than allocated them, so
+//   their sizes are shared.  Only touched by malloc/free, and sharded so
+//   threads rarely contend.
+struct HeapShard {
+  std::mutex lock;
+  std::unordered_map<void *, size_t> sizes;
+};
+static const size_t NumHeapShards = 64;
+static std::array<HeapShard, NumHeapShards> heap_sizes;
+
+static HeapShard &heap_shard(void *addr) {
+  return heap_sizes[(reinterpret_cast<uintptr_t>(addr) >> 4) % NumHeapShards];
+}
+
+// Each alloca is kept with its size, so ret can clear it without a lookup
+typedef AllocaStack<std::pair<void *, size_t>> StackAllocs;
+thread_local StackAllocs stack_allocs;
+// The stack position saved by each jmp_env's setjmp
+thread_local std::unordered_map<void *, StackAllocs::Marker> longjmps;
+
+
+static const char *log_name() {
   const char *logname = "profile.alias";
 
   char *envname = getenv("SFS_LOGFILE");
@@ -224,6 +385,60 @@ void __DynAlias_do_finish() {
     logname = envname;
   }
 
+  return logname;
+}
+
+// Writes out counts, sorted by load value id so logs can be stream merged
+static void write_alias(const std::string &outfilename,
+    AliasRecords &load_to_store_alias, bool sampled, uint64_t num_sampled,
+    uint64_t num_loads) {
+  ProfileWriter ofil(outfilename, ProfileKind::Alias);
+
+  if (sampled) {
+    ofil.writeCoverage(num_sampled, num_loads);
+  }
+
+  std::vector<std::pair<int32_t, size_t>> load_ids;
+  for (size_t i = 0; i < load_to_store_alias.size(); ++i) {
+    if (!load_to_store_alias[i].empty()) {
+      load_ids.emplace_back(__DynAlias_load_ids[i], i);
+    }
+  }
+  std::sort(std::begin(load_ids), std::end(load_ids));
+
+  for (auto &load_pr : load_ids) {
+    auto &stores = load_to_store_alias[load_pr.second];
+    ofil.writeSet(load_pr.first, std::begin(stores), std::end(stores));
+  }
+}
+
+// Writes the records since the last flush, with the loads sampled since
+static void flush_delta(uint64_t seq) {
+  AliasRecords delta;
+  alias_records().drain(delta);
+
+  uint64_t num_sampled = sampler().sampled();
+  uint64_t num_loads = sampler().total();
+
+  write_alias(ProfileFlusher::deltaName(log_name(), seq), delta,
+      sampler().enabled(), num_sampled - last_sampled, num_loads - last_loads);
+
+  last_sampled = num_sampled;
+  last_loads = num_loads;
+}
+
+extern "C" {
+
+void __DynAlias_do_init() {
+  shared = SharedProfile::create(NumSharedCounters, reset_after_fork);
+  ProfileFlusher::start(flush_delta);
+}
+
+void __DynAlias_do_finish() {
+  ProfileFlusher::stop(flush_delta);
+
+  const char *logname = log_name();
+
   std::ostringstream outfilename;
 
   outfilename << logname << "." << getpid();
@@ -253,18 +468,61 @@ void __DynAlias_do_finish() {
   }
   */
 
-  // Now, create the outfile
-  std::ofstream ofil(outfilename.str());
+  auto load_to_store_alias = alias_records().harvest();
+
+  if (cache_stats().enabled()) {
+    cache_stats().print("DynAlias", 10);
+
+    if (use_granules()) {
+      fprintf(stderr, "DynAlias: shadow RSS %zu kB (%zu byte granules), "
+          "%zu kB for %zu split granules\n", granule_map.rss() / 1024,
+          granule_map.granule(), granule_map.splitRss() / 1024,
+          granule_map.numSplits());
+    }
+  }
 
-  // Write out counts:
-  for (auto &val_pr : load_to_store_alias) {
-    ofil << val_pr.first << ":";
+  bool sampled = sampler().enabled();
+  if (sampled) {
+    sampler().flush(sample_local);
+  }
+  uint64_t num_sampled = sampler().sampled();
+  uint64_t num_loads = sampler().total();
+
+  // Only the last process to exit writes the shared records, the others
+  //   only write what didn't fit in them.  Those also write their own sampler
+  //   totals, rather than adding them to the shared ones, so each process's
+  //   loads are covered once.
+  if (shared != nullptr) {
+    bool overflowed = std::any_of(std::begin(load_to_store_alias),
+        std::end(load_to_store_alias),
+        [] (const std::vector<int32_t> &stores) {
+      return !stores.empty();
+    });
+    if (!overflowed) {
+      shared->add(SharedSampled, num_sampled);
+      shared->add(SharedLoads, num_loads);
+    }
 
-    for (int32_t id : val_pr.second) {
-      ofil << " " << id;
+    if (shared->leave()) {
+      if (overflowed) {
+        shared->add(SharedSampled, num_sampled);
+        shared->add(SharedLoads, num_loads);
+      }
+      load_to_store_alias.resize(__DynAlias_num_loads);
+      shared->forEach([&load_to_store_alias] (int32_t load_idx,
+          int32_t store_id) {
+        insert_store(load_to_store_alias[load_idx], store_id);
+      });
+      num_sampled = shared->count(SharedSampled);
+      num_loads = shared->count(SharedLoads);
+    } else if (!overflowed) {
+      return;
     }
-    ofil << std::endl;
   }
+
+  // Now, create the outfile
+  write_alias(outfilename.str(), load_to_store_alias, sampled, num_sampled,
+      num_loads);
 }
 
 void __DynAlias_do_malloc(int32_t obj_id, int64_t size,
@@ -300,8 +558,7 @@ void __DynAlias_main_init3(int32_t argv_id, int32_t arg_id,
 
 void __DynAlias_do_call() {
   // Push a frame on the "stack"
-  stack_allocs.emplace_back();
-  stack_longjmps.emplace_back();
+  stack_allocs.call();
 }
 
 void __DynAlias_do_alloca(int32_t, int64_t size,
@@ -318,7 +575,7 @@ void __DynAlias_do_alloca(int32_t, int64_t size,
   // Handle alloca
   // Add addresses to stack frame
   // std::cout << "stacking: (" << obj_id << ") " << addr << std::endl;
-  stack_allocs.back().push_back(addr);
+  stack_allocs.push(std::make_pair(addr, static_cast<size_t>(size)));
 
   // std::unique_lock<std::mutex> lk(inst_lock);
   /*
@@ -326,7 +583,6 @@ void __DynAlias_do_alloca(int32_t, int64_t size,
     reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(addr) + size)
     << "\n";
   */
-  allocs.emplace(addr, size);
 
   /*
   if (obj_id == 42665) {
@@ -345,12 +601,21 @@ static bool do_free_addr(void *addr) {
   bool ret = false;
 
   // std::cerr << "Finding addr: " << addr << "\n";
-  auto it = allocs.find(addr);
-
-  assert(it != std::end(allocs));
+  size_t size;
+  {
+    auto &shard = heap_shard(addr);
+    std::unique_lock<std::mutex> lk(shard.lock);
+    auto it = shard.sizes.find(addr);
 
+    // Not allocated by an instrumented allocation
+    if (it == std::end(shard.sizes)) {
+      return ret;
+    }
+    size = it->second;
+    shard.sizes.erase(it);
+  }
 
-  map.set(AddressMap<int32_t>::InvalidValue, addr, it->second);
+  shadow_clear(addr, size);
 
   /*
   int count = 0;
@@ -373,90 +638,30 @@ static bool do_free_addr(void *addr) {
   return ret;
 }
 
+static void do_free_stack(const std::pair<void *, size_t> &alloc) {
+  shadow_clear(alloc.first, alloc.second);
+}
+
 void __DynAlias_do_ret() {
   // Remove all ptstos on stack from map
-  const std::vector<void *> &cur_frame = stack_allocs.back();
-  // std::unique_lock<std::mutex> lk(inst_lock);
-  for (auto addr : cur_frame) {
-    bool rc = do_free_addr(addr);
-    if (rc) {
-      // Do ret failed?
-      std::cerr << "Do ret failed to erase address: " << addr << std::endl;
-      assert(0 && "do_ret failed");
-    }
-  }
-  // Pop ptsto frame from stack
-  stack_allocs.pop_back();
-
-  // Also pop the setjumps...
-  for (auto &it : stack_longjmps.back()) {
-    longjmps.erase(it);
-  }
-  stack_longjmps.pop_back();
+  stack_allocs.ret(do_free_stack);
 }
 
 void __DynAlias_do_setjmp(int32_t, void *addr) {
-  // Add ourself to the longjmp ret, so where know where to return to
-  auto stack_pos = std::make_pair(stack_allocs.size()-1,
-      stack_allocs.back().size()-1);
-  auto rc = longjmps.emplace(addr, stack_pos);
-
-  // We reset a jump without clearing it from the stack
-  //   This can happen if setjmp is called 2x on the same jmp_env
-  if (!rc.second) {
-    rc.first->second = stack_pos;
-  }
-
-  // Add ourself to the longjmp stack (so we're cleared on ret)
-  stack_longjmps.back().push_back(rc.first);
+  // Remember where we are on the stack, so the longjmp can return here
+  //   (setjmp may be called 2x on the same jmp_env, the last one wins)
+  longjmps[addr] = stack_allocs.mark();
 }
 
 void __DynAlias_do_longjmp(int32_t id, void *addr) {
-  // Look up our jump in the map...
-  auto jump_pr = longjmps.at(addr);
-
-  // std::unique_lock<std::mutex> lk(inst_lock);
-  // Now, free the later frames from the vector
-  // while (std::next(jump_pr.first) != std::end(stack_allocs))
-  for (size_t i = stack_allocs.size()-1; i > jump_pr.first; --i) {
-    const std::vector<void *> &cur_frame = stack_allocs[i];
-    for (auto addr : cur_frame) {
-      auto ret = do_free_addr(addr);
-      if (ret) {
-        std::cerr << "do_longjmp failed at return erase\n";
-        std::cerr << "do_longjmp id: " << id << "\n";
-        std::cerr << "frame: " << stack_allocs.size()-1 << "\n";
-        std::cerr << "addr: " << addr << "\n";
-        abort();
-      }
-    }
-    // Pop ptsto frame from stack
-    stack_allocs.pop_back();
-
-    // Also pop the setjumps...
-    for (auto &it : stack_longjmps.back()) {
-      longjmps.erase(it);
-    }
-    stack_longjmps.pop_back();
-
-    // We should have the same number of frames for both allocs and longjmps
-    assert(stack_longjmps.size() == stack_allocs.size());
-  }
-
-  // Then free anything after this jump
-  /*std::for_each(std::next(jump_pr.second), std::end(stack_allocs.back()),
-      [] (void *addr)*/
-  auto &vec = stack_allocs.back();
-  for (size_t i = vec.size() - 1; i > jump_pr.second; --i) {
-    void *addr = vec[i];
-    // std::cout << "popping: " << addr << std::endl;
-    if_debug_enabled(auto ret =)
-      do_free_addr(addr);
-    assert(!ret);
-    vec.pop_back();
+  // Free everything allocated since the setjmp
+  auto it = longjmps.find(addr);
+  if (it == std::end(longjmps) ||
+      !stack_allocs.rewind(it->second, do_free_stack)) {
+    std::cerr << "do_longjmp to a returned (or unset) jmp_env\n";
+    std::cerr << "do_longjmp id: " << id << "\n";
+    abort();
   }
-
-  // stack_allocs.back().erase(jump_pr.second, std::end(stack_allocs.back()));
 }
 
 void __DynAlias_do_malloc(int32_t, int64_t size,
@@ -540,17 +745,32 @@ void __DynAlias_do_malloc(int32_t, int64_t size,
     reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(addr) + size)
     << "\n";
   */
-  allocs.emplace(addr, size);
+  auto &shard = heap_shard(addr);
+  std::unique_lock<std::mutex> lk(shard.lock);
+  auto &cur_size = shard.sizes[addr];
+  cur_size = std::max(cur_size, static_cast<size_t>(size));
   /*
   ret.first->second.addId(obj_id);
   assert(ret.second);
   */
 }
 
-void __DynAlias_do_load(int32_t load_id, void *addr, size_t) {
+void __DynAlias_do_load(int32_t load_idx, void *addr, size_t) {
+  if (sampler().enabled()) {
+    sampler().record(sample_local, __DynAlias_sample_skip);
+  }
+
   // std::unique_lock<std::mutex> lk(inst_lock);
 
-  auto id = map.get(addr);
+  auto id = shadow_get(addr);
+
+  bool hit = load_cache.seen(load_idx, id);
+  if (cache_stats().enabled()) {
+    cache_stats().record(__DynAlias_load_ids[load_idx], hit);
+  }
+  if (hit) {
+    return;
+  }
   /*
   if (load_id == 11061) {
     std::cerr << "Loading from: " << load_id << " at: " << addr << " size: " <<
@@ -559,7 +779,18 @@ void __DynAlias_do_load(int32_t load_id, void *addr, size_t) {
   }
   */
 
-  load_to_store_alias[load_id].insert(id);
+  assert(load_idx >= 0 && load_idx < __DynAlias_num_loads);
+  if (shared != nullptr && shared->insert(load_idx, id)) {
+    return;
+  }
+
+  ProfileFlusher::poll();
+  alias_records().record([load_idx, id] (AliasRecords &recs) {
+    if (recs.empty()) {
+      recs.resize(__DynAlias_num_loads);
+    }
+    insert_store(recs[load_idx], id);
+  });
 }
 
 void __DynAlias_do_store(int32_t store_id, void *addr, size_t size) {
@@ -572,7 +803,7 @@ void __DynAlias_do_store(int32_t store_id, void *addr, size_t size) {
       size << std::endl;
   }
   */
-  map.set(store_id, addr, size);
+  shadow_set(store_id, addr, size);
 }
 
 void __DynAlias_do_free(void *addr) {
@@ -26,6 +26,10 @@
 #include <utility>
 #include <vector>
 
+#include "include/ProfileFile.h"
+#include "include/ProfileFlusher.h"
+#include "include/ThreadRecords.h"
+
 #ifndef NDEBUG
 #  define if_debug_enabled(...) __VA_ARGS__
 #else
@@ -36,20 +40,30 @@
 
 #define INVALID_ID (-1)
 
-// We have a stack per thread
-std::mutex inst_lock;
-std::set<std::vector<int32_t>> all_stacks;
+// We have a stack per thread, and record the stacks each thread sees
+typedef std::set<std::vector<int32_t>> StackRecords;
+
+static void merge_stacks(StackRecords &into, StackRecords &from) {
+  if (into.empty()) {
+    into.swap(from);
+  } else {
+    into.insert(std::begin(from), std::end(from));
+    from.clear();
+  }
+}
+
+static ThreadRecords<StackRecords> &stack_records() {
+  static auto &records = ThreadRecords<StackRecords>::create(merge_stacks);
+  return records;
+}
+
 thread_local std::vector<int32_t> stack;
 thread_local bool pushed;
 
 thread_local std::unordered_map<void *, std::pair<size_t, int32_t>>
     addr_to_frame;
 
-extern "C" {
-
-void __DynContext_do_init() { }
-
-void __DynContext_do_finish() {
+static const char *log_name() {
   const char *logname = "profile.callstack";
 
   char *envname = getenv("SFS_LOGFILE");
@@ -57,22 +71,41 @@ void __DynContext_do_finish() {
     logname = envname;
   }
 
-  std::ostringstream outfilename;
-
-  outfilename << logname << "." << getpid();
-
-  std::ofstream ofil(outfilename.str());
+  return logname;
+}
 
-  std::unique_lock<std::mutex> lk(inst_lock);
+static void write_stacks(const std::string &outfilename,
+    const StackRecords &all_stacks) {
+  ProfileWriter ofil(outfilename, ProfileKind::CallStack);
 
   for (auto &vec : all_stacks) {
-    for (auto &elm : vec) {
-      ofil << elm << " ";
-    }
-    ofil << std::endl;
+    ofil.writeList(std::begin(vec), std::end(vec));
   }
 }
 
+// Writes the stacks seen since the last flush
+static void flush_delta(uint64_t seq) {
+  StackRecords delta;
+  stack_records().drain(delta);
+  write_stacks(ProfileFlusher::deltaName(log_name(), seq), delta);
+}
+
+extern "C" {
+
+void __DynContext_do_init() {
+  ProfileFlusher::start(flush_delta);
+}
+
+void __DynContext_do_finish() {
+  ProfileFlusher::stop(flush_delta);
+
+  std::ostringstream outfilename;
+
+  outfilename << log_name() << "." << getpid();
+
+  write_stacks(outfilename.str(), stack_records().harvest());
+}
+
 // Do Call -- no recursion counting
 void __DynContext_do_call(int32_t id) {
   if (stack.empty() || stack.back() != id) {
@@ -82,8 +115,6 @@ void __DynContext_do_call(int32_t id) {
 }
 
 static void save_stack(const std::vector<int32_t> &stack) {
-  std::unique_lock<std::mutex> lk(inst_lock);
-
   /*
   // Clean Stack
   std::vector<int32_t> new_stack;
@@ -100,7 +131,10 @@ static void save_stack(const std::vector<int32_t> &stack) {
   all_stacks.emplace(std::move(new_stack));
   */
 
-  all_stacks.emplace(stack);
+  ProfileFlusher::poll();
+  stack_records().record([&stack] (StackRecords &all_stacks) {
+    all_stacks.emplace(stack);
+  });
 }
 
 // Do ret -- Don't pop if we didn't just return from ourself
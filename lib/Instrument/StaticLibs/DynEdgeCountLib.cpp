@@ -17,8 +17,6 @@
 #include <limits>
 #include <map>
 #include <memory>
-#include <mutex>
-#include <thread>
 #include <unordered_map>
 #include <set>
 #include <sstream>
@@ -26,13 +24,35 @@
 #include <utility>
 #include <vector>
 
-// We have a set of counter variables
-static std::mutex count_lock;
-static std::vector<size_t> counts;
+#include "include/ProfileFile.h"
+#include "include/ProfileFlusher.h"
+#include "include/SharedProfile.h"
 
 extern "C" {
 
-void __DynEdge_do_finish() {
+// Emitted by DynEdgeInst: num_shards copies of num_counts counters, which the
+//   instrumented code increments inline (with relaxed atomic adds)
+extern uint64_t __DynEdge_counts[];
+extern int32_t __DynEdge_num_counts;
+extern int32_t __DynEdge_num_shards;
+
+}  // extern "C"
+
+// The counts of this process and its forks, with SFS_SHARED_PROFILE, added by
+//   each process as it exits
+static SharedProfile *shared = nullptr;
+
+// The counts as of the last flush (see flush_delta)
+static std::vector<uint64_t> flushed;
+
+// A forked child starts with its parent's counts, which its parent adds
+static void reset_after_fork() {
+  memset(__DynEdge_counts, 0,
+      sizeof(uint64_t) * __DynEdge_num_counts * __DynEdge_num_shards);
+  std::fill(std::begin(flushed), std::end(flushed), 0);
+}
+
+static const char *log_name() {
   const char *logname = "profile.edge";
 
   char *envname = getenv("SFS_LOGFILE");
@@ -40,32 +60,68 @@ void __DynEdge_do_finish() {
     logname = envname;
   }
 
-  std::ostringstream outfilename;
+  return logname;
+}
+
+// Sums the shards, threads may still be running so load atomically
+static uint64_t edge_count(size_t i) {
+  size_t num_counts = __DynEdge_num_counts;
+  size_t num_shards = __DynEdge_num_shards;
+  uint64_t count = 0;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    count += __atomic_load_n(&__DynEdge_counts[shard * num_counts + i],
+        __ATOMIC_RELAXED);
+  }
+  return count;
+}
+
+// Writes the counts since the last flush, the counters are never reset so
+//   the deltas are taken from the counts last written
+static void flush_delta(uint64_t seq) {
+  size_t num_counts = __DynEdge_num_counts;
+  flushed.resize(num_counts);
+
+  ProfileWriter ofil(ProfileFlusher::deltaName(log_name(), seq),
+      ProfileKind::Edge);
+  for (size_t i = 0; i < num_counts; ++i) {
+    uint64_t count = edge_count(i);
+    ofil.writeCount(i, count - flushed[i]);
+    flushed[i] = count;
+  }
+}
 
-  outfilename << logname << "." << getpid();
+extern "C" {
 
-  std::ofstream ofil(outfilename.str());
+void __DynEdge_do_finish() {
+  ProfileFlusher::stop(flush_delta);
 
-  std::unique_lock<std::mutex> lk(count_lock);
+  size_t num_counts = __DynEdge_num_counts;
 
-  // Write out counts:
-  for (size_t i = 0; i < counts.size(); ++i) {
-    ofil << i << " " << counts[i] << std::endl;
+  // Only the last process to exit writes the shared counts
+  if (shared != nullptr) {
+    for (size_t i = 0; i < num_counts; ++i) {
+      shared->add(i, edge_count(i));
+    }
+
+    if (!shared->leave()) {
+      return;
+    }
   }
-}
 
-void __DynEdge_do_init() {
-}
+  std::ostringstream outfilename;
+
+  outfilename << log_name() << "." << getpid();
 
-void __DynEdge_do_visit(int32_t id) {
-  // Thread safety n all
-  std::unique_lock<std::mutex> lk(count_lock);
-  assert(id >= 0);
-  if (static_cast<size_t>(id) >= counts.size()) {
-    counts.resize(id+1);
+  ProfileWriter ofil(outfilename.str(), ProfileKind::Edge);
+
+  for (size_t i = 0; i < num_counts; ++i) {
+    ofil.writeCount(i, (shared != nullptr) ? shared->count(i) : edge_count(i));
   }
+}
 
-  counts[id]++;
+void __DynEdge_do_init() {
+  shared = SharedProfile::create(__DynEdge_num_counts, reset_after_fork);
+  ProfileFlusher::start(flush_delta);
 }
 
 }
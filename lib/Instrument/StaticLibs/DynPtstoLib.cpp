@@ -5,9 +5,12 @@
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -20,6 +23,14 @@
 #include <utility>
 #include <vector>
 
+#include "include/AllocaStack.h"
+#include "include/ProfileFile.h"
+#include "include/ProfileFlusher.h"
+#include "include/SampleWindow.h"
+#include "include/SharedProfile.h"
+#include "include/SiteCache.h"
+#include "include/ThreadRecords.h"
+
 #ifndef NDEBUG
 #  define if_debug_enabled(...) __VA_ARGS__
 #else
@@ -172,27 +183,434 @@ class AddressValue {
   bool gep_ = false;
 };
 
+// Shadow memory backend {{{
+// The default address -> object lookup.  Every byte of tracked memory has a
+//   32-bit shadow entry naming an (interned, immutable) ShadowValue, so a visit
+//   is three page-table loads and no lock.  The old std::map backend is kept
+//   as a fallback, select it with DYNPTSTO_BACKEND=map.
+//
+// Unlike the map, the shadow has no notion of ranges.  Overlapping mallocs and
+//   geps update only the bytes they cover, instead of merging or splitting
+//   whole ranges.
+struct ShadowValue {
+  ShadowValue(std::vector<int32_t> obj_ids, bool is_gep) :
+    ids(std::move(obj_ids)), gep(is_gep) { }
+
+  const std::vector<int32_t> ids;
+  const bool gep;
+};
+
+// Interns ShadowValues, so the shadow can store small ids instead of pointers,
+//   and so identical id lists share one value (values are never freed, their
+//   number is bounded by the static object ids and offsets)
+class ShadowValueTable {
+  //{{{
+ public:
+  typedef uint32_t Id;
+  static const Id Unmapped = 0;
+
+  Id intern(std::vector<int32_t> ids, bool gep) {
+    Key key(std::move(ids), gep);
+
+    // Each thread keeps its own view of the table, so only the first use of a
+    //   value by a thread touches the shared lock
+    thread_local std::unordered_map<Key, Id, Key::hasher> local_ids;
+    auto local_it = local_ids.find(key);
+    if (local_it != std::end(local_ids)) {
+      return local_it->second;
+    }
+
+    std::unique_lock<std::mutex> lk(lock_);
+    auto it = ids_.find(key);
+    if (it == std::end(ids_)) {
+      Id id = nextId_++;
+      assert(id < ChunkSize * NumChunks);
+
+      auto &chunk = chunks_[id >> ChunkBits];
+      auto vals = chunk.load(std::memory_order_relaxed);
+      if (vals == nullptr) {
+        vals = new std::atomic<const ShadowValue *>[ChunkSize]();
+        chunk.store(vals, std::memory_order_release);
+      }
+      vals[id & ChunkMask].store(new ShadowValue(key.ids, key.gep),
+          std::memory_order_release);
+
+      it = ids_.emplace(key, id).first;
+    }
+    lk.unlock();
+
+    local_ids.emplace(std::move(key), it->second);
+    return it->second;
+  }
+
+  const ShadowValue &get(Id id) const {
+    assert(id != Unmapped);
+    auto vals = chunks_[id >> ChunkBits].load(std::memory_order_acquire);
+    return *vals[id & ChunkMask].load(std::memory_order_acquire);
+  }
+
+ private:
+  static const size_t ChunkBits = 12;
+  static const size_t ChunkSize = 1 << ChunkBits;
+  static const size_t ChunkMask = ChunkSize - 1;
+  static const size_t NumChunks = 1 << 16;
+
+  struct Key {
+    struct hasher {
+      size_t operator()(const Key &k) const {
+        size_t ret = k.gep;
+        for (auto id : k.ids) {
+          ret ^= std::hash<int32_t>()(id) + (ret << 6) + (ret >> 2);
+        }
+        return ret;
+      }
+    };
+
+    Key(std::vector<int32_t> obj_ids, bool is_gep) :
+      ids(std::move(obj_ids)), gep(is_gep) { }
+
+    bool operator==(const Key &rhs) const {
+      return gep == rhs.gep && ids == rhs.ids;
+    }
+
+    std::vector<int32_t> ids;
+    bool gep;
+  };
+
+  std::mutex lock_;
+  // Id 0 is Unmapped
+  Id nextId_ = 1;
+  std::unordered_map<Key, Id, Key::hasher> ids_;
+  std::array<std::atomic<std::atomic<const ShadowValue *> *>, NumChunks>
+    chunks_{};
+  //}}}
+};
+
+// A 3-level page table from byte address to ShadowValueTable::Id, laid out as
+//   DynAliasLib's AddressMap.  Pages are calloc'd (so untouched parts of a
+//   page are never backed) and installed with a CAS, so lookups and inserts
+//   from different threads never take a lock.
+class ObjectShadow {
+  //{{{
+ public:
+  typedef ShadowValueTable::Id value_type;
+
+  static const size_t Level0Bits = 24;
+  static const size_t Level1Bits = 20;
+  static const size_t Level2Bits = 20;
+
+  static_assert(Level0Bits + Level1Bits + Level2Bits == 64,
+      "Shadow cannot address full address space");
+
+  value_type get(uintptr_t addr) const {
+    auto l1 = level0_[addr >> (Level1Bits + Level2Bits)].load(
+        std::memory_order_acquire);
+    if (l1 == nullptr) {
+      return ShadowValueTable::Unmapped;
+    }
+
+    auto l2 = l1[(addr >> Level2Bits) & Level1Mask].load(
+        std::memory_order_acquire);
+    if (l2 == nullptr) {
+      return ShadowValueTable::Unmapped;
+    }
+
+    return l2[addr & Level2Mask].load(std::memory_order_acquire);
+  }
+
+  // Replaces the value of each byte in [addr, addr+size) with fn(old value)
+  template <typename fn_type>
+  void update(uintptr_t addr, size_t size, fn_type fn) {
+    while (size) {
+      auto leaf = getLeaf(addr);
+      size_t offs = addr & Level2Mask;
+      size_t run = std::min(size, Level2Size - offs);
+
+      for (size_t i = offs; i < offs + run; ++i) {
+        auto old_val = leaf[i].load(std::memory_order_relaxed);
+        leaf[i].store(fn(old_val), std::memory_order_release);
+      }
+
+      addr += run;
+      size -= run;
+    }
+  }
+
+  void set(value_type val, uintptr_t addr, size_t size) {
+    update(addr, size, [val] (value_type) { return val; });
+  }
+
+ private:
+  static const size_t Level1Size = (1 << Level1Bits);
+  static const size_t Level1Mask = Level1Size - 1;
+  static const size_t Level2Size = (1 << Level2Bits);
+  static const size_t Level2Mask = Level2Size - 1;
+
+  typedef std::atomic<value_type> Leaf;
+  typedef std::atomic<Leaf *> Level1;
+
+  template <typename T>
+  static T *getPage(std::atomic<T *> &slot, size_t entries) {
+    auto page = slot.load(std::memory_order_acquire);
+    if (page == nullptr) {
+      auto new_page = static_cast<T *>(calloc(entries, sizeof(T)));
+      if (new_page == nullptr) {
+        std::cerr << "ERROR: Could not allocate DynPtsto shadow page\n";
+        abort();
+      }
+
+      if (slot.compare_exchange_strong(page, new_page,
+            std::memory_order_acq_rel)) {
+        page = new_page;
+      } else {
+        free(new_page);
+      }
+    }
+
+    return page;
+  }
+
+  Leaf *getLeaf(uintptr_t addr) {
+    auto l1 = getPage(level0_[addr >> (Level1Bits + Level2Bits)], Level1Size);
+    return getPage(l1[(addr >> Level2Bits) & Level1Mask], Level2Size);
+  }
+
+  std::array<std::atomic<Level1 *>, (1 << Level0Bits)> level0_{};
+  //}}}
+};
+
+static bool use_shadow() {
+  static const bool shadow = [] {
+    const char *backend = getenv("DYNPTSTO_BACKEND");
+    return backend == nullptr || strcmp(backend, "map") != 0;
+  }();
+
+  return shadow;
+}
+
+static ShadowValueTable shadow_values;
+static ObjectShadow shadow_map;
+
+// The sizes of live heap objects, so do_free knows how much shadow to clear.
+//   Only touched by malloc/free, and sharded so threads rarely contend.
+struct HeapShard {
+  std::mutex lock;
+  std::unordered_map<uintptr_t, int64_t> sizes;
+};
+static const size_t NumHeapShards = 64;
+static std::array<HeapShard, NumHeapShards> heap_sizes;
+
+static HeapShard &heap_shard(uintptr_t addr) {
+  return heap_sizes[(addr >> 4) % NumHeapShards];
+}
+
+static void shadow_alloca(int32_t obj_id, int64_t size, void *addr) {
+  shadow_map.set(shadow_values.intern(std::vector<int32_t>(1, obj_id), false),
+      reinterpret_cast<uintptr_t>(addr), size);
+}
+
+static void shadow_malloc(int32_t obj_id, int64_t size, void *addr) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  auto fresh = shadow_values.intern(std::vector<int32_t>(1, obj_id), false);
+
+  // Memory already holding an object (only happens for globals) gains obj_id,
+  //   as a merged range would in the map.  Memoize on the last old value, as
+  //   bytes come in long runs of the same value
+  auto last_old = ShadowValueTable::Unmapped;
+  auto last_new = fresh;
+  shadow_map.update(start, size,
+      [obj_id, fresh, &last_old, &last_new]
+      (ShadowValueTable::Id old_val) {
+    if (old_val == ShadowValueTable::Unmapped) {
+      return fresh;
+    }
+
+    if (old_val != last_old) {
+      auto &val = shadow_values.get(old_val);
+      auto ids = val.ids;
+      ids.push_back(obj_id);
+      last_old = old_val;
+      last_new = shadow_values.intern(std::move(ids), val.gep);
+    }
+
+    return last_new;
+  });
+
+  auto &shard = heap_shard(start);
+  std::unique_lock<std::mutex> lk(shard.lock);
+  auto &cur_size = shard.sizes[start];
+  cur_size = std::max(cur_size, size);
+}
+
+static void shadow_free(void *addr) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  int64_t size;
+  {
+    auto &shard = heap_shard(start);
+    std::unique_lock<std::mutex> lk(shard.lock);
+    auto it = shard.sizes.find(start);
+    if (it == std::end(shard.sizes)) {
+      return;
+    }
+    size = it->second;
+    shard.sizes.erase(it);
+  }
+
+  shadow_map.set(ShadowValueTable::Unmapped, start, size);
+}
+
+static void shadow_gep(int32_t offs, void *base_addr, void *res_addr,
+    int64_t size) {
+  auto start = reinterpret_cast<uintptr_t>(res_addr);
+  if (shadow_map.get(start) == ShadowValueTable::Unmapped) {
+    return;
+  }
+
+  if (shadow_map.get(reinterpret_cast<uintptr_t>(base_addr)) ==
+      ShadowValueTable::Unmapped) {
+    std::cerr << "WARNING: BASE addr not found: " << base_addr << "\n";
+    std::cerr << "         gep addr: " << res_addr << "\n";
+    return;
+  }
+
+  bool force_gep = (offs != 0);
+
+  // Each byte not yet gep'd is offset to its field, as setGep does for a
+  //   range in the map
+  auto last_old = ShadowValueTable::Unmapped;
+  auto last_new = ShadowValueTable::Unmapped;
+  shadow_map.update(start, size,
+      [offs, force_gep, &last_old, &last_new]
+      (ShadowValueTable::Id old_val) {
+    if (old_val == ShadowValueTable::Unmapped) {
+      return old_val;
+    }
+
+    if (old_val != last_old) {
+      auto &val = shadow_values.get(old_val);
+      last_old = old_val;
+      if (val.gep) {
+        last_new = old_val;
+      } else {
+        auto ids = val.ids;
+        std::transform(std::begin(ids), std::end(ids), std::begin(ids),
+            [offs] (int32_t id) { return id + offs; });
+        last_new = shadow_values.intern(std::move(ids), force_gep);
+      }
+    }
+
+    return last_new;
+  });
+}
+//}}}
+
 std::mutex inst_lock;
 std::map<AddrRange, AddressValue> addr_to_objid;
-std::unordered_map<int32_t, std::set<int32_t>> valid_to_objids;
 
-thread_local std::vector<std::vector<void *>> stack_allocs;
-// Used to pop jmp_env's from the stack on pop
-// std::vector<std::vector<std::map<void *, std::pair<std::vector<std::vector<void *>>::iterator, std::vector<void *>::iterator>>::iterator>> stack_longjmps;  // NOLINT
-thread_local std::vector<std::vector<std::map<void *, std::pair<size_t, size_t>>::iterator>> stack_longjmps;  // NOLINT
-// Used to lookup the stack location jumped to
-thread_local std::map<void *, std::pair<size_t, size_t>> longjmps;  // NOLINT
+// The objects each value was seen pointing to, recorded per thread
+typedef std::unordered_map<int32_t, std::set<int32_t>> PtstoRecords;
 
+static void merge_ptsto(PtstoRecords &into, PtstoRecords &from) {
+  for (auto &val_pr : from) {
+    into[val_pr.first].insert(std::begin(val_pr.second),
+        std::end(val_pr.second));
+  }
+  from.clear();
+}
 
-// GEP support
-// static std::unordered_map<void *, std::vector<AddrRange *>> base_locs;
-static std::unordered_multimap<void *, void *> base_locs;
+static ThreadRecords<PtstoRecords> &ptsto_records() {
+  static auto &records = ThreadRecords<PtstoRecords>::create(merge_ptsto);
+  return records;
+}
 
 extern "C" {
+// The visits left to skip, decremented by the instrumentation when it is built
+//   with -dyn-ptsto-sample
+thread_local int32_t __DynPtsto_sample_skip = 0;
+}
 
-void __DynPtsto_do_init() { }
+static SampleWindow &sampler() {
+  static SampleWindow window("SFS_SAMPLE");
+  return window;
+}
 
-void __DynPtsto_do_finish() {
+static thread_local SampleWindow::Local sample_local;
+
+// The records of this process and its forks, with SFS_SHARED_PROFILE
+static SharedProfile *shared = nullptr;
+// The sampler's totals, added by each process as it exits
+static const size_t SharedSampled = 0;
+static const size_t SharedVisits = 1;
+static const size_t NumSharedCounters = 2;
+
+// The sampler's totals as of the last flush (see flush_delta)
+static uint64_t last_sampled = 0;
+static uint64_t last_visits = 0;
+
+static void reset_after_fork() {
+  sampler().reset(sample_local);
+  last_sampled = 0;
+  last_visits = 0;
+}
+
+// FIXME: 3 is the universal value... I should have this imported somewhere
+//   instead of hardcoded...
+static const std::vector<int32_t> universal_ids = { 3 };
+
+// Records that val_id points to each of obj_ids, in the shared profile while
+//   it has room
+static void record_visit(int32_t val_id, const std::vector<int32_t> &obj_ids) {
+  if (shared != nullptr) {
+    bool inserted = true;
+    for (int32_t obj_id : obj_ids) {
+      inserted &= shared->insert(val_id, obj_id);
+    }
+
+    if (inserted) {
+      return;
+    }
+  }
+
+  ProfileFlusher::poll();
+  ptsto_records().record([val_id, &obj_ids] (PtstoRecords &recs) {
+    recs[val_id].insert(std::begin(obj_ids), std::end(obj_ids));
+  });
+}
+
+// Visits reaching the runtime, printed by do_finish when SFS_PROFILE_STATS is
+//   set (to measure instrumentation changes)
+static std::atomic<uint64_t> total_visits{0};
+
+struct VisitCount {
+  ~VisitCount() {
+    total_visits.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  uint64_t count = 0;
+};
+static thread_local VisitCount visit_count;
+
+// The shadow value each value was last seen pointing to, so repeated visits
+//   skip the records (shadow backend only, the map has no value ids)
+static thread_local SiteCache visit_cache;
+
+static SiteCacheStats &cache_stats() {
+  static SiteCacheStats stats;
+  return stats;
+}
+
+// Each alloca is kept with its size, so the shadow backend can clear it on ret
+typedef AllocaStack<std::pair<void *, int64_t>> StackAllocs;
+thread_local StackAllocs stack_allocs;
+// The stack position saved by each jmp_env's setjmp
+thread_local std::unordered_map<void *, StackAllocs::Marker> longjmps;
+
+
+// GEP support
+// static std::unordered_map<void *, std::vector<AddrRange *>> base_locs;
+static std::unordered_multimap<void *, void *> base_locs;
+
+static const char *log_name() {
   const char *logname = "dyn_ptsto.log";
 
   char *envname = getenv("SFS_LOGFILE");
@@ -200,41 +618,128 @@ void __DynPtsto_do_finish() {
     logname = envname;
   }
 
-  std::string outfilename(logname);
+  return logname;
+}
+
+// Prints to the logfile, sorted by value so logs can be stream merged
+static void write_ptsto(const std::string &outfilename,
+    PtstoRecords &valid_to_objids, bool sampled, uint64_t num_sampled,
+    uint64_t num_visits) {
+  std::vector<int32_t> val_ids;
+  for (auto &val_pr : valid_to_objids) {
+    val_ids.push_back(val_pr.first);
+  }
+  std::sort(std::begin(val_ids), std::end(val_ids));
+
+  ProfileWriter out(outfilename, ProfileKind::Ptsto);
+  if (sampled) {
+    out.writeCoverage(num_sampled, num_visits);
+  }
+  for (auto val_id : val_ids) {
+    auto &objs = valid_to_objids[val_id];
+    out.writeSet(val_id, std::begin(objs), std::end(objs));
+  }
+}
+
+// Writes the records since the last flush, with the visits sampled since
+static void flush_delta(uint64_t seq) {
+  PtstoRecords delta;
+  ptsto_records().drain(delta);
+
+  bool sampled = sampler().enabled();
+  uint64_t num_sampled = sampler().sampled();
+  uint64_t num_visits = sampler().total();
+
+  write_ptsto(ProfileFlusher::deltaName(log_name(), seq), delta, sampled,
+      num_sampled - last_sampled, num_visits - last_visits);
+
+  last_sampled = num_sampled;
+  last_visits = num_visits;
+}
+
+extern "C" {
+
+void __DynPtsto_do_init() {
+  shared = SharedProfile::create(NumSharedCounters, reset_after_fork);
+  ProfileFlusher::start(flush_delta);
+}
+
+void __DynPtsto_do_finish() {
+  ProfileFlusher::stop(flush_delta);
+
+  std::string outfilename(log_name());
+
+  auto valid_to_objids = ptsto_records().harvest();
+
+  bool sampled = sampler().enabled();
+  uint64_t num_sampled = 0;
+  uint64_t num_visits = 0;
+  if (sampled) {
+    sampler().flush(sample_local);
+    num_sampled = sampler().sampled();
+    num_visits = sampler().total();
+  }
+
+  if (getenv("SFS_PROFILE_STATS") != nullptr) {
+    total_visits.fetch_add(visit_count.count, std::memory_order_relaxed);
+    visit_count.count = 0;
+    fprintf(stderr, "DynPtsto: %llu visits\n",
+        static_cast<unsigned long long>(total_visits.load()));  // NOLINT
+    if (use_shadow()) {
+      cache_stats().print("DynPtsto", 10);
+    }
+  }
+
+  // Only the last process to exit writes the shared records, the others
+  //   only write what didn't fit in them.  Those also write their own sampler
+  //   totals, rather than adding them to the shared ones, so each process's
+  //   visits are covered once.
+  if (shared != nullptr) {
+    bool overflowed = !valid_to_objids.empty();
+    if (!overflowed) {
+      shared->add(SharedSampled, num_sampled);
+      shared->add(SharedVisits, num_visits);
+    }
+
+    if (!shared->leave()) {
+      if (overflowed) {
+        write_ptsto(outfilename + "." + std::to_string(getpid()),
+            valid_to_objids, sampled, num_sampled, num_visits);
+      }
+      return;
+    }
+
+    if (overflowed) {
+      shared->add(SharedSampled, num_sampled);
+      shared->add(SharedVisits, num_visits);
+    }
+    shared->forEach([&valid_to_objids] (int32_t val_id, int32_t obj_id) {
+      valid_to_objids[val_id].insert(obj_id);
+    });
+    num_sampled = shared->count(SharedSampled);
+    num_visits = shared->count(SharedVisits);
+  }
 
   // If there is already an outfilename, merge the two
   {
-    std::ifstream logfile(outfilename);
-    if (logfile.is_open()) {
-      for (std::string line; std::getline(logfile, line, ':'); ) {
-        // First parse the first int till the :
-        int32_t call_id = stoi(line);
-
-        auto &fcn_set = valid_to_objids[call_id];
-
-        std::getline(logfile, line);
-        // Now split the line...
-        std::stringstream converter(line);
-        int32_t fcn_id;
-        converter >> fcn_id;
-        while (!converter.fail()) {
-          fcn_set.insert(fcn_id);
-          converter >> fcn_id;
+    ProfileReader logfile(outfilename, ProfileKind::Ptsto);
+    int64_t call_id;
+    std::vector<int64_t> fcn_ids;
+    while (logfile.next(call_id, fcn_ids)) {
+      if (call_id == ProfileCoverageKey) {
+        if (fcn_ids.size() == 2) {
+          sampled = true;
+          num_sampled += fcn_ids[0];
+          num_visits += fcn_ids[1];
         }
+        continue;
       }
+      valid_to_objids[call_id].insert(std::begin(fcn_ids), std::end(fcn_ids));
     }
   }
 
-  FILE *out = fopen(outfilename.c_str(), "w");
-  // Print to the logfile
-  for (auto &val_pr : valid_to_objids) {
-    fprintf(out, "%u:", val_pr.first);
-
-    for (auto &obj_id : val_pr.second) {
-      fprintf(out, " %d", obj_id);
-    }
-    fprintf(out, "\n");
-  }
+  write_ptsto(outfilename, valid_to_objids, sampled, num_sampled,
+      num_visits);
 }
 
 void __DynPtsto_do_malloc(int32_t obj_id, int64_t size,
@@ -269,12 +774,16 @@ void __DynPtsto_main_init3(int32_t argv_id, int32_t arg_id,
 
 void __DynPtsto_do_call() {
   // Push a frame on the "stack"
-  stack_allocs.emplace_back();
-  stack_longjmps.emplace_back();
+  stack_allocs.call();
 }
 
 void __DynPtsto_do_gep(int32_t offs, void *base_addr,
     void *res_addr, int64_t size, int32_t /*gep_id*/) {
+  if (use_shadow()) {
+    shadow_gep(offs, base_addr, res_addr, size);
+    return;
+  }
+
   static uint64_t gep_count = 0;
   std::unique_lock<std::mutex> lk(inst_lock);
 
@@ -462,7 +971,7 @@ void __DynPtsto_do_alloca(int32_t obj_id, int64_t size,
   // Handle alloca
   // Add addresses to stack frame
   // std::cout << "stacking: (" << obj_id << ") " << addr << std::endl;
-  stack_allocs.back().push_back(addr);
+  stack_allocs.push(std::make_pair(addr, size));
 
   /*
   if (obj_id == 42665) {
@@ -471,6 +980,11 @@ void __DynPtsto_do_alloca(int32_t obj_id, int64_t size,
   }
   */
 
+  if (use_shadow()) {
+    shadow_alloca(obj_id, size, addr);
+    return;
+  }
+
   std::unique_lock<std::mutex> lk(inst_lock);
   // Add ptstos to ptsto map
   auto ret =
@@ -516,92 +1030,66 @@ static bool do_free_addr(void *addr) {
   return ret;
 }
 
-void __DynPtsto_do_ret() {
-  // Remove all ptstos on stack from map
-  const std::vector<void *> &cur_frame = stack_allocs.back();
-  {
-    std::unique_lock<std::mutex> lk(inst_lock);
-    for (auto addr : cur_frame) {
-      bool rc = do_free_addr(addr);
-      if (rc) {
-        // Do ret failed?
-        std::cerr << "Do ret failed to erase address: " << addr << std::endl;
-        assert(0 && "do_ret failed");
-      }
-    }
+// Frees an alloca, the caller must hold inst_lock when using the map backend
+static bool do_free_stack(const std::pair<void *, int64_t> &alloc) {
+  if (use_shadow()) {
+    shadow_map.set(ShadowValueTable::Unmapped,
+        reinterpret_cast<uintptr_t>(alloc.first), alloc.second);
+    return false;
   }
-  // Pop ptsto frame from stack
-  stack_allocs.pop_back();
 
-  // Also pop the setjumps...
-  for (auto &it : stack_longjmps.back()) {
-    longjmps.erase(it);
-  }
-  stack_longjmps.pop_back();
+  return do_free_addr(alloc.first);
 }
 
-void __DynPtsto_do_setjmp(int32_t, void *addr) {
-  // Add ourself to the longjmp ret, so where know where to return to
-  auto stack_pos = std::make_pair(stack_allocs.size()-1,
-      stack_allocs.back().size()-1);
-  auto rc = longjmps.emplace(addr, stack_pos);
-
-  // We reset a jump without clearing it from the stack
-  //   This can happen if setjmp is called 2x on the same jmp_env
-  if (!rc.second) {
-    rc.first->second = stack_pos;
+void __DynPtsto_do_ret() {
+  // Remove all ptstos on stack from map
+  std::unique_lock<std::mutex> lk(inst_lock, std::defer_lock);
+  if (!use_shadow()) {
+    lk.lock();
   }
+  stack_allocs.ret([] (const std::pair<void *, int64_t> &alloc) {
+    bool rc = do_free_stack(alloc);
+    if (rc) {
+      // Do ret failed?
+      std::cerr << "Do ret failed to erase address: " << alloc.first <<
+        std::endl;
+      assert(0 && "do_ret failed");
+    }
+  });
+}
 
-  // Add ourself to the longjmp stack (so we're cleared on ret)
-  stack_longjmps.back().push_back(rc.first);
+void __DynPtsto_do_setjmp(int32_t, void *addr) {
+  // Remember where we are on the stack, so the longjmp can return here
+  //   (setjmp may be called 2x on the same jmp_env, the last one wins)
+  longjmps[addr] = stack_allocs.mark();
 }
 
 void __DynPtsto_do_longjmp(int32_t id, void *addr) {
   // Look up our jump in the map...
-  auto jump_pr = longjmps.at(addr);
-
-  // Now, free the later frames from the vector
-  // while (std::next(jump_pr.first) != std::end(stack_allocs))
-  std::unique_lock<std::mutex> lk(inst_lock);
-  for (size_t i = stack_allocs.size()-1; i > jump_pr.first; --i) {
-    const std::vector<void *> &cur_frame = stack_allocs[i];
-    for (auto addr : cur_frame) {
-      auto ret = do_free_addr(addr);
-      if (ret) {
-        std::cerr << "do_longjmp failed at return erase\n";
-        std::cerr << "do_longjmp id: " << id << "\n";
-        std::cerr << "frame: " << stack_allocs.size()-1 << "\n";
-        std::cerr << "addr: " << addr << "\n";
-        abort();
-      }
-    }
-    // Pop ptsto frame from stack
-    stack_allocs.pop_back();
-
-    // Also pop the setjumps...
-    for (auto &it : stack_longjmps.back()) {
-      longjmps.erase(it);
-    }
-    stack_longjmps.pop_back();
+  auto it = longjmps.find(addr);
 
-    // We should have the same number of frames for both allocs and longjmps
-    assert(stack_longjmps.size() == stack_allocs.size());
+  // Now, free everything allocated since the setjmp
+  std::unique_lock<std::mutex> lk(inst_lock, std::defer_lock);
+  if (!use_shadow()) {
+    lk.lock();
   }
+  bool rewound = it != std::end(longjmps) &&
+    stack_allocs.rewind(it->second,
+      [id] (const std::pair<void *, int64_t> &alloc) {
+    auto ret = do_free_stack(alloc);
+    if (ret) {
+      std::cerr << "do_longjmp failed at return erase\n";
+      std::cerr << "do_longjmp id: " << id << "\n";
+      std::cerr << "addr: " << alloc.first << "\n";
+      abort();
+    }
+  });
 
-  // Then free anything after this jump
-  /*std::for_each(std::next(jump_pr.second), std::end(stack_allocs.back()),
-      [] (void *addr)*/
-  auto &vec = stack_allocs.back();
-  for (size_t i = vec.size() - 1; i > jump_pr.second; --i) {
-    void *addr = vec[i];
-    // std::cout << "popping: " << addr << std::endl;
-    if_debug_enabled(auto ret =)
-      do_free_addr(addr);
-    assert(!ret);
-    vec.pop_back();
+  if (!rewound) {
+    std::cerr << "do_longjmp to a returned (or unset) jmp_env\n";
+    std::cerr << "do_longjmp id: " << id << "\n";
+    abort();
   }
-
-  // stack_allocs.back().erase(jump_pr.second, std::end(stack_allocs.back()));
 }
 
 void __DynPtsto_do_malloc(int32_t obj_id, int64_t size,
@@ -631,6 +1119,11 @@ void __DynPtsto_do_malloc(int32_t obj_id, int64_t size,
   }
   */
 
+  if (use_shadow()) {
+    shadow_malloc(obj_id, size, addr);
+    return;
+  }
+
   AddrRange cur_range(addr, size);
 
   /*
@@ -694,6 +1187,11 @@ void __DynPtsto_do_free(void *addr) {
   // std::cout << "freeing: " << addr << std::endl;
   // We shouldn't have double allocated anything except globals, which are never
   //   freed
+  if (use_shadow()) {
+    shadow_free(addr);
+    return;
+  }
+
   std::unique_lock<std::mutex> lk(inst_lock);
   do_free_addr(addr);
 }
@@ -704,23 +1202,43 @@ void __DynPtsto_do_visit(int32_t val_id, void *addr) {
     std::cout << "Visit on: " << val_id << " : " << addr << std::endl;
   }
   */
+  if (sampler().enabled()) {
+    sampler().record(sample_local, __DynPtsto_sample_skip);
+  }
+  visit_count.count++;
+
   // Record that this val_id pts to this addr
+  if (use_shadow()) {
+    auto id = shadow_map.get(reinterpret_cast<uintptr_t>(addr));
+
+    bool hit = visit_cache.seen(val_id, id);
+    if (cache_stats().enabled()) {
+      cache_stats().record(val_id, hit);
+    }
+    if (hit) {
+      return;
+    }
+
+    if (id != ShadowValueTable::Unmapped) {
+      record_visit(val_id, shadow_values.get(id).ids);
+    } else {
+      record_visit(val_id, universal_ids);
+    }
+    return;
+  }
+
   std::unique_lock<std::mutex> lk(inst_lock);
   auto it = addr_to_objid.find(AddrRange(addr));
   if (it != std::end(addr_to_objid)) {
-    for (int32_t obj_id : it->second) {
-      /*
-      if (val_id == 117258) {
-        std::cout << "   got id: " << obj_id << " at: " <<
-          it->first << std::endl;
-      }
-      */
-      valid_to_objids[val_id].insert(obj_id);
+    /*
+    if (val_id == 117258) {
+      std::cout << "   got ids: " << it->second.size() << " at: " <<
+        it->first << std::endl;
     }
+    */
+    record_visit(val_id, it->second.ids());
   } else {
-    // FIXME: 3 is the universal value... I should have this imported somewhere
-    //   instead of hardcoded...
-    valid_to_objids[val_id].insert(3);
+    record_visit(val_id, universal_ids);
   }
 }
 
@@ -18,24 +18,40 @@
 #include <utility>
 #include <vector>
 
+#include "include/ProfileFile.h"
+#include "include/ProfileFlusher.h"
+#include "include/SharedProfile.h"
+#include "include/ThreadRecords.h"
+
 extern int32_t __InstrIndirCalls_num_callsites;
 extern int32_t __InstrIndirCalls_fcn_lookup_len;
 extern void *__InstrIndirCalls_fcn_lookup_array[];
 
 static std::unordered_multimap<void *, int32_t> addr_to_id_map;
-static std::vector<std::set<int32_t>> called_fcns;
 
-extern "C" {
-void __InstrIndirCalls_init_inst(void) {
-  for (int i = 0; i < __InstrIndirCalls_fcn_lookup_len; i++) {
-    // NOTE: Apparently the compiler can map multiple fcn calls to one spot...
-    addr_to_id_map.emplace(__InstrIndirCalls_fcn_lookup_array[i], i);
+// The functions called from each callsite, recorded per thread
+typedef std::vector<std::set<int32_t>> IndirRecords;
+
+static void merge_called(IndirRecords &into, IndirRecords &from) {
+  if (into.size() < from.size()) {
+    into.resize(from.size());
   }
 
-  called_fcns.resize(__InstrIndirCalls_num_callsites);
+  for (size_t i = 0; i < from.size(); ++i) {
+    into[i].insert(std::begin(from[i]), std::end(from[i]));
+  }
+  from.clear();
 }
 
-void __InstrIndirCalls_finish_inst(void) {
+static ThreadRecords<IndirRecords> &indir_records() {
+  static auto &records = ThreadRecords<IndirRecords>::create(merge_called);
+  return records;
+}
+
+// The records of this process and its forks, with SFS_SHARED_PROFILE
+static SharedProfile *shared = nullptr;
+
+static const char *log_name() {
   const char *logname = "profile.indir";
 
   char *envname = getenv("SFS_LOGFILE");
@@ -43,9 +59,62 @@ void __InstrIndirCalls_finish_inst(void) {
     logname = envname;
   }
 
+  return logname;
+}
+
+// Writes the functions called from each callsite since the last flush
+static void flush_delta(uint64_t seq) {
+  IndirRecords delta;
+  indir_records().drain(delta);
+
+  ProfileWriter ofil(ProfileFlusher::deltaName(log_name(), seq),
+      ProfileKind::Indir);
+  for (size_t i = 0; i < delta.size(); i++) {
+    auto &set = delta[i];
+    if (!set.empty()) {
+      ofil.writeSet(i, std::begin(set), std::end(set));
+    }
+  }
+}
+
+extern "C" {
+void __InstrIndirCalls_init_inst(void) {
+  for (int i = 0; i < __InstrIndirCalls_fcn_lookup_len; i++) {
+    // NOTE: Apparently the compiler can map multiple fcn calls to one spot...
+    addr_to_id_map.emplace(__InstrIndirCalls_fcn_lookup_array[i], i);
+  }
+
+  shared = SharedProfile::create(0, nullptr);
+  ProfileFlusher::start(flush_delta);
+}
+
+void __InstrIndirCalls_finish_inst(void) {
+  ProfileFlusher::stop(flush_delta);
+
   std::ostringstream outfilename;
 
-  outfilename << logname << "." << getpid();
+  outfilename << log_name() << "." << getpid();
+
+  auto called_fcns = indir_records().harvest();
+  called_fcns.resize(__InstrIndirCalls_num_callsites);
+
+  // Only the last process to exit writes the shared records, the others
+  //   only write what didn't fit in them
+  if (shared != nullptr) {
+    if (!shared->leave()) {
+      bool overflowed = std::any_of(std::begin(called_fcns),
+          std::end(called_fcns), [] (const std::set<int32_t> &set) {
+        return !set.empty();
+      });
+      if (!overflowed) {
+        return;
+      }
+    } else {
+      shared->forEach([&called_fcns] (int32_t call_id, int32_t fcn_id) {
+        called_fcns[call_id].insert(fcn_id);
+      });
+    }
+  }
 
   // Print out my stuff...
   /*
@@ -74,18 +143,13 @@ void __InstrIndirCalls_finish_inst(void) {
   */
 
   // Now, create the outfile
-  std::ofstream ofil(outfilename.str());
+  ProfileWriter ofil(outfilename.str(), ProfileKind::Indir);
 
   // Write out counts:
   for (size_t i = 0; i < called_fcns.size(); i++) {
     auto &set = called_fcns[i];
 
-    ofil << i << ":";
-
-    for (int32_t id : set) {
-      ofil << " " << id;
-    }
-    ofil << std::endl;
+    ofil.writeSet(i, std::begin(set), std::end(set));
   }
 
   /*
@@ -107,22 +171,41 @@ void __InstrIndirCalls_finish_inst(void) {
 
 void __InstrIndirCalls_fcn_call(int32_t id, void *addr) {
   auto res_set = addr_to_id_map.equal_range(addr);
-  // assert(res_set.first != res_set.second);
-  // std::cout << "array_size is: " << called_fcns.size() << std::endl;
-  // std::cout << "id is: " << id << std::endl;
-  /*
-  if (id == 36) {
-    std::cerr << "id: " << id << " addr: " << addr << std::endl;
+
+  if (shared != nullptr) {
+    bool inserted = true;
+    std::for_each(res_set.first, res_set.second,
+        [&id, &inserted] (std::pair<void *, int32_t> res_pr) {
+      inserted &= shared->insert(id, res_pr.second);
+    });
+
+    if (inserted) {
+      return;
+    }
   }
-  */
-  std::for_each(res_set.first, res_set.second,
-      [&id] (std::pair<void *, int32_t> res_pr) {
+
+  ProfileFlusher::poll();
+  indir_records().record([id, &res_set] (IndirRecords &called_fcns) {
+    if (called_fcns.empty()) {
+      called_fcns.resize(__InstrIndirCalls_num_callsites);
+    }
+    // assert(res_set.first != res_set.second);
+    // std::cout << "array_size is: " << called_fcns.size() << std::endl;
+    // std::cout << "id is: " << id << std::endl;
     /*
     if (id == 36) {
-      std::cerr << "  " << res_pr.second << "\n";
+      std::cerr << "id: " << id << " addr: " << addr << std::endl;
     }
     */
-    called_fcns[id].insert(res_pr.second);
+    std::for_each(res_set.first, res_set.second,
+        [&id, &called_fcns] (std::pair<void *, int32_t> res_pr) {
+      /*
+      if (id == 36) {
+        std::cerr << "  " << res_pr.second << "\n";
+      }
+      */
+      called_fcns[id].insert(res_pr.second);
+    });
   });
 }
 
@@ -11,6 +11,8 @@
 #include <iostream>
 #include <fstream>
 
+#include "include/ProfileFlusher.h"
+
 // Okay, make a signal handler mask for this thread
 static const bool signal_is_term[] = {
   false,  // 0  - ?
@@ -120,8 +122,10 @@ void __SignalHandlers_init(void (*do_exit)(void)) {
   // Setup sigactions for all the term handlers
   // for each term signal, point to my handler
   // FIXME: max signal? -- 32?
+  // The flush signal (if any) is left to the ProfileFlusher
+  int flush_signo = ProfileFlusher::signalFromEnv();
   for (int i = 0; i < 32; i++) {
-    if (signal_is_term[i]) {
+    if (signal_is_term[i] && i != flush_signo) {
       struct sigaction act;
       sigemptyset(&act.sa_mask);
       act.sa_flags = 0;
@@ -144,6 +148,13 @@ int __SignalHandlers_sigaction_shim(int signo,
   ofil << getpid() << ": sigaction wrap?: " << signo << "\n";
   */
 
+  // The flush signal is reserved for the ProfileFlusher, the program's
+  //   handler is dropped
+  int flush_signo = ProfileFlusher::signalFromEnv();
+  if (act != nullptr && flush_signo != 0 && signo == flush_signo) {
+    return sigaction(signo, nullptr, oldact);
+  }
+
   // If they are setting the handler, do that
   if (act->sa_flags & SA_SIGINFO) {
     // If its not a term operation
@@ -11,11 +11,15 @@
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <unordered_map>
 #include <set>
 #include <string>
@@ -24,9 +28,13 @@
 
 #define IN_INS
 
+#include "include/AllocaStack.h"
 #include "include/BloomHash.h"
+#include "include/CheckSet.h"
+#include "include/GranuleShadow.h"
+#include "include/SpecCallStack.h"
 
-static int64_t filter_check = 0;
+// The bloom probe is inlined by the instrumentation, so only hits are counted
 static int64_t filter_miss = 0;
 
 
@@ -36,10 +44,21 @@ void init(void) {
 }
 */
 
+extern "C" {
+// Only incremented by -specsfs-count-callstack instrumentation
+uint64_t __specsfs_callstack_pushes = 0;
+uint64_t __specsfs_callstack_pops = 0;
+}
+
 [[ gnu::destructor ]]
 void fini(void) {
-  std::cerr << "filter good: " << filter_check << std::endl;
   std::cerr << "filter miss: " << filter_miss << std::endl;
+  auto pushes = __atomic_load_n(&__specsfs_callstack_pushes, __ATOMIC_RELAXED);
+  auto pops = __atomic_load_n(&__specsfs_callstack_pops, __ATOMIC_RELAXED);
+  if (pushes != 0 || pops != 0) {
+    std::cerr << "callstack pushes: " << pushes << std::endl;
+    std::cerr << "callstack pops: " << pops << std::endl;
+  }
 }
 
 [[ gnu::unused ]]
@@ -125,17 +144,162 @@ class AddrRange {
 };
 
 std::map<AddrRange, std::vector<int32_t>> addr_to_objid;
-std::vector<std::vector<void *>> stack_allocs;
 
-// Initialize to 0, to represent the "main" call node
-thread_local std::vector<std::pair<int32_t, uint64_t>> stack = {
-  std::pair<int32_t, uint64_t>(0, 0x5F5F5F5F5F5F5F5FULL) };
+// Shadow memory backend {{{
+// The default address -> object lookup, so a check is a shadow load and a
+//   CheckSet lookup.  The old std::map backend is kept as a fallback, select
+//   it with SPECSFS_BACKEND=map (it is also used if the shadow cannot be
+//   reserved).
+//
+// Each granule (8 bytes) of an object holds obj_id + 1, so untouched memory
+//   (0) has no object.  Memory allocated more than once (only globals) holds
+//   ListBase + the index of its interned list of object ids.
+static const int32_t ListBase = 1 << 30;
+
+class IdLists {
+  //{{{
+ public:
+  int32_t intern(std::vector<int32_t> ids) {
+    std::sort(std::begin(ids), std::end(ids));
+    ids.erase(std::unique(std::begin(ids), std::end(ids)), std::end(ids));
+
+    std::unique_lock<std::mutex> lk(lock_);
+    auto it = ids_.find(ids);
+    if (it == std::end(ids_)) {
+      size_t idx = ids_.size();
+      if (idx >= MaxLists) {
+        std::cerr << "ERROR: Too many SpecSFS object id lists\n";
+        abort();
+      }
+      lists_[idx].store(new std::vector<int32_t>(ids),
+          std::memory_order_release);
+      it = ids_.emplace(std::move(ids), idx).first;
+    }
+
+    return ListBase + it->second;
+  }
+
+  const std::vector<int32_t> &get(int32_t val) const {
+    return *lists_[val - ListBase].load(std::memory_order_acquire);
+  }
+
+ private:
+  static const size_t MaxLists = 1 << 16;
+
+  std::mutex lock_;
+  std::map<std::vector<int32_t>, size_t> ids_;
+  std::array<std::atomic<const std::vector<int32_t> *>, MaxLists> lists_{};
+  //}}}
+};
+
+static GranuleShadow shadow;
+static IdLists id_lists;
+
+static bool use_shadow() {
+  static const bool use = [] {
+    const char *backend = getenv("SPECSFS_BACKEND");
+    if (backend != nullptr && strcmp(backend, "map") == 0) {
+      return false;
+    }
+
+    if (!shadow.init(8)) {
+      std::cerr << "WARNING: Couldn't reserve the SpecSFS shadow, using map\n";
+      return false;
+    }
+    return true;
+  }();
+
+  return use;
+}
+
+// Calls fn on each object id of a shadow value
+template <typename fn_type>
+static void shadow_ids(int32_t val, fn_type fn) {
+  if (val >= ListBase) {
+    for (auto obj_id : id_lists.get(val)) {
+      fn(obj_id);
+    }
+  } else if (val > 0) {
+    fn(val - 1);
+  }
+}
+
+static void shadow_alloc(int32_t obj_id, void *addr, int64_t size) {
+  // Memory already holding an object (only happens for globals) gains obj_id,
+  //   as a merged range would in the map.  Memoize on the last old value, as
+  //   granules come in long runs of the same value
+  int32_t fresh = obj_id + 1;
+  int32_t last_old = 0;
+  int32_t last_new = fresh;
+  shadow.update(reinterpret_cast<uintptr_t>(addr), size,
+      [obj_id, fresh, &last_old, &last_new] (int32_t old_val) {
+    if (old_val <= 0 || old_val == fresh) {
+      return fresh;
+    }
 
-thread_local std::unordered_map<void *, std::pair<size_t,
-             std::pair<int32_t, uint64_t>>> addr_to_frame;
+    if (old_val != last_old) {
+      std::vector<int32_t> ids(1, obj_id);
+      shadow_ids(old_val, [&ids] (int32_t id) { ids.push_back(id); });
+      last_old = old_val;
+      last_new = id_lists.intern(std::move(ids));
+    }
+
+    return last_new;
+  });
+}
+
+// The sizes of live heap objects, so free knows how much shadow to clear.
+//   Only touched by malloc/free, and sharded so threads rarely contend.
+struct HeapShard {
+  std::mutex lock;
+  std::unordered_map<void *, int64_t> sizes;
+};
+static const size_t NumHeapShards = 64;
+static std::array<HeapShard, NumHeapShards> heap_sizes;
+
+static HeapShard &heap_shard(void *addr) {
+  return heap_sizes[(reinterpret_cast<uintptr_t>(addr) >> 4) % NumHeapShards];
+}
+//}}}
+
+// Each alloca is kept with its size, so ret can clear its shadow
+typedef AllocaStack<std::pair<void *, int64_t>> StackAllocs;
+thread_local StackAllocs stack_allocs;
+
+// What each jmp_env's setjmp saved: the call stack depth and top frame, and
+//   the alloca stack
+struct JmpFrame {
+  int32_t depth;
+  int32_t id;
+  uint64_t hash;
+  StackAllocs::Marker allocas;
+};
+thread_local std::unordered_map<void *, JmpFrame> addr_to_frame;
+
+// Forgets an alloca, as its frame returns
+static void free_stack(const std::pair<void *, int64_t> &alloc) {
+  // std::cout << "popping: " << alloc.first << std::endl;
+  if (use_shadow()) {
+    shadow.clear(reinterpret_cast<uintptr_t>(alloc.first), alloc.second);
+    return;
+  }
+
+#ifndef NDEBUG
+  auto ret =
+#endif
+    addr_to_objid.erase(AddrRange(alloc.first));
+  assert(ret == 1);
+}
 
 extern "C" {
 
+// The call stack, also pushed and popped by inline instrumentation (see
+//   include/SpecCallStack.h).  Frame 0 (zeroed) represents the "main" call
+//   node
+thread_local int32_t __specsfs_callstack_depth = 0;
+thread_local int32_t __specsfs_callstack_ids[SpecCallStack::MaxDepth];
+thread_local uint64_t __specsfs_callstack_hashes[SpecCallStack::MaxDepth];
+
 void __specsfs_alloc_fcn(int32_t obj_id, void *addr, int64_t size);
 
 void __specsfs_main_init2(int32_t obj_id, int32_t argv_dest_id,
@@ -162,74 +326,54 @@ void __specsfs_main_init3(int32_t obj_id, int32_t argv_dest_id,
 
 void __specsfs_do_call() {
   // Push a frame on the "stack"
-  stack_allocs.emplace_back();
+  stack_allocs.call();
 }
 
-void __specsfs_callstack_push(int32_t id, uint32_t hash) {
-  auto &pr = stack.back();
-  if (stack.empty() || pr.first != id) {
-    auto &cur_hash = pr.second;
-
-    auto new_hash = BloomHasher::mix_hash(cur_hash, hash);
-    stack.push_back(std::make_pair(id, new_hash));
-  }
+// Out-of-line push and pop, used when the instrumentation isn't inlined
+void __specsfs_callstack_push(int32_t id, uint64_t hash) {
+  SpecCallStack::push(__specsfs_callstack_depth, __specsfs_callstack_ids,
+      __specsfs_callstack_hashes, id, hash);
 }
 
 void __specsfs_callstack_pop(int32_t id) {
-  // if (!stack.empty() && stack.back() == id)
-  auto &pr = stack.back();
-  if (pr.first == id) {
-    stack.pop_back();
-  }
+  SpecCallStack::pop(__specsfs_callstack_depth, __specsfs_callstack_ids, id);
 }
 
-void __specsfs_callstack_check(int32_t check_id, int32_t size, int32_t **ids,
-    uint64_t filter_hash[]) {
-  // First, check the bloom filter for this set
-  auto &stack_hash = stack.back().second;
-  filter_check++;
+void __specsfs_callstack_check(int32_t check_id, int32_t num_slots,
+    int32_t **stacks, uint64_t hashes[], uint64_t filter[]) {
+  auto depth = __specsfs_callstack_depth;
+  // No checked stack is this deep
+  if (depth >= SpecCallStack::MaxDepth) {
+    return;
+  }
 
-  if (!BloomHasher::bloom_check(filter_hash, stack_hash)) {
+  // The inline instrumentation only calls on a bloom hit, this is for the
+  //   out-of-line instrumentation
+  auto stack_hash = __specsfs_callstack_hashes[depth];
+  if (!BloomHasher::bloom_check(filter + 1, filter[0], stack_hash)) {
     return;
   }
   filter_miss++;
 
-  // Check if stack matches any in ids
-  for (int i = 0; i < size; ++i) {
-    int32_t *id = ids[i];
-    int32_t size = id[0];
-    ++id;
-
-    if (size != static_cast<int32_t>(stack.size())) {
-      continue;
+  auto stack = SpecCallStack::find(num_slots, stacks, hashes,
+      __specsfs_callstack_ids, depth, stack_hash);
+  if (stack != nullptr) {
+    std::cerr << "stack check failed!" << std::endl;
+    std::cerr << "check id: " << check_id << std::endl;
+    std::cerr << "stack is: {";
+    for (int j = 0; j <= depth; ++j) {
+      std::cerr << " " << __specsfs_callstack_ids[j];
     }
+    std::cerr << " }" << std::endl;
 
-    bool clear = false;
-    for (int j = size-1; j >= 0; --j) {
-      if (stack[j].first != id[j]) {
-        clear = true;
-        break;
-      }
+    std::cerr << "matching stack is: {";
+    for (int j = 0; j < stack[0]; ++j) {
+      std::cerr << " " << stack[1 + j];
     }
+    std::cerr << " }" << std::endl;
 
-    if (!clear) {
-      std::cerr << "stack check failed!" << std::endl;
-      std::cerr << "check id: " << check_id << std::endl;
-      std::cerr << "stack is: {";
-      for (int j = 0; j < size; ++j) {
-        std::cerr << " " << stack[j].first;
-      }
-      std::cerr << " }" << std::endl;
-
-      std::cerr << "ids[" << i << "] is: {";
-      for (int j = 0; j < size; ++j) {
-        std::cerr << " " << id[j];
-      }
-      std::cerr << " }" << std::endl;
-
-      // print_trace();
-      do_exit();
-    }
+    // print_trace();
+    do_exit();
   }
 }
 
@@ -238,30 +382,40 @@ void __specsfs_do_longjmp_call(int32_t, void *jmpstruct, int64_t) {
   // Save the stack (if it needs saving), pop it back to jmpstruct
   auto it = addr_to_frame.find(jmpstruct);
   assert(it != std::end(addr_to_frame));
-
-  // IF we returned to an element w/in an scc, stack.size() will be one less
-  // than the recorded size, in which case, we push the frame back on...
-  if (stack.size() < it->second.first) {
-    assert(stack.size() + 1 == it->second.first);
-    stack.push_back(it->second.second);
-  // In the expected case, we just dump the top of our stack
-  } else {
-    stack.resize(it->second.first);
+  auto &frame = it->second;
+
+  auto depth = frame.depth;
+  // IF we returned to an element w/in an scc, the depth will be one less
+  // than the recorded depth, in which case, we push the frame back on...
+  if (__specsfs_callstack_depth < depth) {
+    assert(__specsfs_callstack_depth + 1 == depth);
+    if (depth < SpecCallStack::MaxDepth) {
+      __specsfs_callstack_ids[depth] = frame.id;
+      __specsfs_callstack_hashes[depth] = frame.hash;
+    }
   }
+  // In the expected case, we just dump the top of our stack
+  __specsfs_callstack_depth = depth;
+
+  // And forget the allocas of the frames jumped out of
+#ifndef NDEBUG
+  bool rewound =
+#endif
+    stack_allocs.rewind(frame.allocas, free_stack);
+  assert(rewound);
 }
 
 void __specsfs_do_setjmp_call(int32_t, void *jmpstruct) {
   // Save the stack, denote we just setjmp'd
-  /*
-  std::cout << "Dumping stack size: " << stack.size() << std::endl;
-  std::cout << "  stack:";
-  for (auto &elm : stack) {
-    std::cout << " " << elm;
+  auto depth = __specsfs_callstack_depth;
+  std::pair<int32_t, uint64_t> top(0, SpecCallStack::BaseHash);
+  if (depth < SpecCallStack::MaxDepth) {
+    top = std::make_pair(__specsfs_callstack_ids[depth],
+        __specsfs_callstack_hashes[depth]);
   }
-  std::cout << std::endl;
-  */
 
-  addr_to_frame[jmpstruct] = std::make_pair(stack.size(), stack.back());
+  addr_to_frame[jmpstruct] = JmpFrame{depth, top.first, top.second,
+    stack_allocs.mark()};
 }
 
 void __specsfs_alloca_fcn(int32_t obj_id, void *addr,
@@ -270,7 +424,13 @@ void __specsfs_alloca_fcn(int32_t obj_id, void *addr,
   // Size is in bits...
   // Handle alloca
   // Add addresses to stack frame
-  stack_allocs.back().push_back(addr);
+  stack_allocs.push(std::make_pair(addr, size));
+
+  if (use_shadow()) {
+    shadow.set(obj_id + 1, reinterpret_cast<uintptr_t>(addr), size);
+    return;
+  }
+
   // Add ptstos to ptsto map
 #ifndef NDEBUG
   auto ret =
@@ -282,18 +442,7 @@ void __specsfs_alloca_fcn(int32_t obj_id, void *addr,
 
 void __specsfs_ret_fcn() {
   // Remove all ptstos on stack from map
-  const std::vector<void *> &cur_frame = stack_allocs.back();
-  for (auto addr : cur_frame) {
-    // std::cout << "popping: " << addr << std::endl;
-#ifndef NDEBUG
-    auto ret =
-#endif
-      addr_to_objid.erase(AddrRange(addr));
-    assert(ret == 1);
-  }
-
-  // Pop ptsto frame from stack
-  stack_allocs.pop_back();
+  stack_allocs.ret(free_stack);
 }
 
 void __specsfs_alloc_fcn(int32_t obj_id, void *addr,
@@ -333,6 +482,16 @@ void __specsfs_alloc_fcn(int32_t obj_id, void *addr,
   */
   // std::cerr << "allocing: (" << obj_id << ") " << addr << std::endl;
 
+  if (use_shadow()) {
+    shadow_alloc(obj_id, addr, size);
+
+    auto &shard = heap_shard(addr);
+    std::unique_lock<std::mutex> lk(shard.lock);
+    auto &cur_size = shard.sizes[addr];
+    cur_size = std::max(cur_size, size);
+    return;
+  }
+
   AddrRange cur_range(addr, size);
   auto ret = addr_to_objid.emplace(cur_range,
       std::vector<int32_t>());
@@ -366,6 +525,23 @@ void __specsfs_free_fcn(void *addr) {
   // free_cnt++;
   // Remove ptsto from map
   // std::cout << "freeing: " << addr << std::endl;
+  if (use_shadow()) {
+    int64_t size;
+    {
+      auto &shard = heap_shard(addr);
+      std::unique_lock<std::mutex> lk(shard.lock);
+      auto it = shard.sizes.find(addr);
+      if (it == std::end(shard.sizes)) {
+        return;
+      }
+      size = it->second;
+      shard.sizes.erase(it);
+    }
+
+    shadow.clear(reinterpret_cast<uintptr_t>(addr), size);
+    return;
+  }
+
   addr_to_objid.erase(AddrRange(addr));
 }
 
@@ -400,41 +576,43 @@ void __specsfs_set_check_fcn(int32_t id,
     return;
   }
 
-  /*
-  std::cerr << "Checking set:";
-  for (int i = 0; i < set_size; i++) {
-    std::cerr << " " << set[i];
-  }
-  std::cerr << std::endl;
-  */
-
+  // set is a CheckSet table, of set_size ids
   int32_t obj_id = -1;
-  auto it = addr_to_objid.find(AddrRange(addr));
   bool found = false;
-  if (it != std::end(addr_to_objid)) {
-    auto &obj_vec = it->second;
-    /*
-    std::cerr << "objid is: " << obj_id << std::endl;
-    std::cerr << "set is:";
-    for (int i = 0; i < set_size; i++) {
-      std::cerr << " " << set[i];
+  if (use_shadow()) {
+    auto val = shadow.get(reinterpret_cast<uintptr_t>(addr));
+    if (val > 0 && val < ListBase) {
+      obj_id = val - 1;
+      found = CheckSet::contains(set, obj_id);
+    } else {
+      shadow_ids(val, [set, &obj_id, &found] (int32_t o_id) {
+        found |= CheckSet::contains(set, o_id);
+        obj_id = o_id;
+      });
     }
-    std::cerr << std::endl;
-    */
-    for (auto o_id : obj_vec) {
-      found |= std::binary_search(set, set+set_size, o_id);
+  } else {
+    auto it = addr_to_objid.find(AddrRange(addr));
+    if (it != std::end(addr_to_objid)) {
+      auto &obj_vec = it->second;
+      for (auto o_id : obj_vec) {
+        found |= CheckSet::contains(set, o_id);
+      }
+      obj_id = obj_vec.front();
     }
-    obj_id = obj_vec.front();
   }
 
-
   if (!found) {
     std::cerr << "set_check_fcn abort!" << std::endl;
     std::cerr << "obj_id is: " << obj_id << std::endl;
     std::cerr << "addr is: " << addr << std::endl;
-    std::cerr << "set is:";
-    for (int i = 0; i < set_size; i++) {
-      std::cerr << " " << set[i];
+    std::vector<int32_t> members;
+    CheckSet::forEach(set, [&members] (int32_t o_id) {
+      members.push_back(o_id);
+    });
+    std::sort(std::begin(members), std::end(members));
+    std::cerr << "set is (" << set_size << "):";
+    for (auto o_id : members) {
+      std::cerr << " " << o_id;
     }
     std::cerr << std::endl;
     std::cerr << "id is: " << id << std::endl;
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include "include/lib/SpecCheckBudget.h"
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "include/Assumptions.h"
+#include "include/LLVMHelper.h"
+#include "include/util.h"
+#include "include/lib/IndirFcnTarget.h"
+#include "include/lib/UnusedFunctions.h"
+
+static llvm::cl::opt<std::string>
+  CheckBudget("spec-check-budget", llvm::cl::init(""),
+      llvm::cl::value_desc("percent"),
+      llvm::cl::desc("Only make the speculative assumptions whose checks are "
+        "estimated to fit in this much of the profiled runtime (e.g. 2%)"));
+
+// CostApprox {{{
+CostApprox::CostApprox(const llvm::Module &m, const DynEdgeLoader &edges) :
+    edges_(edges) {
+  for (auto &fcn : m) {
+    for (auto &bb : fcn) {
+      auto num_executions = edges_.getExecutionCount(&bb);
+      auto num_insts = std::distance(std::begin(bb), std::end(bb));
+
+      totalDynInsts_ += static_cast<double>(num_executions) * num_insts;
+    }
+  }
+}
+
+double CostApprox::blockCost(const llvm::BasicBlock &bb) const {
+  auto num_insts = std::distance(std::begin(bb), std::end(bb));
+  return checkCost(bb, num_insts);
+}
+
+double CostApprox::checkCost(const llvm::BasicBlock &bb,
+    int64_t approx_cost) const {
+  if (!hasInfo()) {
+    return 0.0;
+  }
+
+  auto num_executions = edges_.getExecutionCount(&bb);
+  return static_cast<double>(num_executions) * approx_cost / totalDynInsts_;
+}
+
+double CostApprox::siteCost(InstrumentationSite &site) const {
+  return checkCost(*site.getBB(), site.approxCost());
+}
+
+double CostApprox::siteCost(
+    const std::vector<std::unique_ptr<InstrumentationSite>> &sites) const {
+  double total_cost = 0.0;
+  for (auto &psite : sites) {
+    total_cost += siteCost(*psite);
+  }
+  return total_cost;
+}
+//}}}
+
+// Parses "<percent>[%]" as a fraction
+static bool parseBudget(const std::string &str, double &budget) {
+  char *end;
+  double percent = strtod(str.c_str(), &end);
+  if (end == str.c_str()) {
+    return false;
+  }
+
+  if (*end == '%') {
+    ++end;
+  }
+
+  if (*end != '\0' || percent < 0.0) {
+    return false;
+  }
+
+  budget = percent / 100.0;
+  return true;
+}
+
+SpecCheckBudget::SpecCheckBudget() : llvm::ModulePass(ID) { }
+
+bool SpecCheckBudget::enabled() {
+  return CheckBudget != "";
+}
+
+char SpecCheckBudget::ID = 0;
+static llvm::RegisterPass<SpecCheckBudget> X("spec-assumption-budget",
+    "Chooses the speculative assumptions worth checking, from the edge profile",
+    false, false);
+
+void SpecCheckBudget::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
+  usage.addRequired<DynEdgeLoader>();
+  usage.addRequired<UnusedFunctions>();
+  usage.addRequired<IndirFunctionInfo>();
+  usage.setPreservesAll();
+}
+
+bool SpecCheckBudget::runOnModule(llvm::Module &m) {
+  auto &edges = getAnalysis<DynEdgeLoader>();
+  auto &used_info = getAnalysis<UnusedFunctions>();
+  auto &indir_info = getAnalysis<IndirFunctionInfo>();
+
+  if (edges.hasDynData()) {
+    costs_ = std14::make_unique<CostApprox>(m, edges);
+  }
+
+  if (!enabled()) {
+    return false;
+  }
+
+  double budget;
+  if (!parseBudget(CheckBudget, budget)) {
+    llvm::dbgs() << "WARNING: Bad -spec-check-budget: " << CheckBudget <<
+      ", keeping all assumptions\n";
+    return false;
+  }
+
+  if (costs_ == nullptr || !costs_->hasInfo() || !indir_info.hasInfo()) {
+    llvm::dbgs() << "SpecCheckBudget: No profile, keeping all assumptions\n";
+    return false;
+  }
+
+  limited_ = true;
+
+  // Without its assumption, an indirect call may reach any function whose
+  //   address is taken, so the precision an assumption buys is the targets it
+  //   rules out
+  int64_t num_addr_taken = 0;
+  for (auto &fcn : m) {
+    if (fcn.hasAddressTaken()) {
+      num_addr_taken++;
+    }
+  }
+
+  struct Candidate {
+    const llvm::Instruction *ci;
+    double cost;
+    int64_t gain;
+  };
+
+  // The targets are functions, which are never allocated or freed, so the
+  //   only check is the set check at the call
+  std::vector<Candidate> candidates;
+  SetCache set_cache;
+  foreach_used_inst(m, used_info,
+      [this, &candidates, &set_cache, &indir_info, num_addr_taken]
+      (llvm::Instruction *ci) {
+    // Calls and invokes
+    llvm::ImmutableCallSite cs(ci);
+    if (!cs || LLVMHelper::getFcnFromCall(cs) != nullptr) {
+      return;
+    }
+
+    auto &targets = indir_info.getTargets(ci);
+    SetCheckInst check(cs.getCalledValue(), { }, set_cache, ci);
+
+    Candidate cand;
+    cand.ci = ci;
+    cand.cost = costs_->checkCost(*ci->getParent(), check.approxCost());
+    cand.gain = std::max<int64_t>(0,
+        num_addr_taken - static_cast<int64_t>(targets.size()));
+    candidates.push_back(cand);
+  });
+
+  // Best precision per cost first (free checks first of all)
+  auto ratio = [] (const Candidate &cand) {
+    if (cand.cost == 0.0) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return cand.gain / cand.cost;
+  };
+
+  std::stable_sort(std::begin(candidates), std::end(candidates),
+      [&ratio] (const Candidate &lhs, const Candidate &rhs) {
+    return ratio(lhs) > ratio(rhs);
+  });
+
+  double spent = 0.0;
+  for (auto &cand : candidates) {
+    if (cand.cost == 0.0 || (cand.gain > 0 && spent + cand.cost <= budget)) {
+      spent += cand.cost;
+      keptCalls_.insert(cand.ci);
+    }
+  }
+
+  llvm::dbgs() << "SpecCheckBudget: Kept " << keptCalls_.size() << " of " <<
+    candidates.size() << " indirect call assumptions, estimated cost " <<
+    100.0 * spent << "% of " << 100.0 * budget << "%\n";
+
+  return false;
+}
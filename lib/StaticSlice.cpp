@@ -5,12 +5,21 @@
 #include <gperftools/profiler.h>
 
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -98,6 +107,96 @@ static llvm::cl::opt<std::string>
       llvm::cl::value_desc("string"),
       llvm::cl::desc("Where the slice number choices will be saved"));
 
+static llvm::cl::opt<unsigned> //  NOLINT
+  slice_threads("slice-threads", llvm::cl::init(1),
+      llvm::cl::value_desc("int"),
+      llvm::cl::desc("Number of threads used to compute random/loaded slices"));
+
+static llvm::cl::opt<unsigned> //  NOLINT
+  slice_batch_width("slice-batch-width", llvm::cl::init(0),
+      llvm::cl::value_desc("int"),
+      llvm::cl::desc("With -slice-cache, slices this many criteria (64, 128 or "
+        "256) in a single traversal, 0 slices each criterion separately"));
+
+static llvm::cl::opt<bool>
+  slice_binary_output("slice-binary-output", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Writes -slice-outfile in the (smaller) binary format, "
+        "instead of text"));
+
+static llvm::cl::opt<bool>
+  slice_cache("slice-cache", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Memoizes closed sub-slices (per context) across slice "
+        "criteria.  NOTE: explores every context of a value, not just the "
+        "first one found"));
+
+// Work-stealing pool for batches of independent slices {{{
+// Each worker owns a deque of task ids, dealt round-robin so the lowest ids
+//   (which the in-order writer waits on first) are at the front of every
+//   deque.  Owners pop from the front, thieves steal from the back.
+class SlicePool {
+ public:
+  SlicePool(size_t num_threads, size_t num_tasks) : queues_(num_threads) {
+    for (size_t i = 0; i < num_tasks; ++i) {
+      queues_[i % num_threads].tasks.push_back(i);
+    }
+  }
+
+  // Runs fcn(task_id) for every task, returns once all tasks are done
+  template <typename fcn_type>
+  void run(fcn_type fcn) {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      threads.emplace_back([this, i, &fcn] {
+        size_t task;
+        while (getTask(i, task)) {
+          fcn(task);
+        }
+      });
+    }
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+ private:
+  struct TaskQueue {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+  };
+
+  bool getTask(size_t self, size_t &task) {
+    {
+      auto &queue = queues_[self];
+      std::lock_guard<std::mutex> lock(queue.lock);
+      if (!queue.tasks.empty()) {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        return true;
+      }
+    }
+
+    // Our queue is empty, try to steal from the others
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      auto &victim = queues_[(self + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.lock);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return true;
+      }
+    }
+
+    // No tasks are ever added after construction, so we're done
+    return false;
+  }
+
+  std::vector<TaskQueue> queues_;
+};
+//}}}
+
 
 class Position {
   //{{{
@@ -153,6 +252,32 @@ static llvm::raw_ostream &operator<<(llvm::raw_ostream &os,
   return os;
 }
 
+// Values reached by a slice, instructions are kept as InstLabeler id bits {{{
+class SliceValues {
+ public:
+  explicit SliceValues(const InstLabeler &lblr) : lblr_(lblr) { }
+
+  // Returns true if val wasn't already in the set
+  bool insert(const llvm::Value *val) {
+    if (auto inst = dyn_cast<llvm::Instruction>(val)) {
+      return insts_.test_and_set(lblr_.getID(inst));
+    }
+
+    return others_.insert(val).second;
+  }
+
+  InstIdSet &insts() {
+    return insts_;
+  }
+
+ private:
+  const InstLabeler &lblr_;
+
+  InstIdSet insts_;
+  std::unordered_set<const llvm::Value *> others_;
+};
+//}}}
+
 class StaticSlice : public llvm::ModulePass {
  public:
   static char ID;
@@ -208,10 +333,31 @@ class StaticSlice : public llvm::ModulePass {
 
     llvm::dbgs() << "SLICING\n";
 
+    batchWidth_ = slice_batch_width;
+    if (batchWidth_ != 0 && batchWidth_ != 64 && batchWidth_ != 128 &&
+        batchWidth_ != 256) {
+      llvm::dbgs() << "WARNING: Unsupported -slice-batch-width " <<
+        batchWidth_ << ", using 64\n";
+      batchWidth_ = 64;
+    }
+
+    // Batches explore every context, so they only reproduce -slice-cache's
+    //   slices, not getSlice's default (first context found) ones
+    if (batchWidth_ != 0 && !slice_cache) {
+      llvm::dbgs() << "WARNING: -slice-batch-width needs -slice-cache, "
+        "slicing each criterion separately\n";
+      batchWidth_ = 0;
+    }
+
     std::ofstream slice_writer(slice_save_str, std::ofstream::out);
     std::ifstream slice_reader(slice_load_str, std::ifstream::in);
-    InstLabeler lblr(m, dynInfo_);
-    std::ofstream out_file(outfilename, std::ofstream::out);
+    lblr_ = std14::make_unique<InstLabeler>(m, dynInfo_);
+    auto &lblr = *lblr_;
+    std::ofstream out_file(outfilename,
+        std::ofstream::out | std::ofstream::binary);
+    if (slice_binary_output) {
+      InstWriter::WriteHeader(out_file);
+    }
 
     if (do_rand_slice) {
       util::PerfTimerPrinter X(llvm::dbgs(), "Random Slicing");
@@ -226,7 +372,9 @@ class StaticSlice : public llvm::ModulePass {
 
       std::minstd_rand rgen(rand_seed);
 
-      ProfilerStart("slice_random.prof");
+      // Choose all of the slice criteria up front, so the slices themselves
+      //   may be computed in any order
+      std::vector<const llvm::Instruction *> criteria;
       for (int i = 0; i < num_slices; i++) {
         auto fcn_num = dist(rgen);
         int64_t num_insts = 0;
@@ -237,43 +385,15 @@ class StaticSlice : public llvm::ModulePass {
         std::uniform_int_distribution<int> inst_dist(0, num_insts-1);
         auto inst_num = inst_dist(rgen);
 
-        auto &inst = *insts[inst_num];
-        // Create a slice of this instruction:
-        llvm::dbgs() << "Slicing: " << inst << "\n";
+        auto inst = insts[inst_num];
+        criteria.push_back(inst);
 
-        auto positions = getInitialPositions(&inst);
-        llvm::dbgs() << "Slice has: " << positions.size() <<
-          " initial positions\n";
-
-        auto slice_set = getSlice(positions);
-        int64_t slice_insts = 0;
-        for (auto val : slice_set) {
-          auto inst = dyn_cast<llvm::Instruction>(val);
-          if (inst != nullptr) {
-            slice_insts++;
-          }
-        }
-        llvm::dbgs() << "slice num: " << i << "\n";
-        llvm::dbgs() << "  slice name: " <<
-          inst.getParent()->getParent()->getName() << ": " <<
-          inst.getParent()->getName() << "->" << inst << "\n";
-        llvm::dbgs() << "  slice insts: " << slice_insts << "\n";
-        /*
-        llvm::dbgs() << "Have slice:\n";
-        for (auto val : slice_set) {
-          llvm::dbgs() << "  " << *val << "\n";
-        }
-        */
-
-        // and write out the slice, for later analysis:
-        InstWriter::Write(out_file, i,
-            std::begin(slice_set), std::end(slice_set),
-            lblr);
-
-
-        SlicePosition pos(&inst, m);
+        SlicePosition pos(inst, m);
         slice_writer << pos << "\n";
       }
+
+      ProfilerStart("slice_random.prof");
+      sliceAll(m, criteria, out_file);
       ProfilerStop();
     }
 
@@ -284,43 +404,12 @@ class StaticSlice : public llvm::ModulePass {
           std::istream_iterator<SlicePosition>(slice_reader),
           std::istream_iterator<SlicePosition>());
 
-      size_t i = 0;
+      std::vector<const llvm::Instruction *> criteria;
       for (auto &slice_pos : slices) {
-        const llvm::Instruction *inst = slice_pos.inst(m);
-
-        // Create a slice of this instruction:
-        llvm::dbgs() << "Slicing: " << *inst << "\n";
-
-        auto positions = getInitialPositions(inst);
-        llvm::dbgs() << "Slice has: " << positions.size() <<
-          " initial positions\n";
-
-        auto slice_set = getSlice(positions);
-        int64_t slice_insts = 0;
-        for (auto val : slice_set) {
-          auto inst = dyn_cast<llvm::Instruction>(val);
-          if (inst != nullptr) {
-            slice_insts++;
-          }
-        }
-        llvm::dbgs() << "slice num: " << i << "\n";
-        llvm::dbgs() << "  slice name: " <<
-          inst->getParent()->getParent()->getName() << ": " <<
-          inst->getParent()->getName() << "->" << *inst << "\n";
-        llvm::dbgs() << "  slice insts: " << slice_insts << "\n";
-        /*
-        llvm::dbgs() << "Have slice:\n";
-        for (auto val : slice_set) {
-          llvm::dbgs() << "  " << *val << "\n";
-        }
-        */
-
-        // and write out the slice, for later analysis:
-        InstWriter::Write(out_file, i,
-            std::begin(slice_set), std::end(slice_set),
-            lblr);
-        ++i;
+        criteria.push_back(slice_pos.inst(m));
       }
+
+      sliceAll(m, criteria, out_file);
     }
 
     if (do_main_slice) {
@@ -335,8 +424,8 @@ class StaticSlice : public llvm::ModulePass {
 
           auto slice_set = getSlice(positions);
           llvm::dbgs() << "Have slice:\n";
-          for (auto val : slice_set) {
-            llvm::dbgs() << "  " << *val << "\n";
+          for (auto id : slice_set) {
+            llvm::dbgs() << "  " << *lblr.getInst(id) << "\n";
           }
         }
       }
@@ -441,82 +530,33 @@ class StaticSlice : public llvm::ModulePass {
         ret.emplace_back(info, id);
 
         // llvm::dbgs() << "Evaluating load: " << *pinst << "\n";
-        auto &bb_set = pos.predBBs();
-        /*
-        llvm::dbgs() << "predBBs is: " << util::print_iter_cpy(bb_set) << "\n";
-        llvm::dbgs() << "pos.stack() is : " << pos.stack() << "\n";
-        */
-        // llvm::dbgs() << "bb_set size: " << bb_set.count() << "\n";
-        auto &visited_set = inst_to_checked_bbs[pinst];
-        auto to_visit = bb_set - visited_set;
-
-        // Add the set we're about to visit to our visited set
-        visited_set |= to_visit;
-
-        auto ld_src = pinst->getOperand(0);
-        /*
-        llvm::dbgs() << "ld isnt is: " <<
-          pinst->getParent()->getParent()->getName() << ": " <<
-          pinst->getParent()->getName() << " -- "
-          << *pinst << "\n";
-          */
-
-        // Now visit all the bbs we need to
-        // llvm::dbgs() << "to_visit size: " << to_visit.count() << "\n";
-        for (auto bb_id : to_visit) {
-          // llvm::dbgs() << "bb_id: " << bb_id << "\n";
-          auto bb = bbNum_->getBB(bb_id);
-          // llvm::dbgs() << "got bb: " << bb->getName() << "\n";
-          assert(dynInfo_->isUsed(bb));
-          for (auto &inst : *bb) {
-            if (llvm::isa<llvm::StoreInst>(inst)) {
-              auto st_dest = inst.getOperand(1);
-
-              if (llvm::isa<llvm::PointerType>(inst.getOperand(1)->getType())) {
-                // If we're forcing using static alias analysis:
-                if (force_alias) {
-                  if (dynAlias_->loadStoreAlias(cast<llvm::LoadInst>(pinst),
-                        cast<llvm::StoreInst>(&inst))) {
-                    // Need to get all valid contexts prior to my own that are
-                    //   also valid for this context...
-                    // FIXME: Do that...
-                    // Get contexts...
-                    auto prior_contexts = info.getPriorContexts(&inst,
-                        pos.id());
-
-                    for (auto context_id : prior_contexts) {
-                      ret.emplace_back(info, context_id);
-                    }
-                  }
-                } else {
-                  // llvm::dbgs() << "store is: " << inst << "\n";
-                  // llvm::dbgs() << "ld is: " << *pinst << "\n";
-                  if (alias_->alias(llvm::MemoryLocation(st_dest),
-                          llvm::MemoryLocation(ld_src)) !=
-                        llvm::AliasResult::NoAlias) {
-                    // llvm::dbgs() << "Adding inst: " << inst << "\n";
-                    // llvm::dbgs() << "  with stack: " << stack << "\n";  // NOLINT
-                    auto prior_contexts = info.getPriorContexts(&inst,
-                        pos.id());
-
-                    for (auto context_id : prior_contexts) {
-                      ret.emplace_back(info, context_id);
-                    }
-                  }
-                }
-              // OR if we just cast a ptr to an int...
-              } else if (llvm::ConstantExpr *ce =
-                  dyn_cast<llvm::ConstantExpr>(inst.getOperand(1))) {
-                if (ce->getOpcode() == llvm::Instruction::PtrToInt) {
-                  llvm::dbgs() << "FIXME: unsupported constexpr cast to int"
-                    " then store\n";
-                }
-              } else {
-                llvm::dbgs() << "FIXME: unsupported load from non-ptr: " <<
-                  inst << "\n";
-              }
-            }
+        if (slice_cache) {
+          for (auto context_id : getLoadStores(pos, li)) {
+            ret.emplace_back(info, context_id);
+          }
+        } else {
+          // Pull the bbs out of the bdds while holding the bdd lock, the
+          //   store scan doesn't need it
+          std::vector<BBNumber::Id> to_visit;
+          {
+            auto bdd_lock = info.lockBdds();
+            auto &bb_set = pos.predBBs();
+            /*
+            llvm::dbgs() << "predBBs is: " << util::print_iter_cpy(bb_set) <<
+              "\n";
+            llvm::dbgs() << "pos.stack() is : " << pos.stack() << "\n";
+            */
+            // llvm::dbgs() << "bb_set size: " << bb_set.count() << "\n";
+            auto &visited_set = inst_to_checked_bbs[pinst];
+            auto to_visit_set = bb_set - visited_set;
+
+            // Add the set we're about to visit to our visited set
+            visited_set |= to_visit_set;
+
+            to_visit.assign(std::begin(to_visit_set), std::end(to_visit_set));
           }
+
+          addAliasingStores(pos, li, to_visit, ret);
         }
 
         // llvm::dbgs() << "END LD INST\n";
@@ -673,9 +713,121 @@ class StaticSlice : public llvm::ModulePass {
     return ret;
   }
 
-  std::unordered_set<const llvm::Value *>
-  getSlice(const std::vector<Position> &positions) {
-    std::unordered_set<const llvm::Value *> ret;
+  // Adds the (prior) contexts of every store in bbs which may alias li
+  void addAliasingStores(const Position &pos, const llvm::LoadInst *li,
+      const std::vector<BBNumber::Id> &bbs, std::vector<Position> &ret) {
+    auto &info = pos.info();
+    auto ld_src = li->getOperand(0);
+    /*
+    llvm::dbgs() << "ld isnt is: " <<
+      li->getParent()->getParent()->getName() << ": " <<
+      li->getParent()->getName() << " -- "
+      << *li << "\n";
+      */
+
+    // Now visit all the bbs we need to
+    // llvm::dbgs() << "to_visit size: " << bbs.size() << "\n";
+    for (auto bb_id : bbs) {
+      // llvm::dbgs() << "bb_id: " << bb_id << "\n";
+      auto bb = bbNum_->getBB(bb_id);
+      // llvm::dbgs() << "got bb: " << bb->getName() << "\n";
+      assert(dynInfo_->isUsed(bb));
+      for (auto &inst : *bb) {
+        if (llvm::isa<llvm::StoreInst>(inst)) {
+          auto st_dest = inst.getOperand(1);
+
+          if (llvm::isa<llvm::PointerType>(inst.getOperand(1)->getType())) {
+            // If we're forcing using static alias analysis:
+            if (force_alias) {
+              if (loadStoreAlias(li, cast<llvm::StoreInst>(&inst))) {
+                // Need to get all valid contexts prior to my own that are
+                //   also valid for this context...
+                // FIXME: Do that...
+                // Get contexts...
+                auto prior_contexts = info.getPriorContexts(&inst,
+                    pos.id());
+
+                for (auto context_id : prior_contexts) {
+                  ret.emplace_back(info, context_id);
+                }
+              }
+            } else {
+              // llvm::dbgs() << "store is: " << inst << "\n";
+              // llvm::dbgs() << "ld is: " << *li << "\n";
+              if (mayAlias(st_dest, ld_src)) {
+                // llvm::dbgs() << "Adding inst: " << inst << "\n";
+                // llvm::dbgs() << "  with stack: " << stack << "\n";  // NOLINT
+                auto prior_contexts = info.getPriorContexts(&inst,
+                    pos.id());
+
+                for (auto context_id : prior_contexts) {
+                  ret.emplace_back(info, context_id);
+                }
+              }
+            }
+          // OR if we just cast a ptr to an int...
+          } else if (llvm::ConstantExpr *ce =
+              dyn_cast<llvm::ConstantExpr>(inst.getOperand(1))) {
+            if (ce->getOpcode() == llvm::Instruction::PtrToInt) {
+              llvm::dbgs() << "FIXME: unsupported constexpr cast to int"
+                " then store\n";
+            }
+          } else {
+            llvm::dbgs() << "FIXME: unsupported load from non-ptr: " <<
+              inst << "\n";
+          }
+        }
+      }
+    }
+  }
+
+  // The stores feeding a load only depend on the load and its pred bbs (prior
+  //   contexts are found independent of the load's context), so they are
+  //   memoized across contexts and slices
+  const std::vector<ContextInfo::ContextId> &
+  getLoadStores(const Position &pos, const llvm::LoadInst *li) {
+    auto &info = pos.info();
+    std::vector<BBNumber::Id> bbs;
+    LoadStoreKey key;
+    {
+      auto bdd_lock = info.lockBdds();
+      auto &bb_set = pos.predBBs();
+      // NOTE: The bdd id is stable, the context keeps bb_set alive
+      key = std::make_tuple(li, bb_set.id(),
+          pos.stack() == ContextInfo::StackInfo::NonCons());
+
+      {
+        std::lock_guard<std::mutex> lock(summaryLock_);
+        auto it = loadStores_.find(key);
+        if (it != std::end(loadStores_)) {
+          return it->second;
+        }
+      }
+
+      bbs.assign(std::begin(bb_set), std::end(bb_set));
+    }
+
+    std::vector<Position> stores;
+    addAliasingStores(pos, li, bbs, stores);
+
+    std::vector<ContextInfo::ContextId> store_ids;
+    store_ids.reserve(stores.size());
+    for (auto &store_pos : stores) {
+      store_ids.push_back(store_pos.id());
+    }
+
+    std::lock_guard<std::mutex> lock(summaryLock_);
+    return loadStores_.emplace(key, std::move(store_ids)).first->second;
+  }
+
+  // Returns the instructions of the slice, non-instruction values (arguments,
+  //   constants) are only tracked while slicing
+  InstIdSet getSlice(const std::vector<Position> &positions) {
+    if (slice_cache) {
+      return getSliceCached(positions);
+    }
+
+    SliceValues ret(*lblr_);
     // Add v to our set, and do some work
     util::Worklist<Position> worklist(
         std::begin(positions), std::end(positions));
@@ -709,22 +861,528 @@ class StaticSlice : public llvm::ModulePass {
         }
         */
         assert(src.val() != nullptr);
-        if (ret.find(src.val()) == std::end(ret)) {
+        if (ret.insert(src.val())) {
           /*
           if (src.hasContext()) {
             llvm::dbgs() << "src_stack is: " << src.stack() << "\n";
           }
           */
           worklist.push(src);
-          ret.insert(src.val());
         }
       }
     }
 
+    // The checked bb sets are bdds, they must die under the bdd lock
+    auto bdd_lock = contextInfo_->lockBdds();
+    inst_to_checked_bbs.clear();
+
+    return std::move(ret.insts());
+  }
+
+  // Cross-slice summaries {{{
+  // A summary is one strongly connected set of contexts in the (backwards)
+  //   dependence graph, plus the summaries it depends on.  Summaries are
+  //   immutable once published, so any later slice reaching one of its
+  //   contexts unions the summary instead of re-exploring it.
+  struct SliceSummary {
+    InstIdSet insts;
+    std::vector<const SliceSummary *> deps;
+    size_t numContexts = 0;
+  };
+
+  const SliceSummary *findSummary(ContextInfo::ContextId id) {
+    std::lock_guard<std::mutex> lock(summaryLock_);
+    auto it = summaries_.find(id);
+    if (it == std::end(summaries_)) {
+      return nullptr;
+    }
+
+    return it->second;
+  }
+
+  void addSummary(std::unique_ptr<SliceSummary> summary,
+      const std::vector<ContextInfo::ContextId> &ids) {
+    std::lock_guard<std::mutex> lock(summaryLock_);
+    for (auto id : ids) {
+      // Another thread may have summarized the same contexts, either summary
+      //   is correct
+      summaries_.emplace(id, summary.get());
+    }
+    summaryStore_.emplace_back(std::move(summary));
+  }
+
+  // Same as getSlice, but tracks each context (not only each value) and builds
+  //   a summary for every SCC of contexts it finishes (Tarjan's, iteratively)
+  InstIdSet getSliceCached(const std::vector<Position> &positions) {
+    typedef ContextInfo::ContextId ContextId;
+    struct Frame {
+      ContextId id;
+      std::vector<Position> srcs;
+      size_t next;
+    };
+
+    struct NodeData {
+      size_t index;
+      size_t lowlink;
+      bool onStack;
+      std::vector<const SliceSummary *> deps;
+    };
+
+    std::unordered_map<ContextId, NodeData, ContextId::hasher> nodes;
+    // Summary of every context finished (or found in the cache) by this slice
+    std::unordered_map<ContextId, const SliceSummary *, ContextId::hasher>
+      done;
+    std::unordered_set<const SliceSummary *> built;
+    std::vector<ContextId> scc_stack;
+    std::vector<Frame> call_stack;
+    size_t next_index = 0;
+    size_t hits = 0;
+    size_t expanded = 0;
+
+    // Not used for loads when caching, but getSources wants one
+    std::unordered_map<const llvm::Value *, ContextInfo::BBBddSet>
+      inst_to_checked_bbs;
+
+    auto lookup = [this, &done, &hits] (ContextId id) -> const SliceSummary * {
+      auto it = done.find(id);
+      if (it != std::end(done)) {
+        return it->second;
+      }
+
+      auto summary = findSummary(id);
+      if (summary != nullptr) {
+        hits++;
+        done.emplace(id, summary);
+      }
+      return summary;
+    };
+
+    auto push = [this, &nodes, &scc_stack, &call_stack, &next_index,
+         &expanded, &inst_to_checked_bbs] (const Position &pos) {
+      auto &data = nodes[pos.id()];
+      data.index = next_index;
+      data.lowlink = next_index;
+      data.onStack = true;
+      next_index++;
+      expanded++;
+
+      scc_stack.push_back(pos.id());
+      call_stack.push_back(Frame{pos.id(),
+          getSources(pos, inst_to_checked_bbs), 0});
+    };
+
+    for (auto &pos : positions) {
+      if (lookup(pos.id()) != nullptr ||
+          nodes.find(pos.id()) != std::end(nodes)) {
+        continue;
+      }
+
+      push(pos);
+      while (!call_stack.empty()) {
+        auto &frame = call_stack.back();
+
+        if (frame.next < frame.srcs.size()) {
+          auto src = frame.srcs[frame.next++];
+          assert(src.val() != nullptr);
+
+          auto summary = lookup(src.id());
+          if (summary != nullptr) {
+            nodes[frame.id].deps.push_back(summary);
+            continue;
+          }
+
+          auto it = nodes.find(src.id());
+          if (it == std::end(nodes)) {
+            // NOTE: invalidates frame
+            push(src);
+            continue;
+          }
+
+          // Finished nodes are all in done, so this one is in our SCC stack
+          assert(it->second.onStack);
+          auto &data = nodes[frame.id];
+          data.lowlink = std::min(data.lowlink, it->second.index);
+          continue;
+        }
+
+        // All sources are visited, finish this context
+        auto id = frame.id;
+        call_stack.pop_back();
+
+        auto &data = nodes[id];
+        if (data.lowlink != data.index) {
+          // Part of a larger SCC, rooted further up the call stack
+          auto &parent = nodes[call_stack.back().id];
+          parent.lowlink = std::min(parent.lowlink, data.lowlink);
+          continue;
+        }
+
+        // id roots an SCC, summarize it
+        auto summary = std14::make_unique<SliceSummary>();
+        std::vector<ContextId> members;
+        ContextId member;
+        do {
+          member = scc_stack.back();
+          scc_stack.pop_back();
+
+          auto &member_data = nodes[member];
+          member_data.onStack = false;
+          members.push_back(member);
+          auto inst = dyn_cast<llvm::Instruction>(
+              contextInfo_->getContext(member).inst());
+          if (inst != nullptr) {
+            summary->insts.set(lblr_->getID(inst));
+          }
+          summary->deps.insert(std::end(summary->deps),
+              std::begin(member_data.deps), std::end(member_data.deps));
+        } while (member != id);
+
+        std::sort(std::begin(summary->deps), std::end(summary->deps));
+        summary->deps.erase(
+            std::unique(std::begin(summary->deps), std::end(summary->deps)),
+            std::end(summary->deps));
+        summary->numContexts = members.size();
+
+        auto psummary = summary.get();
+        built.insert(psummary);
+        for (auto member : members) {
+          done[member] = psummary;
+        }
+        addSummary(std::move(summary), members);
+
+        if (!call_stack.empty()) {
+          nodes[call_stack.back().id].deps.push_back(psummary);
+        }
+      }
+    }
+
+    // Now union the summaries reachable from our initial positions
+    InstIdSet ret;
+    std::unordered_set<const SliceSummary *> visited;
+    std::vector<const SliceSummary *> worklist;
+    size_t served = 0;
+    for (auto &pos : positions) {
+      worklist.push_back(done.at(pos.id()));
+    }
+
+    while (!worklist.empty()) {
+      auto summary = worklist.back();
+      worklist.pop_back();
+
+      if (!visited.insert(summary).second) {
+        continue;
+      }
+
+      ret |= summary->insts;
+      if (built.find(summary) == std::end(built)) {
+        served += summary->numContexts;
+      }
+
+      worklist.insert(std::end(worklist),
+          std::begin(summary->deps), std::end(summary->deps));
+    }
+
+    cacheHits_ += hits;
+    cacheExpanded_ += expanded;
+    cacheServed_ += served;
+
+    auto bdd_lock = contextInfo_->lockBdds();
+    inst_to_checked_bbs.clear();
+
     return ret;
   }
 
+  // Multi-criteria slicing {{{
+  // Slices up to width criteria in one traversal.  Each criterion owns one
+  //   bit, and the mask of each context is the set of criteria whose slice
+  //   reaches it.  Masks are propagated backwards along the sources
+  //   getSources() finds, until nothing changes.  Like -slice-cache, this
+  //   tracks every context, so the slices match -slice-cache's (not the
+  //   default getSlice's), and it is only used with -slice-cache.
+  template <size_t width>
+  std::vector<InstIdSet> getSliceBatch(
+      const std::vector<std::vector<Position>> &criteria) {
+    typedef ContextInfo::ContextId ContextId;
+    typedef std::bitset<width> Mask;
+    assert(criteria.size() <= width);
+
+    std::unordered_map<ContextId, Mask, ContextId::hasher> masks;
+    // Sources of each context, so each is only found once per batch
+    std::unordered_map<ContextId, std::vector<Position>, ContextId::hasher>
+      sources;
+    std::unordered_set<ContextId, ContextId::hasher> queued;
+    std::deque<ContextId> worklist;
+
+    // Not used for loads in this mode, but getSources wants one
+    std::unordered_map<const llvm::Value *, ContextInfo::BBBddSet>
+      inst_to_checked_bbs;
+
+    auto enqueue = [&queued, &worklist] (const Position &pos) {
+      if (queued.insert(pos.id()).second) {
+        worklist.push_back(pos.id());
+      }
+    };
+
+    for (size_t i = 0; i < criteria.size(); ++i) {
+      for (auto &pos : criteria[i]) {
+        masks[pos.id()].set(i);
+        enqueue(pos);
+      }
+    }
+
+    size_t num_visits = 0;
+    while (!worklist.empty()) {
+      auto id = worklist.front();
+      worklist.pop_front();
+      queued.erase(id);
+      num_visits++;
+
+      auto src_it = sources.find(id);
+      if (src_it == std::end(sources)) {
+        Position pos(*contextInfo_, id);
+        src_it = sources.emplace(id,
+            getSources(pos, inst_to_checked_bbs)).first;
+      }
+
+      auto mask = masks[id];
+      for (auto &src : src_it->second) {
+        assert(src.val() != nullptr);
+        auto &src_mask = masks[src.id()];
+        auto new_mask = src_mask | mask;
+        if (new_mask != src_mask) {
+          src_mask = new_mask;
+          enqueue(src);
+        }
+      }
+    }
+
+    std::vector<InstIdSet> ret(criteria.size());
+    for (auto &pr : masks) {
+      auto inst = dyn_cast<llvm::Instruction>(
+          contextInfo_->getContext(pr.first).inst());
+      if (inst == nullptr) {
+        continue;
+      }
+
+      auto inst_id = lblr_->getID(inst);
+      for (size_t i = 0; i < criteria.size(); ++i) {
+        if (pr.second.test(i)) {
+          ret[i].set(inst_id);
+        }
+      }
+    }
+
+    batchContexts_ += sources.size();
+    batchVisits_ += num_visits;
+
+    auto bdd_lock = contextInfo_->lockBdds();
+    inst_to_checked_bbs.clear();
+
+    return ret;
+  }
+  //}}}
+
+  void printCacheStats() {
+    if (batchWidth_ != 0) {
+      size_t contexts = batchContexts_;
+      size_t visits = batchVisits_;
+      llvm::dbgs() << "Batch slicing: " << contexts << " contexts, " <<
+        visits << " context visits\n";
+    }
+
+    if (!slice_cache) {
+      return;
+    }
+
+    size_t hits = cacheHits_;
+    size_t expanded = cacheExpanded_;
+    size_t served = cacheServed_;
+
+    llvm::dbgs() << "Slice cache: " << hits << " hits, " << expanded <<
+      " positions explored";
+    if (hits + expanded > 0) {
+      llvm::dbgs() << " (hit rate " << (100 * hits) / (hits + expanded) <<
+        "%)";
+    }
+    llvm::dbgs() << "\n";
+
+    llvm::dbgs() << "Slice cache: " << served <<
+      " positions served from summaries";
+    if (served + expanded > 0) {
+      llvm::dbgs() << " (" << (100 * served) / (served + expanded) <<
+        "% fewer positions visited)";
+    }
+    llvm::dbgs() << "\n";
+    llvm::dbgs() << "Slice cache: " << summaryStore_.size() << " summaries, " <<
+      loadStores_.size() << " load store sets\n";
+  }
+  //}}}
+
  private:
+  struct SliceResult {
+    std::string log;
+    InstIdSet slice;
+  };
+
+  static SliceResult makeResult(size_t slice_num,
+      const llvm::Instruction *inst, size_t num_positions, InstIdSet slice) {
+    SliceResult result;
+    result.slice = std::move(slice);
+    llvm::raw_string_ostream log(result.log);
+
+    log << "Slicing: " << *inst << "\n";
+    log << "Slice has: " << num_positions << " initial positions\n";
+
+    int64_t slice_insts = result.slice.count();
+    log << "slice num: " << slice_num << "\n";
+    log << "  slice name: " <<
+      inst->getParent()->getParent()->getName() << ": " <<
+      inst->getParent()->getName() << "->" << *inst << "\n";
+    log << "  slice insts: " << slice_insts << "\n";
+    /*
+    log << "Have slice:\n";
+    for (auto id : result.slice) {
+      log << "  " << *lblr_->getInst(id) << "\n";
+    }
+    */
+    log.flush();
+
+    return result;
+  }
+
+  // Slices criteria [first, last), in one traversal when batching
+  std::vector<SliceResult> sliceUnit(
+      const std::vector<const llvm::Instruction *> &criteria,
+      size_t first, size_t last) {
+    std::vector<std::vector<Position>> positions;
+    for (size_t i = first; i < last; ++i) {
+      positions.emplace_back(getInitialPositions(criteria[i]));
+    }
+
+    std::vector<InstIdSet> slices;
+    switch (batchWidth_) {
+      case 0:
+        assert(last == first + 1);
+        slices.emplace_back(getSlice(positions[0]));
+        break;
+      case 64:
+        slices = getSliceBatch<64>(positions);
+        break;
+      case 128:
+        slices = getSliceBatch<128>(positions);
+        break;
+      case 256:
+        slices = getSliceBatch<256>(positions);
+        break;
+      default:
+        llvm_unreachable("Unsupported -slice-batch-width");
+    }
+
+    std::vector<SliceResult> ret;
+    for (size_t i = first; i < last; ++i) {
+      ret.emplace_back(makeResult(i, criteria[i], positions[i-first].size(),
+            std::move(slices[i-first])));
+    }
+
+    return ret;
+  }
+
+  // Slices each of criteria, writing the results in criteria order
+  void sliceAll(llvm::Module &m,
+      const std::vector<const llvm::Instruction *> &criteria,
+      std::ofstream &out_file) {
+    // Each unit of work is one slice, or one batch of slices
+    size_t unit_size = std::max(batchWidth_, static_cast<size_t>(1));
+    size_t num_units = (criteria.size() + unit_size - 1) / unit_size;
+    auto unit_end = [&criteria, unit_size] (size_t unit) {
+      return std::min((unit+1) * unit_size, criteria.size());
+    };
+
+    size_t num_threads = std::max(static_cast<size_t>(slice_threads),
+        static_cast<size_t>(1));
+    num_threads = std::min(num_threads, std::max(num_units,
+          static_cast<size_t>(1)));
+
+    auto write_results = [&out_file, unit_size] (size_t unit,
+        const std::vector<SliceResult> &results) {
+      size_t i = unit * unit_size;
+      for (auto &result : results) {
+        llvm::dbgs() << result.log;
+        // and write out the slice, for later analysis:
+        if (slice_binary_output) {
+          InstWriter::WriteBinary(out_file, i, result.slice);
+        } else {
+          InstWriter::WriteText(out_file, i, result.slice);
+        }
+        ++i;
+      }
+    };
+
+    if (num_threads == 1) {
+      for (size_t unit = 0; unit < num_units; ++unit) {
+        write_results(unit,
+            sliceUnit(criteria, unit * unit_size, unit_end(unit)));
+      }
+      printCacheStats();
+      return;
+    }
+
+    llvm::dbgs() << "Slicing with " << num_threads << " threads\n";
+    freezeSharedAnalyses(m);
+
+    // Finished slices are parked here until all prior slices are written
+    std::mutex done_lock;
+    std::condition_variable done_cv;
+    std::vector<std::unique_ptr<std::vector<SliceResult>>> done(num_units);
+
+    SlicePool pool(num_threads, num_units);
+    std::thread workers([&] {
+      pool.run([&] (size_t unit) {
+        auto results = std14::make_unique<std::vector<SliceResult>>(
+            sliceUnit(criteria, unit * unit_size, unit_end(unit)));
+
+        std::lock_guard<std::mutex> lock(done_lock);
+        done[unit] = std::move(results);
+        done_cv.notify_all();
+      });
+    });
+
+    for (size_t unit = 0; unit < num_units; ++unit) {
+      std::unique_ptr<std::vector<SliceResult>> results;
+      {
+        std::unique_lock<std::mutex> lock(done_lock);
+        done_cv.wait(lock, [&done, unit] { return done[unit] != nullptr; });
+        results = std::move(done[unit]);
+      }
+
+      write_results(unit, *results);
+    }
+
+    workers.join();
+    printCacheStats();
+  }
+
+  // CallDests lazily fills its tables on lookup, fill them all now so
+  //   concurrent slices only ever read them
+  void freezeSharedAnalyses(llvm::Module &m) {
+    for (auto &fcn : m) {
+      callDests_->getCallers(&fcn);
+      callDests_->getRets(&fcn);
+    }
+  }
+
+  // The alias analyses keep internal caches, so queries are serialized
+  bool mayAlias(const llvm::Value *st_dest, const llvm::Value *ld_src) {
+    std::lock_guard<std::mutex> lock(aliasLock_);
+    return alias_->alias(llvm::MemoryLocation(st_dest),
+        llvm::MemoryLocation(ld_src)) != llvm::AliasResult::NoAlias;
+  }
+
+  bool loadStoreAlias(const llvm::LoadInst *li, const llvm::StoreInst *si) {
+    std::lock_guard<std::mutex> lock(aliasLock_);
+    return dynAlias_->loadStoreAlias(li, si);
+  }
+
   std::vector<Position> getInitialPositions(const llvm::Instruction *inst) {
     std::vector<Position> positions;
     if (non_context_sensitive) {
@@ -753,6 +1411,25 @@ class StaticSlice : public llvm::ModulePass {
 
   llvm::AliasAnalysis *alias_;
   DynAliasLoader *dynAlias_;
+  std::mutex aliasLock_;
+
+  // Cross-slice caches (-slice-cache), guarded by summaryLock_
+  typedef std::tuple<const llvm::LoadInst *, int, bool> LoadStoreKey;
+  std::mutex summaryLock_;
+  std::unordered_map<ContextInfo::ContextId, const SliceSummary *,
+    ContextInfo::ContextId::hasher> summaries_;
+  std::vector<std::unique_ptr<SliceSummary>> summaryStore_;
+  std::map<LoadStoreKey, std::vector<ContextInfo::ContextId>> loadStores_;
+  std::atomic<size_t> cacheHits_{0};
+  std::atomic<size_t> cacheExpanded_{0};
+  std::atomic<size_t> cacheServed_{0};
+
+  // Multi-criteria slicing (-slice-batch-width)
+  size_t batchWidth_ = 0;
+  std::atomic<size_t> batchContexts_{0};
+  std::atomic<size_t> batchVisits_{0};
+
+  std::unique_ptr<InstLabeler> lblr_;
 
   std::map<const llvm::BasicBlock *, const llvm::BasicBlock *> dom_;
   std::map<const llvm::Function *, std::vector<const llvm::ReturnInst *>>
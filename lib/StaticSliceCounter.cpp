@@ -26,6 +26,7 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
+#include "llvm/ADT/SparseBitVector.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
@@ -65,22 +66,19 @@ class StaticSliceCounter : public llvm::ModulePass {
     //    Call
     //      "SpecialCall" -- we're ignoring?
 
-    // Load the slice file
-    // Find the used bbs
-    // for each bb, get a count of insts
-    // For each inst:
-    //    if load, select, store, call
-    //      add to inst count
+    // Precompute, for every instruction id, its bb and the instrumentation
+    //   class/weight it contributes.  Each slice is then a sparse dot product
+    //   of its instruction (and bb) bitsets against those weights.
+    // Then stream the slice file, one slice at a time
 
-    std::ifstream in_file(infilename, std::ifstream::in);
+    std::ifstream in_file(infilename,
+        std::ifstream::in | std::ifstream::binary);
 
     auto &dyn_info = getAnalysis<UnusedFunctions>();
     auto &dyn_edge = getAnalysis<DynEdgeLoader>();
 
     InstLabeler lblr(m, &dyn_info);
-
-    int i = 0;
-    auto pr = InstReader::Read(in_file, lblr);
+    setupWeights(m, lblr, dyn_edge);
 
     // std::map<const llvm::Function *, const llvm::Argument *> fcn_to_arg;
     // std::set<const llvm::GlobalValue *> globals;
@@ -94,156 +92,164 @@ class StaticSliceCounter : public llvm::ModulePass {
       }
     }
 
-    while (pr.first != -1) {
-      auto &insts = pr.second;
-
-      int64_t num_insts = 0;
-      int64_t num_bb_insts = 0;
-      int64_t num_load_insts = 0;
-      int64_t num_store_insts = 0;
-      int64_t num_select_insts = 0;
-      int64_t num_call_insts = 0;
-
-      std::map<const llvm::Function *,
-            std::set<const llvm::BasicBlock *>>
-        fcn_to_bb;
-      std::map<const llvm::BasicBlock *,
-            std::set<const llvm::Instruction *>>
-        bb_to_inst;
-
-      // Okay, have the insts... now gather the bbs
-      std::set<const llvm::BasicBlock *> bbs;
-
-      for (auto inst : insts) {
-        bbs.insert(inst->getParent());
+    InstReader reader(in_file, lblr);
+    int64_t header_id;
+    InstIdSet insts;
+    llvm::SparseBitVector<> bbs;
+    int i = 0;
+    while (reader.next(header_id, insts)) {
+      int64_t class_counts[NumClasses] = {};
+
+      bbs.clear();
+      size_t slice_size = 0;
+      for (auto inst_id : insts) {
+        auto bb_id = instBB_[inst_id];
+        bbs.set(bb_id);
+        class_counts[instClass_[inst_id]] += bbWeight_[bb_id];
+        slice_size++;
       }
 
-      // Now, do bbs:
-      for (auto pbb : bbs) {
-        // Get edge count of bb
-        // 2 insts per bb, one for start one for end
-        int64_t inc_amt =
-          static_cast<int64_t>(dyn_edge.getExecutionCount(pbb) * 2);
-        num_insts += inc_amt;
-        num_bb_insts += inc_amt;
-        auto pr = fcn_to_bb.emplace(pbb->getParent(),
-            std::set<const llvm::BasicBlock *>());
-
-        auto it = pr.first;
-
-        it->second.emplace(pbb);
+      // 2 insts per bb, one for start one for end
+      int64_t num_bb_insts = 0;
+      for (auto bb_id : bbs) {
+        num_bb_insts += 2 * bbWeight_[bb_id];
       }
 
-      for (auto pinst : insts) {
-        // Add inst in bb to insts
-        auto pr = bb_to_inst.emplace(pinst->getParent(),
-            std::set<const llvm::Instruction *>());
-
-        auto it = pr.first;
-
-        it->second.emplace(pinst);
-
-        if (llvm::isa<llvm::LoadInst>(pinst)) {
-          int64_t inc_amt =
-            static_cast<int64_t>(
-                dyn_edge.getExecutionCount(pinst->getParent()));
-          num_insts += inc_amt;
-          num_load_insts += inc_amt;
-        } else if (llvm::isa<llvm::SelectInst>(pinst)) {
-          int64_t inc_amt =
-            static_cast<int64_t>(
-                dyn_edge.getExecutionCount(pinst->getParent()));
-          num_insts += inc_amt;
-          num_select_insts += inc_amt;
-        } else if (llvm::isa<llvm::StoreInst>(pinst)) {
-          int64_t inc_amt =
-            static_cast<int64_t>(
-                dyn_edge.getExecutionCount(pinst->getParent()));
-          num_insts += inc_amt;
-          num_store_insts += inc_amt;
-        } else if (llvm::isa<llvm::CallInst>(pinst)) {
-          int64_t inc_amt =
-            static_cast<int64_t>(
-                dyn_edge.getExecutionCount(pinst->getParent()));
-          num_insts += inc_amt;
-          num_call_insts += inc_amt;
+      int64_t num_insts = num_bb_insts;
+      for (int32_t cls = 0; cls < NumClasses; ++cls) {
+        if (cls != NoClass) {
+          num_insts += class_counts[cls];
         }
       }
 
       llvm::dbgs() << "slice: " << i << "\n";
-      llvm::dbgs() << "  slice_size: " << insts.size() << "\n";
+      llvm::dbgs() << "  slice_size: " << slice_size << "\n";
       llvm::dbgs() << "  num_insts: " << num_insts << "\n";
       /*
       llvm::dbgs() << "  num_bb_insts: " << num_bb_insts << "\n";
-      llvm::dbgs() << "  num_load_insts: " << num_load_insts << "\n";
-      llvm::dbgs() << "  num_store_insts: " << num_store_insts << "\n";
-      llvm::dbgs() << "  num_call_insts: " << num_call_insts << "\n";
-      llvm::dbgs() << "  num_select_insts: " << num_select_insts << "\n";
+      llvm::dbgs() << "  num_load_insts: " << class_counts[LoadClass] << "\n";
+      llvm::dbgs() << "  num_store_insts: " << class_counts[StoreClass] <<
+        "\n";
+      llvm::dbgs() << "  num_call_insts: " << class_counts[CallClass] << "\n";
+      llvm::dbgs() << "  num_select_insts: " << class_counts[SelectClass] <<
+        "\n";
       */
 
       if (poutfile != nullptr) {
-        auto &outfile = *poutfile;
-
-        auto &dyn_alias = getAnalysis<DynAliasLoader>();
-
-        outfile << "-----------------------------------------------------\n";
-        outfile << "Slice : " << i << "\n";
-        outfile << "-----------------------------------------------------\n";
-
-        for (auto &fcn_pr : fcn_to_bb) {
-          auto pfcn = fcn_pr.first;
-          auto &bb_set = fcn_pr.second;
-
-          outfile << "\n" << pfcn->getName() << "\n";
-          for (auto &bb : *pfcn) {
-            auto pbb = &bb;
-            // Don't print bbs not in our set
-            if (bb_set.find(&bb) == std::end(bb_set)) {
-              continue;
-            }
-
-            outfile << "  " << bb.getName() << ":\n";
-
-            auto bb_map_it = bb_to_inst.find(pbb);
-            auto &inst_set = bb_map_it->second;
-            for (auto &inst : bb) {
-              auto pinst = &inst;
-
-              if (inst_set.find(pinst) == std::end(inst_set)) {
-                continue;
-              }
-
-
-              outfile << "  " << InstPrinter(pinst) << "\n";
-
-              if (auto li = dyn_cast<llvm::LoadInst>(pinst)) {
-                outfile << "      Load Aliases with: " << "\n";
-                // Get all aliases from our dyn alias analysis
-                auto aliases = dyn_alias.getAliases(li);
-                if (aliases.size() == 1 && aliases[0] == nullptr) {
-                  outfile << "        Unknown alias set!\n";
-                } else {
-                  for (auto palias : aliases) {
-                    auto inst = cast<llvm::Instruction>(palias);
-                    outfile << "      " << FullInstPrinter(inst) << "\n";
-                  }
-                }
-              }
-            }
-
-            outfile << "\n";
-          }
-        }
+        printReconstruction(*poutfile, i, insts, lblr);
       }
 
-
-      pr = InstReader::Read(in_file, lblr);
       i++;
     }
 
 
     return false;
   }
+
+ private:
+  enum InstClass : int8_t {
+    NoClass = 0,
+    LoadClass,
+    SelectClass,
+    StoreClass,
+    CallClass,
+    NumClasses
+  };
+
+  static InstClass getClass(const llvm::Instruction &inst) {
+    if (llvm::isa<llvm::LoadInst>(inst)) {
+      return LoadClass;
+    } else if (llvm::isa<llvm::SelectInst>(inst)) {
+      return SelectClass;
+    } else if (llvm::isa<llvm::StoreInst>(inst)) {
+      return StoreClass;
+    } else if (llvm::isa<llvm::CallInst>(inst)) {
+      return CallClass;
+    }
+
+    return NoClass;
+  }
+
+  void setupWeights(llvm::Module &m, const InstLabeler &lblr,
+      const DynEdgeLoader &dyn_edge) {
+    instBB_.resize(lblr.numIDs());
+    instClass_.resize(lblr.numIDs());
+
+    for (auto &fcn : m) {
+      for (auto &bb : fcn) {
+        uint32_t bb_id = bbWeight_.size();
+        bbWeight_.push_back(dyn_edge.hasDynData() ?
+            static_cast<int64_t>(dyn_edge.getExecutionCount(&bb)) : 0);
+
+        for (auto &inst : bb) {
+          auto inst_id = lblr.getID(&inst);
+          instBB_[inst_id] = bb_id;
+          instClass_[inst_id] = getClass(inst);
+        }
+      }
+    }
+  }
+
+  void printReconstruction(llvm::raw_ostream &outfile, int slice_num,
+      const InstIdSet &insts, const InstLabeler &lblr) {
+    auto &dyn_alias = getAnalysis<DynAliasLoader>();
+
+    outfile << "-----------------------------------------------------\n";
+    outfile << "Slice : " << slice_num << "\n";
+    outfile << "-----------------------------------------------------\n";
+
+    // Ids are assigned in module order, so iterating the set visits each
+    //   function, and each bb within it, in order
+    const llvm::Function *cur_fcn = nullptr;
+    const llvm::BasicBlock *cur_bb = nullptr;
+    for (auto inst_id : insts) {
+      auto pinst = lblr.getInst(inst_id);
+      auto pbb = pinst->getParent();
+      auto pfcn = pbb->getParent();
+
+      if (pfcn != cur_fcn) {
+        if (cur_bb != nullptr) {
+          outfile << "\n";
+        }
+        outfile << "\n" << pfcn->getName() << "\n";
+        cur_fcn = pfcn;
+        cur_bb = nullptr;
+      }
+
+      if (pbb != cur_bb) {
+        if (cur_bb != nullptr) {
+          outfile << "\n";
+        }
+        outfile << "  " << pbb->getName() << ":\n";
+        cur_bb = pbb;
+      }
+
+      outfile << "  " << InstPrinter(pinst) << "\n";
+
+      if (auto li = dyn_cast<llvm::LoadInst>(pinst)) {
+        outfile << "      Load Aliases with: " << "\n";
+        // Get all aliases from our dyn alias analysis
+        auto aliases = dyn_alias.getAliases(li);
+        if (aliases.size() == 1 && aliases[0] == nullptr) {
+          outfile << "        Unknown alias set!\n";
+        } else {
+          for (auto palias : aliases) {
+            auto inst = cast<llvm::Instruction>(palias);
+            outfile << "      " << FullInstPrinter(inst) << "\n";
+          }
+        }
+      }
+    }
+
+    if (cur_bb != nullptr) {
+      outfile << "\n";
+    }
+  }
+
+  // Per bb (in module order) and per InstLabeler id tables
+  std::vector<int64_t> bbWeight_;
+  std::vector<uint32_t> instBB_;
+  std::vector<InstClass> instClass_;
 };
 
 char StaticSliceCounter::ID = 0;
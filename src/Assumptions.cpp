@@ -7,22 +7,28 @@
 
 #include <cassert>
 
+#include <algorithm>
+#include <map>
 #include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "include/CheckSet.h"
 #include "include/ExtInfo.h"
 #include "include/LLVMHelper.h"
 
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -402,24 +408,27 @@ static llvm::GlobalVariable *getGlobalSet(llvm::Module &m,
   auto gv = m.getGlobalVariable(gv_name);
   if (gv == nullptr) {
     auto i32_type = llvm::IntegerType::get(m.getContext(), 32);
-    // Create the array type:
-    //   Note, its an array of (set.size()) of int32_ts
-    auto array_type = llvm::ArrayType::get(i32_type,
-        set.size());
 
-    // Create the array initializer:
-    //   For each elm : set
-    //     arrayInit[i] = elm
-    std::vector<llvm::Constant *> initializer;
+    // The set is stored as a CheckSet table, so the runtime can test
+    //   membership in O(1)
+    std::vector<int32_t> ids;
     // llvm::dbgs() << "  Creating gv: " << gv_name << "\n";
     // llvm::dbgs() << "  With set:";
     for (auto obj_id : set) {
-      initializer.push_back(
-          llvm::ConstantInt::get(i32_type, obj_id.val()));
+      ids.push_back(obj_id.val());
       // llvm::dbgs() << " " << obj_id;
     }
     // llvm::dbgs() << "\n";
+    auto table = CheckSet::encode(ids);
 
+    // Create the array type:
+    //   Note, its an array of (table.size()) of int32_ts
+    auto array_type = llvm::ArrayType::get(i32_type, table.size());
+
+    std::vector<llvm::Constant *> initializer;
+    for (auto word : table) {
+      initializer.push_back(llvm::ConstantInt::get(i32_type, word));
+    }
 
     auto array_init = llvm::ConstantArray::get(array_type, initializer);
 
@@ -695,3 +704,239 @@ DeadCodeAssumption::approxDependencies(
 //}}}
 //}}}
 
+
+// Check optimization {{{
+// True if every instruction in [it, en) is sure to fall through to the next
+//   (e.g. no call which may exit), so a check at en runs if one at it does
+static bool fallsThrough(llvm::BasicBlock::const_iterator it,
+    llvm::BasicBlock::const_iterator en) {
+  for (; it != en; ++it) {
+    if (!llvm::isGuaranteedToTransferExecutionToSuccessor(&*it)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// True if a check before site runs on every iteration of loop which is
+//   entered (so it runs at least once, if the loop is entered)
+static bool runsEachIteration(const llvm::Instruction *site,
+    const llvm::Loop *loop, const llvm::DominatorTree &dt) {
+  auto site_bb = site->getParent();
+
+  // Every way out of the loop must pass the check...
+  llvm::SmallVector<llvm::BasicBlock *, 8> exiting;
+  loop->getExitingBlocks(exiting);
+  if (exiting.empty()) {
+    return false;
+  }
+
+  for (auto bb : exiting) {
+    if (!dt.dominates(site_bb, bb)) {
+      return false;
+    }
+  }
+
+  // ...and nothing which can run before it may leave the loop some other way
+  for (auto bb : loop->blocks()) {
+    if (bb == site_bb) {
+      if (!fallsThrough(std::begin(*bb), site->getIterator())) {
+        return false;
+      }
+    } else if (!dt.dominates(site_bb, bb) &&
+        !fallsThrough(std::begin(*bb), std::end(*bb))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool isInvariant(const llvm::Loop *loop, const llvm::Value *val) {
+  auto inst = dyn_cast<llvm::Instruction>(val);
+  return inst == nullptr || !loop->contains(inst);
+}
+
+// Moves check to the preheader of each loop it's invariant in, returns true if
+//   it moved
+static bool hoistCheck(SetCheckInst &check, const llvm::DominatorTree &dt,
+    const llvm::LoopInfo &li) {
+  auto site = check.getSite();
+  auto val = check.getValue();
+  bool hoisted = false;
+
+  for (auto loop = li.getLoopFor(site->getParent()); loop != nullptr;
+      loop = loop->getParentLoop()) {
+    auto preheader = loop->getLoopPreheader();
+    if (preheader == nullptr) {
+      break;
+    }
+
+    // A cast inside the loop is fine, if the pointer it casts is invariant
+    if (!isInvariant(loop, val)) {
+      val = val->stripPointerCasts();
+      if (!isInvariant(loop, val)) {
+        break;
+      }
+    }
+
+    if (!runsEachIteration(site, loop, dt)) {
+      break;
+    }
+
+    site = preheader->getTerminator();
+    check.setValue(val);
+    check.setSite(site);
+    hoisted = true;
+  }
+
+  return hoisted;
+}
+
+void optimizeChecks(std::vector<std::unique_ptr<InstrumentationSite>> &sites) {
+  std::map<llvm::Function *, std::vector<SetCheckInst *>> fcn_checks;
+  std::map<llvm::Function *, std::vector<VisitInst *>> fcn_visits;
+  for (auto &psite : sites) {
+    if (auto check = dyn_cast<SetCheckInst>(psite.get())) {
+      // Checks placed after their value's definition are left alone
+      if (check->getSite() != nullptr) {
+        fcn_checks[check->getSite()->getFunction()].push_back(check);
+      }
+    } else if (auto visit = dyn_cast<VisitInst>(psite.get())) {
+      fcn_visits[visit->getBB()->getParent()].push_back(visit);
+    }
+  }
+
+  std::set<const InstrumentationSite *> removed;
+  int32_t num_hoisted = 0;
+  int32_t num_merged = 0;
+  int32_t num_dominated = 0;
+
+  std::set<llvm::Function *> fcns;
+  for (auto &pr : fcn_checks) {
+    fcns.insert(pr.first);
+  }
+  for (auto &pr : fcn_visits) {
+    fcns.insert(pr.first);
+  }
+
+  for (auto fcn : fcns) {
+    llvm::DominatorTree dt(*fcn);
+
+    // A reached dead block has already failed its own check
+    auto &visits = fcn_visits[fcn];
+    for (auto visit : visits) {
+      auto bb = visit->getBB();
+      auto dominated = std::any_of(std::begin(visits), std::end(visits),
+          [&dt, bb] (const VisitInst *other) {
+        return other->getBB() != bb && dt.dominates(other->getBB(), bb);
+      });
+
+      if (dominated) {
+        removed.insert(visit);
+        num_dominated++;
+      }
+    }
+
+    auto &checks = fcn_checks[fcn];
+    if (checks.empty()) {
+      continue;
+    }
+
+    llvm::LoopInfo li(dt);
+    for (auto check : checks) {
+      if (hoistCheck(*check, dt, li)) {
+        num_hoisted++;
+      }
+    }
+
+    // Program order within each block
+    std::map<const llvm::Instruction *, size_t> order;
+    for (auto &bb : *fcn) {
+      size_t idx = 0;
+      for (auto &inst : bb) {
+        order.emplace(&inst, idx++);
+      }
+    }
+
+    // Checks of the same address, first in each block first
+    std::map<const llvm::Value *, std::vector<SetCheckInst *>> by_addr;
+    for (auto check : checks) {
+      by_addr[check->getValue()->stripPointerCasts()].push_back(check);
+    }
+
+    auto runs_before = [&order] (const SetCheckInst *lhs,
+        const SetCheckInst *rhs) {
+      return order.at(lhs->getSite()) < order.at(rhs->getSite());
+    };
+
+    for (auto &pr : by_addr) {
+      auto &group = pr.second;
+      std::stable_sort(std::begin(group), std::end(group), runs_before);
+
+      // Merge a later check in the same block into the first, if the later
+      //   one is sure to run once the first has
+      for (size_t i = 0; i < group.size(); ++i) {
+        auto first = group[i];
+        if (removed.count(first) != 0) {
+          continue;
+        }
+
+        for (size_t j = i + 1; j < group.size(); ++j) {
+          auto later = group[j];
+          if (removed.count(later) != 0 ||
+              later->getSite()->getParent() != first->getSite()->getParent()) {
+            continue;
+          }
+
+          if (fallsThrough(first->getSite()->getIterator(),
+                later->getSite()->getIterator())) {
+            first->intersectCheckSet(later->getCheckSet());
+            removed.insert(later);
+            num_merged++;
+          }
+        }
+      }
+
+      // Remove checks dominated by a check which is at least as strict
+      for (auto check : group) {
+        if (removed.count(check) != 0) {
+          continue;
+        }
+
+        auto site = check->getSite();
+        auto &check_set = check->getCheckSet();
+        auto dominated = std::any_of(std::begin(group), std::end(group),
+            [&] (const SetCheckInst *other) {
+          if (other == check || removed.count(other) != 0) {
+            return false;
+          }
+
+          auto other_site = other->getSite();
+          bool dominates = (other_site->getParent() == site->getParent()) ?
+            order.at(other_site) <= order.at(site) :
+            dt.dominates(other_site->getParent(), site->getParent());
+
+          auto &other_set = other->getCheckSet();
+          return dominates && std::includes(std::begin(check_set),
+              std::end(check_set), std::begin(other_set), std::end(other_set));
+        });
+
+        if (dominated) {
+          removed.insert(check);
+          num_dominated++;
+        }
+      }
+    }
+  }
+
+  auto it = std::remove_if(std::begin(sites), std::end(sites),
+      [&removed] (const std::unique_ptr<InstrumentationSite> &psite) {
+    return removed.count(psite.get()) != 0;
+  });
+  sites.erase(it, std::end(sites));
+
+  llvm::dbgs() << "optimizeChecks: hoisted " << num_hoisted << ", merged " <<
+    num_merged << ", removed " << num_dominated << " dominated checks\n";
+}
+//}}}
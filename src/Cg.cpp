@@ -1329,8 +1329,9 @@ void Cg::resolveCalls(CgCache &base_cgs, CgCache &full_cgs) {
       dir_calls.emplace_back(cs, called_fcn, &caller_info);
     // Else add an external call constraint
     } else {
-      // Check for indir info:
-      if (indir_info.hasInfo() && !no_spec) {
+      // Check for indir info (if its checks are worth it):
+      if (indir_info.hasInfo() && !no_spec &&
+          dynInfo_.keepIndirCall(ci)) {
         // llvm::dbgs() << "have indir info!\n";
         // llvm::dbgs() << "ci is: " << *ci << "\n";
         auto &targets = indir_info.getTargets(ci);
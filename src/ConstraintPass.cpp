@@ -57,6 +57,12 @@ void ConstraintPass::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
   // Required for call info passes
   usage.addRequired<CsCFG>();
   usage.addRequired<CallContextLoader>();
+
+  // To choose the assumptions worth checking, only with a budget (which needs
+  //   the edge profile)
+  if (SpecCheckBudget::enabled()) {
+    usage.addRequired<SpecCheckBudget>();
+  }
 }
 
 bool ConstraintPass::runOnModule(llvm::Module &m) {
@@ -71,7 +77,10 @@ bool ConstraintPass::runOnModule(llvm::Module &m) {
 
   auto &call_info =
       getAnalysis<CallContextLoader>();
-  DynamicInfo dyn_info(unused_fcns, indir_info, call_info);
+
+  const SpecCheckBudget *check_budget = SpecCheckBudget::enabled() ?
+      &getAnalysis<SpecCheckBudget>() : nullptr;
+  DynamicInfo dyn_info(unused_fcns, indir_info, call_info, check_budget);
 
   auto &cs_cfg =
       getAnalysis<CsCFG>();
@@ -11,8 +11,6 @@
 
 #include "include/SpecSFS.h"
 
-#include "llvm/Analysis/ProfileInfo.h"
-
 #include "include/AllocInfo.h"
 #include "include/ControlFlowGraph.h"
 #include "include/DUG.h"
@@ -21,66 +19,14 @@
 #include "include/SEG.h"
 #include "include/util.h"
 #include "include/lib/DynPtsto.h"
+#include "include/lib/EdgeCountPass.h"
+#include "include/lib/SpecCheckBudget.h"
 
 static llvm::cl::opt<std::string>
   TimeThresholdStr("specsfs-dyn-threshold", llvm::cl::init(".00001"),
       llvm::cl::value_desc("string"),
       llvm::cl::desc("Threshold to consider a dynamic ptsto value cold"));
 
-class CostApprox {
- public:
-    // 1/10000?
-    // Go needs less accurate dyn-ptsto info to be performant (it still retains
-    //   solid accuracy with this rate though)
-    // static constexpr double TimeThreshold = .00001;
-    // Sphinx needs more accurate dyn ptsto data to benefit... although it
-    //   doesn't seem to slow it down as much as expected...
-    // static constexpr double TimeThreshold = .001;
-    CostApprox(const llvm::Module &m, llvm::ProfileInfo &pi) :
-          pi_(pi) {
-      for (auto &fcn : m) {
-        for (auto &bb : fcn) {
-          auto num_executions = pi.getExecutionCount(&bb);
-          auto num_insts = std::distance(std::begin(bb), std::end(bb));
-
-          totalDynInsts_ += num_executions * num_insts;
-        }
-      }
-    }
-
-    bool costIsLow(const llvm::BasicBlock &bb) {
-      // If this block's cost is less than... 1/10000th of the execuiton time?
-      auto bb_insts = std::distance(std::begin(bb), std::end(bb));
-      auto dyn_executions = pi_.getExecutionCount(&bb);
-      auto bb_dyn_insts = bb_insts * dyn_executions;
-
-      auto TimeThreshold = stod(TimeThresholdStr);
-      auto ret = (bb_dyn_insts / totalDynInsts_) < TimeThreshold;
-
-      return ret;
-    }
-
-    bool costIsLow(const std::vector<std::unique_ptr<InstrumentationSite>>
-        &inst_site_vec) {
-      double total_cost = 0;
-
-      for (auto &pinst : inst_site_vec) {
-        auto bb = pinst->getBB();
-
-        total_cost += pinst->approxCost() * pi_.getExecutionCount(bb);
-      }
-
-      total_cost /= totalDynInsts_;
-
-      auto TimeThreshold = stod(TimeThresholdStr);
-      return total_cost < TimeThreshold;
-    }
-
- private:
-    llvm::ProfileInfo &pi_;
-    double totalDynInsts_ = 0.0;
-};
-
 std::map<ObjectMap::ObjID, Bitmap>
 SpecSFS::addDynPtstoInfo(llvm::Module &m, DUG &,
     CFG &, ObjectMap &omap, const ExtLibInfo &ext_info) {
@@ -100,23 +46,24 @@ SpecSFS::addDynPtstoInfo(llvm::Module &m, DUG &,
   //       NOTE: I get this information statically, so no need to change this
   //         -- unless I somehow get that info dynamically
 
-  auto &prof_info = getAnalysis<llvm::ProfileInfo>();
+  auto &dyn_edges = getAnalysis<DynEdgeLoader>();
   auto &dyn_ptsto = getAnalysis<DynPtstoLoader>();
-  // To check if ProfileInfo is valid...
+  // To check if the edge profile is valid...
   const auto &unused_fcn = getAnalysis<UnusedFunctions>();
 
   std::map<ObjectMap::ObjID, Bitmap> top_level_constraints;
 
   // If we have the dynamic information do the optimization
   if (unused_fcn.hasInfo() && dyn_ptsto.hasInfo()) {
-    CostApprox ca(m, prof_info);
+    CostApprox ca(m, dyn_edges);
+    auto time_threshold = stod(TimeThresholdStr);
 
     // For each function
     for (auto &fcn : m) {
       for (auto &bb : fcn) {
         if (unused_fcn.isUsed(bb)) {
           // Figure out how frequently the BB is used
-          if (ca.costIsLow(bb)) {
+          if (ca.blockCost(bb) < time_threshold) {
             // Use dyn ptsto info
             // Get the dyn info for this BB
             for (auto &instr : bb) {
@@ -151,7 +98,7 @@ SpecSFS::addDynPtstoInfo(llvm::Module &m, DUG &,
 
                   auto approx_deps = ptsto_aspn->getApproxDependencies(omap, m);
 
-                  if (ca.costIsLow(approx_deps)) {
+                  if (ca.siteCost(approx_deps) < time_threshold) {
                     auto &dyn_bmp = top_level_constraints[val_id];
                     for (auto cons : ptsto) {
                       // NOTE: The dyn ptsto is now field sensitive, so we're
@@ -27,7 +27,34 @@
 #include "include/LLVMHelper.h"
 #include "include/SpecAnders.h"
 #include "include/SpecAndersCS.h"
+#include "include/SpecCallStack.h"
 #include "include/ValueMap.h"
+#include "include/lib/SpecCheckBudget.h"
+
+static llvm::cl::opt<bool>
+  inline_callstack("specsfs-inline-callstack", llvm::cl::init(true),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Push, pop and bloom-probe the checked call stack with "
+        "inline IR, only calling the runtime on a bloom hit"));
+
+static llvm::cl::opt<bool>
+  minimal_callstack("specsfs-minimal-callstack", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Only push and pop at the checked callsites and their "
+        "immediate preds, instead of every callsite which may precede a "
+        "checked callsite (experimental, see scripts/callstack-counts)"));
+
+static llvm::cl::opt<bool>
+  optimize_checks("specsfs-opt-checks", llvm::cl::init(true),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Hoist loop-invariant set checks, and merge or remove "
+        "checks made redundant by others, before instrumenting"));
+
+static llvm::cl::opt<bool>
+  count_callstack("specsfs-count-callstack", llvm::cl::init(false),
+      llvm::cl::value_desc("bool"),
+      llvm::cl::desc("Count the inline call-stack pushes and pops executed, "
+        "printed by the runtime at exit"));
 
 const int64_t PtrSizeBytes = sizeof(void *);
 
@@ -158,14 +185,33 @@ class SpecSFSInstrumenter : public llvm::ModulePass {
   llvm::Function *getPopFcn(llvm::Module &m);
   llvm::Function *getCheckFcn(llvm::Module &m);
 
+  void setupCallStack(llvm::Module &m);
+  llvm::Value *callStackElm(llvm::GlobalVariable *array, llvm::Value *depth,
+      llvm::Instruction *insert_before);
+  void addInlinePush(int32_t id, uint64_t hash,
+      llvm::Instruction *insert_before);
+  void addInlinePop(int32_t id, llvm::Instruction *insert_before);
+  void addCount(llvm::GlobalVariable *counter,
+      llvm::Instruction *insert_before);
+  void addInlineCheck(llvm::Function *check_fcn,
+      llvm::ArrayRef<llvm::Value *> args, llvm::Value *filter,
+      size_t filter_bits, llvm::Instruction *insert_before);
+
   llvm::Constant *BloomFilterToPointer(
       llvm::Module &,
       const BloomHasher::BloomFilter &);
 
-  std::pair<llvm::Constant *, llvm::Constant *>
-  getCheckData(llvm::Module &m,
-      const std::vector<const std::vector<CsCFG::Id> *> &data,
-      BloomHasher::BloomFilter *hash_combine);
+  // The stacks of a check site, laid out as in include/SpecCallStack.h
+  struct CheckData {
+    llvm::Constant *numSlots;
+    llvm::Constant *stacks;
+    llvm::Constant *hashes;
+    llvm::Constant *filter;
+    size_t filterBits;
+  };
+
+  CheckData getCheckData(llvm::Module &m,
+      const std::vector<const std::vector<CsCFG::Id> *> &data);
 
   void addCallInst(llvm::Module &m,
       CsCFG::Id val,
@@ -190,6 +236,16 @@ class SpecSFSInstrumenter : public llvm::ModulePass {
   llvm::Function *callPushFcn_ = nullptr;
   llvm::Function *callSetJmpFcn_ = nullptr;
   llvm::Function *callLongJmpFcn_ = nullptr;
+
+  // The runtime's thread-local call stack (see include/SpecCallStack.h)
+  llvm::GlobalVariable *stackDepth_ = nullptr;
+  llvm::GlobalVariable *stackIds_ = nullptr;
+  llvm::GlobalVariable *stackHashes_ = nullptr;
+  // Frames at or past this depth are only counted
+  int32_t stackLimit_ = SpecCallStack::MaxDepth;
+
+  llvm::GlobalVariable *pushCount_ = nullptr;
+  llvm::GlobalVariable *popCount_ = nullptr;
 };
 
 void SpecSFSInstrumenter::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
@@ -199,6 +255,10 @@ void SpecSFSInstrumenter::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
   // We don't instrument frees in dead code, so we need to get that here
   usage.addRequired<UnusedFunctions>();
   usage.addRequired<IndirFunctionInfo>();
+  // To report what the checks should cost (with a budget)
+  if (SpecCheckBudget::enabled()) {
+    usage.addRequired<SpecCheckBudget>();
+  }
 
   // We require SpecSFS, to provide assumptions and ObjID->llvm::Value mappings
   // usage.addRequired<llvm::AliasAnalysis>();
@@ -412,7 +472,8 @@ llvm::Function *SpecSFSInstrumenter::getPopFcn(llvm::Module &m) {
 llvm::Function *SpecSFSInstrumenter::getCheckFcn(llvm::Module &m) {
   if (callCheckFcn_ == nullptr) {
     std::vector<llvm::Type *> check_args =
-        { int32Type_, int32Type_, int32PtrPtrType_, int64PtrType_ };
+        { int32Type_, int32Type_, int32PtrPtrType_, int64PtrType_,
+          int64PtrType_ };
     auto fcn_type = llvm::FunctionType::get(
         voidType_,
         check_args,
@@ -424,15 +485,25 @@ llvm::Function *SpecSFSInstrumenter::getCheckFcn(llvm::Module &m) {
   return callCheckFcn_;
 }
 
-std::pair<llvm::Constant *, llvm::Constant *>
+SpecSFSInstrumenter::CheckData
 SpecSFSInstrumenter::getCheckData(llvm::Module &m,
-    const std::vector<const std::vector<CsCFG::Id> *> &data,
-    BloomHasher::BloomFilter *hash_combine) {
+    const std::vector<const std::vector<CsCFG::Id> *> &data) {
   // Okay, create a type for this data
-  // We will return a pair, a size followed by an array of size, data arrays
-  // We are ultimately returning an array of i32PtrTypes_
-  std::vector<llvm::Constant *> glbl_array_data;
-  std::vector<llvm::Value *> stacks;
+  // We build an open addressed table of the stacks, keyed by the stack hash
+  //   the runtime keeps, and a bloom filter of those hashes (see
+  //   include/SpecCallStack.h)
+  size_t num_slots = SpecCallStack::numSlots(data.size());
+  auto null_stack = llvm::ConstantPointerNull::get(
+      llvm::cast<llvm::PointerType>(int32PtrType_));
+  std::vector<llvm::Constant *> glbl_array_data(num_slots, null_stack);
+  std::vector<llvm::Constant *> hash_data(num_slots,
+      llvm::ConstantInt::get(int64Type_, 0));
+
+  CheckData ret;
+  ret.filterBits = BloomHasher::filter_bits(data.size());
+  BloomHasher::BloomFilter filter;
+  BloomHasher::bloom_clear(filter, ret.filterBits);
+
   for (auto &pstack : data) {
     // Create an array of the stack:
     // Type is: i32_t, size+1
@@ -442,11 +513,18 @@ SpecSFSInstrumenter::getCheckData(llvm::Module &m,
     // elm 0 is constant of size:
     std::vector<llvm::Constant *> array_data =
         { llvm::ConstantInt::get(int32Type_, pstack->size()) };
-    int64_t array_hash = 0x5F5F5F5F5F5F5F5FULL;
+    uint64_t array_hash = SpecCallStack::BaseHash;
+    bool first = true;
     for (auto &id : *pstack) {
       array_data.push_back(llvm::ConstantInt::get(int32Type_,
             static_cast<int32_t>(id)));
 
+      // Frame 0 is main, which the runtime doesn't mix into its hash
+      if (first) {
+        first = false;
+        continue;
+      }
+
       // size_t id_hash = std::hash<CsCFG::Id>()(id);
       size_t id_hash = bloom_hash(static_cast<size_t>(id));
       llvm::dbgs() << "id hash is: " << id_hash << "\n";
@@ -454,7 +532,7 @@ SpecSFSInstrumenter::getCheckData(llvm::Module &m,
       array_hash = BloomHasher::mix_hash(array_hash,
           id_hash);
     }
-    BloomHasher::bloom_add(*hash_combine, array_hash);
+    BloomHasher::bloom_add(filter, array_hash);
 
     // Now, create a constant array
     auto const_array = llvm::ConstantArray::get(array_type, array_data);
@@ -472,10 +550,17 @@ SpecSFSInstrumenter::getCheckData(llvm::Module &m,
         sub_array->getType(),
         sub_array,
         indicies);
-    glbl_array_data.push_back(gep);
+
+    // Place it in the first free slot of its probe sequence
+    size_t slot = SpecCallStack::slot(array_hash, num_slots);
+    while (glbl_array_data[slot] != null_stack) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    glbl_array_data[slot] = gep;
+    hash_data[slot] = llvm::ConstantInt::get(int64Type_, array_hash);
   }
 
-  auto array_type = llvm::ArrayType::get(int32PtrType_, data.size());
+  auto array_type = llvm::ArrayType::get(int32PtrType_, num_slots);
 
   auto gv_init = llvm::ConstantArray::get(array_type, glbl_array_data);
 
@@ -483,24 +568,36 @@ SpecSFSInstrumenter::getCheckData(llvm::Module &m,
   llvm::GlobalVariable *gv = new llvm::GlobalVariable(m, array_type, true,
       llvm::GlobalValue::InternalLinkage, gv_init, "CallStackCheckData");
 
+  auto hash_type = llvm::ArrayType::get(int64Type_, num_slots);
+  llvm::GlobalVariable *hash_gv = new llvm::GlobalVariable(m, hash_type,
+      true, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantArray::get(hash_type, hash_data),
+      "CallStackCheckData_hashes");
+
   // Now, get the pointer to the first element (thats an int32ptrptrtype_)
   std::vector<llvm::Constant *> indicies =
       { llvm::ConstantInt::get(int32Type_, 0),
         llvm::ConstantInt::get(int32Type_, 0) };
   // And bitcast that to an int32PtrType_
-  auto gep = llvm::ConstantExpr::getInBoundsGetElementPtr(gv->getType(),
+  ret.stacks = llvm::ConstantExpr::getInBoundsGetElementPtr(gv->getType(),
       gv, indicies);
+  ret.hashes = llvm::ConstantExpr::getInBoundsGetElementPtr(
+      hash_gv->getType(), hash_gv, indicies);
+  ret.numSlots = llvm::ConstantInt::get(int32Type_, num_slots);
+  ret.filter = BloomFilterToPointer(m, filter);
 
-  return std::make_pair(llvm::ConstantInt::get(int32Type_, data.size()), gep);
+  return ret;
 }
 
 llvm::Constant *SpecSFSInstrumenter::BloomFilterToPointer(
     llvm::Module &m,
     const BloomHasher::BloomFilter &filter) {
-  // Convert the data into int 64 types
-  auto array_type = llvm::ArrayType::get(int64Type_, filter.size());
+  // Convert the data into int 64 types, prefixed by the filter size in bits
+  auto array_type = llvm::ArrayType::get(int64Type_, filter.size() + 1);
 
-  std::vector<llvm::Constant *> array_data;
+  std::vector<llvm::Constant *> array_data =
+      { llvm::ConstantInt::get(int64Type_,
+          filter.size() * BloomHasher::bit_size) };
 
   for (auto &elm : filter) {
     array_data.push_back(llvm::ConstantInt::get(int64Type_, elm));
@@ -527,49 +624,267 @@ llvm::Constant *SpecSFSInstrumenter::BloomFilterToPointer(
   return array_ptr;
 }
 
+void SpecSFSInstrumenter::setupCallStack(llvm::Module &m) {
+  if (stackDepth_ != nullptr) {
+    return;
+  }
+
+  auto get_tls = [&m] (llvm::Type *type, const char *name) {
+    return new llvm::GlobalVariable(m, type, false,
+        llvm::GlobalValue::ExternalLinkage, nullptr, name, nullptr,
+        llvm::GlobalVariable::InitialExecTLSModel);
+  };
+
+  stackDepth_ = get_tls(int32Type_, SpecCallStack::DepthName);
+  stackIds_ = get_tls(
+      llvm::ArrayType::get(int32Type_, SpecCallStack::MaxDepth),
+      SpecCallStack::IdsName);
+  stackHashes_ = get_tls(
+      llvm::ArrayType::get(int64Type_, SpecCallStack::MaxDepth),
+      SpecCallStack::HashesName);
+
+  if (count_callstack) {
+    auto get_count = [this, &m] (const char *name) {
+      return new llvm::GlobalVariable(m, int64Type_, false,
+          llvm::GlobalValue::ExternalLinkage, nullptr, name);
+    };
+
+    pushCount_ = get_count(SpecCallStack::PushesName);
+    popCount_ = get_count(SpecCallStack::PopsName);
+  }
+}
+
+// Atomically increments counter (only used to measure, so relaxed)
+void SpecSFSInstrumenter::addCount(llvm::GlobalVariable *counter,
+    llvm::Instruction *insert_before) {
+  if (counter != nullptr) {
+    new llvm::AtomicRMWInst(llvm::AtomicRMWInst::Add, counter,
+        llvm::ConstantInt::get(int64Type_, 1),
+        llvm::AtomicOrdering::Monotonic, llvm::SyncScope::System,
+        insert_before);
+  }
+}
+
+// Returns a pointer to array[depth]
+llvm::Value *SpecSFSInstrumenter::callStackElm(llvm::GlobalVariable *array,
+    llvm::Value *depth, llvm::Instruction *insert_before) {
+  std::vector<llvm::Value *> indicies =
+      { llvm::ConstantInt::get(int32Type_, 0), depth };
+  return llvm::GetElementPtrInst::CreateInBounds(array->getValueType(), array,
+      indicies, "", insert_before);
+}
+
+// Inline version of SpecCallStack::push (limit is stackLimit_):
+//   if (depth >= limit - 1) {
+//     depth++;
+//   } else if (ids[depth] != id) {
+//     ids[depth + 1] = id;
+//     hashes[depth + 1] = mix_hash(hashes[depth], hash);
+//     depth++;
+//   }
+void SpecSFSInstrumenter::addInlinePush(int32_t id, uint64_t hash,
+    llvm::Instruction *insert_before) {
+  addCount(pushCount_, insert_before);
+
+  auto depth = new llvm::LoadInst(stackDepth_, "", insert_before);
+  auto one = llvm::ConstantInt::get(int32Type_, 1);
+  auto next_depth = llvm::BinaryOperator::Create(llvm::Instruction::Add,
+      depth, one, "", insert_before);
+
+  auto full = new llvm::ICmpInst(insert_before, llvm::CmpInst::ICMP_SGE, depth,
+      llvm::ConstantInt::get(int32Type_, stackLimit_ - 1));
+
+  llvm::TerminatorInst *full_term;
+  llvm::TerminatorInst *push_term;
+  llvm::SplitBlockAndInsertIfThenElse(full, insert_before, &full_term,
+      &push_term);
+
+  new llvm::StoreInst(next_depth, stackDepth_, full_term);
+
+  auto id_val = llvm::ConstantInt::get(int32Type_, id);
+  auto top_id = new llvm::LoadInst(callStackElm(stackIds_, depth, push_term),
+      "", push_term);
+  auto is_new = new llvm::ICmpInst(push_term, llvm::CmpInst::ICMP_NE, top_id,
+      id_val);
+  auto new_term = llvm::SplitBlockAndInsertIfThen(is_new, push_term, false);
+
+  // mix_hash(stack_hash, elm_hash) is:
+  //   stack_hash ^ (elm_hash + 0x9e3779b9 + (stack_hash << 6) +
+  //     (stack_hash >> 2))
+  auto top_hash = new llvm::LoadInst(
+      callStackElm(stackHashes_, depth, new_term), "", new_term);
+  auto mix = llvm::BinaryOperator::Create(llvm::Instruction::Add,
+      llvm::ConstantInt::get(int64Type_, hash + 0x9e3779b9),
+      llvm::BinaryOperator::Create(llvm::Instruction::Shl, top_hash,
+        llvm::ConstantInt::get(int64Type_, 6), "", new_term),
+      "", new_term);
+  mix = llvm::BinaryOperator::Create(llvm::Instruction::Add, mix,
+      llvm::BinaryOperator::Create(llvm::Instruction::LShr, top_hash,
+        llvm::ConstantInt::get(int64Type_, 2), "", new_term),
+      "", new_term);
+  auto new_hash = llvm::BinaryOperator::Create(llvm::Instruction::Xor,
+      top_hash, mix, "", new_term);
+
+  new llvm::StoreInst(id_val, callStackElm(stackIds_, next_depth, new_term),
+      new_term);
+  new llvm::StoreInst(new_hash,
+      callStackElm(stackHashes_, next_depth, new_term), new_term);
+  new llvm::StoreInst(next_depth, stackDepth_, new_term);
+}
+
+// Inline version of SpecCallStack::pop (limit is stackLimit_):
+//   if (depth >= limit || (depth > 0 && ids[depth] == id)) {
+//     depth--;
+//   }
+void SpecSFSInstrumenter::addInlinePop(int32_t id,
+    llvm::Instruction *insert_before) {
+  addCount(popCount_, insert_before);
+
+  auto depth = new llvm::LoadInst(stackDepth_, "", insert_before);
+  auto prev_depth = llvm::BinaryOperator::Create(llvm::Instruction::Sub,
+      depth, llvm::ConstantInt::get(int32Type_, 1), "", insert_before);
+
+  auto full = new llvm::ICmpInst(insert_before, llvm::CmpInst::ICMP_SGE, depth,
+      llvm::ConstantInt::get(int32Type_, stackLimit_));
+
+  llvm::TerminatorInst *full_term;
+  llvm::TerminatorInst *pop_term;
+  llvm::SplitBlockAndInsertIfThenElse(full, insert_before, &full_term,
+      &pop_term);
+
+  new llvm::StoreInst(prev_depth, stackDepth_, full_term);
+
+  auto top_id = new llvm::LoadInst(callStackElm(stackIds_, depth, pop_term),
+      "", pop_term);
+  auto is_top = new llvm::ICmpInst(pop_term, llvm::CmpInst::ICMP_EQ, top_id,
+      llvm::ConstantInt::get(int32Type_, id));
+  auto not_main = new llvm::ICmpInst(pop_term, llvm::CmpInst::ICMP_SGT, depth,
+      llvm::ConstantInt::get(int32Type_, 0));
+  auto do_pop = llvm::BinaryOperator::Create(llvm::Instruction::And, is_top,
+      not_main, "", pop_term);
+  auto do_pop_term = llvm::SplitBlockAndInsertIfThen(do_pop, pop_term, false);
+
+  new llvm::StoreInst(prev_depth, stackDepth_, do_pop_term);
+}
+
+// Probes filter (of filter_bits, see include/SpecCallStack.h) with the top
+//   stack hash, and only calls __specsfs_callstack_check on a hit:
+//   if (depth < limit && bloom_check(filter + 1, bits, hashes[depth])) {
+//     __specsfs_callstack_check(args)
+//   }
+void SpecSFSInstrumenter::addInlineCheck(llvm::Function *check_fcn,
+    llvm::ArrayRef<llvm::Value *> args, llvm::Value *filter,
+    size_t filter_bits, llvm::Instruction *insert_before) {
+  auto depth = new llvm::LoadInst(stackDepth_, "", insert_before);
+  auto in_range = new llvm::ICmpInst(insert_before, llvm::CmpInst::ICMP_SLT,
+      depth, llvm::ConstantInt::get(int32Type_, stackLimit_));
+  auto probe_term = llvm::SplitBlockAndInsertIfThen(in_range, insert_before,
+      false);
+
+  auto stack_hash = new llvm::LoadInst(
+      callStackElm(stackHashes_, depth, probe_term), "", probe_term);
+
+  // Mirrors BloomHasher::bloom_check, each hash selects one bit of the filter
+  assert(is_power_of_two(filter_bits));
+  llvm::Value *hit = nullptr;
+  for (size_t i = 0; i < BloomHasher::num_hashes; ++i) {
+    llvm::Value *offs = llvm::BinaryOperator::Create(llvm::Instruction::LShr,
+        stack_hash,
+        llvm::ConstantInt::get(int64Type_, i * BloomHasher::shift_size), "",
+        probe_term);
+    offs = llvm::BinaryOperator::Create(llvm::Instruction::And, offs,
+        llvm::ConstantInt::get(int64Type_, filter_bits - 1), "",
+        probe_term);
+
+    // The words follow the size
+    llvm::Value *idx = llvm::BinaryOperator::Create(
+        llvm::Instruction::UDiv, offs,
+        llvm::ConstantInt::get(int64Type_, BloomHasher::bit_size), "",
+        probe_term);
+    idx = llvm::BinaryOperator::Create(llvm::Instruction::Add, idx,
+        llvm::ConstantInt::get(int64Type_, 1), "", probe_term);
+    auto shift = llvm::BinaryOperator::Create(llvm::Instruction::URem, offs,
+        llvm::ConstantInt::get(int64Type_, BloomHasher::bit_size), "",
+        probe_term);
+
+    std::vector<llvm::Value *> indicies = { idx };
+    auto elm_ptr = llvm::GetElementPtrInst::CreateInBounds(int64Type_, filter,
+        indicies, "", probe_term);
+    auto elm = new llvm::LoadInst(elm_ptr, "", probe_term);
+    auto bit = llvm::BinaryOperator::Create(llvm::Instruction::LShr, elm,
+        shift, "", probe_term);
+    bit = llvm::BinaryOperator::Create(llvm::Instruction::And, bit,
+        llvm::ConstantInt::get(int64Type_, 1), "", probe_term);
+    auto is_set = new llvm::ICmpInst(probe_term, llvm::CmpInst::ICMP_NE, bit,
+        llvm::ConstantInt::get(int64Type_, 0));
+
+    if (hit == nullptr) {
+      hit = is_set;
+    } else {
+      hit = llvm::BinaryOperator::Create(llvm::Instruction::And, hit, is_set,
+          "", probe_term);
+    }
+  }
+
+  auto check_term = llvm::SplitBlockAndInsertIfThen(hit, probe_term, false);
+  llvm::CallInst::Create(check_fcn, args, "", check_term);
+}
+
 void SpecSFSInstrumenter::addCallInst(llvm::Module &m,
     CsCFG::Id val,
     llvm::Instruction *cs,
     const std::vector<const std::vector<CsCFG::Id> *> &stacks) {
+  // The pop goes just after the call, find that before we split any blocks
+  auto after_cs = cs->getNextNode();
+  assert(after_cs != nullptr);
+
   // First add a call to the push function
   {
-    auto push_fcn = getPushFcn(m);
-
     // we add the push jsut before the call
     // size_t val_hash = std::hash<CsCFG::Id>()(val);
     size_t val_hash = bloom_hash(static_cast<size_t>(val));
-    std::vector<llvm::Value *> push_args =
-        { llvm::ConstantInt::get(int32Type_, static_cast<int32_t>(val)),
-          llvm::ConstantInt::get(int64Type_, val_hash) };
-    llvm::CallInst::Create(push_fcn, push_args, "", cs);
+    if (inline_callstack) {
+      addInlinePush(static_cast<int32_t>(val), val_hash, cs);
+    } else {
+      auto push_fcn = getPushFcn(m);
+
+      std::vector<llvm::Value *> push_args =
+          { llvm::ConstantInt::get(int32Type_, static_cast<int32_t>(val)),
+            llvm::ConstantInt::get(int64Type_, val_hash) };
+      llvm::CallInst::Create(push_fcn, push_args, "", cs);
+    }
   }
 
   // Then, (if needed), do a call to the check function
   if (stacks.size() > 0) {
     auto check_fcn = getCheckFcn(m);
 
-    // Initialize array to 0
-    BloomHasher::BloomFilter stack_hash;
-    BloomHasher::bloom_clear(stack_hash);
-    auto data_pr = getCheckData(m, stacks, &stack_hash);
+    auto data = getCheckData(m, stacks);
 
-    auto array_data = BloomFilterToPointer(m, stack_hash);
-    llvm::dbgs() << "array_data is: " << *array_data << "\n";
+    llvm::dbgs() << "filter is: " << *data.filter << " (" << data.filterBits
+      << " bits)\n";
     std::vector<llvm::Value *> check_args =
         { llvm::ConstantInt::get(int32Type_, static_cast<int32_t>(val)),
-          data_pr.first, data_pr.second,
-          array_data };
-    llvm::CallInst::Create(check_fcn, check_args, "", cs);
+          data.numSlots, data.stacks, data.hashes,
+          data.filter };
+    if (inline_callstack) {
+      addInlineCheck(check_fcn, check_args, data.filter, data.filterBits, cs);
+    } else {
+      llvm::CallInst::Create(check_fcn, check_args, "", cs);
+    }
   }
 
   // Finally call the pop function
   {
-    auto pop_fcn = getPopFcn(m);
-
-    std::vector<llvm::Value *> pop_args =
-        { llvm::ConstantInt::get(int32Type_, static_cast<int32_t>(val)) };
-    auto pop_call = llvm::CallInst::Create(pop_fcn, pop_args);
-    pop_call->insertAfter(cs);
+    if (inline_callstack) {
+      addInlinePop(static_cast<int32_t>(val), after_cs);
+    } else {
+      auto pop_fcn = getPopFcn(m);
+
+      std::vector<llvm::Value *> pop_args =
+          { llvm::ConstantInt::get(int32Type_, static_cast<int32_t>(val)) };
+      llvm::CallInst::Create(pop_fcn, pop_args, "", after_cs);
+    }
   }
 }
 
@@ -588,13 +903,24 @@ bool SpecSFSInstrumenter::addCallstackChecks(llvm::Module &m,
   auto &cfg = aa.getCsCFG();
 
   // Setup our initial worklist, for each id in stack
+  size_t longest_stack = 0;
   for (auto &stack : invalid_stacks) {
     for (auto &id : stack) {
       wl.push(id);
     }
+    longest_stack = std::max(longest_stack, stack.size());
   }
 
-  // Now, add call/ret inst for all pred callsites!
+  // Now, add call/ret inst for every callsite which may precede a checked
+  //   callsite.
+  //
+  //   -specsfs-minimal-callstack only pushes the checked callsites and their
+  //   immediate preds.  Checked stacks are compared frame by frame, and a
+  //   frame interleaved with a checked stack's frames is a pred of the frame
+  //   above it, so frames further down shouldn't be able to cause a match.
+  //   Neither that, nor how many pushes it saves, has been measured on the
+  //   test/ programs yet (see scripts/callstack-counts), so it isn't the
+  //   default.
   while (!wl.empty()) {
     auto id = wl.pop();
 
@@ -606,11 +932,28 @@ bool SpecSFSInstrumenter::addCallstackChecks(llvm::Module &m,
     if (rc.second) {
       for (auto &pred_id : node.preds()) {
         // FIXME(ddevec) ugly....
-        wl.push(util::convert_id<CsCFG::Id>(pred_id));
+        auto pred = util::convert_id<CsCFG::Id>(pred_id);
+        if (!minimal_callstack) {
+          wl.push(pred);
+        } else {
+          inst_ids.emplace(util::convert_id<CsCFG::Id>(
+                cfg.getNode(pred).id()));
+        }
       }
     }
   }
 
+  // No checked stack is deeper than longest_stack, so deeper frames are only
+  //   counted
+  if (minimal_callstack) {
+    stackLimit_ = std::min<int32_t>(SpecCallStack::MaxDepth,
+        std::max<size_t>(longest_stack, 1));
+  }
+
+  llvm::dbgs() << "SpecSFS callstack: " << invalid_stacks.size() <<
+    " checked stacks, instrumenting " << inst_ids.size() <<
+    " callsite ids, stack limit " << stackLimit_ << "\n";
+
   std::unordered_multimap<CsCFG::Id, const std::vector<CsCFG::Id> *>
     invalid_stack_insts;
 
@@ -645,6 +988,10 @@ bool SpecSFSInstrumenter::addCallstackChecks(llvm::Module &m,
   }
 
 
+  if (inline_callstack) {
+    setupCallStack(m);
+  }
+
   // inst_ids now contains all call sites I need to instrument w/ call/ret info
   for (auto id : inst_ids) {
     // Now instrument all ids
@@ -816,6 +1163,17 @@ bool SpecSFSInstrumenter::runOnModule(llvm::Module &m) {
   auto it = std::unique(std::begin(insts), std::end(insts), dedup_uni_fcn);
   insts.erase(it, std::end(insts));
 
+  if (optimize_checks) {
+    optimizeChecks(insts);
+  }
+
+  auto costs = SpecCheckBudget::enabled() ?
+      getAnalysis<SpecCheckBudget>().costs() : nullptr;
+  if (costs != nullptr) {
+    llvm::dbgs() << "Estimated check cost: " << 100.0 * costs->siteCost(insts)
+      << "% of the profiled runtime\n";
+  }
+
   /*
   llvm::dbgs() << "that's " << insts.size() << " instrumentation sites "
     "(post dedup)\n";
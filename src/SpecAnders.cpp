@@ -211,7 +211,9 @@ bool SpecAndersWrapperPass::runOnModule(llvm::Module &m) {
   auto &uf = getAnalysis<UnusedFunctions>();
   auto &indir_info = getAnalysis<IndirFunctionInfo>();
   auto &call_info = getAnalysis<CallContextLoader>();
-  anders_.run(m, cp, uf, indir_info, call_info);
+  const SpecCheckBudget *check_budget = SpecCheckBudget::enabled() ?
+      &getAnalysis<SpecCheckBudget>() : nullptr;
+  anders_.run(m, cp, uf, indir_info, call_info, check_budget);
   result_.reset(new SpecAndersAAResult(anders_));
   return false;
 }
@@ -235,6 +237,10 @@ void SpecAndersWrapperPass::getAnalysisUsage(
   usage.addRequired<IndirFunctionInfo>();
 
   usage.addRequired<CallContextLoader>();
+  // To choose the assumptions worth checking (with a budget)
+  if (SpecCheckBudget::enabled()) {
+    usage.addRequired<SpecCheckBudget>();
+  }
   // For dynamic ptsto removal
   // usage.addRequired<DynPtstoLoader>();
   // usage.addRequired<llvm::ProfileSummaryInfo>();
@@ -255,7 +261,8 @@ void SpecAndersAnalysis::run(llvm::Module &m,
     ConstraintPass &cons_pass,
     UnusedFunctions &unused_fcns,
     IndirFunctionInfo &indir_fcns,
-    CallContextLoader &call_info) {
+    CallContextLoader &call_info,
+    const SpecCheckBudget *check_budget) {
   // Set up our alias analysis
   // -- This is required for the llvm AliasAnalysis interface
   // FIXME(ddevec): fix for new alias analysis interface
@@ -267,7 +274,7 @@ void SpecAndersAnalysis::run(llvm::Module &m,
 
   // Setup dynamic info
   dynInfo_ = std14::make_unique<DynamicInfo>(unused_fcns,
-      indir_fcns, call_info);
+      indir_fcns, call_info, check_budget);
 
   // Clear the def-use graph
   // It should already be cleared, but I'm paranoid
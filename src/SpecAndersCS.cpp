@@ -142,6 +142,10 @@ void SpecAndersCS::getAnalysisUsage(llvm::AnalysisUsage &usage) const {
   usage.addRequired<IndirFunctionInfo>();
   usage.addRequired<CsCFG>();
   usage.addRequired<CallContextLoader>();
+  // To choose the assumptions worth checking (with a budget)
+  if (SpecCheckBudget::enabled()) {
+    usage.addRequired<SpecCheckBudget>();
+  }
 
   usage.addRequired<ConstraintPass>();
   // For dynamic ptsto removal
@@ -161,12 +165,14 @@ bool SpecAndersCS::runOnModule(llvm::Module &m) {
   auto &indir_info = getAnalysis<IndirFunctionInfo>();
   auto &call_info = getAnalysis<CallContextLoader>();
   auto &cs_cfg = getAnalysis<CsCFG>();
+  const SpecCheckBudget *check_budget = SpecCheckBudget::enabled() ?
+      &getAnalysis<SpecCheckBudget>() : nullptr;
 
   consPass_ = &getAnalysis<ConstraintPass>();
 
   // FIXME: Acutally construct?
   dynInfo_ = std14::make_unique<DynamicInfo>(unused_fcns,
-      indir_info, call_info);
+      indir_info, call_info, check_budget);
 
   BasicFcnCFG fcn_cfg(m, *dynInfo_);
 
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#ifndef TOOLS_PROFILEMERGER_H_
+#define TOOLS_PROFILEMERGER_H_
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "include/ProfileFile.h"
+
+// Merges profile files of one ProfileKind with a streaming k-way merge.
+//
+// The runtimes write records sorted by key (call stacks are sorted by their
+//   frames), so each input is streamed from its mmap, and only the current
+//   record of each input is held in memory.  Inputs which are not sorted (old
+//   text logs) are first sorted into a temporary file, one at a time.
+//
+// With more than one thread, the inputs are split into one group per thread,
+//   each group is merged into a temporary file in parallel, and those files are
+//   merged into the output.
+class ProfileMerger {
+  //{{{
+ public:
+  explicit ProfileMerger(ProfileKind kind) : kind_(kind) { }
+
+  bool merge(const std::vector<std::string> &inputs,
+      const std::string &outfile, bool text, size_t num_threads) {
+    if (!sameCoverage(inputs)) {
+      return false;
+    }
+
+    num_threads = std::max<size_t>(1,
+        std::min(num_threads, inputs.size()));
+
+    std::vector<std::string> sorted(inputs.size());
+    std::atomic<bool> ok(true);
+
+    // Sort any unsorted inputs, then merge each group to a temp file
+    std::vector<std::string> group_outs(num_threads);
+    auto do_group = [this, &inputs, &sorted, &group_outs, &ok, num_threads]
+        (size_t group) {
+      size_t first = group * inputs.size() / num_threads;
+      size_t last = (group + 1) * inputs.size() / num_threads;
+      std::vector<std::string> group_ins;
+      for (size_t i = first; i < last; ++i) {
+        sorted[i] = normalize(inputs[i]);
+        if (sorted[i].empty()) {
+          ok = false;
+          return;
+        }
+        group_ins.push_back(sorted[i]);
+      }
+
+      if (num_threads > 1) {
+        group_outs[group] = tempName();
+        ProfileWriter out(group_outs[group], kind_, false);
+        mergeSorted(group_ins, out);
+      }
+    };
+
+    if (num_threads == 1) {
+      do_group(0);
+    } else {
+      std::vector<std::thread> threads;
+      for (size_t i = 0; i < num_threads; ++i) {
+        threads.emplace_back(do_group, i);
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    }
+
+    if (ok) {
+      ProfileWriter out(outfile, kind_, text);
+      if (!out.good()) {
+        std::cerr << "Couldn't open output file: " << outfile << std::endl;
+        ok = false;
+      } else if (num_threads == 1) {
+        mergeSorted(sorted, out);
+      } else {
+        mergeSorted(group_outs, out);
+      }
+    }
+
+    // Cleanup the temps
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      if (!sorted[i].empty() && sorted[i] != inputs[i]) {
+        unlink(sorted[i].c_str());
+      }
+    }
+    for (auto &name : group_outs) {
+      if (!name.empty()) {
+        unlink(name.c_str());
+      }
+    }
+
+    return ok;
+  }
+
+ private:
+  struct Record {
+    int64_t key = 0;
+    std::vector<int64_t> vals;
+  };
+
+  // Call stacks are identified by their frames, everything else by key
+  bool less(const Record &lhs, const Record &rhs) const {
+    if (kind_ == ProfileKind::CallStack) {
+      return lhs.vals < rhs.vals;
+    }
+    return lhs.key < rhs.key;
+  }
+
+  bool same(const Record &lhs, const Record &rhs) const {
+    return !less(lhs, rhs) && !less(rhs, lhs);
+  }
+
+  void combine(Record &into, const Record &from) const {
+    switch (kind_) {
+      case ProfileKind::Edge:
+        if (into.vals.empty()) {
+          into.vals = from.vals;
+        } else if (!from.vals.empty()) {
+          into.vals[0] += from.vals[0];
+        }
+        break;
+      case ProfileKind::CallStack:
+        break;
+      default:
+        if (into.key == ProfileCoverageKey) {
+          into.vals.resize(std::max(into.vals.size(), from.vals.size()));
+          for (size_t i = 0; i < from.vals.size(); ++i) {
+            into.vals[i] += from.vals[i];
+          }
+          break;
+        }
+
+        {
+          std::vector<int64_t> merged;
+          merged.reserve(into.vals.size() + from.vals.size());
+          std::set_union(std::begin(into.vals), std::end(into.vals),
+              std::begin(from.vals), std::end(from.vals),
+              std::back_inserter(merged));
+          into.vals.swap(merged);
+        }
+        break;
+    }
+  }
+
+  void write(ProfileWriter &out, const Record &rec) const {
+    switch (kind_) {
+      case ProfileKind::Edge:
+        out.writeCount(rec.key, rec.vals.empty() ? 0 : rec.vals[0]);
+        break;
+      case ProfileKind::CallStack:
+        out.writeList(std::begin(rec.vals), std::end(rec.vals));
+        break;
+      default:
+        out.writeSet(rec.key, std::begin(rec.vals), std::end(rec.vals));
+        break;
+    }
+  }
+
+  // Set records must hold sorted unique ids, which old text logs need not
+  void cleanup(Record &rec) const {
+    if (kind_ != ProfileKind::CallStack && kind_ != ProfileKind::Edge &&
+        rec.key != ProfileCoverageKey) {
+      std::sort(std::begin(rec.vals), std::end(rec.vals));
+      rec.vals.erase(std::unique(std::begin(rec.vals), std::end(rec.vals)),
+          std::end(rec.vals));
+    }
+  }
+
+  // A sampled input's coverage record only covers its own events, so merging
+  //   it with unsampled inputs (which have none) would claim their events were
+  //   sampled too.  Returns false (with an error) for a mix.
+  bool sameCoverage(const std::vector<std::string> &inputs) const {
+    if (kind_ != ProfileKind::Ptsto && kind_ != ProfileKind::Alias) {
+      return true;
+    }
+
+    std::string sampled;
+    std::string unsampled;
+    for (auto &input : inputs) {
+      ProfileReader in(input, kind_);
+      Record first;
+      // The coverage record is written first, empty inputs have neither
+      if (!in.next(first.key, first.vals)) {
+        continue;
+      }
+
+      auto &name = (first.key == ProfileCoverageKey) ? sampled : unsampled;
+      if (name.empty()) {
+        name = input;
+      }
+    }
+
+    if (!sampled.empty() && !unsampled.empty()) {
+      std::cerr << "ERROR: Can't merge sampled (" << sampled <<
+        ") and unsampled (" << unsampled << ") profiles" << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  static std::string tempName() {
+    const char *dir = getenv("TMPDIR");
+    std::string name = std::string(dir != nullptr ? dir : "/tmp") +
+      "/ohamerge.XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+      std::cerr << "Couldn't create temp file: " << name << std::endl;
+      abort();
+    }
+    close(fd);
+    return name;
+  }
+
+  // Returns a sorted version of filename (filename itself if it already is
+  //   sorted), or "" on error
+  std::string normalize(const std::string &filename) const {
+    {
+      ProfileReader in(filename, kind_);
+      if (!in.isOpen()) {
+        std::cerr << "Couldn't open input file: " << filename << std::endl;
+        return "";
+      }
+
+      bool is_sorted = in.isBinary();
+      Record prev;
+      Record cur;
+      bool first = true;
+      while (is_sorted && in.next(cur.key, cur.vals)) {
+        if (!first && !less(prev, cur)) {
+          is_sorted = false;
+        }
+        first = false;
+        std::swap(prev, cur);
+      }
+
+      if (is_sorted) {
+        return filename;
+      }
+    }
+
+    // Sort this one input in memory
+    std::map<int64_t, Record> by_key;
+    std::map<std::vector<int64_t>, Record> by_stack;
+    ProfileReader in(filename, kind_);
+    Record cur;
+    while (in.next(cur.key, cur.vals)) {
+      cleanup(cur);
+      auto &rec = (kind_ == ProfileKind::CallStack) ?
+        by_stack[cur.vals] : by_key[cur.key];
+      if (rec.vals.empty()) {
+        rec = cur;
+      } else {
+        combine(rec, cur);
+      }
+    }
+
+    auto name = tempName();
+    ProfileWriter out(name, kind_, false);
+    for (auto &pr : by_key) {
+      write(out, pr.second);
+    }
+    for (auto &pr : by_stack) {
+      write(out, pr.second);
+    }
+
+    return name;
+  }
+
+  // k-way merges sorted inputs into out
+  void mergeSorted(const std::vector<std::string> &inputs,
+      ProfileWriter &out) const {
+    std::vector<std::unique_ptr<ProfileReader>> readers;
+    std::vector<Record> heads(inputs.size());
+
+    auto greater = [this, &heads] (size_t lhs, size_t rhs) {
+      return less(heads[rhs], heads[lhs]);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)>
+      queue(greater);
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      readers.emplace_back(new ProfileReader(inputs[i], kind_));
+      if (readers[i]->next(heads[i].key, heads[i].vals)) {
+        queue.push(i);
+      }
+    }
+
+    Record cur;
+    while (!queue.empty()) {
+      auto idx = queue.top();
+      queue.pop();
+      cur = std::move(heads[idx]);
+      if (readers[idx]->next(heads[idx].key, heads[idx].vals)) {
+        queue.push(idx);
+      }
+
+      while (!queue.empty() && same(heads[queue.top()], cur)) {
+        idx = queue.top();
+        queue.pop();
+        combine(cur, heads[idx]);
+        if (readers[idx]->next(heads[idx].key, heads[idx].vals)) {
+          queue.push(idx);
+        }
+      }
+
+      write(out, cur);
+    }
+  }
+
+  ProfileKind kind_;
+  //}}}
+};
+
+// Parses "[-j threads] [-o outfile] [-text|-binary] inputs...", as shared by
+//   the merge tools.  Output defaults to text on stdout (as the tools used to
+//   print), or binary when an outfile is given.
+//
+// The kind is taken from the binary inputs' headers, which must all agree.
+//   Text inputs have no header, and are read as the binary inputs' kind, or
+//   as default_kind if there are none.
+inline int profile_merge_main(int argc, char **argv,
+    ProfileKind default_kind) {
+  std::vector<std::string> inputs;
+  std::string outfile = "-";
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  int text = -1;
+  bool bad_arg = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "-j" && i + 1 < argc) {
+      char *end;
+      errno = 0;
+      num_threads = strtoul(argv[++i], &end, 10);
+      if (errno != 0 || end == argv[i] || *end != '\0' || num_threads == 0 ||
+          argv[i][0] == '-') {
+        std::cerr << "ERROR: -j needs a positive thread count, not: " <<
+          argv[i] << std::endl;
+        bad_arg = true;
+      }
+    } else if (arg == "-o" && i + 1 < argc) {
+      outfile = argv[++i];
+    } else if (arg == "-text") {
+      text = 1;
+    } else if (arg == "-binary") {
+      text = 0;
+    } else {
+      inputs.push_back(arg);
+    }
+  }
+
+  if (bad_arg || inputs.empty()) {
+    std::cerr << "ERROR: Usage: " << argv[0] <<
+      " [-j threads] [-o outfile] [-text|-binary] <input files>" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (text == -1) {
+    text = (outfile == "-");
+  }
+
+  ProfileKind kind = default_kind;
+  std::string kind_from;
+  for (auto &input : inputs) {
+    ProfileKind file_kind;
+    if (!ProfileReader::fileKind(input, file_kind)) {
+      continue;
+    }
+
+    if (kind_from.empty()) {
+      kind = file_kind;
+      kind_from = input;
+    } else if (file_kind != kind) {
+      std::cerr << "ERROR: " << input << " is a different kind of profile "
+        "than " << kind_from << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  ProfileMerger merger(kind);
+  if (!merger.merge(inputs, outfile, text, num_threads)) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#endif  // TOOLS_PROFILEMERGER_H_
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+// Benchmarks ProfileMerger against the old load-everything merge, on synthetic
+//   dyn_ptsto logs:
+//     ./bench_merge <files> <keys per file> <ids per key> [threads]
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/ProfileFile.h"
+#include "tools/ProfileMerger.h"
+
+static std::vector<std::string> make_inputs(const std::string &dir,
+    size_t num_files, size_t num_keys, size_t num_ids, bool text) {
+  std::vector<std::string> ret;
+  std::mt19937 rand(42);
+  // Runs see overlapping values and objects, as real runs of a program do
+  std::uniform_int_distribution<int64_t> key(0, num_keys * 4);
+  std::uniform_int_distribution<int64_t> id(0, num_ids * 16);
+
+  for (size_t i = 0; i < num_files; ++i) {
+    std::string name = dir + "/in." + std::to_string(i) +
+      (text ? ".txt" : ".bin");
+    std::set<int64_t> keys;
+    while (keys.size() < num_keys) {
+      keys.insert(key(rand));
+    }
+
+    ProfileWriter out(name, ProfileKind::Ptsto, text);
+    for (auto k : keys) {
+      std::set<int64_t> ids;
+      while (ids.size() < num_ids) {
+        ids.insert(id(rand));
+      }
+      out.writeSet(k, std::begin(ids), std::end(ids));
+    }
+    ret.push_back(name);
+  }
+
+  return ret;
+}
+
+// The merge as merge_logfiles used to do it
+static void legacy_merge(const std::vector<std::string> &inputs,
+    const std::string &outfile) {
+  std::unordered_map<int32_t, std::set<int32_t>> valid_to_objids;
+  for (auto &filename : inputs) {
+    ProfileReader logfile(filename, ProfileKind::Ptsto);
+    int64_t call_id;
+    std::vector<int64_t> fcn_ids;
+    while (logfile.next(call_id, fcn_ids)) {
+      valid_to_objids[call_id].insert(std::begin(fcn_ids), std::end(fcn_ids));
+    }
+  }
+
+  std::ofstream out(outfile);
+  for (auto &val_pr : valid_to_objids) {
+    out << val_pr.first << ":";
+    for (auto &obj_id : val_pr.second) {
+      out << " " << obj_id;
+    }
+    out << std::endl;
+  }
+}
+
+template <typename fn_type>
+static double time_it(fn_type fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::cerr << "ERROR: Usage: " << argv[0] <<
+      " <files> <keys per file> <ids per key> [threads]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  size_t num_files = std::stoul(argv[1]);
+  size_t num_keys = std::stoul(argv[2]);
+  size_t num_ids = std::stoul(argv[3]);
+  size_t num_threads = (argc > 4) ? std::stoul(argv[4]) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  const char *tmp = getenv("TMPDIR");
+  std::string dir = std::string(tmp != nullptr ? tmp : "/tmp") +
+    "/bench_merge.XXXXXX";
+  if (mkdtemp(&dir[0]) == nullptr) {
+    std::cerr << "Couldn't create temp dir: " << dir << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  auto bin_inputs = make_inputs(dir, num_files, num_keys, num_ids, false);
+  auto text_inputs = make_inputs(dir, num_files, num_keys, num_ids, true);
+  std::string outfile = dir + "/out";
+
+  ProfileMerger merger(ProfileKind::Ptsto);
+
+  std::cout << "legacy (text in, text out): " <<
+    time_it([&] { legacy_merge(text_inputs, outfile); }) << " s\n";
+  std::cout << "kway, 1 thread (text in, text out): " <<
+    time_it([&] { merger.merge(text_inputs, outfile, true, 1); }) << " s\n";
+  std::cout << "kway, 1 thread (binary in, binary out): " <<
+    time_it([&] { merger.merge(bin_inputs, outfile, false, 1); }) << " s\n";
+  std::cout << "kway, " << num_threads <<
+    " threads (binary in, binary out): " <<
+    time_it([&] { merger.merge(bin_inputs, outfile, false, num_threads); }) <<
+    " s\n";
+
+  for (auto &name : bin_inputs) {
+    unlink(name.c_str());
+  }
+  for (auto &name : text_inputs) {
+    unlink(name.c_str());
+  }
+  unlink(outfile.c_str());
+  rmdir(dir.c_str());
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015 David Devecsery
+ */
+
+// Drives the DynPtsto runtime with a synthetic alloc/gep/visit/free workload,
+//   to compare its address lookup backends.  Run it once per backend:
+//     DYNPTSTO_BACKEND=map ./bench_ptsto <threads> <objects> <visits>
+//     DYNPTSTO_BACKEND=shadow ./bench_ptsto <threads> <objects> <visits>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+void __DynPtsto_do_call();
+void __DynPtsto_do_ret();
+void __DynPtsto_do_alloca(int32_t obj_id, int64_t size, void *addr);
+void __DynPtsto_do_malloc(int32_t obj_id, int64_t size, void *addr);
+void __DynPtsto_do_free(void *addr);
+void __DynPtsto_do_gep(int32_t offs, void *base_addr, void *res_addr,
+    int64_t size, int32_t gep_id);
+void __DynPtsto_do_visit(int32_t val_id, void *addr);
+}
+
+static const int64_t ObjSize = 64;
+static const int64_t FieldSize = 8;
+static const int32_t NumFields = ObjSize / FieldSize;
+
+static void run_thread(int tid, size_t num_objs, size_t num_visits) {
+  std::mt19937 rand(tid);
+  std::vector<char *> objs;
+
+  // Every object gets its fields split by geps, as structs do
+  __DynPtsto_do_call();
+  char frame[ObjSize];
+  __DynPtsto_do_alloca(100 + tid, ObjSize, frame);
+
+  for (size_t i = 0; i < num_objs; ++i) {
+    auto obj = static_cast<char *>(malloc(ObjSize));
+    int32_t obj_id = 1000 + 100 * tid + (i % 1024 % 100) * NumFields;
+    __DynPtsto_do_malloc(obj_id, ObjSize, obj);
+    for (int32_t fld = 0; fld < NumFields; ++fld) {
+      __DynPtsto_do_gep(fld, obj, obj + fld * FieldSize, FieldSize, fld);
+    }
+    objs.push_back(obj);
+  }
+
+  std::uniform_int_distribution<size_t> pick(0, objs.size() - 1);
+  std::uniform_int_distribution<int64_t> offs(0, ObjSize - 1);
+  for (size_t i = 0; i < num_visits; ++i) {
+    // Like a real pointer, each visited value only sees a few objects
+    auto obj = pick(rand);
+    __DynPtsto_do_visit(obj % 1024, objs[obj] + offs(rand));
+  }
+
+  for (auto obj : objs) {
+    __DynPtsto_do_free(obj);
+    free(obj);
+  }
+  __DynPtsto_do_ret();
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    std::cerr << "ERROR: Usage: " << argv[0] <<
+      " <threads> <objects per thread> <visits per thread>" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int num_threads = std::stoi(argv[1]);
+  size_t num_objs = std::stoul(argv[2]);
+  size_t num_visits = std::stoul(argv[3]);
+
+  const char *backend = getenv("DYNPTSTO_BACKEND");
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(run_thread, i, num_objs, num_visits);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  size_t ops = num_threads * (num_objs * (NumFields + 2) + num_visits);
+
+  std::cout << "backend: " << (backend ? backend : "shadow") << "\n";
+  std::cout << "threads: " << num_threads << "\n";
+  std::cout << "ops: " << ops << "\n";
+  std::cout << "time (s): " << secs << "\n";
+  std::cout << "ns/op: " << secs * 1e9 / ops << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "include/CheckSet.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Every member is found, nothing near the members is, and forEach visits
+//   exactly the members
+static void check_table(const std::vector<int32_t> &ids,
+    CheckSet::Kind expected_kind) {
+  auto table = CheckSet::encode(ids);
+  std::string desc = std::to_string(ids.size()) + " ids";
+  test_assert(table[0] == expected_kind, "wrong encoding for " + desc);
+
+  std::set<int32_t> members(std::begin(ids), std::end(ids));
+  for (auto id : ids) {
+    for (int32_t near = std::max(0, id - 40); near <= id + 40; ++near) {
+      test_assert(CheckSet::contains(table.data(), near) ==
+          (members.count(near) != 0),
+          "wrong membership of " + std::to_string(near) + " in " + desc);
+    }
+  }
+  test_assert(!CheckSet::contains(table.data(), -1), "-1 is a member");
+
+  std::set<int32_t> visited;
+  CheckSet::forEach(table.data(), [&visited] (int32_t id) {
+    test_assert(visited.insert(id).second, "id visited twice");
+  });
+  test_assert(visited == members, "forEach doesn't visit the set " + desc);
+}
+
+static std::vector<int32_t> random_ids(std::mt19937 &rand, size_t count,
+    int32_t max_id) {
+  std::uniform_int_distribution<int32_t> dist(0, max_id);
+  std::set<int32_t> ids;
+  while (ids.size() < count) {
+    ids.insert(dist(rand));
+  }
+  return std::vector<int32_t>(std::begin(ids), std::end(ids));
+}
+
+int main(void) {
+  std::mt19937 rand(1);
+
+  check_table({ }, CheckSet::Bitmap);
+  check_table({ 7 }, CheckSet::Bitmap);
+  check_table({ 0, 1, 2, 3, 31, 32, 33 }, CheckSet::Bitmap);
+
+  for (size_t count : { 2, 10, 100, 1000, 20000 }) {
+    // Dense ids get a bitmap, sparse ids (however many) the hash
+    check_table(random_ids(rand, count, 4 * count), CheckSet::Bitmap);
+    check_table(random_ids(rand, count, 1 << 30), CheckSet::Hash);
+  }
+
+  // Ids which share their low bits still hash apart
+  std::vector<int32_t> strided;
+  for (int32_t i = 0; i < 1000; ++i) {
+    strided.push_back(i << 20);
+  }
+  check_table(strided, CheckSet::Hash);
+
+  // Encoding is deterministic, so rebuilds emit the same tables
+  auto ids = random_ids(rand, 500, 1 << 30);
+  test_assert(CheckSet::encode(ids) == CheckSet::encode(ids),
+      "encoding isn't deterministic");
+
+  return EXIT_SUCCESS;
+}
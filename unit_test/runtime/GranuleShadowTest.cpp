@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "include/GranuleShadow.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// The shadow never touches the addresses it maps, so any range will do
+static const uintptr_t Base = 0x10000000;
+static const size_t RegionSize = 1 << 14;
+
+// Random sets, updates and small clears, against a value per byte
+static void check_stores(GranuleShadow &shadow, size_t granule) {
+  test_assert(shadow.granule() == granule, "wrong granule");
+
+  std::string desc = "granule " + std::to_string(granule);
+  std::vector<int32_t> expected(RegionSize, 0);
+
+  std::mt19937 rand(granule);
+  std::uniform_int_distribution<size_t> offs_dist(0, RegionSize - 1);
+  std::uniform_int_distribution<size_t> size_dist(1, 4 * granule);
+  std::uniform_int_distribution<int32_t> val_dist(0, 1000);
+  for (int i = 0; i < 20000; ++i) {
+    auto offs = offs_dist(rand);
+    auto size = std::min(size_dist(rand), RegionSize - offs);
+    switch (rand() % 3) {
+      case 0: {
+        auto val = val_dist(rand);
+        shadow.set(val, Base + offs, size);
+        for (size_t j = offs; j < offs + size; ++j) {
+          expected[j] = val;
+        }
+        break;
+      }
+      case 1:
+        shadow.update(Base + offs, size, [] (int32_t val) {
+          return val + 1;
+        });
+        for (size_t j = offs; j < offs + size; ++j) {
+          expected[j]++;
+        }
+        break;
+      default:
+        shadow.clear(Base + offs, size);
+        for (size_t j = offs; j < offs + size; ++j) {
+          expected[j] = GranuleShadow::InvalidValue;
+        }
+        break;
+    }
+  }
+
+  for (size_t j = 0; j < RegionSize; ++j) {
+    test_assert(shadow.get(Base + j) == expected[j],
+        "wrong value at " + std::to_string(j) + " with " + desc);
+  }
+  test_assert(shadow.numSplits() != 0, "partial stores didn't split");
+
+  // Untouched memory reads as 0, addresses past the shadow as invalid
+  test_assert(shadow.get(Base + RegionSize + 4096) == 0,
+      "untouched memory isn't 0 with " + desc);
+  test_assert(shadow.get(~static_cast<uintptr_t>(0)) ==
+      GranuleShadow::InvalidValue, "address past the shadow is valid");
+}
+
+// A large clear (which returns its shadow pages) leaves no old values, and
+//   doesn't touch its neighbors
+static void check_large_clear(GranuleShadow &shadow, size_t granule) {
+  std::string desc = "granule " + std::to_string(granule);
+  size_t size = 4 * GranuleShadow::LargeFree + 3;
+  uintptr_t start = Base + 5;
+  shadow.set(7, start - 5, size + 10);
+  // Split a few granules, so their slots are freed
+  for (size_t offs = 0; offs < size; offs += size / 16) {
+    shadow.set(9, start + offs, 1);
+  }
+
+  shadow.clear(start, size);
+  for (size_t offs = 0; offs < size; ++offs) {
+    auto val = shadow.get(start + offs);
+    test_assert(val == 0 || val == GranuleShadow::InvalidValue,
+        "cleared value " + std::to_string(val) + " with " + desc);
+  }
+  test_assert(shadow.get(start) == GranuleShadow::InvalidValue &&
+      shadow.get(start + size - 1) == GranuleShadow::InvalidValue,
+      "partial granules weren't cleared with " + desc);
+  for (int i = 1; i <= 5; ++i) {
+    test_assert(shadow.get(start - i) == 7 &&
+        shadow.get(start + size - 1 + i) == 7,
+        "clear touched its neighbors with " + desc);
+  }
+}
+
+int main(void) {
+  GranuleShadow shadow;
+  test_assert(!shadow.init(0) && !shadow.init(12) && !shadow.init(128),
+      "bad granule accepted");
+
+  // A shadow's reservation (half the address space, at granule 8) is never
+  //   unmapped, so each granule is tested in its own child
+  for (size_t granule : { 8, 16, 64 }) {
+    pid_t pid = fork();
+    test_assert(pid >= 0, "fork failed");
+    if (pid == 0) {
+      test_assert(shadow.init(granule), "couldn't reserve the shadow");
+      check_stores(shadow, granule);
+      check_large_clear(shadow, granule);
+      exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    test_assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == EXIT_SUCCESS,
+        "granule " + std::to_string(granule) + " failed");
+  }
+
+  return EXIT_SUCCESS;
+}
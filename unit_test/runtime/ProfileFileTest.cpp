@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "include/ProfileFile.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+typedef std::vector<std::pair<int64_t, std::vector<int64_t>>> Records;
+
+static std::string temp_name() {
+  const char *dir = getenv("TMPDIR");
+  std::string name = std::string(dir != nullptr ? dir : "/tmp") +
+    "/profilefiletest.XXXXXX";
+  int fd = mkstemp(&name[0]);
+  test_assert(fd >= 0, "mkstemp failed");
+  close(fd);
+  return name;
+}
+
+static std::string kind_name(ProfileKind kind, bool text) {
+  return std::to_string(static_cast<uint64_t>(kind)) +
+    (text ? " (text)" : " (binary)");
+}
+
+static void write_records(const std::string &name, ProfileKind kind,
+    bool text, const Records &records) {
+  ProfileWriter ofil(name, kind, text);
+  test_assert(ofil.good(), "couldn't open " + name);
+  for (auto &pr : records) {
+    auto &vals = pr.second;
+    switch (kind) {
+      case ProfileKind::Ptsto:
+      case ProfileKind::Alias:
+      case ProfileKind::Indir:
+        ofil.writeSet(pr.first, std::begin(vals), std::end(vals));
+        break;
+      case ProfileKind::CallStack:
+        ofil.writeList(std::begin(vals), std::end(vals));
+        break;
+      case ProfileKind::Edge:
+        ofil.writeCount(pr.first, vals.front());
+        break;
+    }
+  }
+}
+
+static Records read_records(const std::string &name, ProfileKind kind) {
+  ProfileReader reader(name, kind);
+  test_assert(reader.isOpen(), "couldn't open " + name);
+
+  Records ret;
+  int64_t key;
+  std::vector<int64_t> vals;
+  while (reader.next(key, vals)) {
+    ret.emplace_back(key, vals);
+  }
+  return ret;
+}
+
+static std::string read_file(const std::string &name) {
+  std::ifstream in(name, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+      std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string &name, const std::string &data) {
+  std::ofstream out(name, std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+}
+
+// Records of kind, with negative keys and ids, large ids and empty sets
+static Records make_records(ProfileKind kind) {
+  switch (kind) {
+    case ProfileKind::Ptsto:
+    case ProfileKind::Alias:
+    case ProfileKind::Indir:
+      return {
+        { -300, { -70000, -3, 0, 5 } },
+        { -2, { } },
+        { 0, { 0 } },
+        { 7, { 1, 2, 3, 4, 5, 1000000 } },
+        { 127, { } },
+        { int64_t(1) << 40, { -(int64_t(1) << 40), int64_t(1) << 50 } }
+      };
+    case ProfileKind::CallStack:
+      // Stacks aren't sorted, and may repeat ids
+      return {
+        { 0, { 0, 5, 3, 5, 1 } },
+        { 0, { -4 } },
+        { 0, { 0, 1000000, 2 } }
+      };
+    case ProfileKind::Edge:
+      return {
+        { -9, { 3 } },
+        { 0, { 0 } },
+        { 1, { 1 } },
+        { 200, { int64_t(1) << 40 } }
+      };
+  }
+  return { };
+}
+
+// Each kind reads back what was written, in both formats
+static void check_round_trip() {
+  for (auto kind : { ProfileKind::Ptsto, ProfileKind::Alias,
+      ProfileKind::Indir, ProfileKind::CallStack, ProfileKind::Edge }) {
+    for (bool text : { false, true }) {
+      auto desc = kind_name(kind, text);
+      auto name = temp_name();
+      auto records = make_records(kind);
+      write_records(name, kind, text, records);
+
+      ProfileReader reader(name, kind);
+      test_assert(reader.isBinary() == !text, "wrong format for " + desc);
+
+      auto read = read_records(name, kind);
+      test_assert(read.size() == records.size(),
+          "wrong number of records for " + desc);
+      for (size_t i = 0; i < records.size(); ++i) {
+        // Call stack keys are unused (text numbers them by line)
+        if (kind != ProfileKind::CallStack) {
+          test_assert(read[i].first == records[i].first,
+              "wrong key for " + desc);
+        }
+        test_assert(read[i].second == records[i].second,
+            "wrong values for " + desc);
+      }
+
+      ProfileKind file_kind;
+      test_assert(ProfileReader::fileKind(name, file_kind) == !text &&
+          (text || file_kind == kind), "wrong file kind for " + desc);
+      unlink(name.c_str());
+    }
+  }
+
+  // Empty call stacks survive in binary (they are blank lines in text)
+  auto name = temp_name();
+  Records empty_stack = { { 0, { } }, { 0, { 1 } } };
+  write_records(name, ProfileKind::CallStack, false, empty_stack);
+  test_assert(read_records(name, ProfileKind::CallStack) == empty_stack,
+      "empty call stack lost");
+  unlink(name.c_str());
+}
+
+// The coverage record is read back as the first (lowest keyed) record, and
+//   total is never below sampled
+static void check_coverage() {
+  for (bool text : { false, true }) {
+    auto name = temp_name();
+    {
+      ProfileWriter ofil(name, ProfileKind::Ptsto, text);
+      ofil.writeCoverage(10, 100);
+      std::vector<int64_t> ids = { 1 };
+      ofil.writeSet(0, std::begin(ids), std::end(ids));
+    }
+    Records expected = { { ProfileCoverageKey, { 10, 100 } }, { 0, { 1 } } };
+    test_assert(read_records(name, ProfileKind::Ptsto) == expected,
+        "wrong coverage record");
+
+    {
+      ProfileWriter ofil(name, ProfileKind::Ptsto, text);
+      ofil.writeCoverage(10, 5);
+    }
+    expected = { { ProfileCoverageKey, { 10, 10 } } };
+    test_assert(read_records(name, ProfileKind::Ptsto) == expected,
+        "coverage total below sampled");
+    unlink(name.c_str());
+  }
+}
+
+// Missing, empty and mismatched files read no records
+static void check_rejected() {
+  auto name = temp_name();
+  test_assert(read_records(name, ProfileKind::Ptsto).empty(),
+      "empty file has records");
+
+  ProfileKind kind;
+  test_assert(!ProfileReader::fileKind(name, kind), "empty file has a kind");
+  unlink(name.c_str());
+  test_assert(!ProfileReader(name, ProfileKind::Ptsto).isOpen(),
+      "missing file is open");
+  test_assert(!ProfileReader::fileKind(name, kind), "missing file has a kind");
+
+  // A binary profile of another kind
+  write_records(name, ProfileKind::Edge, false,
+      make_records(ProfileKind::Edge));
+  test_assert(read_records(name, ProfileKind::Ptsto).empty(),
+      "read a profile of the wrong kind");
+
+  // Another version
+  auto data = read_file(name);
+  data[sizeof(ProfileFileMagic)] = 2;
+  write_file(name, data);
+  test_assert(read_records(name, ProfileKind::Edge).empty(),
+      "read a profile of the wrong version");
+  test_assert(!ProfileReader::fileKind(name, kind),
+      "wrong version has a kind");
+
+  // Malformed text
+  write_file(name, "1: 2 3\nfoo: 4\n5: 6\n");
+  test_assert(read_records(name, ProfileKind::Ptsto).size() == 1,
+      "read past malformed text");
+  write_file(name, "1: 2 3x\n5: 6\n");
+  test_assert(read_records(name, ProfileKind::Ptsto).empty(),
+      "read a line with trailing junk");
+  write_file(name, "OH");
+  test_assert(read_records(name, ProfileKind::CallStack).empty(),
+      "read a truncated header as a call stack");
+  unlink(name.c_str());
+}
+
+// Every truncation of a binary file reads a prefix of its records
+static void check_truncated() {
+  for (auto kind : { ProfileKind::Ptsto, ProfileKind::CallStack,
+      ProfileKind::Edge }) {
+    auto name = temp_name();
+    auto records = make_records(kind);
+    write_records(name, kind, false, records);
+    auto data = read_file(name);
+
+    for (size_t len = 0; len < data.size(); ++len) {
+      write_file(name, data.substr(0, len));
+      auto read = read_records(name, kind);
+      test_assert(read.size() < records.size(),
+          "truncated file has every record");
+      for (size_t i = 0; i < read.size(); ++i) {
+        test_assert(read[i] == records[i], "truncated file has a bad record");
+      }
+    }
+    unlink(name.c_str());
+  }
+}
+
+// Corrupt files (whose end is a page end, so a read past it faults) are read
+//   without running off their end
+static void check_corrupt() {
+  auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  std::string header;
+  header.append(ProfileFileMagic, sizeof(ProfileFileMagic));
+  header.push_back(static_cast<char>(ProfileFileVersion));
+  header.push_back(static_cast<char>(ProfileKind::Ptsto));
+
+  auto name = temp_name();
+
+  // An unterminated varint
+  auto data = header;
+  data.resize(page_size, static_cast<char>(0x80));
+  write_file(name, data);
+  test_assert(read_records(name, ProfileKind::Ptsto).empty(),
+      "read an unterminated varint");
+
+  // A record claiming more values than the file holds
+  data = header;
+  data.push_back(0);
+  data.append("\xff\xff\xff\xff\xff\xff\xff\xff\x7f", 9);
+  data.resize(page_size, 1);
+  write_file(name, data);
+  test_assert(read_records(name, ProfileKind::Ptsto).empty(),
+      "read an oversized record");
+
+  // Random damage reads at most a record per byte, each value one byte
+  std::mt19937 rand(1);
+  write_records(name, ProfileKind::Ptsto, false,
+      make_records(ProfileKind::Ptsto));
+  auto good = read_file(name);
+  for (int i = 0; i < 2000; ++i) {
+    data = good;
+    for (int j = rand() % 4; j >= 0; --j) {
+      data[header.size() + rand() % (data.size() - header.size())] =
+        static_cast<char>(rand());
+    }
+    write_file(name, data);
+
+    size_t num_vals = 0;
+    auto read = read_records(name, ProfileKind::Ptsto);
+    for (auto &pr : read) {
+      num_vals += pr.second.size();
+    }
+    test_assert(read.size() + num_vals <= data.size(),
+        "read more than the file holds");
+  }
+  unlink(name.c_str());
+}
+
+int main(void) {
+  check_round_trip();
+  check_coverage();
+  check_rejected();
+  check_truncated();
+  check_corrupt();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "include/ProfileFlusher.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << getpid() << ": " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static sem_t flushed;
+static std::atomic<int64_t> a_seq(-1);
+static std::atomic<int64_t> b_seq(-1);
+static std::atomic<bool> b_slow(false);
+static sem_t c_gate;
+
+// b writes the count since its last flush, as the libraries' deltas do.  A
+//   forked child drops both (as their reset_after_fork does).
+static std::atomic<uint64_t> b_count(0);
+static std::atomic<uint64_t> b_flushed(0);
+static std::atomic<uint64_t> b_delta(0);
+
+static void reset_b() {
+  b_count = 0;
+  b_flushed = 0;
+}
+
+static void flush_a(uint64_t seq) {
+  a_seq = seq;
+  sem_post(&flushed);
+}
+
+static void flush_b(uint64_t seq) {
+  if (b_slow) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+  b_delta = b_count - b_flushed;
+  b_flushed = b_count.load();
+  b_seq = seq;
+  sem_post(&flushed);
+}
+
+// Never finishes
+static void flush_c(uint64_t) {
+  sem_post(&flushed);
+  while (sem_wait(&c_gate) != 0 && errno == EINTR) { }
+}
+
+static void wait_flushes(int count) {
+  for (int i = 0; i < count; ++i) {
+    while (sem_wait(&flushed) != 0 && errno == EINTR) { }
+  }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+int main(void) {
+  setenv("SFS_FLUSH_SIGNAL", std::to_string(SIGUSR2).c_str(), 1);
+  sem_init(&flushed, 0, 0);
+  sem_init(&c_gate, 0, 0);
+
+  ProfileFlusher::start(flush_a);
+  ProfileFlusher::start(flush_b);
+  pthread_atfork(nullptr, nullptr, reset_b);
+
+  b_count = 10;
+  kill(getpid(), SIGUSR2);
+  wait_flushes(2);
+  test_assert(a_seq == 0 && b_seq == 0, "first flush isn't 0");
+  test_assert(b_delta == 10, "wrong first delta");
+
+  // Stopping a only stops a
+  ProfileFlusher::stop(flush_a);
+  kill(getpid(), SIGUSR2);
+  wait_flushes(1);
+  test_assert(b_seq == 1, "b stopped with a");
+  test_assert(a_seq == 0, "a flushed after its stop");
+
+  // Fork while b flushes.  The child mustn't inherit a held lock, and gets its
+  //   own flusher (once it polls), counting from 0
+  b_slow = true;
+  kill(getpid(), SIGUSR2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  auto pid = fork();
+  test_assert(pid >= 0, "fork failed");
+  if (pid == 0) {
+    // The parent's flush finished before the fork, drop its post
+    sem_init(&flushed, 0, 0);
+    b_seq = -1;
+    b_slow = false;
+    kill(getpid(), SIGUSR2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    test_assert(b_seq == -1, "child flushed before its flusher started");
+
+    b_count = 3;
+    ProfileFlusher::poll();
+    wait_flushes(1);
+    test_assert(b_seq == 0, "child's flushes don't start at 0: " +
+        std::to_string(b_seq));
+    test_assert(b_delta == 3, "child's first delta isn't its own count: " +
+        std::to_string(b_delta));
+
+    auto start = std::chrono::steady_clock::now();
+    ProfileFlusher::stop(flush_b);
+    test_assert(seconds_since(start) < 1.0, "child's stop() blocked");
+    _exit(EXIT_SUCCESS);
+  }
+
+  int status;
+  test_assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+      WEXITSTATUS(status) == EXIT_SUCCESS, "child failed");
+
+  wait_flushes(1);
+  test_assert(b_seq == 2, "parent's flushes lost across the fork");
+  b_slow = false;
+
+  // A stop() can't wait on a flush which never finishes
+  ProfileFlusher::start(flush_c);
+  kill(getpid(), SIGUSR2);
+  wait_flushes(2);
+  auto start = std::chrono::steady_clock::now();
+  ProfileFlusher::stop(flush_c);
+  test_assert(seconds_since(start) < 30.0, "stop() didn't give up");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "include/SharedProfile.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << getpid() << ": " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int num_forks = 0;
+
+static void on_fork() {
+  num_forks++;
+}
+
+static void wait_child(pid_t pid, int code) {
+  int status;
+  test_assert(waitpid(pid, &status, 0) == pid, "waitpid failed");
+  test_assert(WIFEXITED(status) && WEXITSTATUS(status) == code,
+      "child " + std::to_string(pid) + " failed");
+}
+
+static void wait_killed(pid_t pid) {
+  int status;
+  test_assert(waitpid(pid, &status, 0) == pid && WIFSIGNALED(status),
+      "child " + std::to_string(pid) + " wasn't killed");
+}
+
+int main(void) {
+  setenv("SFS_SHARED_PROFILE", "4096", 1);
+
+  // Flushes only see each process's own records, so they can't be combined
+  setenv("SFS_FLUSH_INTERVAL", "1", 1);
+  test_assert(SharedProfile::create(2, on_fork) == nullptr,
+      "shared profile created with flushing on");
+  unsetenv("SFS_FLUSH_INTERVAL");
+
+  auto shared = SharedProfile::create(2, on_fork);
+  test_assert(shared != nullptr, "create failed");
+
+  test_assert(shared->insert(0, 0), "insert failed");
+  test_assert(shared->insert(0, 0), "reinsert failed");
+  shared->add(0, 1);
+
+  // Workers record, and leave without being the last
+  for (int i = 1; i <= 4; ++i) {
+    auto pid = fork();
+    test_assert(pid >= 0, "fork failed");
+    if (pid == 0) {
+      test_assert(num_forks == 1, "on_fork not called");
+      shared->insert(i, i);
+      shared->add(0, 1);
+      _exit(shared->leave() ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    wait_child(pid, EXIT_SUCCESS);
+  }
+
+  // Neither a child which execs, nor one which is killed, holds the profile
+  //   open
+  auto exec_pid = fork();
+  test_assert(exec_pid >= 0, "fork failed");
+  if (exec_pid == 0) {
+    shared->insert(5, 5);
+    execl("/bin/sleep", "sleep", "60", static_cast<char *>(nullptr));
+    _exit(EXIT_FAILURE);
+  }
+
+  auto killed_pid = fork();
+  test_assert(killed_pid >= 0, "fork failed");
+  if (killed_pid == 0) {
+    shared->insert(6, 6);
+    pause();
+    _exit(EXIT_FAILURE);
+  }
+
+  // A child which outlives the parent is the last
+  int to_child[2];
+  test_assert(pipe(to_child) == 0, "pipe failed");
+  auto last_pid = fork();
+  test_assert(last_pid >= 0, "fork failed");
+  if (last_pid == 0) {
+    char c;
+    test_assert(read(to_child[0], &c, 1) == 1, "read failed");
+    shared->insert(7, 7);
+    shared->add(1, 3);
+    if (!shared->leave()) {
+      _exit(EXIT_FAILURE);
+    }
+
+    std::set<std::pair<int32_t, int32_t>> pairs;
+    shared->forEach([&pairs] (int32_t key, int32_t val) {
+      pairs.emplace(key, val);
+    });
+    for (int32_t i = 0; i <= 7; ++i) {
+      test_assert(pairs.count(std::make_pair(i, i)) == 1,
+          "lost pair " + std::to_string(i));
+    }
+    test_assert(pairs.size() == 8, "extra pairs");
+    test_assert(shared->count(0) == 5 && shared->count(1) == 3,
+        "lost counts");
+    _exit(EXIT_SUCCESS);
+  }
+
+  // Wait for the exec, then kill the other child without letting it leave
+  while (true) {
+    bool exec_held = false;
+    shared->forEach([&exec_held] (int32_t key, int32_t) {
+      exec_held |= (key == 5);
+    });
+    if (exec_held) {
+      break;
+    }
+    usleep(1000);
+  }
+  usleep(100000);
+  kill(killed_pid, SIGKILL);
+  wait_killed(killed_pid);
+
+  test_assert(!shared->leave(), "parent left last, before its child");
+  test_assert(!shared->leave(), "parent left twice");
+  test_assert(write(to_child[1], "x", 1) == 1, "write failed");
+  wait_child(last_pid, EXIT_SUCCESS);
+
+  kill(exec_pid, SIGKILL);
+  wait_killed(exec_pid);
+
+  // A full table fails fast, and keeps what it holds
+  setenv("SFS_SHARED_PROFILE", "64", 1);
+  auto small = SharedProfile::create(0, nullptr);
+  test_assert(small != nullptr, "create failed");
+  int32_t num_inserted = 0;
+  while (small->insert(num_inserted, 0)) {
+    num_inserted++;
+  }
+  test_assert(small->full(), "insert failed without filling the table");
+  test_assert(num_inserted >= 1 && num_inserted <= 48,
+      "inserted past 3/4 full: " + std::to_string(num_inserted));
+  test_assert(!small->insert(0, 0), "insert into a full table");
+  int32_t num_held = 0;
+  small->forEach([&num_held] (int32_t, int32_t) {
+    num_held++;
+  });
+  test_assert(num_held == num_inserted, "full table lost pairs");
+  test_assert(small->leave(), "sole member isn't last");
+
+  return EXIT_SUCCESS;
+}
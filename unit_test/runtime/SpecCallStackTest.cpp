@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#define IN_INS
+
+#include "include/BloomHash.h"
+#include "include/SpecCallStack.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Stands in for the instrumenter's callsite hash
+static uint64_t id_hash(int32_t id) {
+  uint64_t hash = static_cast<uint64_t>(id) + 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
+
+// The hash of stack as the instrumenter computes it (skipping frame 0)
+static uint64_t stack_hash(const std::vector<int32_t> &stack) {
+  uint64_t hash = SpecCallStack::BaseHash;
+  for (size_t i = 1; i < stack.size(); ++i) {
+    hash = BloomHasher::mix_hash(hash, id_hash(stack[i]));
+  }
+  return hash;
+}
+
+struct Stack {
+  int32_t depth = 0;
+  int32_t ids[SpecCallStack::MaxDepth] = { };
+  uint64_t hashes[SpecCallStack::MaxDepth] = { };
+
+  void push(int32_t id, int32_t limit = SpecCallStack::MaxDepth) {
+    SpecCallStack::push(depth, ids, hashes, id, id_hash(id), limit);
+  }
+
+  void pop(int32_t id, int32_t limit = SpecCallStack::MaxDepth) {
+    SpecCallStack::pop(depth, ids, id, limit);
+  }
+};
+
+// A check site's table and filter, built as getCheckData (in
+//   src/InsertSpecAssumptions.cpp) emits them
+struct Table {
+  explicit Table(const std::vector<std::vector<int32_t>> &checked) {
+    numSlots = SpecCallStack::numSlots(checked.size());
+    test_assert((numSlots & (numSlots - 1)) == 0 &&
+        numSlots >= 2 * checked.size(), "bad number of slots");
+    stacks.assign(numSlots, nullptr);
+    hashes.assign(numSlots, 0);
+    filterBits = BloomHasher::filter_bits(checked.size());
+    BloomHasher::bloom_clear(filter, filterBits);
+
+    for (auto &stack : checked) {
+      data.emplace_back(1, static_cast<int32_t>(stack.size()));
+      data.back().insert(std::end(data.back()), std::begin(stack),
+          std::end(stack));
+    }
+
+    for (size_t i = 0; i < checked.size(); ++i) {
+      auto hash = stack_hash(checked[i]);
+      BloomHasher::bloom_add(filter, hash);
+      add(data[i].data(), hash);
+    }
+  }
+
+  void add(int32_t *stack, uint64_t hash) {
+    auto slot = SpecCallStack::slot(hash, numSlots);
+    while (stacks[slot] != nullptr) {
+      slot = (slot + 1) & (numSlots - 1);
+    }
+    stacks[slot] = stack;
+    hashes[slot] = hash;
+  }
+
+  bool probe(const Stack &stack) const {
+    return BloomHasher::bloom_check(filter.data(), filterBits,
+        stack.hashes[stack.depth]);
+  }
+
+  const int32_t *find(const Stack &stack) const {
+    return SpecCallStack::find(numSlots, stacks.data(), hashes.data(),
+        stack.ids, stack.depth, stack.hashes[stack.depth]);
+  }
+
+  size_t numSlots;
+  std::vector<int32_t *> stacks;
+  std::vector<uint64_t> hashes;
+  size_t filterBits;
+  BloomHasher::BloomFilter filter;
+  std::vector<std::vector<int32_t>> data;
+};
+
+static std::vector<int32_t> random_stack(std::mt19937 &rand) {
+  std::uniform_int_distribution<int32_t> size_dist(1, 12);
+  std::uniform_int_distribution<int32_t> id_dist(1, 200);
+  std::vector<int32_t> stack = { 0 };
+  for (int32_t i = size_dist(rand); i > 0; --i) {
+    auto id = id_dist(rand);
+    // Repeated pushes are skipped, so a stack never repeats its top
+    if (id != stack.back()) {
+      stack.push_back(id);
+    }
+  }
+  return stack;
+}
+
+// Pushes every frame of stack (after main) onto an empty stack
+static void replay(Stack &stack, const std::vector<int32_t> &ids) {
+  stack.depth = 0;
+  for (size_t i = 1; i < ids.size(); ++i) {
+    stack.push(ids[i]);
+  }
+}
+
+// Random calls and returns, against a std::vector stack (kept well short of
+//   MaxDepth)
+static void check_push_pop(std::mt19937 &rand) {
+  Stack stack;
+  std::vector<int32_t> expected = { 0 };
+  std::uniform_int_distribution<int32_t> id_dist(1, 8);
+  for (int i = 0; i < 100000; ++i) {
+    auto id = id_dist(rand);
+    // Most returns pop the top callsite, the rest are skipped pops
+    if (rand() % 4 != 0) {
+      id = expected.back();
+    }
+
+    if (rand() % 2 == 0 && expected.size() < 64) {
+      stack.push(id);
+      if (expected.back() != id) {
+        expected.push_back(id);
+      }
+    } else {
+      stack.pop(id);
+      if (expected.size() > 1 && expected.back() == id) {
+        expected.pop_back();
+      }
+    }
+
+    test_assert(stack.depth + 1 == static_cast<int32_t>(expected.size()),
+        "wrong depth");
+    test_assert(stack.ids[stack.depth] == expected.back(), "wrong top");
+    test_assert(stack.hashes[stack.depth] == stack_hash(expected),
+        "rolling hash doesn't match the stack's hash");
+  }
+}
+
+// Frames past the limit are only counted, and popping back to it leaves the
+//   frames below intact
+static void check_limit() {
+  const int32_t limit = 4;
+  Stack stack;
+  for (int32_t id = 1; id <= 10; ++id) {
+    stack.push(id, limit);
+  }
+  test_assert(stack.depth == 10, "frames past the limit weren't counted");
+
+  for (int32_t id = 10; id > 3; --id) {
+    stack.pop(id, limit);
+  }
+  test_assert(stack.depth == limit - 1, "frames past the limit didn't pop");
+  test_assert(stack.hashes[stack.depth] == stack_hash({ 0, 1, 2, 3 }),
+      "frames below the limit changed");
+}
+
+// Every checked stack is found (and hits the filter), other stacks are not
+//   found, and rarely hit the filter
+static void check_tables(std::mt19937 &rand) {
+  for (size_t count : { 1, 3, 50, 1000 }) {
+    std::string desc = std::to_string(count) + " stacks";
+    std::vector<std::vector<int32_t>> checked;
+    for (size_t i = 0; i < count; ++i) {
+      checked.push_back(random_stack(rand));
+    }
+    Table table(checked);
+
+    Stack stack;
+    for (auto &ids : checked) {
+      replay(stack, ids);
+      test_assert(table.probe(stack), "checked stack missed the filter, " +
+          desc);
+      auto found = table.find(stack);
+      test_assert(found != nullptr &&
+          std::vector<int32_t>(found + 1, found + 1 + found[0]) == ids,
+          "checked stack not found, " + desc);
+    }
+
+    size_t hits = 0;
+    size_t others = 0;
+    std::set<std::vector<int32_t>> checked_set(std::begin(checked),
+        std::end(checked));
+    for (int i = 0; i < 20000; ++i) {
+      auto ids = random_stack(rand);
+      if (checked_set.count(ids) != 0) {
+        continue;
+      }
+      others++;
+      replay(stack, ids);
+      hits += table.probe(stack);
+      test_assert(table.find(stack) == nullptr,
+          "unchecked stack found, " + desc);
+    }
+    // About 0.25% with the filter sized per site (more for filters capped at
+    //   max_bits)
+    test_assert(hits * 50 < others, "filter hits too often, " + desc);
+  }
+}
+
+// Stacks with the same hash are told apart by their ids and size, and frame 0
+//   isn't compared
+static void check_collisions() {
+  // { size, ids... }, a's frame 0 differs from the stack's
+  std::vector<int32_t> a = { 4, 7, 1, 2, 3 };
+  std::vector<int32_t> b = { 4, 0, 1, 5, 3 };
+  std::vector<int32_t> c = { 3, 0, 2, 3 };
+  Table table({ });
+  table.numSlots = 8;
+  table.stacks.assign(table.numSlots, nullptr);
+  table.hashes.assign(table.numSlots, 0);
+
+  Stack stack;
+  replay(stack, { 0, 1, 2, 3 });
+  auto hash = stack.hashes[stack.depth];
+  for (auto stack_data : { &b, &c, &a }) {
+    table.add(stack_data->data(), hash);
+  }
+  test_assert(table.find(stack) == a.data(), "colliding stack not found");
+
+  replay(stack, { 0, 1, 2, 4 });
+  stack.hashes[stack.depth] = hash;
+  test_assert(table.find(stack) == nullptr, "stack matched by hash alone");
+}
+
+int main(void) {
+  std::mt19937 rand(1);
+
+  check_push_pop(rand);
+  check_limit();
+  check_tables(rand);
+  check_collisions();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/ThreadRecords.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+typedef std::set<int64_t> Records;
+
+static void merge(Records &into, Records &from) {
+  into.insert(std::begin(from), std::end(from));
+  from.clear();
+}
+
+static const int NumThreads = 4;
+static const int64_t PerThread = 20000;
+
+static ThreadRecords<Records> &records = ThreadRecords<Records>::create(merge);
+
+static void worker(int64_t tid) {
+  for (int64_t i = 0; i < PerThread; ++i) {
+    int64_t id = tid * PerThread + i;
+    records.record([id] (Records &recs) {
+      recs.insert(id);
+    });
+  }
+}
+
+static Records *interrupted = nullptr;
+
+// A do_finish run by a signal interrupting its own thread's record
+static void on_signal(int) {
+  interrupted = new Records(records.harvest());
+}
+
+int main(void) {
+  // Harvest and drain while the workers record, every record must show up in
+  //   exactly one delta, and in the final harvest
+  std::vector<std::thread> threads;
+  for (int i = 0; i < NumThreads; ++i) {
+    threads.emplace_back(worker, i);
+  }
+
+  std::vector<Records> deltas;
+  for (int i = 0; i < 100; ++i) {
+    records.harvest();
+    deltas.emplace_back();
+    records.drain(deltas.back());
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  deltas.emplace_back();
+  records.drain(deltas.back());
+
+  auto all = records.harvest();
+  test_assert(all.size() == NumThreads * PerThread,
+      "harvest lost records: " + std::to_string(all.size()));
+
+  size_t num_deltas = 0;
+  Records drained;
+  for (auto &delta : deltas) {
+    num_deltas += delta.size();
+    drained.insert(std::begin(delta), std::end(delta));
+  }
+  test_assert(drained == all, "deltas don't add up to the harvest");
+  test_assert(num_deltas == all.size(), "a record is in two deltas");
+
+  // A harvest from a signal handler interrupting the thread's own record must
+  //   return, without the torn records
+  signal(SIGUSR1, on_signal);
+  records.record([] (Records &recs) {
+    recs.insert(-1);
+    pthread_kill(pthread_self(), SIGUSR1);
+  });
+  test_assert(interrupted != nullptr, "signal harvest didn't run");
+  test_assert(interrupted->count(-1) == 0, "signal harvest has torn records");
+  test_assert(interrupted->size() == all.size(),
+      "signal harvest lost records");
+
+  // The next record starts from an empty buffer
+  worker(NumThreads);
+  all = records.harvest();
+  test_assert(all.size() == (NumThreads + 1) * PerThread,
+      "records after a signal harvest lost");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2016 David Devecsery
+ */
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "include/ProfileFile.h"
+#include "tools/ProfileMerger.h"
+
+static void test_assert(bool check, std::string msg) {
+  if (!check) {
+    std::cerr << "ERROR: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+typedef std::vector<std::pair<int64_t, std::vector<int64_t>>> Records;
+
+// Inputs and outputs go in dir, the merger's temps in temp_dir (as TMPDIR),
+//   so leaked temps are seen
+static std::string dir;
+static std::string temp_dir;
+
+static std::string make_dir() {
+  std::string name = "/tmp/ohamergetest.XXXXXX";
+  test_assert(mkdtemp(&name[0]) != nullptr, "mkdtemp failed");
+  return name;
+}
+
+static size_t num_entries(const std::string &name) {
+  auto d = opendir(name.c_str());
+  test_assert(d != nullptr, "opendir failed");
+  size_t ret = 0;
+  while (auto ent = readdir(d)) {
+    std::string ent_name(ent->d_name);
+    ret += (ent_name != "." && ent_name != "..");
+  }
+  closedir(d);
+  return ret;
+}
+
+// Runs the merge tool's main on args
+static bool run_merge(std::vector<std::string> args) {
+  args.insert(std::begin(args), "merge_test");
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  bool ok = profile_merge_main(static_cast<int>(args.size()), argv.data(),
+      ProfileKind::Ptsto) == EXIT_SUCCESS;
+  test_assert(num_entries(temp_dir) == 0, "merge left temp files");
+  return ok;
+}
+
+static void write_records(const std::string &name, ProfileKind kind,
+    bool text, const Records &records) {
+  ProfileWriter ofil(name, kind, text);
+  test_assert(ofil.good(), "couldn't open " + name);
+  for (auto &pr : records) {
+    auto &vals = pr.second;
+    switch (kind) {
+      case ProfileKind::CallStack:
+        ofil.writeList(std::begin(vals), std::end(vals));
+        break;
+      case ProfileKind::Edge:
+        ofil.writeCount(pr.first, vals.front());
+        break;
+      default:
+        ofil.writeSet(pr.first, std::begin(vals), std::end(vals));
+        break;
+    }
+  }
+}
+
+static Records read_records(const std::string &name, ProfileKind kind) {
+  ProfileReader reader(name, kind);
+  test_assert(reader.isOpen(), "couldn't open " + name);
+  Records ret;
+  int64_t key;
+  std::vector<int64_t> vals;
+  while (reader.next(key, vals)) {
+    ret.emplace_back(key, vals);
+  }
+  return ret;
+}
+
+// Input i is sorted binary, unsorted binary (with repeated keys) or unsorted
+//   text, in turn
+static std::vector<std::string> write_inputs(ProfileKind kind,
+    const std::vector<Records> &inputs, std::mt19937 &rand) {
+  std::vector<std::string> ret;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    auto records = inputs[i];
+    bool text = (i % 3 == 2);
+    if (i % 3 == 0) {
+      // Sorted inputs have one record per key (or stack)
+      std::map<std::pair<int64_t, std::vector<int64_t>>,
+        std::set<int64_t>> by_key;
+      for (auto &pr : records) {
+        if (kind == ProfileKind::CallStack || kind == ProfileKind::Edge) {
+          by_key[pr];
+        } else {
+          by_key[std::make_pair(pr.first, std::vector<int64_t>())].insert(
+              std::begin(pr.second), std::end(pr.second));
+        }
+      }
+      records.clear();
+      for (auto &pr : by_key) {
+        auto vals = pr.first.second;
+        vals.insert(std::end(vals), std::begin(pr.second),
+            std::end(pr.second));
+        records.emplace_back(pr.first.first, vals);
+      }
+    } else {
+      std::shuffle(std::begin(records), std::end(records), rand);
+    }
+
+    auto name = dir + "/in." + std::to_string(i);
+    write_records(name, kind, text, records);
+    ret.push_back(name);
+  }
+  return ret;
+}
+
+static std::vector<int64_t> random_set(std::mt19937 &rand) {
+  std::uniform_int_distribution<int64_t> id_dist(-20, 200);
+  std::set<int64_t> ids;
+  for (int i = rand() % 6; i > 0; --i) {
+    ids.insert(id_dist(rand));
+  }
+  return std::vector<int64_t>(std::begin(ids), std::end(ids));
+}
+
+// Merges the output of every -j against a reference, and as text
+template <typename check_fn>
+static void check_merges(const std::vector<std::string> &inputs,
+    const std::string &desc, check_fn check) {
+  for (size_t threads : { 1, 2, 3, 16 }) {
+    for (bool text : { false, true }) {
+      auto out = dir + "/out";
+      std::vector<std::string> args = { "-j", std::to_string(threads), "-o",
+        out, text ? "-text" : "-binary" };
+      args.insert(std::end(args), std::begin(inputs), std::end(inputs));
+      test_assert(run_merge(args), desc + " merge failed");
+
+      ProfileReader reader(out, ProfileKind::Ptsto);
+      test_assert(reader.isBinary() == !text, desc + " wrong output format");
+      check(out, desc + " with -j " + std::to_string(threads) +
+          (text ? " (text)" : ""));
+      unlink(out.c_str());
+    }
+  }
+}
+
+// Points-to sets are unioned by key, keys come out sorted and unique
+static void check_sets(std::mt19937 &rand) {
+  std::map<int64_t, std::set<int64_t>> expected;
+  std::vector<Records> inputs(7);
+  std::uniform_int_distribution<int64_t> key_dist(-5, 40);
+  for (auto &records : inputs) {
+    for (int i = 0; i < 30; ++i) {
+      auto key = key_dist(rand);
+      // Skip the coverage key, these are unsampled
+      if (key == ProfileCoverageKey) {
+        continue;
+      }
+      auto ids = random_set(rand);
+      records.emplace_back(key, ids);
+      expected[key].insert(std::begin(ids), std::end(ids));
+    }
+  }
+
+  auto names = write_inputs(ProfileKind::Ptsto, inputs, rand);
+  check_merges(names, "points-to", [&expected] (const std::string &out,
+        const std::string &desc) {
+    std::map<int64_t, std::set<int64_t>> merged;
+    int64_t prev = 0;
+    bool first = true;
+    for (auto &pr : read_records(out, ProfileKind::Ptsto)) {
+      test_assert(first || pr.first > prev, desc + " keys not sorted");
+      test_assert(std::is_sorted(std::begin(pr.second), std::end(pr.second)),
+          desc + " ids not sorted");
+      merged[pr.first].insert(std::begin(pr.second), std::end(pr.second));
+      prev = pr.first;
+      first = false;
+    }
+    test_assert(merged == expected, desc + " sets don't match");
+  });
+}
+
+// Edge counts are summed by key
+static void check_edges(std::mt19937 &rand) {
+  std::map<int64_t, int64_t> expected;
+  std::vector<Records> inputs(5);
+  std::uniform_int_distribution<int64_t> key_dist(0, 30);
+  std::uniform_int_distribution<int64_t> count_dist(0, 1000);
+  for (auto &records : inputs) {
+    // Counts are unique by key in each input
+    std::map<int64_t, int64_t> counts;
+    for (int i = 0; i < 20; ++i) {
+      counts[key_dist(rand)] += count_dist(rand);
+    }
+    for (auto &pr : counts) {
+      records.emplace_back(pr.first, std::vector<int64_t>{ pr.second });
+      expected[pr.first] += pr.second;
+    }
+  }
+
+  auto names = write_inputs(ProfileKind::Edge, inputs, rand);
+  check_merges(names, "edge", [&expected] (const std::string &out,
+        const std::string &desc) {
+    std::map<int64_t, int64_t> merged;
+    for (auto &pr : read_records(out, ProfileKind::Edge)) {
+      test_assert(merged.count(pr.first) == 0, desc + " repeated key");
+      merged[pr.first] = pr.second.front();
+    }
+    test_assert(merged == expected, desc + " counts don't match");
+  });
+}
+
+// Call stacks are deduplicated
+static void check_stacks(std::mt19937 &rand) {
+  std::set<std::vector<int64_t>> expected;
+  std::vector<Records> inputs(4);
+  std::uniform_int_distribution<int64_t> id_dist(0, 4);
+  for (auto &records : inputs) {
+    for (int i = 0; i < 25; ++i) {
+      std::vector<int64_t> stack = { 0 };
+      for (int j = rand() % 4; j >= 0; --j) {
+        stack.push_back(id_dist(rand));
+      }
+      records.emplace_back(0, stack);
+      expected.insert(stack);
+    }
+  }
+
+  auto names = write_inputs(ProfileKind::CallStack, inputs, rand);
+  check_merges(names, "call stack", [&expected] (const std::string &out,
+        const std::string &desc) {
+    std::vector<std::vector<int64_t>> merged;
+    for (auto &pr : read_records(out, ProfileKind::CallStack)) {
+      merged.push_back(pr.second);
+    }
+    test_assert(std::is_sorted(std::begin(merged), std::end(merged)),
+        desc + " stacks not sorted");
+    test_assert(std::set<std::vector<int64_t>>(std::begin(merged),
+          std::end(merged)) == expected && merged.size() == expected.size(),
+        desc + " stacks don't match");
+  });
+}
+
+// Sampled coverage is summed, and can't be mixed with unsampled profiles
+static void check_coverage() {
+  auto sampled_a = dir + "/sampled.a";
+  auto sampled_b = dir + "/sampled.b";
+  auto unsampled = dir + "/unsampled";
+  auto out = dir + "/out";
+  write_records(sampled_a, ProfileKind::Ptsto, false,
+      { { ProfileCoverageKey, { 1, 10 } }, { 3, { 4 } } });
+  write_records(sampled_b, ProfileKind::Ptsto, true,
+      { { ProfileCoverageKey, { 2, 20 } }, { 3, { 5 } } });
+  write_records(unsampled, ProfileKind::Ptsto, false, { { 3, { 6 } } });
+
+  for (auto threads : { "1", "2" }) {
+    test_assert(run_merge({ "-j", threads, "-o", out, sampled_a, sampled_b }),
+        "sampled merge failed");
+    Records expected = { { ProfileCoverageKey, { 3, 30 } }, { 3, { 4, 5 } } };
+    test_assert(read_records(out, ProfileKind::Ptsto) == expected,
+        "coverage not summed");
+
+    test_assert(!run_merge({ "-j", threads, "-o", out, sampled_a,
+          unsampled }), "merged sampled with unsampled");
+  }
+  unlink(out.c_str());
+}
+
+// Bad -j counts, and binary inputs of different kinds, are refused
+static void check_refused() {
+  auto ptsto = dir + "/ptsto";
+  auto edge = dir + "/edge";
+  auto out = dir + "/out";
+  write_records(ptsto, ProfileKind::Ptsto, false, { { 1, { 2 } } });
+  write_records(edge, ProfileKind::Edge, false, { { 1, { 2 } } });
+
+  for (auto threads : { "0", "-2", "x", "3x", "" }) {
+    test_assert(!run_merge({ "-j", threads, "-o", out, ptsto }),
+        std::string("accepted -j ") + threads);
+  }
+  test_assert(!run_merge({ "-o", out, ptsto, edge }),
+      "merged different kinds");
+  test_assert(!run_merge({ "-o", out, dir + "/missing" }),
+      "merged a missing input");
+
+  // The kind comes from the binary inputs
+  test_assert(run_merge({ "-o", out, edge, edge }), "edge merge failed");
+  Records expected = { { 1, { 4 } } };
+  test_assert(read_records(out, ProfileKind::Edge) == expected,
+      "edge kind not taken from the inputs");
+  unlink(out.c_str());
+}
+
+int main(void) {
+  dir = make_dir();
+  temp_dir = make_dir();
+  setenv("TMPDIR", temp_dir.c_str(), 1);
+
+  std::mt19937 rand(1);
+  check_sets(rand);
+  check_edges(rand);
+  check_stacks(rand);
+  check_coverage();
+  check_refused();
+
+  std::string cleanup = "rm -rf " + dir + " " + temp_dir;
+  test_assert(system(cleanup.c_str()) == 0, "cleanup failed");
+  return EXIT_SUCCESS;
+}